@@ -0,0 +1,485 @@
+/* account.c: Per-Request Allocation and System Call Accounting */
+
+#include "spidey.h"
+
+#ifdef ACCOUNTING
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define ACCOUNT_SITES       1024        /* Call sites in shared table */
+#define ACCOUNT_LIVE        (1 << 16)   /* Allocations tracked per process */
+
+/* Structures */
+
+typedef struct {
+    uint64_t    requests;
+    uint64_t    mallocs;                /* Allocations */
+    uint64_t    frees;                  /* Frees of tracked allocations */
+    uint64_t    bytes;                  /* Bytes allocated */
+    uint64_t    syscalls;
+    uint64_t    leaks;                  /* Allocations live after request */
+    uint64_t    leaked;                 /* Bytes live after request */
+} AccountTotals;
+
+typedef struct {
+    uintptr_t   key;                    /* Address of AccountSite (0 if free) */
+    const char *file;
+    int         line;
+    const char *call;
+    uint64_t    calls;
+    uint64_t    bytes;
+    uint64_t    leaks[ACCOUNT_TYPES];
+    uint64_t    leaked;
+} AccountSlot;
+
+typedef struct {
+    time_t          dumped;             /* When totals were last dumped */
+    AccountTotals   types[ACCOUNT_TYPES];
+    AccountSlot     sites[ACCOUNT_SITES];
+} Accounts;
+
+typedef struct {
+    void       *ptr;                    /* Allocation (NULL if entry is free) */
+    size_t      size;
+    int         site;                   /* Slot of allocating site (or -1) */
+    uint64_t    seq;                    /* Request that made it (0 if none) */
+} AccountLive;
+
+typedef struct {
+    uint64_t    seq;                    /* Current request (0 if none) */
+    AccountType type;
+    bool        forked;                 /* Whether request began in parent */
+    uint64_t    mallocs;
+    uint64_t    frees;
+    uint64_t    bytes;
+    uint64_t    syscalls;
+    uint64_t    outstanding;            /* Allocations of request still live */
+} AccountRequest;
+
+/* Global Variables */
+
+static Accounts       *SharedAccounts = NULL;   /* NULL until account_create */
+static AccountLive    *Live           = NULL;   /* Per process, inherited by fork */
+static uint64_t        LiveCount      = 0;
+static uint64_t        Untracked      = 0;      /* Allocations the table had no room for */
+static uint64_t        Sequence       = 0;
+static AccountRequest  Current        = { 0 };
+
+static const char *AccountTypeNames[ACCOUNT_TYPES] = {
+    "other", "file", "directory", "cgi", "bundle", "http2", "error",
+};
+
+/* Internal Functions */
+
+/**
+ * Return shared slot of call site, claiming one on first use.
+ **/
+static AccountSlot * account_slot(AccountSite *site) {
+    if (!SharedAccounts) {
+        return NULL;
+    }
+    if (site->index) {
+        return &SharedAccounts->sites[site->index - 1];
+    }
+
+    /* Site records have the same address in every forked process */
+    uintptr_t key = (uintptr_t)site;
+    for (size_t i = 0; i < ACCOUNT_SITES; i++) {
+        size_t       index = (key / sizeof(AccountSite) + i) % ACCOUNT_SITES;
+        AccountSlot *slot  = &SharedAccounts->sites[index];
+        uintptr_t    owner = 0;
+
+        if (__atomic_compare_exchange_n(&slot->key, &owner, key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            slot->file = site->file;
+            slot->line = site->line;
+            __atomic_store_n(&slot->call, site->call, __ATOMIC_RELEASE);
+        } else if (owner != key) {
+            continue;
+        }
+        site->index = index + 1;
+        return slot;
+    }
+    return NULL;
+}
+
+/**
+ * Hash allocation address into live table.
+ **/
+static size_t account_hash(uintptr_t address) {
+    return (address >> 4) * 0x9e3779b97f4a7c15ULL >> 48;
+}
+
+/**
+ * Find live table entry of allocation (or the empty entry where it belongs).
+ **/
+static size_t account_find(uintptr_t address) {
+    size_t i = account_hash(address);
+    while (Live[i].ptr && (uintptr_t)Live[i].ptr != address) {
+        i = (i + 1) % ACCOUNT_LIVE;
+    }
+    return i;
+}
+
+/**
+ * Record allocation made at call site.
+ **/
+static void * account_track(AccountSite *site, void *ptr, size_t size) {
+    if (!ptr) {
+        return NULL;
+    }
+
+    AccountSlot *slot = account_slot(site);
+    if (slot) {
+        __atomic_add_fetch(&slot->calls, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&slot->bytes, size, __ATOMIC_RELAXED);
+    }
+    Current.mallocs++;
+    Current.bytes += size;
+
+    /* Keep the table at most half full so probes stay short */
+    if (!Live || LiveCount >= ACCOUNT_LIVE / 2) {
+        Untracked++;
+        return ptr;
+    }
+
+    size_t i = account_find((uintptr_t)ptr);
+    Live[i].ptr  = ptr;
+    Live[i].size = size;
+    Live[i].site = slot ? slot - SharedAccounts->sites : -1;
+    Live[i].seq  = site->keep ? 0 : Current.seq;
+    LiveCount++;
+    if (Live[i].seq) {
+        Current.outstanding++;
+    }
+    return ptr;
+}
+
+/**
+ * Forget allocation, keeping probe sequences of the other entries intact.
+ *
+ * The allocation is named by address, since it may already be released.
+ **/
+static void account_forget(uintptr_t address) {
+    if (!Live || !address) {
+        return;
+    }
+
+    size_t i = account_find(address);
+    if (!Live[i].ptr) {
+        return;     /* Allocated by code that is not counted */
+    }
+
+    Current.frees++;
+    if (Live[i].seq && Live[i].seq == Current.seq) {
+        Current.outstanding--;
+    }
+    LiveCount--;
+
+    /* Shift later entries of the same cluster back into the hole */
+    size_t j = i;
+    while (true) {
+        j = (j + 1) % ACCOUNT_LIVE;
+        if (!Live[j].ptr) {
+            break;
+        }
+        size_t home = account_hash((uintptr_t)Live[j].ptr);
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+            continue;
+        }
+        Live[i] = Live[j];
+        i = j;
+    }
+    Live[i].ptr = NULL;
+}
+
+/**
+ * Compare slots by bytes allocated, then by calls (qsort).
+ **/
+static int account_compare(const void *a, const void *b) {
+    const AccountSlot *x = *(const AccountSlot * const *)a;
+    const AccountSlot *y = *(const AccountSlot * const *)b;
+
+    if (x->bytes != y->bytes) {
+        return x->bytes < y->bytes ? 1 : -1;
+    }
+    if (x->calls != y->calls) {
+        return x->calls < y->calls ? 1 : -1;
+    }
+    return 0;
+}
+
+/**
+ * Dump totals per request type and counts per call site to stderr.
+ **/
+static void account_dump(void) {
+    static AccountSlot *sorted[ACCOUNT_SITES];
+    size_t              nsorted = 0;
+    pid_t               pid     = getpid();
+
+    fprintf(stderr, "[%5d] ACCT  %-9s %9s %9s %9s %11s %9s %7s %9s\n", pid,
+            "type", "requests", "mallocs/r", "frees/r", "bytes/r", "syscall/r", "leaks", "leaked");
+    for (int type = 0; type < ACCOUNT_TYPES; type++) {
+        AccountTotals t = SharedAccounts->types[type];
+        if (!t.requests) {
+            continue;
+        }
+        fprintf(stderr, "[%5d] ACCT  %-9s %9lu %9.1f %9.1f %11.1f %9.1f %7lu %9lu\n", pid,
+                AccountTypeNames[type], t.requests,
+                (double)t.mallocs / t.requests, (double)t.frees / t.requests,
+                (double)t.bytes / t.requests, (double)t.syscalls / t.requests,
+                t.leaks, t.leaked);
+    }
+
+    for (size_t i = 0; i < ACCOUNT_SITES; i++) {
+        AccountSlot *slot = &SharedAccounts->sites[i];
+        if (__atomic_load_n(&slot->call, __ATOMIC_ACQUIRE) && slot->calls) {
+            sorted[nsorted++] = slot;
+        }
+    }
+    qsort(sorted, nsorted, sizeof(AccountSlot *), account_compare);
+
+    if (Untracked) {
+        fprintf(stderr, "[%5d] ACCT  %lu allocations untracked (live table full)\n", pid, Untracked);
+    }
+
+    fprintf(stderr, "[%5d] ACCT  %-24s %-12s %9s %11s  %s\n", pid, "site", "call", "calls", "bytes", "leaks");
+    for (size_t i = 0; i < nsorted; i++) {
+        AccountSlot *slot = sorted[i];
+        char         site[64];
+        char         leaks[128] = "";
+        size_t       used       = 0;
+
+        for (int type = 0; type < ACCOUNT_TYPES; type++) {
+            if (slot->leaks[type] && used < sizeof(leaks)) {
+                used += snprintf(leaks + used, sizeof(leaks) - used, "%s%s=%lu",
+                                 used ? "," : "", AccountTypeNames[type], slot->leaks[type]);
+            }
+        }
+        snprintf(site, sizeof(site), "%s:%d", slot->file, slot->line);
+        fprintf(stderr, "[%5d] ACCT  %-24s %-12s %9lu %11lu  %s\n", pid,
+                site, slot->call, slot->calls, slot->bytes, leaks);
+    }
+}
+
+/* Functions */
+
+/**
+ * Create accounting tables shared by all processes.
+ *
+ * @return  true on success, false on error.
+ *
+ * This must be called before forking so that every process adds to the same
+ * totals.
+ **/
+bool account_create(void) {
+    Accounts *accounts = mmap(NULL, sizeof(Accounts), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (accounts == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    Live = mmap(NULL, ACCOUNT_LIVE * sizeof(AccountLive), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Live == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        Live = NULL;
+        munmap(accounts, sizeof(Accounts));
+        return false;
+    }
+
+    accounts->dumped = time(NULL);
+    SharedAccounts   = accounts;
+    return true;
+}
+
+/**
+ * Begin accounting for a new request.
+ **/
+void account_begin(void) {
+    memset(&Current, 0, sizeof(Current));
+    Current.seq = ++Sequence;
+}
+
+/**
+ * Classify current request (the first classification sticks).
+ *
+ * @param   type        Type of request.
+ **/
+void account_type(AccountType type) {
+    if (Current.type == ACCOUNT_OTHER) {
+        Current.type = type;
+    }
+}
+
+/**
+ * Finish accounting for current request.
+ *
+ * Allocations the request made that are still live are reported as leaks of
+ * the request's type and of their call sites.  Every ACCOUNT_INTERVAL
+ * seconds, one process dumps the totals.
+ **/
+void account_end(void) {
+    if (!SharedAccounts || !Current.seq) {
+        return;
+    }
+
+    AccountTotals *t = &SharedAccounts->types[Current.type];
+    if (!Current.forked) {
+        __atomic_add_fetch(&t->requests, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&t->mallocs, Current.mallocs, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->frees, Current.frees, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->bytes, Current.bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&t->syscalls, Current.syscalls, __ATOMIC_RELAXED);
+
+    /* Report each leak once */
+    for (size_t i = 0; Live && Current.outstanding && i < ACCOUNT_LIVE; i++) {
+        AccountLive *l = &Live[i];
+        if (!l->ptr || l->seq != Current.seq) {
+            continue;
+        }
+        __atomic_add_fetch(&t->leaks, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&t->leaked, l->size, __ATOMIC_RELAXED);
+        if (l->site >= 0) {
+            AccountSlot *slot = &SharedAccounts->sites[l->site];
+            __atomic_add_fetch(&slot->leaks[Current.type], 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&slot->leaked, l->size, __ATOMIC_RELAXED);
+        }
+        l->seq = 0;
+        Current.outstanding--;
+    }
+    Current.seq = 0;
+
+    /* Dump periodically */
+    time_t now    = time(NULL);
+    time_t dumped = __atomic_load_n(&SharedAccounts->dumped, __ATOMIC_RELAXED);
+    if (now - dumped >= ACCOUNT_INTERVAL &&
+        __atomic_compare_exchange_n(&SharedAccounts->dumped, &dumped, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        account_dump();
+    }
+}
+
+/**
+ * Count system call made at call site.
+ *
+ * @param   site        Call site.
+ *
+ * This only uses atomics, so it is safe in signal handlers.
+ **/
+void account_syscall(AccountSite *site) {
+    AccountSlot *slot = account_slot(site);
+    if (slot) {
+        __atomic_add_fetch(&slot->calls, 1, __ATOMIC_RELAXED);
+    }
+    Current.syscalls++;
+}
+
+/**
+ * Count fork(2) made at call site.
+ *
+ * @return  Result of fork(2).
+ *
+ * A child carries on the request of its parent, so it only adds what it does
+ * itself.
+ **/
+pid_t account_fork(AccountSite *site) {
+    account_syscall(site);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        Current.forked   = true;
+        Current.mallocs  = 0;
+        Current.frees    = 0;
+        Current.bytes    = 0;
+        Current.syscalls = 0;
+    }
+    return pid;
+}
+
+/**
+ * Counted malloc(3).
+ **/
+void * account_malloc(AccountSite *site, size_t size) {
+    return account_track(site, malloc(size), size);
+}
+
+/**
+ * Counted calloc(3).
+ **/
+void * account_calloc(AccountSite *site, size_t count, size_t size) {
+    return account_track(site, calloc(count, size), count * size);
+}
+
+/**
+ * Counted realloc(3) (a free of the old block and an allocation of the new).
+ **/
+void * account_realloc(AccountSite *site, void *ptr, size_t size) {
+    uintptr_t address = (uintptr_t)ptr;
+    void     *resized = realloc(ptr, size);
+    if (resized) {
+        account_forget(address);
+    }
+    return account_track(site, resized, size);
+}
+
+/**
+ * Counted strdup(3).
+ **/
+char * account_strdup(AccountSite *site, const char *s) {
+    char *copy = strdup(s);
+    return account_track(site, copy, copy ? strlen(copy) + 1 : 0);
+}
+
+/**
+ * Counted strndup(3).
+ **/
+char * account_strndup(AccountSite *site, const char *s, size_t n) {
+    char *copy = strndup(s, n);
+    return account_track(site, copy, copy ? strlen(copy) + 1 : 0);
+}
+
+/**
+ * Counted realpath(3) (an allocation only when it returns a new buffer).
+ **/
+char * account_realpath(AccountSite *site, const char *path, char *resolved) {
+    char *real = realpath(path, resolved);
+    if (real && !resolved) {
+        account_track(site, real, strlen(real) + 1);
+    }
+    return real;
+}
+
+/**
+ * Counted fopen(3) (a system call, and a stream that must be closed).
+ **/
+FILE * account_fopen(AccountSite *site, const char *path, const char *mode) {
+    Current.syscalls++;
+    return account_track(site, fopen(path, mode), sizeof(FILE));
+}
+
+/**
+ * Counted fclose(3).
+ **/
+int account_fclose(AccountSite *site, FILE *stream) {
+    account_syscall(site);
+    account_forget((uintptr_t)stream);
+    return fclose(stream);
+}
+
+/**
+ * Counted free(3).
+ **/
+void account_free(void *ptr) {
+    account_forget((uintptr_t)ptr);
+    free(ptr);
+}
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
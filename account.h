@@ -0,0 +1,59 @@
+/* account.h: Allocation and System Call Accounting Wrappers
+ *
+ * Include after every system header in a translation unit whose allocations
+ * and system calls should be counted.  Without ACCOUNTING this is empty.
+ *
+ * Define ACCOUNT_KEEP before including this for units whose allocations are
+ * meant to outlive the request that made them (ie. the file cache), so that
+ * they are counted but never reported as leaks.
+ */
+
+#ifndef ACCOUNT_H
+#define ACCOUNT_H
+
+#ifdef ACCOUNTING
+
+#ifndef ACCOUNT_KEEP
+#define ACCOUNT_KEEP        false
+#endif
+
+/* Each call site gets its own static record (and so its own shared slot) */
+#define ACCOUNT_SITE(call) \
+    ({ static AccountSite account_site_ = { __FILE__, __LINE__, call, ACCOUNT_KEEP, 0 }; &account_site_; })
+
+#define ACCOUNT_SYSCALL(call, expression) \
+    (account_syscall(ACCOUNT_SITE(call)), expression)
+
+/* Allocator */
+#define malloc(size)            account_malloc(ACCOUNT_SITE("malloc"), size)
+#define calloc(count, size)     account_calloc(ACCOUNT_SITE("calloc"), count, size)
+#define realloc(ptr, size)      account_realloc(ACCOUNT_SITE("realloc"), ptr, size)
+#define strdup(s)               account_strdup(ACCOUNT_SITE("strdup"), s)
+#define strndup(s, n)           account_strndup(ACCOUNT_SITE("strndup"), s, n)
+#define realpath(path, buffer)  account_realpath(ACCOUNT_SITE("realpath"), path, buffer)
+#define free(ptr)               account_free(ptr)
+
+/* System calls */
+#define fork()                  account_fork(ACCOUNT_SITE("fork"))
+#define open(...)               ACCOUNT_SYSCALL("open", open(__VA_ARGS__))
+#define close(fd)               ACCOUNT_SYSCALL("close", close(fd))
+#define read(fd, data, n)       ACCOUNT_SYSCALL("read", read(fd, data, n))
+#define write(fd, data, n)      ACCOUNT_SYSCALL("write", write(fd, data, n))
+#define writev(fd, iov, n)      ACCOUNT_SYSCALL("writev", writev(fd, iov, n))
+#define stat(path, s)           ACCOUNT_SYSCALL("stat", stat(path, s))
+#define fstat(fd, s)            ACCOUNT_SYSCALL("fstat", fstat(fd, s))
+#define sendfile(...)           ACCOUNT_SYSCALL("sendfile", sendfile(__VA_ARGS__))
+#define splice(...)             ACCOUNT_SYSCALL("splice", splice(__VA_ARGS__))
+#define pipe2(fds, flags)       ACCOUNT_SYSCALL("pipe2", pipe2(fds, flags))
+#define dup2(fd, target)        ACCOUNT_SYSCALL("dup2", dup2(fd, target))
+#define poll(fds, n, timeout)   ACCOUNT_SYSCALL("poll", poll(fds, n, timeout))
+#define shutdown(fd, how)       ACCOUNT_SYSCALL("shutdown", shutdown(fd, how))
+#define memfd_create(name, f)   ACCOUNT_SYSCALL("memfd_create", memfd_create(name, f))
+#define fopen(path, mode)       account_fopen(ACCOUNT_SITE("fopen"), path, mode)
+#define fclose(stream)          account_fclose(ACCOUNT_SITE("fclose"), stream)
+
+#endif
+
+#endif
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
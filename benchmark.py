@@ -0,0 +1,427 @@
+#!/usr/bin/env python3
+
+import json
+import multiprocessing
+import os
+import random
+import shutil
+import socket
+import subprocess
+import sys
+import time
+
+# Globals
+
+SPIDEY      = './spidey'
+ROOT        = '/tmp/spidey-benchmark'
+REPORT      = 'benchmark.json'
+BASELINE    = 'benchmark-baseline.json'
+LOG         = 'benchmark.log'
+MODES       = ['single', 'forking', 'workers']
+CLOSING     = ['single', 'workers']     # Modes that close every connection
+CONCURRENCY = [1, 16, 64]
+KEEPALIVE   = [True, False]
+WORKLOADS   = None
+DURATION    = 3.0
+WARMUP      = 0.5
+MAX_FILE    = 1 << 30
+THRESHOLD   = 10.0
+LATENCY     = 25.0
+SAVE        = False
+VERSION     = 1                         # Bump when generated roots change
+
+# Generated files and directories (see workloads)
+
+FILES = [
+    ('100B', 100),
+    ('10K',  10 << 10),
+    ('1M',   1 << 20),
+    ('64M',  64 << 20),
+    ('1G',   1 << 30),
+]
+
+DIRECTORIES = [
+    ('10',   10),
+    ('1k',   1000),
+    ('100k', 100000),
+]
+
+MIX_FILES   = 1000                      # Files in size distribution workload
+MIX_MIN     = 100
+MIX_MAX     = 1 << 20
+
+# Functions
+
+def usage(status=0):
+    print('''Usage: {} [options]
+    -h              Display help message
+    -s              Save this run as the new baseline
+
+    -b  PATH        Baseline to compare against ({})
+    -c  LIST        Concurrency sweep ({})
+    -d  SECONDS     Measured seconds per run ({})
+    -k  LIST        Keep-alive sweep, on and/or off (on,off; on is skipped for {})
+    -l  PERCENT     Tail latency increase flagged as regression ({})
+    -m  LIST        Concurrency modes ({})
+    -o  PATH        Report to write ({})
+    -r  PATH        Directory for generated document root ({})
+    -t  PERCENT     Throughput drop flagged as regression ({})
+    -w  LIST        Workloads (all)
+    -x  SIZE        Largest generated file, ie. 64M ({})
+
+Workloads: {}
+    '''.format(os.path.basename(sys.argv[0]), BASELINE, ','.join(map(str, CONCURRENCY)),
+               DURATION, ','.join(CLOSING), LATENCY, ','.join(MODES), REPORT, ROOT, THRESHOLD,
+               MAX_FILE, ','.join(workloads())))
+    sys.exit(status)
+
+def parse_size(s):
+    ''' Parse size with optional K, M, or G suffix. '''
+    units = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+    if s and s[-1].upper() in units:
+        return int(s[:-1]) * units[s[-1].upper()]
+    return int(s)
+
+def workloads():
+    ''' Return workloads by name: URIs requested at random. '''
+    result = {}
+    for name, size in FILES:
+        if size <= MAX_FILE:
+            result['file-' + name] = ['/files/' + name]
+    result['file-mix'] = ['/mix/{:04d}'.format(i) for i in range(MIX_FILES)]
+    for name, entries in DIRECTORIES:
+        result['dir-' + name] = ['/dirs/' + name]
+    result['cgi-env'] = ['/cgi/env.sh']
+    return result
+
+def generate(root):
+    ''' Build synthetic document root (once per VERSION and MAX_FILE). '''
+    stamp = os.path.join(root, '.generated')
+    if os.path.exists(stamp) and open(stamp).read() == '{} {}'.format(VERSION, MAX_FILE):
+        return
+
+    print('Generating document root in {}...'.format(root))
+    shutil.rmtree(root, ignore_errors=True)
+    for directory in ('files', 'mix', 'dirs', 'cgi'):
+        os.makedirs(os.path.join(root, directory))
+
+    # Files of each size (large ones are sparse, so they cost no disk)
+    for name, size in FILES:
+        if size > MAX_FILE:
+            continue
+        with open(os.path.join(root, 'files', name), 'wb') as fs:
+            if size <= MIX_MAX:
+                fs.write(os.urandom(size))
+            else:
+                fs.truncate(size)
+
+    # Log-uniform sizes: mostly small files, a few large ones
+    rng = random.Random(VERSION)
+    for i in range(MIX_FILES):
+        size = int(MIX_MIN * (MIX_MAX / MIX_MIN) ** rng.random())
+        with open(os.path.join(root, 'mix', '{:04d}'.format(i)), 'wb') as fs:
+            fs.write(os.urandom(size))
+
+    # Directories to list
+    for name, entries in DIRECTORIES:
+        directory = os.path.join(root, 'dirs', name)
+        os.makedirs(directory)
+        for i in range(entries):
+            open(os.path.join(directory, 'entry-{:06d}.txt'.format(i)), 'w').close()
+
+    # CGI script like www/scripts/env.sh
+    script = os.path.join(root, 'cgi', 'env.sh')
+    shutil.copy(os.path.join('www', 'scripts', 'env.sh'), script)
+    os.chmod(script, 0o755)
+
+    with open(stamp, 'w') as fs:
+        fs.write('{} {}'.format(VERSION, MAX_FILE))
+
+def free_port():
+    ''' Return loopback port nobody is listening on. '''
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+def start_server(mode, port, log):
+    ''' Start spidey and wait until it accepts connections. '''
+    server = subprocess.Popen([SPIDEY, '-c', mode, '-p', '127.0.0.1:{}'.format(port), '-r', ROOT],
+                              stdout=log, stderr=log)
+    deadline = time.time() + 10
+    while time.time() < deadline:
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=1).close()
+            return server
+        except OSError:
+            if server.poll() is not None:
+                break
+            time.sleep(0.05)
+    stop_server(server)
+    raise RuntimeError('spidey did not start in {} mode (see {})'.format(mode, LOG))
+
+def stop_server(server):
+    ''' Stop spidey and the processes it started. '''
+    server.terminate()
+    try:
+        server.wait(timeout=10)
+    except subprocess.TimeoutExpired:
+        server.kill()
+        server.wait()
+
+def read_response(stream):
+    ''' Read one response; return status, body length, and whether the
+    connection may be reused. '''
+    line = stream.readline()
+    if not line:
+        raise ConnectionError('connection closed')
+    status  = int(line.split()[1])
+    headers = {}
+    while True:
+        line = stream.readline()
+        if line in (b'\r\n', b'\n', b''):
+            break
+        name, _, value = line.decode('latin-1').partition(':')
+        headers[name.strip().lower()] = value.strip().lower()
+
+    reuse  = line != b'' and headers.get('connection') != 'close'
+    length = 0
+    if 'content-length' in headers:
+        remaining = int(headers['content-length'])
+        while remaining:
+            data = stream.read1(min(remaining, 1 << 20))
+            if not data:
+                raise ConnectionError('short body')
+            remaining -= len(data)
+            length    += len(data)
+    elif headers.get('transfer-encoding') == 'chunked':
+        while True:
+            size = int(stream.readline().split(b';')[0], 16)
+            length += len(stream.read(size + 2)) - 2
+            if size == 0:
+                break
+    else:
+        for data in iter(lambda: stream.read1(1 << 20), b''):
+            length += len(data)
+        reuse = False
+    return status, length, reuse
+
+def client(uris, keepalive, port, start, stop, results, seed):
+    ''' Send requests on one connection at a time until stop; report
+    latencies of those completed after start (requests still running at stop
+    are finished, so large files are measured too). '''
+    rng       = random.Random(seed)
+    latencies = []
+    errors    = 0
+    nbytes    = 0
+    conn      = None
+    stream    = None
+    last      = stop
+    close     = b'' if keepalive else b'Connection: close\r\n'
+
+    while time.time() < stop:
+        uri = rng.choice(uris)
+        try:
+            began = time.time()
+            if conn is None:
+                conn   = socket.create_connection(('127.0.0.1', port))
+                conn.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+                conn.settimeout(max(stop - began, 0) + 30)
+                stream = conn.makefile('rb')
+            conn.sendall(b'GET ' + uri.encode() + b' HTTP/1.1\r\nHost: benchmark\r\n' + close + b'\r\n')
+            status, length, reuse = read_response(stream)
+            ended = time.time()
+            if ended >= start:
+                last = ended
+                if status == 200:
+                    latencies.append(ended - began)
+                    nbytes += length
+                else:
+                    errors += 1
+        except (OSError, ValueError, IndexError):
+            reuse = False
+            if time.time() >= start:
+                errors += 1
+        if not reuse and conn is not None:
+            stream.close()
+            conn.close()
+            conn = stream = None
+
+    if conn is not None:
+        stream.close()
+        conn.close()
+    results.put((latencies, errors, nbytes, last))
+
+def percentile(values, p):
+    ''' Return p-th percentile of sorted values (nearest rank). '''
+    if not values:
+        return 0.0
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+def run(mode, workload, uris, concurrency, keepalive, port):
+    ''' Drive one cell of the matrix and summarize it. '''
+    results = multiprocessing.Queue()
+    start   = time.time() + WARMUP
+    stop    = start + DURATION
+    clients = [multiprocessing.Process(target=client, args=(uris, keepalive, port, start, stop, results, i))
+               for i in range(concurrency)]
+    for c in clients:
+        c.start()
+
+    latencies = []
+    errors    = 0
+    nbytes    = 0
+    for c in clients:
+        l, e, n, last = results.get()
+        latencies += l
+        errors    += e
+        nbytes    += n
+        stop       = max(stop, last)
+    for c in clients:
+        c.join()
+
+    elapsed = stop - start
+
+    latencies.sort()
+    return {
+        'mode':        mode,
+        'workload':    workload,
+        'concurrency': concurrency,
+        'keepalive':   keepalive,
+        'requests':    len(latencies),
+        'errors':      errors,
+        'rps':         len(latencies) / elapsed,
+        'mbps':        nbytes / elapsed / (1 << 20),
+        'p50_ms':      percentile(latencies, 50) * 1000,
+        'p90_ms':      percentile(latencies, 90) * 1000,
+        'p99_ms':      percentile(latencies, 99) * 1000,
+        'max_ms':      (latencies[-1] if latencies else 0) * 1000,
+    }
+
+def cell_key(cell):
+    return '{mode} {workload} c={concurrency} {0}'.format('keepalive' if cell['keepalive'] else 'close', **cell)
+
+def compare(report, baseline):
+    ''' Compare cells against baseline; return regressions. '''
+    previous    = {cell_key(cell): cell for cell in baseline['results']}
+    regressions = []
+    for cell in report['results']:
+        old = previous.get(cell_key(cell))
+        if not old:
+            continue
+
+        reasons = []
+        if old['rps'] and cell['rps'] < old['rps'] * (1 - THRESHOLD / 100):
+            reasons.append('throughput {:.0f} -> {:.0f} req/s ({:+.1f}%)'.format(
+                old['rps'], cell['rps'], 100 * (cell['rps'] / old['rps'] - 1)))
+        if old['p99_ms'] and cell['p99_ms'] > old['p99_ms'] * (1 + LATENCY / 100):
+            reasons.append('p99 {:.2f} -> {:.2f} ms ({:+.1f}%)'.format(
+                old['p99_ms'], cell['p99_ms'], 100 * (cell['p99_ms'] / old['p99_ms'] - 1)))
+        if cell['errors'] > old['errors']:
+            reasons.append('errors {} -> {}'.format(old['errors'], cell['errors']))
+        if reasons:
+            regressions.append((cell_key(cell), reasons))
+    return regressions
+
+def describe():
+    ''' Return what this run was measured on. '''
+    try:
+        commit = subprocess.run(['git', 'rev-parse', '--short', 'HEAD'], capture_output=True,
+                                text=True).stdout.strip()
+    except OSError:
+        commit = None
+    return {
+        'commit':   commit,
+        'date':     time.strftime('%Y-%m-%dT%H:%M:%S%z'),
+        'host':     socket.gethostname(),
+        'cpus':     multiprocessing.cpu_count(),
+        'duration': DURATION,
+    }
+
+# Main execution
+
+if __name__ == '__main__':
+    # Parse command line arguments
+    args = sys.argv[1:]
+    while args and args[0].startswith('-') and len(args[0]) > 1:
+        arg = args.pop(0)
+        if arg == '-h':
+            usage(0)
+        elif arg == '-s':
+            SAVE = True
+        elif arg == '-b':
+            BASELINE = args.pop(0)
+        elif arg == '-c':
+            CONCURRENCY = [int(c) for c in args.pop(0).split(',')]
+        elif arg == '-d':
+            DURATION = float(args.pop(0))
+        elif arg == '-k':
+            KEEPALIVE = [k == 'on' for k in args.pop(0).split(',')]
+        elif arg == '-l':
+            LATENCY = float(args.pop(0))
+        elif arg == '-m':
+            MODES = args.pop(0).split(',')
+        elif arg == '-o':
+            REPORT = args.pop(0)
+        elif arg == '-r':
+            ROOT = args.pop(0)
+        elif arg == '-t':
+            THRESHOLD = float(args.pop(0))
+        elif arg == '-w':
+            WORKLOADS = args.pop(0).split(',')
+        elif arg == '-x':
+            MAX_FILE = parse_size(args.pop(0))
+        else:
+            usage(1)
+    if args:
+        usage(1)
+
+    available = workloads()
+    selected  = WORKLOADS or list(available)
+    if any(name not in available for name in selected):
+        usage(1)
+
+    # Build document root, then sweep every mode, workload, concurrency,
+    # and keep-alive setting against a fresh server per mode (modes that close
+    # every connection have no keep-alive runs to compare)
+    generate(ROOT)
+    report = describe()
+    report['results'] = []
+    with open(LOG, 'w') as log:
+        for mode in MODES:
+            port   = free_port()
+            server = start_server(mode, port, log)
+            try:
+                for workload in selected:
+                    for concurrency in CONCURRENCY:
+                        for keepalive in KEEPALIVE:
+                            if keepalive and mode in CLOSING:
+                                continue
+                            cell = run(mode, workload, available[workload], concurrency, keepalive, port)
+                            report['results'].append(cell)
+                            print('{:48} {:10.1f} req/s {:9.1f} MB/s  p50 {:8.2f}  p99 {:8.2f}  max {:8.2f} ms  {} errors'.format(
+                                cell_key(cell), cell['rps'], cell['mbps'], cell['p50_ms'], cell['p99_ms'],
+                                cell['max_ms'], cell['errors']))
+            finally:
+                stop_server(server)
+
+    with open(REPORT, 'w') as fs:
+        json.dump(report, fs, indent=2)
+    print('Wrote {} ({} runs)'.format(REPORT, len(report['results'])))
+
+    # Compare against baseline (saving this run if there is none yet)
+    if SAVE or not os.path.exists(BASELINE):
+        shutil.copy(REPORT, BASELINE)
+        print('Saved {} as baseline {}'.format(REPORT, BASELINE))
+        sys.exit(0)
+
+    with open(BASELINE) as fs:
+        baseline = json.load(fs)
+    regressions = compare(report, baseline)
+    print('Compared against {} (commit {}, {})'.format(BASELINE, baseline.get('commit'), baseline.get('date')))
+    for key, reasons in regressions:
+        print('REGRESSION {}: {}'.format(key, '; '.join(reasons)))
+    if regressions:
+        sys.exit(1)
+    print('No regressions (throughput -{}%, p99 +{}%)'.format(THRESHOLD, LATENCY))
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
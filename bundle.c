@@ -0,0 +1,252 @@
+/* bundle.c: Memory-Mapped Site Bundles */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Structures */
+
+struct bundle {
+    const char         *base;           /* Start of mapping */
+    size_t              length;         /* Size of mapping */
+    const BundleHeader *header;
+    const BundleEntry  *entries;        /* Sorted by path */
+    const char         *strings;
+};
+
+/* Internal Functions */
+
+/**
+ * Return string from bundle string table.
+ **/
+static const char * bundle_string(Bundle *b, uint32_t offset) {
+    return b->strings + offset;
+}
+
+/**
+ * Determine if byte range lies within the mapping.
+ **/
+static bool bundle_range(Bundle *b, uint64_t offset, uint64_t length) {
+    return offset <= b->length && length <= b->length - offset;
+}
+
+/**
+ * Determine if offset names a NUL-terminated string inside the string table
+ * (which runs to the end of the mapping, as bodies are placed after it).
+ **/
+static bool bundle_valid_string(Bundle *b, uint32_t offset) {
+    size_t size = b->length - b->header->strings;
+    return offset < size && memchr(b->strings + offset, '\0', size - offset) != NULL;
+}
+
+/**
+ * Validate header, index, and every entry's strings and bodies.
+ *
+ * @return  true if nothing in the bundle points outside the mapping.
+ **/
+static bool bundle_validate(Bundle *b) {
+    const BundleHeader *h = b->header;
+
+    if (b->length < sizeof(BundleHeader) || h->magic != BUNDLE_MAGIC ||
+        h->index % _Alignof(BundleEntry) != 0 ||
+        !bundle_range(b, h->index, (uint64_t)h->count * sizeof(BundleEntry)) ||
+        !bundle_range(b, h->strings, 0)) {
+        return false;
+    }
+    b->entries = (const BundleEntry *)(b->base + h->index);
+    b->strings = b->base + h->strings;
+
+    if (!bundle_valid_string(b, h->root)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < h->count; i++) {
+        const BundleEntry *e = &b->entries[i];
+        if (!bundle_valid_string(b, e->path) || !bundle_valid_string(b, e->mimetype) ||
+            !bundle_valid_string(b, e->etag) || !bundle_range(b, e->body, e->length) ||
+            (e->gzbody && !bundle_range(b, e->gzbody, e->gzlength))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Normalize URI path for lookup.
+ *
+ * @return  false if the path is too long or contains a parent reference.
+ *
+ * Repeated slashes are collapsed and trailing slashes are removed, so that
+ * /text/, /text, and //text all name the same entry.
+ **/
+static bool bundle_normalize(const char *uri, char *path, size_t size) {
+    size_t n = 0;
+
+    for (const char *c = uri; *c; c++) {
+        if (*c == '/' && n && path[n - 1] == '/') {
+            continue;
+        }
+        if (n + 1 >= size) {
+            return false;
+        }
+        path[n++] = *c;
+    }
+    while (n > 1 && path[n - 1] == '/') {
+        n--;
+    }
+    path[n] = '\0';
+
+    return n && path[0] == '/' && !strstr(path, "/../") &&
+           !(n >= 3 && streq(path + n - 3, "/.."));
+}
+
+/* Functions */
+
+/**
+ * Map site bundle built by spidey-pack.
+ *
+ * @param   path        Path to bundle file.
+ * @return  Newly mapped bundle (or NULL on error).
+ *
+ * Every entry is checked against the mapping before the bundle is used, so
+ * requests never read past its end.
+ **/
+Bundle * bundle_open(const char *path) {
+    struct stat s;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &s) < 0) {
+        fprintf(stderr, "Unable to open bundle %s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    void *base = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    Bundle *b = calloc(1, sizeof(Bundle));
+    if (!b) {
+        munmap(base, s.st_size);
+        return NULL;
+    }
+    b->base    = base;
+    b->length  = s.st_size;
+    b->header  = base;
+
+    /* Refuse the whole bundle if anything in it is out of bounds (ie. a
+     * truncated or corrupt file) */
+    if (!bundle_validate(b)) {
+        fprintf(stderr, "Invalid bundle: %s\n", path);
+        munmap(base, s.st_size);
+        free(b);
+        return NULL;
+    }
+
+    log("Mapped bundle %s (%u entries)", path, b->header->count);
+    return b;
+}
+
+/**
+ * Unmap site bundle.
+ *
+ * @param   b           Bundle (may be NULL).
+ **/
+void bundle_close(Bundle *b) {
+    if (b) {
+        munmap((void *)b->base, b->length);
+        free(b);
+    }
+}
+
+/**
+ * Return source document root recorded in bundle (where CGI scripts live).
+ *
+ * @param   b           Bundle.
+ * @return  Path of directory bundle was built from.
+ **/
+const char * bundle_root(Bundle *b) {
+    return bundle_string(b, b->header->root);
+}
+
+/**
+ * Lookup entry for URI path with binary search.
+ *
+ * @param   b           Bundle.
+ * @param   uri         URI path (without query).
+ * @return  Entry (or NULL if not found).
+ **/
+const BundleEntry * bundle_lookup(Bundle *b, const char *uri) {
+    char path[BUFSIZ];
+
+    if (!bundle_normalize(uri, path, sizeof(path))) {
+        return NULL;
+    }
+
+    size_t lo = 0;
+    size_t hi = b->header->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int    cmp = strcmp(path, bundle_string(b, b->entries[mid].path));
+        if (cmp == 0) {
+            return &b->entries[mid];
+        } else if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Send bundle entry directly from the mapping.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   b           Bundle.
+ * @param   e           Entry to send (must not be a CGI entry).
+ * @return  -1 on error and 0 on success.
+ *
+ * Clients that already have the entry (If-None-Match) get 304 Not Modified,
+ * and clients that accept gzip get the precompressed body if there is one.
+ **/
+int bundle_send(Request *r, Bundle *b, const BundleEntry *e) {
+    const char *etag     = bundle_string(b, e->etag);
+    const char *match    = request_header(r, "If-None-Match");
+    const char *encoding = request_header(r, "Accept-Encoding");
+    Response    resp;
+
+    if (match && streq(match, etag)) {
+        response_init(&resp, HTTP_STATUS_NOT_MODIFIED);
+        response_header(&resp, RESPONSE_ETAG, etag);
+        return response_send(r, &resp);
+    }
+
+    response_init(&resp, HTTP_STATUS_OK);
+    response_header(&resp, RESPONSE_CONTENT_TYPE, bundle_string(b, e->mimetype));
+    response_header(&resp, RESPONSE_ETAG, etag);
+    if (e->gzbody) {
+        response_header(&resp, RESPONSE_VARY, "Accept-Encoding");
+    }
+    if (e->gzbody && accepts_encoding(encoding, "gzip")) {
+        response_header(&resp, RESPONSE_CONTENT_ENCODING, "gzip");
+        response_length(&resp, e->gzlength);
+        response_body(&resp, b->base + e->gzbody, e->gzlength);
+    } else {
+        response_length(&resp, e->length);
+        response_body(&resp, b->base + e->body, e->length);
+    }
+    return response_send(r, &resp);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
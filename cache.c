@@ -0,0 +1,763 @@
+/* cache.c: Small File Response Cache */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Cache entries outlive the request that fills them */
+#define ACCOUNT_KEEP    true
+#include "account.h"
+
+/* Constants */
+
+#define CACHE_SMALL_RATIO   10          /* Percent of budget for small queue */
+
+typedef enum {
+    CACHE_SMALL = 0,                    /* Recently inserted entries */
+    CACHE_MAIN,                         /* Entries that proved themselves */
+    CACHE_GHOST,                        /* Recently evicted keys (no data) */
+    CACHE_QUEUES
+} CacheQueue;
+
+/* Structures */
+
+struct cache_entry {
+    CacheEntry     *chain;              /* Next entry in hash bucket */
+    CacheEntry     *prev;               /* Previous (newer) entry in queue */
+    CacheEntry     *next;               /* Next (older) entry in queue */
+    uint64_t        hash;               /* Hash of path */
+    char           *path;               /* Real path of file */
+
+    dev_t           dev;                /* Identity of cached file version */
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtime;
+
+    char           *data;               /* Identity headers followed by body */
+    size_t          hlen;
+    size_t          blen;
+    char           *gzdata;             /* Gzip headers followed by body */
+    size_t          gzhlen;
+    size_t          gzblen;
+
+    size_t          charge;             /* Bytes charged against budget */
+    unsigned char   freq;               /* Saturating access counter (0-3) */
+    unsigned char   queue;              /* CacheQueue entry is on */
+};
+
+typedef struct {
+    CacheEntry     *head;               /* Newest entry */
+    CacheEntry     *tail;               /* Oldest entry */
+    size_t          count;
+    size_t          bytes;
+} Fifo;
+
+struct cache {
+    size_t          max_bytes;          /* Budget for all cached data */
+    size_t          max_entries;        /* Maximum number of cached files */
+    size_t          max_file;           /* Largest file that will be cached */
+    size_t          bytes;              /* Bytes currently charged */
+    size_t          entries;            /* Files currently cached */
+
+    CacheEntry    **buckets;            /* Hash table of entries */
+    size_t          nbuckets;
+    Fifo            queues[CACHE_QUEUES];
+};
+
+/* Global Variables */
+
+static Host    *PreloadHost = NULL;     /* Host whose cache nftw(3) fills */
+
+/* Internal Functions */
+
+/**
+ * Compute FNV-1a hash of string.
+ **/
+static uint64_t cache_hash(const char *s) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Add entry to the head of a queue.
+ **/
+static void fifo_push(Cache *c, CacheEntry *e, CacheQueue queue) {
+    Fifo *q = &c->queues[queue];
+
+    e->queue = queue;
+    e->prev  = NULL;
+    e->next  = q->head;
+    if (q->head) {
+        q->head->prev = e;
+    } else {
+        q->tail = e;
+    }
+    q->head   = e;
+    q->count += 1;
+    q->bytes += e->charge;
+}
+
+/**
+ * Remove entry from whatever queue it is on.
+ **/
+static void fifo_remove(Cache *c, CacheEntry *e) {
+    Fifo *q = &c->queues[e->queue];
+
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        q->head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        q->tail = e->prev;
+    }
+    e->prev   = e->next = NULL;
+    q->count -= 1;
+    q->bytes -= e->charge;
+}
+
+/**
+ * Find entry (live or ghost) for path.
+ **/
+static CacheEntry * cache_find(Cache *c, const char *path, uint64_t hash) {
+    for (CacheEntry *e = c->buckets[hash % c->nbuckets]; e; e = e->chain) {
+        if (e->hash == hash && streq(e->path, path)) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Release cached data of entry, leaving only its key.
+ **/
+static void cache_release(Cache *c, CacheEntry *e) {
+    if (e->queue != CACHE_GHOST) {
+        c->bytes   -= e->charge;
+        c->entries -= 1;
+    }
+    free(e->data);
+    free(e->gzdata);
+    e->data   = e->gzdata = NULL;
+    e->charge = 0;
+}
+
+/**
+ * Remove entry from hash table and queues and deallocate it.
+ **/
+static void cache_delete(Cache *c, CacheEntry *e) {
+    CacheEntry **link = &c->buckets[e->hash % c->nbuckets];
+    while (*link != e) {
+        link = &(*link)->chain;
+    }
+    *link = e->chain;
+
+    fifo_remove(c, e);
+    cache_release(c, e);
+    free(e->path);
+    free(e);
+}
+
+/**
+ * Evict oldest entry of the small queue.
+ *
+ * Entries that were hit while in the small queue are promoted to the main
+ * queue; the rest are demoted to ghosts so that a quick re-reference sends
+ * them straight to the main queue.  This keeps one-hit wonders (ie. scans)
+ * from flushing the working set.
+ **/
+static void cache_evict_small(Cache *c) {
+    CacheEntry *e = c->queues[CACHE_SMALL].tail;
+
+    fifo_remove(c, e);
+    if (e->freq > 0) {
+        e->freq = 0;
+        fifo_push(c, e, CACHE_MAIN);
+        return;
+    }
+
+    cache_release(c, e);
+    fifo_push(c, e, CACHE_GHOST);
+    while (c->queues[CACHE_GHOST].count > c->max_entries) {
+        cache_delete(c, c->queues[CACHE_GHOST].tail);
+    }
+}
+
+/**
+ * Evict oldest entry of the main queue, giving recently hit entries
+ * another pass through the queue.
+ **/
+static void cache_evict_main(Cache *c) {
+    CacheEntry *e = c->queues[CACHE_MAIN].tail;
+
+    fifo_remove(c, e);
+    if (e->freq > 0) {
+        e->freq--;
+        fifo_push(c, e, CACHE_MAIN);
+        return;
+    }
+    cache_delete(c, e);
+}
+
+/**
+ * Evict entries until an entry of the specified size fits within the cache
+ * budgets (S3-FIFO).
+ **/
+static void cache_evict(Cache *c, size_t charge) {
+    while (c->bytes + charge > c->max_bytes || c->entries + 1 > c->max_entries) {
+        Fifo *small = &c->queues[CACHE_SMALL];
+        if (small->count && (small->bytes * 100 >= c->max_bytes * CACHE_SMALL_RATIO ||
+                             !c->queues[CACHE_MAIN].count)) {
+            cache_evict_small(c);
+        } else if (c->queues[CACHE_MAIN].count) {
+            cache_evict_main(c);
+        } else {
+            break;
+        }
+    }
+}
+
+/**
+ * Compress body with gzip.
+ *
+ * @return  Allocated buffer (or NULL if compression did not help).
+ **/
+static char * cache_gzip(const char *body, size_t blen, size_t *zlen) {
+    z_stream z = {0};
+
+    if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    size_t bound = deflateBound(&z, blen);
+    char  *zbody = malloc(bound);
+    if (zbody) {
+        z.next_in   = (Bytef *)body;
+        z.avail_in  = blen;
+        z.next_out  = (Bytef *)zbody;
+        z.avail_out = bound;
+        if (deflate(&z, Z_FINISH) != Z_STREAM_END || z.total_out >= blen) {
+            free(zbody);
+            zbody = NULL;
+        } else {
+            *zlen = z.total_out;
+        }
+    }
+    deflateEnd(&z);
+    return zbody;
+}
+
+/**
+ * Build contiguous headers and body block.
+ **/
+static char * cache_block(const char *mimetype, const char *extra, const char *body, size_t blen, size_t *hlen) {
+    char headers[BUFSIZ];
+    int  n = snprintf(headers, sizeof(headers),
+                      "Content-Type: %s\r\nContent-Length: %zu\r\n%s\r\n",
+                      mimetype, blen, extra);
+
+    char *block = malloc(n + blen);
+    if (block) {
+        memcpy(block, headers, n);
+        memcpy(block + n, body, blen);
+        *hlen = n;
+    }
+    return block;
+}
+
+/**
+ * Read entire file into allocated buffer.
+ **/
+static char * cache_read(const char *path, size_t size) {
+    int   fd   = open(path, O_RDONLY | O_CLOEXEC);
+    char *body = fd < 0 ? NULL : malloc(size ? size : 1);
+    size_t nread = 0;
+
+    while (body && nread < size) {
+        ssize_t n = read(fd, body + nread, size - nread);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(body);
+            body = NULL;
+            break;
+        }
+        nread += n;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    return body;
+}
+
+/**
+ * Fill entry with response blocks published in the shared cache.
+ **/
+static bool cache_fill_shared(CacheEntry *e, Host *h, const char *path, const struct stat *s) {
+    ShmEntry shared;
+
+    if (!shmcache_get(h->shared, path, s, &shared, true)) {
+        return false;
+    }
+
+    e->data   = shared.data;
+    e->hlen   = shared.hlen;
+    e->blen   = shared.blen;
+    e->gzdata = shared.gzdata;
+    e->gzhlen = shared.gzhlen;
+    e->gzblen = shared.gzblen;
+    debug("Cache shared hit: %s", path);
+    return true;
+}
+
+/**
+ * Fill entry with response blocks built from file and publish them in the
+ * shared cache.
+ **/
+static bool cache_fill_file(CacheEntry *e, Host *h, const char *path, const struct stat *s) {
+    char *body = cache_read(path, s->st_size);
+    if (!body) {
+        return false;
+    }
+
+    /* Build identity and gzip variants */
+    char  *mimetype = determine_mimetype(path, h->mimetypes, h->mimetype);
+    size_t zlen     = 0;
+    char  *zbody    = cache_gzip(body, s->st_size, &zlen);
+
+    e->data = cache_block(mimetype, zbody ? "Vary: Accept-Encoding\r\n" : "", body, s->st_size, &e->hlen);
+    e->blen = s->st_size;
+    if (zbody) {
+        e->gzdata = cache_block(mimetype, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n", zbody, zlen, &e->gzhlen);
+        e->gzblen = zlen;
+    }
+    free(body);
+    free(zbody);
+
+    if (!e->data || (zbody && !e->gzdata)) {
+        free(e->data);
+        free(e->gzdata);
+        free(mimetype);
+        return false;
+    }
+
+    /* Publish for other processes */
+    ShmEntry shared = {
+        .data   = e->data,
+        .hlen   = e->hlen,
+        .blen   = e->blen,
+        .gzdata = e->gzdata,
+        .gzhlen = e->gzhlen,
+        .gzblen = e->gzblen,
+    };
+    strncpy(shared.mimetype, mimetype, sizeof(shared.mimetype) - 1);
+    shmcache_put(h->shared, path, s, &shared);
+
+    free(mimetype);
+    return true;
+}
+
+/**
+ * Fill entry with response blocks built by whichever process is already
+ * filling the same version of the file, or build and share them.
+ *
+ * The shared result is the four block lengths followed by the identity
+ * block and the gzip block, so waiters neither read nor compress the file.
+ * Hosts that share a root may type files differently, so the key names the
+ * host too.
+ **/
+static bool cache_fill_flight(CacheEntry *e, Host *h, const char *path, const struct stat *s) {
+    char   key[PATH_MAX + 128];
+    size_t lengths[4];
+    Flight flight;
+
+    snprintf(key, sizeof(key), "file\n%s\n%s\n%lu:%lu:%lld:%lld.%09ld", h->names, path,
+             (unsigned long)s->st_dev, (unsigned long)s->st_ino, (long long)s->st_size,
+             (long long)s->st_mtim.tv_sec, s->st_mtim.tv_nsec);
+
+    if (flight_begin(&flight, key) == FLIGHT_WAITER) {
+        size_t      length;
+        const char *result = flight_wait(&flight, &length);
+        if (result && length >= sizeof(lengths)) {
+            memcpy(lengths, result, sizeof(lengths));
+            size_t identity = lengths[0] + lengths[1];
+            size_t gzip     = lengths[2] + lengths[3];
+            if (length == sizeof(lengths) + identity + gzip &&
+                (e->data = malloc(identity)) && (!gzip || (e->gzdata = malloc(gzip)))) {
+                memcpy(e->data, result + sizeof(lengths), identity);
+                if (gzip) {
+                    memcpy(e->gzdata, result + sizeof(lengths) + identity, gzip);
+                }
+                e->hlen   = lengths[0];
+                e->blen   = lengths[1];
+                e->gzhlen = lengths[2];
+                e->gzblen = lengths[3];
+                flight_end(&flight, true);
+                debug("Cache coalesced: %s", path);
+                return true;
+            }
+            free(e->data);
+            e->data = NULL;
+        }
+        flight_end(&flight, false);
+    }
+
+    bool ok = cache_fill_file(e, h, path, s);
+    if (flight.role == FLIGHT_LEADER) {
+        if (ok) {
+            lengths[0] = e->hlen;
+            lengths[1] = e->blen;
+            lengths[2] = e->gzdata ? e->gzhlen : 0;
+            lengths[3] = e->gzdata ? e->gzblen : 0;
+            flight_append(&flight, lengths, sizeof(lengths));
+            flight_append(&flight, e->data, lengths[0] + lengths[1]);
+            flight_append(&flight, e->gzdata, lengths[2] + lengths[3]);
+        }
+        flight_end(&flight, ok);
+    }
+    return ok;
+}
+
+/**
+ * Preload callback for nftw(3).
+ **/
+static int cache_preload_file(const char *path, const struct stat *s, int type, struct FTW *ftw) {
+    if (type == FTW_F && S_ISREG(s->st_mode) && access(path, X_OK) != 0) {
+        cache_fill(PreloadHost, path, s);
+    }
+    return 0;
+}
+
+/* Functions */
+
+/**
+ * Create small file cache.
+ *
+ * @param   max_bytes   Budget for cached headers and bodies.
+ * @param   max_entries Maximum number of cached files.
+ * @param   max_file    Largest file size to cache.
+ * @return  Newly allocated cache (or NULL if the cache is disabled).
+ **/
+Cache * cache_create(size_t max_bytes, size_t max_entries, size_t max_file) {
+    if (!max_bytes || !max_entries) {
+        return NULL;
+    }
+
+    Cache *c = calloc(1, sizeof(Cache));
+    if (!c) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    c->max_bytes   = max_bytes;
+    c->max_entries = max_entries;
+    c->max_file    = max_file;
+    c->nbuckets    = max_entries * 2 + 1;
+    c->buckets     = calloc(c->nbuckets, sizeof(CacheEntry *));
+    if (!c->buckets) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+/**
+ * Lookup cached response for file.
+ *
+ * @param   h           Host whose cache to search.
+ * @param   path        Real path of file.
+ * @param   s           Current stat of file.
+ * @return  Cached entry (or NULL if file is not cached or has changed).
+ **/
+CacheEntry * cache_lookup(Host *h, const char *path, const struct stat *s) {
+    Cache *c = h->cache;
+    if (!c) {
+        return NULL;
+    }
+
+    CacheEntry *e = cache_find(c, path, cache_hash(path));
+    if (!e || e->queue == CACHE_GHOST) {
+        return NULL;
+    }
+
+    /* Invalidate entries whose file has changed */
+    if (e->dev != s->st_dev || e->ino != s->st_ino || e->size != s->st_size ||
+        e->mtime.tv_sec != s->st_mtim.tv_sec || e->mtime.tv_nsec != s->st_mtim.tv_nsec) {
+        debug("Cache stale: %s", path);
+        cache_delete(c, e);
+        return NULL;
+    }
+
+    if (e->freq < 3) {
+        e->freq++;
+    }
+    return e;
+}
+
+/**
+ * Read file and insert prebuilt responses for it into cache.
+ *
+ * @param   h           Host whose cache (and shared segment) to fill.
+ * @param   path        Real path of file.
+ * @param   s           Current stat of file.
+ * @return  Cached entry (or NULL if file cannot be cached).
+ *
+ * The file is charged to the host's own budget only.
+ **/
+CacheEntry * cache_fill(Host *h, const char *path, const struct stat *s) {
+    Cache *c = h->cache;
+    if (!c || (size_t)s->st_size > c->max_file) {
+        return NULL;
+    }
+
+    CacheEntry *e = calloc(1, sizeof(CacheEntry));
+    if (!e) {
+        return NULL;
+    }
+
+    /* Build responses from a sibling's work or from the file itself */
+    if (!cache_fill_shared(e, h, path, s) && !cache_fill_flight(e, h, path, s)) {
+        free(e);
+        return NULL;
+    }
+
+    if (!(e->path = strdup(path))) {
+        free(e->data);
+        free(e->gzdata);
+        free(e);
+        return NULL;
+    }
+
+    e->hash   = cache_hash(path);
+    e->dev    = s->st_dev;
+    e->ino    = s->st_ino;
+    e->size   = s->st_size;
+    e->mtime  = s->st_mtim;
+    e->charge = sizeof(CacheEntry) + strlen(path) + e->hlen + e->blen + e->gzhlen + e->gzblen;
+
+    if (e->charge > c->max_bytes) {
+        free(e->data);
+        free(e->gzdata);
+        free(e->path);
+        free(e);
+        return NULL;
+    }
+
+    /* Replace any existing entry; keys remembered as ghosts go to main */
+    CacheQueue  queue = CACHE_SMALL;
+    CacheEntry *old   = cache_find(c, path, e->hash);
+    if (old) {
+        if (old->queue == CACHE_GHOST) {
+            queue = CACHE_MAIN;
+        }
+        cache_delete(c, old);
+    }
+
+    cache_evict(c, e->charge);
+
+    e->chain = c->buckets[e->hash % c->nbuckets];
+    c->buckets[e->hash % c->nbuckets] = e;
+    c->bytes   += e->charge;
+    c->entries += 1;
+    fifo_push(c, e, queue);
+
+    debug("Cache fill: %s (%zu bytes for %s)", path, e->charge, h->names);
+    return e;
+}
+
+/**
+ * Send cached response to client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   e           Cached entry.
+ * @param   gzip        Whether to send gzip variant (if it exists).
+ * @return  -1 on error and 0 on success.
+ *
+ * The status line and Date come from the response builder; the rest of the
+ * response is a single contiguous block, so this is one writev(2).
+ **/
+int cache_send(Request *r, CacheEntry *e, bool gzip) {
+    char  *data = e->data;
+    size_t hlen = e->hlen;
+    size_t blen = e->blen;
+
+    if (gzip && e->gzdata) {
+        data = e->gzdata;
+        hlen = e->gzhlen;
+        blen = e->gzblen;
+    }
+
+    Response resp;
+    response_init(&resp, HTTP_STATUS_OK);
+    response_raw(&resp, data, r->head ? hlen : hlen + blen);
+    return response_send(r, &resp);
+}
+
+/**
+ * Determine mimetype of file, consulting the host's shared cache first.
+ *
+ * @param   h           Host serving file.
+ * @param   path        Real path of file.
+ * @param   s           Current stat of file.
+ * @return  An allocated string containing the mime-type of the file.
+ *
+ * Results computed here are published so that other processes do not have
+ * to scan the host's mimetypes file for the same file.
+ **/
+char * cache_mimetype(Host *h, const char *path, const struct stat *s) {
+    ShmEntry shared = {{0}};
+
+    if (shmcache_get(h->shared, path, s, &shared, false)) {
+        return strdup(shared.mimetype);
+    }
+
+    char *mimetype = determine_mimetype(path, h->mimetypes, h->mimetype);
+    if (mimetype) {
+        strncpy(shared.mimetype, mimetype, sizeof(shared.mimetype) - 1);
+        shmcache_put(h->shared, path, s, &shared);
+    }
+    return mimetype;
+}
+
+/**
+ * Preload host's cache with all small files in directory tree.
+ *
+ * @param   h           Host whose cache to fill.
+ * @param   root        Directory to walk.
+ **/
+void cache_preload(Host *h, const char *root) {
+    Cache *c = h->cache;
+    if (!c) {
+        return;
+    }
+
+    PreloadHost = h;
+    if (nftw(root, cache_preload_file, 16, FTW_PHYS) < 0) {
+        fprintf(stderr, "nftw failed: %s\n", strerror(errno));
+    }
+    PreloadHost = NULL;
+    log("Preloaded %zu files (%zu bytes) from %s", c->entries, c->bytes, root);
+}
+
+/**
+ * Deallocate cache and every entry in it.
+ *
+ * @param   c           Cache (may be NULL).
+ **/
+void cache_destroy(Cache *c) {
+    if (!c) {
+        return;
+    }
+
+    for (int queue = 0; queue < CACHE_QUEUES; queue++) {
+        while (c->queues[queue].head) {
+            cache_delete(c, c->queues[queue].head);
+        }
+    }
+    free(c->buckets);
+    free(c);
+}
+
+/**
+ * Save paths of cached files (hottest first) for a later cache_restore.
+ *
+ * @param   path        Snapshot file to write.
+ * @return  true if the snapshot was written.
+ *
+ * Only the index is saved: for each host, one real path per line, main
+ * queue before small queue, followed by the files in its shared segment (if
+ * any).  The file is written aside and renamed into place, so readers never
+ * see a partial one.
+ **/
+bool cache_snapshot(const char *path) {
+    char temporary[PATH_MAX];
+    if (!path || snprintf(temporary, sizeof(temporary), "%s.%d", path, getpid()) >= (int)sizeof(temporary)) {
+        return false;
+    }
+
+    FILE *fs = fopen(temporary, "w");
+    if (!fs) {
+        fprintf(stderr, "Unable to write snapshot %s: %s\n", temporary, strerror(errno));
+        return false;
+    }
+
+    size_t count = 0;
+    Host  *h;
+    for (size_t i = 0; (h = host_at(i)); i++) {
+        Cache *c = h->cache;
+        for (int queue = CACHE_MAIN; c && queue >= CACHE_SMALL; queue--) {
+            for (CacheEntry *e = c->queues[queue].head; e; e = e->next) {
+                fprintf(fs, "%s\n", e->path);
+                count++;
+            }
+        }
+        count += shmcache_snapshot(h->shared, fs);
+    }
+
+    if (fclose(fs) != 0 || rename(temporary, path) < 0) {
+        fprintf(stderr, "Unable to write snapshot %s: %s\n", path, strerror(errno));
+        unlink(temporary);
+        return false;
+    }
+    log("Saved %zu cached paths to %s", count, path);
+    return true;
+}
+
+/**
+ * Refill caches with files listed in snapshot written by cache_snapshot.
+ *
+ * @param   path        Snapshot file (a missing file is not an error).
+ *
+ * Each file goes back to the cache of the host whose root holds it.  Paths
+ * outside every root (ie. from before a root change) and executables (which
+ * are CGI scripts) are skipped, as in cache_preload.
+ **/
+void cache_restore(const char *path) {
+    if (!path) {
+        return;
+    }
+
+    FILE *fs = fopen(path, "r");
+    if (!fs) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Unable to read snapshot %s: %s\n", path, strerror(errno));
+        }
+        return;
+    }
+
+    char        line[PATH_MAX + 1];
+    size_t      count = 0;
+    struct stat s;
+    while (fgets(line, sizeof(line), fs)) {
+        line[strcspn(line, "\n")] = '\0';
+        Host *h = host_owning(line);
+        if (!h || !h->cache || cache_find(h->cache, line, cache_hash(line))) {
+            continue;
+        }
+        if (stat(line, &s) == 0 && S_ISREG(s.st_mode) && access(line, X_OK) != 0 && cache_fill(h, line, &s)) {
+            count++;
+        }
+    }
+    fclose(fs);
+    log("Restored %zu files from %s", count, path);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,144 @@
+/* capture.c: Request Capture Log */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CAPTURE_BUFFER  (64 * 1024)     /* Largest record written at once */
+
+/* Global Variables */
+
+static int      CaptureFd = -1;         /* Capture log (opened with O_APPEND) */
+static char     Pending[CAPTURE_BUFFER];/* Bytes of record being built */
+static size_t   PendingLength = 0;
+static CaptureRecord PendingRecord;
+
+/* Internal Functions */
+
+/**
+ * Return current time in nanoseconds since the epoch.
+ **/
+static uint64_t capture_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Functions */
+
+/**
+ * Open capture log, truncating it.
+ *
+ * @param   path        Path to capture log.
+ * @return  true if log was opened, false on error.
+ *
+ * This must be called before forking: every process appends whole records
+ * to the same file with a single writev(2), so records never interleave.
+ **/
+bool capture_open(const char *path) {
+    CaptureHeader header = { .magic = CAPTURE_MAGIC, .version = CAPTURE_VERSION };
+
+    CaptureFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (CaptureFd < 0) {
+        fprintf(stderr, "Unable to open capture log %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (write(CaptureFd, &header, sizeof(header)) != sizeof(header)) {
+        fprintf(stderr, "Unable to write capture log %s: %s\n", path, strerror(errno));
+        close(CaptureFd);
+        CaptureFd = -1;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Determine if requests are being captured.
+ **/
+bool capture_enabled(void) {
+    return CaptureFd >= 0;
+}
+
+/**
+ * Mark arrival of request on connection.
+ *
+ * @param   r           Request structure.
+ *
+ * This is called once the request line has been read, so the pending bytes
+ * (the request line) become the start of a CAPTURE_REQUEST record.
+ **/
+void capture_stamp(Request *r) {
+    if (CaptureFd < 0) {
+        return;
+    }
+
+    PendingRecord.timestamp  = capture_now();
+    PendingRecord.connection = r->id;
+    PendingRecord.type       = CAPTURE_REQUEST;
+}
+
+/**
+ * Append raw bytes received from client to pending record.
+ *
+ * @param   r           Request structure.
+ * @param   data        Bytes consumed from client.
+ * @param   length      Number of bytes.
+ *
+ * Bodies larger than the pending buffer are split into several records.
+ **/
+void capture_bytes(Request *r, const void *data, size_t length) {
+    if (CaptureFd < 0) {
+        return;
+    }
+
+    while (length) {
+        if (PendingLength == sizeof(Pending)) {
+            capture_flush();
+        }
+        if (PendingLength == 0 && PendingRecord.type != CAPTURE_REQUEST) {
+            PendingRecord.timestamp  = capture_now();
+            PendingRecord.connection = r->id;
+            PendingRecord.type       = CAPTURE_BODY;
+        }
+
+        size_t n = sizeof(Pending) - PendingLength;
+        n = n < length ? n : length;
+        memcpy(Pending + PendingLength, data, n);
+        PendingLength += n;
+        data           = (const char *)data + n;
+        length        -= n;
+    }
+}
+
+/**
+ * Write pending record to capture log.
+ *
+ * Bytes that follow (ie. the request body) start a new CAPTURE_BODY record.
+ **/
+void capture_flush(void) {
+    if (CaptureFd < 0 || PendingLength == 0) {
+        PendingRecord.type = 0;
+        return;
+    }
+
+    PendingRecord.length = PendingLength;
+    struct iovec iov[2]  = {
+        { &PendingRecord, sizeof(PendingRecord) },
+        { Pending, PendingLength },
+    };
+    if (writev(CaptureFd, iov, 2) < 0) {
+        fprintf(stderr, "writev failed: %s\n", strerror(errno));
+    }
+    PendingLength      = 0;
+    PendingRecord.type = 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
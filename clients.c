@@ -0,0 +1,328 @@
+/* clients.c: Per-Client Connection Caps, Request Rates, and Costs */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <sys/mman.h>
+
+/* Constants */
+
+#define CLIENT_PROBE        8           /* Slots examined per lookup */
+#define CLIENT_SPINS        1000        /* Attempts to lock a slot before giving up */
+#define CLIENT_AGE          60000000    /* Microseconds before an idle client may be forgotten */
+#define CLIENT_TOKEN        1000000     /* Fixed-point units per request token */
+
+/* Structures */
+
+typedef struct {
+    uint32_t        lock;               /* Spinlock (1 while held) */
+    uint32_t        connections;        /* Open connections charged to client */
+    uint8_t         addr[16];           /* Client address (IPv4 mapped into IPv6) */
+    uint64_t        seen;               /* Last admission or release (0 if never used) */
+    uint64_t        refill;             /* Last token refill */
+    int64_t         tokens;             /* Request tokens (in CLIENT_TOKEN units) */
+    uint64_t        cost;               /* Average busy time per connection */
+} ClientSlot;
+
+typedef struct {
+    size_t          nslots;
+    ClientSlot      slots[];
+} Clients;
+
+/* Global Variables */
+
+static Clients *SharedClients = NULL;   /* NULL until clients_create */
+
+/* Internal Functions */
+
+/**
+ * Read monotonic clock in microseconds.
+ **/
+static uint64_t client_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Determine key of client address (IPv4 clients get their mapped IPv6
+ * address, so both families share one entry).
+ *
+ * @return  true if the address has a key (ie. not a UNIX socket).
+ **/
+static bool client_key(const struct sockaddr_storage *addr, uint8_t key[16]) {
+    if (addr->ss_family == AF_INET6) {
+        memcpy(key, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+        return true;
+    }
+    if (addr->ss_family == AF_INET) {
+        memset(key, 0, 10);
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Compute FNV-1a hash of key.
+ **/
+static uint64_t client_hash(const uint8_t key[16]) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < 16; i++) {
+        hash ^= key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Lock slot.
+ *
+ * @return  true if locked, false if the holder did not let go (ie. it died
+ * holding the lock), in which case the client goes untracked.
+ **/
+static bool client_lock(ClientSlot *slot) {
+    for (int spins = 0; spins < CLIENT_SPINS; spins++) {
+        if (!__atomic_exchange_n(&slot->lock, 1, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+        sched_yield();
+    }
+    return false;
+}
+
+/**
+ * Unlock slot.
+ **/
+static void client_unlock(ClientSlot *slot) {
+    __atomic_store_n(&slot->lock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Lock slot of client if it still belongs to the address.
+ *
+ * @return  Locked slot (or NULL if the client is untracked or was forgotten).
+ **/
+static ClientSlot * client_locked(int client, const struct sockaddr_storage *addr) {
+    uint8_t key[16];
+
+    if (!SharedClients || client <= 0 || (size_t)client > SharedClients->nslots || !client_key(addr, key)) {
+        return NULL;
+    }
+
+    ClientSlot *slot = &SharedClients->slots[client - 1];
+    if (!client_lock(slot)) {
+        return NULL;
+    }
+    if (memcmp(slot->addr, key, sizeof(key)) != 0) {
+        client_unlock(slot);
+        return NULL;
+    }
+    return slot;
+}
+
+/* Functions */
+
+/**
+ * Create client table shared by all processes.
+ *
+ * @param   slots       Number of client addresses tracked at once.
+ * @return  true on success, false on error.
+ *
+ * This must be called before forking (and does nothing if a table already
+ * exists).  Without it (or with no slots), clients are neither capped nor
+ * rate limited, and connections are handed out in the order they arrived.
+ **/
+bool clients_create(size_t slots) {
+    if (SharedClients || !slots) {
+        return true;
+    }
+
+    size_t   length  = sizeof(Clients) + slots * sizeof(ClientSlot);
+    Clients *clients = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (clients == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    clients->nslots = slots;
+    SharedClients   = clients;
+    return true;
+}
+
+/**
+ * Charge new connection to its client.
+ *
+ * @param   addr        Address of client.
+ * @return  Client (slot plus one), 0 if the client is untracked, or -1 if
+ * the client already has ClientConnections open and the connection should
+ * be closed.
+ *
+ * A client not in the table takes a free slot or the one least recently
+ * seen among those with no open connections; if every probed slot is in
+ * use, the client goes untracked.  Charges a client has held for
+ * CLIENT_AGE without any activity are forgotten (ie. processes that died
+ * without releasing them), so a lost charge never locks a client out.
+ **/
+int client_admit(const struct sockaddr_storage *addr) {
+    uint8_t key[16];
+
+    if (!SharedClients || !client_key(addr, key)) {
+        return 0;
+    }
+
+    uint64_t    now    = client_clock();
+    uint64_t    hash   = client_hash(key);
+    ClientSlot *victim = NULL;
+
+    /* Find client */
+    for (int i = 0; i < CLIENT_PROBE; i++) {
+        size_t      index = (hash + i) % SharedClients->nslots;
+        ClientSlot *slot  = &SharedClients->slots[index];
+
+        if (slot->seen && memcmp(slot->addr, key, sizeof(key)) == 0 && client_lock(slot)) {
+            if (memcmp(slot->addr, key, sizeof(key)) == 0) {
+                if (slot->seen + CLIENT_AGE < now) {
+                    slot->connections = 0;
+                }
+                if (ClientConnections && slot->connections >= ClientConnections) {
+                    client_unlock(slot);
+                    return -1;
+                }
+                slot->connections++;
+                slot->seen = now;
+                client_unlock(slot);
+                return index + 1;
+            }
+            client_unlock(slot);
+        }
+
+        /* Remember oldest slot that may be reused */
+        if (!slot->seen || !slot->connections || slot->seen + CLIENT_AGE < now) {
+            if (!victim || slot->seen < victim->seen) {
+                victim = slot;
+            }
+        }
+    }
+
+    /* Take over slot (unless another process just did) */
+    if (!victim || !client_lock(victim)) {
+        return 0;
+    }
+    if (victim->seen && victim->connections && victim->seen + CLIENT_AGE >= now) {
+        client_unlock(victim);
+        return 0;
+    }
+    memcpy(victim->addr, key, sizeof(key));
+    victim->connections = 1;
+    victim->seen        = now;
+    victim->refill      = now;
+    victim->tokens      = (int64_t)(ClientBurst ? ClientBurst : 1) * CLIENT_TOKEN;
+    victim->cost        = 0;
+    client_unlock(victim);
+    return victim - SharedClients->slots + 1;
+}
+
+/**
+ * Return charge for closed connection to its client.
+ *
+ * @param   client      Client returned by client_admit.
+ * @param   addr        Address of client.
+ * @param   busy        Microseconds spent handling the connection's requests.
+ *
+ * The client's cost (the average busy time of its connections, which
+ * accept_request uses to share turns between clients) is updated too.
+ **/
+void client_release(int client, const struct sockaddr_storage *addr, uint64_t busy) {
+    ClientSlot *slot = client_locked(client, addr);
+    if (!slot) {
+        return;
+    }
+
+    if (slot->connections) {
+        slot->connections--;
+    }
+    slot->cost = slot->cost ? slot->cost - slot->cost / 8 + busy / 8 : busy;
+    slot->seen = client_clock();
+    client_unlock(slot);
+}
+
+/**
+ * Return average busy time of client's connections.
+ *
+ * @param   client      Client returned by client_admit.
+ * @return  Microseconds (0 if unknown).
+ **/
+uint64_t client_cost(int client) {
+    if (!SharedClients || client <= 0 || (size_t)client > SharedClients->nslots) {
+        return 0;
+    }
+    return __atomic_load_n(&SharedClients->slots[client - 1].cost, __ATOMIC_RELAXED);
+}
+
+/**
+ * Start handling request, taking one of its client's request tokens.
+ *
+ * @param   r           Request structure.
+ * @return  true if the request may be handled, false if its client is over
+ * ClientRate (and the request should be refused).
+ *
+ * Tokens refill at ClientRate per second, up to ClientBurst.  The time until
+ * client_end counts toward the connection's busy time.
+ **/
+bool client_begin(Request *r) {
+    r->started = client_clock();
+    if (ClientRate <= 0) {
+        return true;
+    }
+
+    ClientSlot *slot = client_locked(r->client, &r->addr);
+    if (!slot) {
+        return true;
+    }
+
+    int64_t burst = (int64_t)(ClientBurst ? ClientBurst : 1) * CLIENT_TOKEN;
+    if (r->started > slot->refill) {
+        slot->tokens += (int64_t)((r->started - slot->refill) * ClientRate);
+        slot->refill  = r->started;
+    }
+    if (slot->tokens > burst) {
+        slot->tokens = burst;
+    }
+
+    bool allowed = slot->tokens >= CLIENT_TOKEN;
+    if (allowed) {
+        slot->tokens -= CLIENT_TOKEN;
+    }
+    client_unlock(slot);
+    return allowed;
+}
+
+/**
+ * Finish handling request started by client_begin.
+ *
+ * @param   r           Request structure.
+ **/
+void client_end(Request *r) {
+    if (r->started) {
+        r->busy   += client_clock() - r->started;
+        r->started = 0;
+    }
+}
+
+/**
+ * Leave connection's charge to the process that now serves it.
+ *
+ * @param   r           Request structure.
+ **/
+void client_detach(Request *r) {
+    r->client = 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
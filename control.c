@@ -0,0 +1,351 @@
+/* control.c: Reload, Binary Upgrade, and Graceful Drain */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define CONTROL_LISTENERS   "SPIDEY_LISTENERS"  /* Inherited sockets (ie. 3,4,5) */
+#define CONTROL_PARENT      "SPIDEY_UPGRADING"  /* Process to drain once ready */
+#define CONTROL_INHERIT_MAX 4096                /* Most sockets handed over */
+
+/* Global Variables */
+
+static unsigned  Pending     = 0;               /* CONTROL_* flags raised by signals */
+static int       Wakeup[2]   = { -1, -1 };      /* Self-pipe written by handler */
+static char      Executable[PATH_MAX];          /* Binary to exec on upgrade */
+static char    **Arguments   = NULL;            /* Original command line */
+static pid_t     Upgrade     = 0;               /* New binary being started */
+static pid_t     Upgrading   = 0;               /* Old process to drain once ready */
+static int      *Inherited   = NULL;            /* Sockets handed over (-1 once taken) */
+static size_t    InheritedCount = 0;
+
+/* Internal Functions */
+
+/**
+ * Record control signal and wake up accept loop.
+ **/
+static void control_handler(int signum) {
+    int saved = errno;
+
+    switch (signum) {
+        case SIGHUP:  __atomic_fetch_or(&Pending, CONTROL_RELOAD, __ATOMIC_RELAXED);   break;
+        case SIGUSR1: __atomic_fetch_or(&Pending, CONTROL_SNAPSHOT, __ATOMIC_RELAXED); break;
+        case SIGUSR2: __atomic_fetch_or(&Pending, CONTROL_UPGRADE, __ATOMIC_RELAXED);  break;
+        case SIGQUIT: __atomic_fetch_or(&Pending, CONTROL_DRAIN, __ATOMIC_RELAXED);    break;
+    }
+    if (Wakeup[1] >= 0 && write(Wakeup[1], "", 1) < 0) {
+        /* Pipe is full, so a wakeup is already pending */
+    }
+    errno = saved;
+}
+
+/**
+ * Create self-pipe that makes control signals wake up poll(2).
+ **/
+static bool control_pipe(void) {
+    if (Wakeup[0] >= 0) {
+        close(Wakeup[0]);
+        close(Wakeup[1]);
+    }
+    if (pipe2(Wakeup, O_CLOEXEC | O_NONBLOCK) < 0) {
+        fprintf(stderr, "pipe2 failed: %s\n", strerror(errno));
+        Wakeup[0] = Wakeup[1] = -1;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Take sockets handed over by the process that started this one.
+ **/
+static void control_inherit(void) {
+    const char *list   = getenv(CONTROL_LISTENERS);
+    const char *parent = getenv(CONTROL_PARENT);
+
+    if (list && (Inherited = calloc(CONTROL_INHERIT_MAX, sizeof(int)))) {
+        for (const char *c = list; *c && InheritedCount < CONTROL_INHERIT_MAX; ) {
+            char *end;
+            long  fd = strtol(c, &end, 10);
+            if (end == c) {
+                break;
+            }
+            if (fd > STDERR_FILENO && fd < INT_MAX && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0) {
+                Inherited[InheritedCount++] = fd;
+            }
+            c = *end == ',' ? end + 1 : end;
+        }
+    }
+    if (parent) {
+        Upgrading = strtol(parent, NULL, 10);
+    }
+
+    /* Neither CGI scripts nor later upgrades should see these */
+    unsetenv(CONTROL_LISTENERS);
+    unsetenv(CONTROL_PARENT);
+}
+
+/**
+ * Determine if socket is bound to the same address and port.
+ **/
+static bool control_matches(int fd, const struct sockaddr *addr) {
+    struct sockaddr_storage local;
+    socklen_t               length = sizeof(local);
+
+    if (getsockname(fd, (struct sockaddr *)&local, &length) < 0 || local.ss_family != addr->sa_family) {
+        return false;
+    }
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in *a = (const struct sockaddr_in *)addr;
+        const struct sockaddr_in *b = (const struct sockaddr_in *)&local;
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)addr;
+        const struct sockaddr_in6 *b = (const struct sockaddr_in6 *)&local;
+        return a->sin6_port == b->sin6_port && a->sin6_scope_id == b->sin6_scope_id &&
+               memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+    }
+    return false;
+}
+
+/* Functions */
+
+/**
+ * Install control signal handlers and take over any inherited sockets.
+ *
+ * @param   argv        Command line (re-executed on upgrade).
+ * @return  true on success, false on error.
+ *
+ * The signals only raise flags (see control_signals); they are acted on
+ * between connections:
+ *
+ *  SIGHUP      Re-read OptionsPath, re-resolve RootPath, and rebuild caches.
+ *  SIGUSR1     Save the cache index to SnapshotPath.
+ *  SIGUSR2     Start the binary again on the same listening sockets.
+ *  SIGQUIT     Stop accepting, finish accepted connections, and exit.
+ **/
+bool control_init(char *argv[]) {
+    ssize_t n = readlink("/proc/self/exe", Executable, sizeof(Executable) - 1);
+    if (n < 0) {
+        fprintf(stderr, "readlink failed: %s\n", strerror(errno));
+        return false;
+    }
+    Executable[n] = '\0';
+    Arguments     = argv;
+
+    control_inherit();
+    if (!control_pipe()) {
+        return false;
+    }
+
+    struct sigaction action = {
+        .sa_handler = control_handler,
+        .sa_flags   = 0,                /* Interrupt wait(2) in supervisors */
+    };
+    sigemptyset(&action.sa_mask);
+    int signals[] = { SIGHUP, SIGUSR1, SIGUSR2, SIGQUIT };
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+        if (sigaction(signals[i], &action, NULL) < 0) {
+            fprintf(stderr, "sigaction failed: %s\n", strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Prepare control signals in a worker process.
+ *
+ * Workers get a wakeup pipe of their own (so that a signal to one worker
+ * does not wake another) and leave upgrades to their supervisor.
+ **/
+void control_worker(void) {
+    control_pipe();
+    signal(SIGUSR2, SIG_IGN);
+}
+
+/**
+ * Ignore control signals in a process that only serves one connection.
+ *
+ * Those processes finish their connection whatever happens to the server
+ * that started them.
+ **/
+void control_ignore(void) {
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    if (Wakeup[0] >= 0) {
+        close(Wakeup[0]);
+        close(Wakeup[1]);
+        Wakeup[0] = Wakeup[1] = -1;
+    }
+}
+
+/**
+ * Return descriptor that becomes readable when a control signal arrives.
+ *
+ * @return  Read end of wakeup pipe (or -1 if there is none).
+ *
+ * Accept loops poll this along with their listeners, so a signal that
+ * arrives just before poll(2) still wakes it up.
+ **/
+int control_fd(void) {
+    return Wakeup[0];
+}
+
+/**
+ * Fetch and clear raised control signals.
+ *
+ * @return  CONTROL_* flags.
+ **/
+unsigned control_signals(void) {
+    char buffer[64];
+    while (Wakeup[0] >= 0 && read(Wakeup[0], buffer, sizeof(buffer)) > 0);
+    return __atomic_exchange_n(&Pending, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Act on raised control signals in a process that accepts connections.
+ *
+ * @param   listeners   Server sockets (closed when draining).
+ **/
+void control_apply(Listeners *listeners) {
+    unsigned signals = control_signals();
+
+    if (signals & CONTROL_RELOAD) {
+        server_reload(listeners);
+    }
+    if (signals & (CONTROL_SNAPSHOT | CONTROL_UPGRADE)) {
+        cache_snapshot(SnapshotPath);
+    }
+    if (signals & CONTROL_UPGRADE) {
+        control_upgrade(listeners->fds, listeners->count);
+    }
+    if ((signals & CONTROL_DRAIN) && listeners->count) {
+        log("Draining: no longer accepting connections");
+        listeners_close(listeners);
+    }
+}
+
+/**
+ * Take over inherited socket bound to address.
+ *
+ * @param   addr        Address to listen on.
+ * @param   addrlen     Length of address.
+ * @param   reuseport   Whether the socket must share its port.
+ * @return  Listening socket (or -1 if none was inherited).
+ *
+ * Sockets are taken in the order they were handed over, so workers get
+ * back the same position in each reuseport group.
+ **/
+int control_adopt(const struct sockaddr *addr, socklen_t addrlen, bool reuseport) {
+    for (size_t i = 0; i < InheritedCount; i++) {
+        int       fd     = Inherited[i];
+        int       shared = 0;
+        socklen_t length = sizeof(shared);
+
+        if (fd < 0 || !control_matches(fd, addr) ||
+            getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &shared, &length) < 0 || !shared != !reuseport) {
+            continue;
+        }
+        Inherited[i] = -1;
+        debug("Adopted listening socket %d", fd);
+        return fd;
+    }
+    return -1;
+}
+
+/**
+ * Start the server binary again, handing it the listening sockets.
+ *
+ * @param   fds         Listening sockets.
+ * @param   count       Number of sockets.
+ * @return  true if the new process was started.
+ *
+ * The new process binds nothing that it can take over, so no connection is
+ * refused in between.  Once it is ready it sends this process SIGQUIT
+ * (see control_ready); if it fails instead, this process keeps serving.
+ **/
+bool control_upgrade(const int *fds, size_t count) {
+    /* Only one upgrade at a time */
+    if (Upgrade > 0 && waitpid(Upgrade, NULL, WNOHANG) == 0) {
+        log("Upgrade to process %d already in progress", Upgrade);
+        return false;
+    }
+
+    char   list[CONTROL_INHERIT_MAX * 8];
+    size_t used = 0;
+    for (size_t i = 0; i < count && used < sizeof(list); i++) {
+        used += snprintf(list + used, sizeof(list) - used, "%s%d", i ? "," : "", fds[i]);
+    }
+    if (used >= sizeof(list)) {
+        fprintf(stderr, "Too many listening sockets to hand over\n");
+        return false;
+    }
+
+    pid_t parent = getpid();
+    pid_t pid    = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (pid == 0) {
+        char upgrading[32];
+        snprintf(upgrading, sizeof(upgrading), "%d", parent);
+
+        /* Keep listening sockets open across exec */
+        for (size_t i = 0; i < count; i++) {
+            fcntl(fds[i], F_SETFD, 0);
+        }
+        setenv(CONTROL_LISTENERS, list, 1);
+        setenv(CONTROL_PARENT, upgrading, 1);
+        signal(SIGCHLD, SIG_DFL);
+
+        execv(Executable, Arguments);
+        fprintf(stderr, "Unable to exec %s: %s\n", Executable, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    Upgrade = pid;
+    log("Upgrading: started %s as process %d", Executable, pid);
+    return true;
+}
+
+/**
+ * Finish taking over from the process being upgraded.
+ *
+ * Call once every listening socket has been opened.  Inherited sockets that
+ * were not taken (ie. an address was dropped) are closed, and the old
+ * process is told to drain.
+ **/
+void control_ready(void) {
+    for (size_t i = 0; i < InheritedCount; i++) {
+        if (Inherited[i] >= 0) {
+            close(Inherited[i]);
+        }
+    }
+    free(Inherited);
+    Inherited      = NULL;
+    InheritedCount = 0;
+
+    if (Upgrading > 0 && getppid() == Upgrading) {
+        log("Upgrade ready: draining process %d", Upgrading);
+        kill(Upgrading, SIGQUIT);
+    }
+    Upgrading = 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,325 @@
+/* flight.c: Single-flight Coalescing of Concurrent Misses */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define FLIGHT_PROBE        8           /* Slots examined per lookup */
+#define FLIGHT_KEY_MAX      1024        /* Longest key that can be shared */
+#define FLIGHT_PAGE_SIZE    4096
+
+/* Slot word: state in the low bits, number of attached waiters above */
+#define FLIGHT_FREE         0           /* Never used */
+#define FLIGHT_CLAIMED      1           /* Leader is writing the key */
+#define FLIGHT_RUNNING      2           /* Leader is doing the work */
+#define FLIGHT_DONE         3           /* Result (if ok) is readable */
+#define FLIGHT_STATE        3
+#define FLIGHT_WAITER_UNIT  4
+
+/* Structures */
+
+typedef struct {
+    uint32_t        word;               /* State and waiters (futex word) */
+    pid_t           leader;             /* Process doing the work */
+    uint64_t        hash;               /* Hash of key */
+    uint32_t        ok;                 /* Whether result is complete */
+    size_t          length;             /* Bytes of result */
+    char            key[FLIGHT_KEY_MAX];
+    char            data[];             /* Result bytes */
+} FlightSlot;
+
+typedef struct {
+    uint32_t        nslots;
+    size_t          slot_size;
+    size_t          capacity;           /* Bytes of result per slot */
+    char            slots[] __attribute__((aligned(FLIGHT_PAGE_SIZE)));
+} Flights;
+
+/* Global Variables */
+
+static Flights *SharedFlights = NULL;   /* NULL until flights_create */
+
+/* Internal Functions */
+
+/**
+ * Compute FNV-1a hash of string.
+ **/
+static uint64_t flight_hash(const char *s) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Return slot at index.
+ **/
+static FlightSlot * flight_slot(uint64_t index) {
+    return (FlightSlot *)(SharedFlights->slots + (index % SharedFlights->nslots) * SharedFlights->slot_size);
+}
+
+/**
+ * Wake every process waiting on slot.
+ **/
+static void flight_wake(FlightSlot *slot) {
+    syscall(SYS_futex, &slot->word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/**
+ * Fail slot whose leader exited without finishing.
+ *
+ * @return  true if the slot was (or already is) finished.
+ **/
+static bool flight_abandon(FlightSlot *slot, uint32_t word) {
+    pid_t leader = slot->leader;
+
+    if ((word & FLIGHT_STATE) != FLIGHT_RUNNING || kill(leader, 0) == 0 || errno != ESRCH) {
+        return false;
+    }
+
+    /* Result stays not ok from when the slot was claimed */
+    if (slot->leader == leader) {
+        __atomic_compare_exchange_n(&slot->word, &word, word | FLIGHT_DONE, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        flight_wake(slot);
+    }
+    return true;
+}
+
+/**
+ * Attach to slot if its leader is working on key.
+ **/
+static bool flight_attach(FlightSlot *slot, uint64_t hash, const char *key) {
+    uint32_t word = __atomic_load_n(&slot->word, __ATOMIC_ACQUIRE);
+
+    /* Keys are written while claimed, which is brief */
+    for (int spins = 0; (word & FLIGHT_STATE) == FLIGHT_CLAIMED && spins < 1000; spins++) {
+        sched_yield();
+        word = __atomic_load_n(&slot->word, __ATOMIC_ACQUIRE);
+    }
+
+    while ((word & FLIGHT_STATE) == FLIGHT_RUNNING && slot->hash == hash) {
+        if (flight_abandon(slot, word)) {
+            return false;
+        }
+        if (__atomic_compare_exchange_n(&slot->word, &word, word + FLIGHT_WAITER_UNIT, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            /* Slot cannot be reused while attached, so the key is stable */
+            if (slot->hash == hash && strcmp(slot->key, key) == 0) {
+                return true;
+            }
+            __atomic_fetch_sub(&slot->word, FLIGHT_WAITER_UNIT, __ATOMIC_RELEASE);
+            return false;
+        }
+    }
+    return false;
+}
+
+/* Functions */
+
+/**
+ * Create coalescing table shared by all processes.
+ *
+ * @param   slots       Number of distinct keys that can be in flight.
+ * @return  true on success, false on error.
+ *
+ * This must be called before forking.  Without it (or with no slots), every
+ * request does its own work.  Each slot holds FLIGHT_RESULT_MAX bytes or
+ * both variants of the largest cacheable file, whichever is more; pages are
+ * only allocated as results are written, so unused capacity costs nothing.
+ **/
+bool flights_create(size_t slots) {
+    if (!slots) {
+        return true;
+    }
+
+    size_t capacity  = 2 * (CacheMaxFile + BUFSIZ);
+    if (capacity < FLIGHT_RESULT_MAX) {
+        capacity = FLIGHT_RESULT_MAX;
+    }
+
+    size_t slot_size = (sizeof(FlightSlot) + capacity + FLIGHT_PAGE_SIZE - 1) & ~(size_t)(FLIGHT_PAGE_SIZE - 1);
+    size_t length    = sizeof(Flights) + slots * slot_size;
+
+    Flights *flights = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (flights == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    flights->nslots    = slots;
+    flights->slot_size = slot_size;
+    flights->capacity  = capacity;
+    SharedFlights      = flights;
+    return true;
+}
+
+/**
+ * Begin work identified by key, or attach to a process already doing it.
+ *
+ * @param   f           Flight to initialize.
+ * @param   key         Key of work (ie. path and identity of file; NULL
+ *                      if the work must not be shared).
+ * @return  FLIGHT_LEADER if the caller must do the work and publish it,
+ *          FLIGHT_WAITER if the caller should use flight_wait, or
+ *          FLIGHT_SOLO if the caller must do the work for itself.
+ *
+ * Every flight that is not FLIGHT_SOLO must be finished with flight_end.
+ **/
+FlightRole flight_begin(Flight *f, const char *key) {
+    f->role     = FLIGHT_SOLO;
+    f->slot     = NULL;
+    f->length   = 0;
+    f->overflow = false;
+
+    if (!SharedFlights || !key || strlen(key) >= FLIGHT_KEY_MAX) {
+        return FLIGHT_SOLO;
+    }
+
+    uint64_t hash = flight_hash(key);
+    for (int attempt = 0; attempt < FLIGHT_PROBE; attempt++) {
+        FlightSlot *victim = NULL;
+        uint32_t    word   = 0;
+
+        /* Attach to leader or find a slot nobody is using */
+        for (int i = 0; i < FLIGHT_PROBE; i++) {
+            FlightSlot *slot = flight_slot(hash + i);
+            if (flight_attach(slot, hash, key)) {
+                f->role = FLIGHT_WAITER;
+                f->slot = slot;
+                return FLIGHT_WAITER;
+            }
+
+            uint32_t other = __atomic_load_n(&slot->word, __ATOMIC_ACQUIRE);
+            if (flight_abandon(slot, other)) {
+                other = __atomic_load_n(&slot->word, __ATOMIC_ACQUIRE);
+            }
+            if (!victim && (other == FLIGHT_FREE || other == FLIGHT_DONE)) {
+                victim = slot;
+                word   = other;
+            }
+        }
+        if (!victim) {
+            return FLIGHT_SOLO;
+        }
+
+        /* Claim slot, then publish key */
+        if (__atomic_compare_exchange_n(&victim->word, &word, FLIGHT_CLAIMED, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            victim->hash   = hash;
+            victim->leader = getpid();
+            victim->ok     = 0;
+            victim->length = 0;
+            strcpy(victim->key, key);
+            __atomic_store_n(&victim->word, FLIGHT_RUNNING, __ATOMIC_RELEASE);
+
+            f->role = FLIGHT_LEADER;
+            f->slot = victim;
+            return FLIGHT_LEADER;
+        }
+    }
+    return FLIGHT_SOLO;
+}
+
+/**
+ * Append bytes to leader's result.
+ *
+ * @param   f           Flight (ignored unless leader).
+ * @param   data        Bytes of result.
+ * @param   length      Number of bytes.
+ *
+ * Results larger than the slot are not shared; waiters then do the work
+ * themselves.
+ **/
+void flight_append(Flight *f, const void *data, size_t length) {
+    if (!f || f->role != FLIGHT_LEADER || f->overflow || !length) {
+        return;
+    }
+
+    FlightSlot *slot = f->slot;
+    if (f->length + length > SharedFlights->capacity) {
+        f->overflow = true;
+        return;
+    }
+    memcpy(slot->data + f->length, data, length);
+    f->length += length;
+}
+
+/**
+ * Wait for leader to finish.
+ *
+ * @param   f           Flight (must be waiter).
+ * @param   length      Pointer to store length of result.
+ * @return  Result published by leader (or NULL if leader failed, could not
+ *          share its result, or took longer than CGITimeout).
+ *
+ * The result stays valid until flight_end.
+ **/
+const void * flight_wait(Flight *f, size_t *length) {
+    FlightSlot     *slot = f->slot;
+    struct timespec deadline;
+    struct timespec now;
+    uint32_t        word;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)CGITimeout;
+
+    while (((word = __atomic_load_n(&slot->word, __ATOMIC_ACQUIRE)) & FLIGHT_STATE) == FLIGHT_RUNNING) {
+        struct timespec slice = { .tv_sec = 1 };
+        syscall(SYS_futex, &slot->word, FUTEX_WAIT, word, &slice, NULL, 0);
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec ||
+            (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+            return NULL;
+        }
+        flight_abandon(slot, __atomic_load_n(&slot->word, __ATOMIC_ACQUIRE));
+    }
+
+    if (!slot->ok) {
+        return NULL;
+    }
+    *length = slot->length;
+    return slot->data;
+}
+
+/**
+ * Finish flight.
+ *
+ * @param   f           Flight.
+ * @param   ok          Whether leader's work succeeded (ignored for waiters).
+ *
+ * The leader publishes its result and wakes the waiters; waiters detach from
+ * the result, and the last one out lets the slot be reused.
+ **/
+void flight_end(Flight *f, bool ok) {
+    FlightSlot *slot = f->slot;
+
+    if (f->role == FLIGHT_LEADER) {
+        slot->length = f->length;
+        slot->ok     = ok && !f->overflow;
+        __atomic_fetch_or(&slot->word, FLIGHT_DONE, __ATOMIC_RELEASE);
+        flight_wake(slot);
+    } else if (f->role == FLIGHT_WAITER) {
+        __atomic_fetch_sub(&slot->word, FLIGHT_WAITER_UNIT, __ATOMIC_RELEASE);
+    }
+
+    f->role = FLIGHT_SOLO;
+    f->slot = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
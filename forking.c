@@ -11,18 +11,40 @@
 /**
  * Fork incoming HTTP requests to handle the concurrently.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   listeners   Server sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
  *
  * The parent should accept a request and then fork off and let the child
  * handle the request.
+ *
+ * Children only live for one request, so the parent maps shared cache
+ * segments (one per host) first; children publish what they learn there for
+ * their siblings.
+ *
+ * Control signals are acted on by the parent between connections.  When it
+ * drains, the parent returns once the connections it accepted are handed
+ * off; children finish theirs on their own.
  **/
-int forking_server(int sfd) {
+int forking_server(Listeners *listeners) {
+    /* Create cache segments (one per host), scheduling lanes, coalescing
+     * table, and client table shared by all children */
+    hosts_share();
+    if (!lanes_create() || !flights_create(FlightSlots) || !clients_create(ClientSlots)) {
+        return EXIT_FAILURE;
+    }
+
+
     /* Accept and handle HTTP request */
     while (true) {
+        /* Reload, snapshot, upgrade, or drain */
+        control_apply(listeners);
+
     	/* Accept request */
-        Request *request = accept_request(sfd);
+        Request *request = accept_request(listeners);
         if(!request){
+            if (!listeners->count) {
+                break;
+            }
             continue;
         }
 	/* Ignore children */
@@ -33,18 +55,27 @@ int forking_server(int sfd) {
             fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
             free_request(request);
         } else if (pid == 0) {  /* Child */
-            /* Read from client and then echo back */
-            handle_request(request); 
+            /* Reap own CGI scripts and enforce connection deadlines */
+            signal(SIGCHLD, SIG_DFL);
+            control_ignore();
+            timers_init();
+            accept_discard();
+
+            /* Handle requests until client closes persistent connection */
+            do {
+                handle_request(request);
+            } while (request_reset(request));
             free_request(request);
             exit(EXIT_SUCCESS);
         } else {                /* Parent */
-            /* Close connection */
+            /* Close connection (the child releases its client's charge) */
+            client_detach(request);
             free_request(request);
         }
     }
 
-    /* Close server socket */
-    close(sfd);   
+    /* Close server sockets */
+    listeners_close(listeners);   
     return EXIT_SUCCESS;
 }
 
@@ -7,14 +7,45 @@
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "account.h"
+
+/* Constants */
+
+#define FILE_CHUNK_SIZE     (64 * 1024)     /* Bytes sent along with headers */
+#define CGI_CHUNK_SIZE      (64 * 1024)     /* Bytes of CGI output per chunk */
+#define CGI_HEADERS_MAX     (8 * 1024)      /* Largest CGI header block */
+
 /* Internal Declarations */
+HTTPStatus handle_bundle_request(Request *request);
 HTTPStatus handle_browse_request(Request *request);
-HTTPStatus handle_file_request(Request *request);
+HTTPStatus handle_file_request(Request *request, const struct stat *s);
 HTTPStatus handle_cgi_request(Request *request);
+HTTPStatus handle_detached_request(Request *request, Lane lane, Lane charged, HTTPStatus (*handler)(Request *));
 HTTPStatus handle_error(Request *request, HTTPStatus status);
+int        cgi_open(Request *request, pid_t *pid, pid_t *feeder);
+void       cgi_feed_close(Request *request, pid_t feeder);
+int        cgi_close(int fd, pid_t pid);
+void       cgi_timeout(Timer *timer);
+HTTPStatus cgi_stream(Request *request, int fd, Flight *flight);
+HTTPStatus cgi_replay(Request *request, const void *output, size_t length);
+const char * cgi_flight_key(Request *request, char *key, size_t size);
+
+/* Global Variables */
+
+static const char *CGIVariables[] = {   /* Every variable exported to CGI scripts */
+    "QUERY_STRING", "REMOTE_PORT", "REQUEST_METHOD", "REQUEST_URI", "REMOTE_ADDR",
+    "DOCUMENT_ROOT", "SCRIPT_FILENAME", "SERVER_PORT", "HTTPS", "CONTENT_LENGTH", "CONTENT_TYPE",
+    "HTTP_HOST", "HTTP_ACCEPT", "HTTP_ACCEPT_LANGUAGE", "HTTP_ACCEPT_ENCODING", "HTTP_CONNECTION",
+    "HTTP_USER_AGENT", NULL,
+};
 
 /**
  * Handle HTTP Request.
@@ -22,25 +53,74 @@ HTTPStatus handle_error(Request *request, HTTPStatus status);
  * @param   r           HTTP Request structure
  * @return  Status of the HTTP request.
  *
- * This parses a request, determines the request path, determines the request
- * type, and then dispatches to the appropriate handler type.
+ * This parses a request, determines its virtual host and request path,
+ * determines the request type, and then dispatches to the appropriate handler
+ * type.
  *
  * On error, handle_error should be used with an appropriate HTTP status code.
  **/
 HTTPStatus  handle_request(Request *r) {
     HTTPStatus result = HTTP_STATUS_OK;
 
+    /* Finish TLS handshake before the first request on a connection */
+    if (r->tls && !tls_handshake(r))
+    {
+        r->keep_alive = false;
+        return HTTP_STATUS_BAD_REQUEST;
+    }
+
     /* Parse request */
     if (parse_request(r) == -1)
     {
+        /* Client closed persistent connection between requests */
+        if (!r->method && r->eof)
+        {
+            r->keep_alive = false;
+            return HTTP_STATUS_OK;
+        }
         fprintf(stderr, "parse_request failed: %s\n", strerror(errno));
         result = HTTP_STATUS_BAD_REQUEST;
         result = handle_error(r, result);
         return result;
     }
 
+    /* Route to virtual host named by Host header (or the default host) */
+    r->host = host_lookup(request_header(r, "Host"));
+
+    /* Refuse clients making requests faster than their rate */
+    if (!client_begin(r))
+    {
+        r->keep_alive = false;
+        result = handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        log("HTTP REQUEST STATUS: %s (client over rate)", http_status_string(result));
+        return result;
+    }
+
+    /* Switch to HTTP/2 (prior knowledge or h2c upgrade), in a process of its
+     * own where connections may not persist */
+    if (http2_requested(r))
+    {
+        account_type(ACCOUNT_HTTP2);
+        result = KeepAlive ? http2_serve(r) : handle_detached_request(r, LANE_NONE, LANE_NONE, http2_serve);
+        log("HTTP/2 CONNECTION STATUS: %s", http_status_string(result));
+        return result;
+    }
+
+    /* Serve from site bundle instead of file system */
+    if (r->host->bundle)
+    {
+        account_type(ACCOUNT_BUNDLE);
+        result = handle_bundle_request(r);
+        if (result != HTTP_STATUS_OK && result != HTTP_STATUS_NOT_MODIFIED)
+        {
+            r->keep_alive = false;
+        }
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
+        return result;
+    }
+
     /* Determine request path */
-    r->path = determine_request_path(r->uri); 
+    r->path = determine_request_path(r->host->root, r->uri);
     if (r->path == NULL)
     {
         fprintf(stderr, "determine_request_path failed: %s\n", strerror(errno));
@@ -48,19 +128,54 @@ HTTPStatus  handle_request(Request *r) {
         result = handle_error(r, result);
         return result;
     }
-    debug("HTTP REQUEST PATH: %s", r->path);
+    debug("HTTP REQUEST PATH: %s (host %s)", r->path, r->host->names);
 
     /* Dispatch to appropriate request handler type based on file type */
     struct stat s;
     if(stat(r->path, &s) < 0)
     {
         fprintf(stderr, "stat failed: %s\n", strerror(errno));
-        result = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        result = HTTP_STATUS_NOT_FOUND;
+        result = handle_error(r, result);
         return result;
     }
     int cgi = access(r->path, X_OK);
     int file_num = access(r->path, R_OK);
 
+    /* Scripts are not served at all on hosts without CGI */
+    if (cgi == 0 && (s.st_mode & S_IFMT) == S_IFREG && !r->host->cgi)
+    {
+        result = handle_error(r, HTTP_STATUS_NOT_FOUND);
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
+        return result;
+    }
+
+    /* Take a slot in the request's lane, queueing only when none is free */
+    Lane lane = LANE_STATIC;
+    if ((s.st_mode & S_IFMT) == S_IFDIR)
+    {
+        lane = LANE_DIRECTORY;
+    }
+    else if (cgi == 0 && (s.st_mode & S_IFMT) == S_IFREG)
+    {
+        lane = LANE_CGI;
+    }
+    account_type(lane == LANE_DIRECTORY ? ACCOUNT_DIRECTORY : lane == LANE_CGI ? ACCOUNT_CGI : ACCOUNT_FILE);
+
+    Lane charged = lane_enter(lane, false);
+    if (lane == LANE_CGI && LaneDetach)
+    {
+        result = handle_detached_request(r, LANE_CGI, charged, handle_cgi_request);
+        log("HTTP REQUEST STATUS: %s (detached)", http_status_string(result));
+        return result;
+    }
+    if (charged == LANE_NONE && (charged = lane_enter(lane, true)) == LANE_NONE)
+    {
+        result = handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
+        return result;
+    }
+
     if ((s.st_mode & S_IFMT) == S_IFDIR)
     {
         result = handle_browse_request(r);
@@ -83,13 +198,141 @@ HTTPStatus  handle_request(Request *r) {
     else if (file_num == 0 && cgi != 0)
     {
         debug("got in here");
-        result = handle_file_request(r);
+        result = handle_file_request(r, &s);
+    }
+    lane_leave(charged);
+
+    /* Only reuse connections after complete, successful responses */
+    if (result != HTTP_STATUS_OK && result != HTTP_STATUS_NOT_MODIFIED)
+    {
+        r->keep_alive = false;
     }
 
     log("HTTP REQUEST STATUS: %s", http_status_string(result));
     return result;
 }
 
+/**
+ * Handle request in a process of its own.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   lane        Lane the request runs in (LANE_NONE for none).
+ * @param   charged     Lane slot already taken (or LANE_NONE to wait for one).
+ * @param   handler     Function that serves the request.
+ * @return  Status of handing off the request.
+ *
+ * Workers use this so that a burst of CGI requests queues in the CGI lane
+ * instead of stalling the static files behind it, and single and workers
+ * modes use it for HTTP/2 connections, which would otherwise hold the
+ * process for as long as they stay open.  The request is served by a
+ * grandchild (so that the process never waits on it) and the connection is
+ * closed once the handler finishes.
+ **/
+HTTPStatus handle_detached_request(Request *r, Lane lane, Lane charged, HTTPStatus (*handler)(Request *)) {
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        lane_leave(charged);
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    if (pid == 0)
+    {
+        /* Orphan the request process so that init reaps it */
+        pid = fork();
+        if (pid != 0)
+        {
+            if (pid < 0)
+            {
+                fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+                lane_leave(charged);
+            }
+            _exit(EXIT_SUCCESS);
+        }
+
+        signal(SIGCHLD, SIG_DFL);
+        control_ignore();
+        timers_init();
+        accept_discard();
+
+        r->keep_alive = false;
+        if (lane != LANE_NONE && charged == LANE_NONE)
+        {
+            charged = lane_enter(lane, true);
+        }
+        HTTPStatus result = lane != LANE_NONE && charged == LANE_NONE ?
+            handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE) : handler(r);
+        lane_leave(charged);
+
+        log("HTTP REQUEST STATUS: %s", http_status_string(result));
+        free_request(r);
+        _exit(EXIT_SUCCESS);
+    }
+
+    /* Connection (its TLS session and client charge) now belongs to the
+     * request process */
+    tls_detach(r);
+    client_detach(r);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+    r->keep_alive = false;
+    return HTTP_STATUS_OK;
+}
+
+/**
+ * Handle bundle request.
+ *
+ * @param   r           HTTP Request structure.
+ * @return  Status of the HTTP bundle request.
+ *
+ * This looks up the URI in the host's bundle and sends the file or directory
+ * listing straight from the mapping.  CGI entries run from the bundle's source
+ * directory on disk, taking a slot in the CGI lane like any other script.
+ *
+ * If the URI is not in the bundle, then handle error with
+ * HTTP_STATUS_NOT_FOUND.
+ **/
+HTTPStatus  handle_bundle_request(Request *r) {
+    const BundleEntry *entry = bundle_lookup(r->host->bundle, r->uri);
+    if (!entry)
+    {
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    }
+
+    if ((entry->flags & BUNDLE_CGI) && !r->host->cgi)
+    {
+        return handle_error(r, HTTP_STATUS_NOT_FOUND);
+    }
+    if (entry->flags & BUNDLE_CGI)
+    {
+        r->path = determine_request_path(r->host->root, r->uri);
+        if (!r->path)
+        {
+            return handle_error(r, HTTP_STATUS_NOT_FOUND);
+        }
+
+        /* Scripts share the CGI lane with those served from disk */
+        Lane charged = lane_enter(LANE_CGI, false);
+        if (LaneDetach)
+        {
+            return handle_detached_request(r, LANE_CGI, charged, handle_cgi_request);
+        }
+        if (charged == LANE_NONE && (charged = lane_enter(LANE_CGI, true)) == LANE_NONE)
+        {
+            return handle_error(r, HTTP_STATUS_SERVICE_UNAVAILABLE);
+        }
+        HTTPStatus result = handle_cgi_request(r);
+        lane_leave(charged);
+        return result;
+    }
+
+    if (bundle_send(r, r->host->bundle, entry) < 0)
+    {
+        return 418;
+    }
+    return HTTP_STATUS_OK;
+}
+
 /**
  * Handle browse request.
  *
@@ -114,14 +357,19 @@ HTTPStatus  handle_browse_request(Request *r) {
         return HTTP_STATUS_NOT_FOUND;
     }
 
-    /* Write HTTP Header with OK Status and text/html Content-Type */
-    fprintf(r->file, "HTTP/1.0 200 OK\n");
-    fprintf(r->file, "Content-Type: text/html\n");
-    fprintf(r->file, "\r\n");
-
-
     /* For each entry in directory, emit HTML list item */
-    fprintf(r->file, "<ul>");
+    char   *listing = NULL;
+    size_t  length  = 0;
+    FILE   *stream  = open_memstream(&listing, &length);
+    if (!stream)
+    {
+        fprintf(stderr, "open_memstream failed: %s\n", strerror(errno));
+        for (int i = 0; i < n; i++) free(entries[i]);
+        free(entries);
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    fprintf(stream, "<ul>");
     for (int i = 0; i < n; i++)
     {
         if(streq(entries[i]->d_name,".")){
@@ -129,19 +377,28 @@ HTTPStatus  handle_browse_request(Request *r) {
             continue;
         }
         if(streq(r->uri,"/")){
-            fprintf(r->file, "<li><a href=\"%s%s\">%s</a></li>\n",r->uri,entries[i]->d_name, entries[i]->d_name);
+            fprintf(stream, "<li><a href=\"%s%s\">%s</a></li>\n",r->uri,entries[i]->d_name, entries[i]->d_name);
         } else {
-            fprintf(r->file, "<li><a href=\"%s/%s\">%s</a></li>\n",r->uri,entries[i]->d_name, entries[i]->d_name);
+            fprintf(stream, "<li><a href=\"%s/%s\">%s</a></li>\n",r->uri,entries[i]->d_name, entries[i]->d_name);
         }
         free(entries[i]);
     }
-    fprintf(r->file, "</ul>");
-
-    /* Flush socket, return OK */
+    fprintf(stream, "</ul>");
+    fclose(stream);
     free(entries);
-    if (fflush(r->file) < 0)
+
+    /* Write HTTP Header with OK Status and text/html Content-Type and listing */
+    Response resp;
+    response_init(&resp, HTTP_STATUS_OK);
+    response_header(&resp, RESPONSE_CONTENT_TYPE, "text/html");
+    response_length(&resp, length);
+    response_body(&resp, listing, length);
+    int sent = response_send(r, &resp);
+    free(listing);
+
+    /* Return OK */
+    if (sent < 0)
     {
-        fprintf(stderr, "fflush failed: %s\n", strerror(errno));
         return 418;
     }
     return HTTP_STATUS_OK;
@@ -155,53 +412,106 @@ HTTPStatus  handle_browse_request(Request *r) {
  *
  * This opens and streams the contents of the specified file to the socket.
  *
+ * Small files are served from the host's cache as a single prebuilt response
+ * (in gzip form if the client accepts it); misses fill the cache when
+ * possible.
+ *
  * If the path cannot be opened for reading, then handle error with
  * HTTP_STATUS_NOT_FOUND.
  **/
-HTTPStatus  handle_file_request(Request *r) {
-    FILE *fs;
-    char buffer[BUFSIZ];
+HTTPStatus  handle_file_request(Request *r, const struct stat *st) {
+    int fd;
+    struct stat s;
+    char buffer[FILE_CHUNK_SIZE];
     char *mimetype = NULL;
-    //size_t nread;
+
+    /* Serve from small file cache */
+    CacheEntry *entry = cache_lookup(r->host, r->path, st);
+    if (!entry) {
+        entry = cache_fill(r->host, r->path, st);
+    }
+    if (entry) {
+        bool gzip = accepts_encoding(request_header(r, "Accept-Encoding"), "gzip");
+        return cache_send(r, entry, gzip) < 0 ? 418 : HTTP_STATUS_OK;
+    }
 
     /* Open file for reading */
-    fs = fopen(r->path, "r");
-    if (!fs)
+    fd = open(r->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &s) < 0)
     {
-        fprintf(stderr, "fopen failed: %s\n", strerror(errno));
+        fprintf(stderr, "open failed: %s\n", strerror(errno));
         goto fail;
     }
 
     /* Determine mimetype */
-    mimetype = determine_mimetype(r->path);
+    mimetype = cache_mimetype(r->host, r->path, &s);
 
-    /* Write HTTP Headers with OK status and determined Content-Type */
-    fprintf(r->file, "HTTP/1.0 200 OK\n");
-    fprintf(r->file, "Content-Type: %s\n", mimetype);
-    fprintf(r->file, "\r\n");
+    /* Read first chunk of file (HEAD sends none of it) */
+    ssize_t nread = r->head ? 0 : read(fd, buffer, sizeof(buffer));
+    if (nread < 0)
+    {
+        fprintf(stderr, "read failed: %s\n", strerror(errno));
+        goto fail;
+    }
 
-    /* Read from file and write to socket in chunks */
-    int nread;
-    while((nread = fread(buffer, 1, BUFSIZ, fs)) > 0)
+    /* Write HTTP Headers with OK status and determined Content-Type along
+     * with the first chunk (corked if sendfile follows, so the tail of this
+     * write shares a segment with the start of the next) */
+    bool corked = !r->head && nread < s.st_size;
+    if (corked) {
+        socket_cork(r->fd, true);
+    }
+    Response resp;
+    response_init(&resp, HTTP_STATUS_OK);
+    response_header(&resp, RESPONSE_CONTENT_TYPE, mimetype);
+    response_length(&resp, s.st_size);
+    response_body(&resp, buffer, nread);
+    if (response_send(r, &resp) < 0)
     {
-        int nwritten = fwrite(buffer,1,nread, r->file);
-        while(nwritten != nread){
-            nwritten += fwrite(buffer+nwritten,1,nread-nwritten,r->file);
-        }
+        goto error;
     }
 
-    /* Close file, flush socket, deallocate mimetype, return OK */
-    fclose(fs);
-    if (fflush(r->file) < 0)
+    /* Send remainder of file directly from page cache (encrypted by the
+     * kernel on TLS connections, if it took the session keys) */
+    off_t offset = r->head ? s.st_size : nread;
+    timer_add(&r->timer, WriteTimeout, request_timeout, r);
+    while (offset < s.st_size)
     {
-        fprintf(stderr, "fflush failed: %s\n", strerror(errno));
-        return 418;
+        ssize_t nsent = r->tls ? tls_sendfile(r, fd, &offset, s.st_size - offset)
+                               : sendfile(r->fd, fd, &offset, s.st_size - offset);
+        if (nsent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nsent <= 0) {
+            fprintf(stderr, "sendfile failed: %s\n", strerror(errno));
+            goto error;
+        }
+        /* Client made progress, so extend write deadline */
+        timer_add(&r->timer, WriteTimeout, request_timeout, r);
     }
+    timer_cancel(&r->timer);
+
+    /* Flush final partial segment */
+    if (corked) {
+        socket_cork(r->fd, false);
+    }
+
+    /* Close file, deallocate mimetype, return OK */
+    close(fd);
     free(mimetype);
     return HTTP_STATUS_OK;
 
+error:
+    /* Close file, free mimetype, return 418 */
+    close(fd);
+    free(mimetype);
+    return 418;
+
 fail:
     /* Close file, free mimetype, return INTERNAL_SERVER_ERROR */
+    if (fd >= 0) {
+        close(fd);
+    }
     free(mimetype);
     return HTTP_STATUS_INTERNAL_SERVER_ERROR;
 }
@@ -212,15 +522,26 @@ fail:
  * @param   r           HTTP Request structure.
  * @return  Status of the HTTP file request.
  *
- * This popens and streams the results of the specified executables to the
- * socket.
+ * This runs the specified executable and streams its results to the socket.
+ *
+ * Scripts that run longer than the host's CGI timeout are killed along with any
+ * processes they spawned.
  *
  * If the path cannot be popened, then handle error with
  * HTTP_STATUS_INTERNAL_SERVER_ERROR.
  **/
 HTTPStatus handle_cgi_request(Request *r) {
-    FILE *pfs;
-    char buffer[BUFSIZ];
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    char length[32];
+    pid_t pid;
+    pid_t feeder;
+    Timer deadline = {0};
+
+    /* Clear variables left from earlier requests on this connection */
+    for (const char **variable = CGIVariables; *variable; variable++) {
+        unsetenv(*variable);
+    }
 
     /* Export CGI environment variables from request structure:
      * http://en.wikipedia.org/wiki/Common_Gateway_Interface */
@@ -229,13 +550,26 @@ HTTPStatus handle_cgi_request(Request *r) {
     } else {
         setenv("QUERY_STRING",r->query,1);
     }
-    setenv("REMOTE_PORT",r->port,1);
+    request_address(r, host, sizeof(host), port, sizeof(port));
+    setenv("REMOTE_PORT",port,1);
     setenv("REQUEST_METHOD",r->method,1);
     setenv("REQUEST_URI",r->uri,1);
-    setenv("REMOTE_ADDR",r->host,1);
-    setenv("DOCUMENT_ROOT",RootPath,1);
+    setenv("REMOTE_ADDR",host,1);
+    setenv("DOCUMENT_ROOT",r->host->root,1);
     setenv("SCRIPT_FILENAME",r->path,1);
-    setenv("SERVER_PORT",Port,1);
+    snprintf(port, sizeof(port), "%u", r->port);
+    setenv("SERVER_PORT",port,1);
+    if (r->secure) {
+        setenv("HTTPS","on",1);
+    }
+    if (r->body == REQUEST_BODY_LENGTH) {
+        snprintf(length, sizeof(length), "%lld", (long long)r->body_remaining);
+        setenv("CONTENT_LENGTH",length,1);
+    }
+    const char *type = request_header(r, "Content-Type");
+    if (type) {
+        setenv("CONTENT_TYPE",type,1);
+    }
  
     //DOCUMENT_ROOT, SCRIPT_FILENAME, SERVER_PORT
     /* Export CGI environment variables from request headers */
@@ -263,32 +597,443 @@ HTTPStatus handle_cgi_request(Request *r) {
         headerptr = headerptr->next;
     }
 
-    /* POpen CGI Script */
+    /* Share output of identical requests already running the script */
+    Flight flight;
+    char   key[BUFSIZ];
+    if (flight_begin(&flight, cgi_flight_key(r, key, sizeof(key))) == FLIGHT_WAITER)
+    {
+        size_t      length;
+        const void *output = flight_wait(&flight, &length);
+        if (output)
+        {
+            HTTPStatus result = cgi_replay(r, output, length);
+            flight_end(&flight, true);
+            return result;
+        }
+        flight_end(&flight, false);
+    }
+
+    /* Start CGI Script */
     debug("r->path: %s",r->path);
-    pfs = popen(r->path, "r"); // pass in path user requested 
-    if (pfs == NULL)
+    int pfd = cgi_open(r, &pid, &feeder); // pass in path user requested 
+    if (pfd < 0)
     {
-        fprintf(stderr, "popen failed: %s\n", strerror(errno));
-        pclose(pfs);
+        fprintf(stderr, "cgi_open failed: %s\n", strerror(errno));
+        flight_end(&flight, false);
         return HTTP_STATUS_NOT_FOUND;
     }
+    timer_add(&deadline, r->host->cgi_timeout, cgi_timeout, &pid);
+
+    /* Read and translate CGI headers, then stream body */
+    HTTPStatus result = cgi_stream(r, pfd, &flight);
+
+    /* Close pipe, reap script, publish output, return status */
+    timer_cancel(&deadline);
+    cgi_close(pfd, pid);
+    cgi_feed_close(r, feeder);
+    flight_end(&flight, result == HTTP_STATUS_OK);
+    return result;
+}
+
+/**
+ * Build coalescing key for CGI request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   key         Buffer to store key.
+ * @param   size        Size of buffer.
+ * @return  Key (or NULL if the request must run the script itself).
+ *
+ * Only hosts that opt in share output, and only for idempotent requests: GET
+ * and HEAD without a body, cookies, or credentials.  The output may depend on
+ * anything the script was given, so every exported variable (already set by
+ * handle_cgi_request) forms the key.
+ **/
+const char * cgi_flight_key(Request *r, char *key, size_t size) {
+    if (!r->host->cgi_coalesce ||
+        (!streq(r->method, "GET") && !streq(r->method, "HEAD")) || r->body != REQUEST_BODY_NONE ||
+        request_header(r, "Cookie") || request_header(r, "Authorization")) {
+        return NULL;
+    }
 
-    /* Copy data from popen to socket */
-    while(fgets(buffer, BUFSIZ, pfs))
+    size_t used = snprintf(key, size, "cgi");
+    for (const char **variable = CGIVariables; *variable; variable++) {
+        const char *value = getenv(*variable);
+        int n = value ? snprintf(key + used, size - used, "\n%s=%s", *variable, value)
+                      : snprintf(key + used, size - used, "\n%s", *variable);
+        if (n < 0 || (size_t)n >= size - used) {
+            return NULL;
+        }
+        used += n;
+    }
+    return key;
+}
+
+/**
+ * Send CGI output produced by another request.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   output      Raw script output (headers and body).
+ * @param   length      Length of output.
+ * @return  Status of the HTTP CGI request.
+ *
+ * The output goes through cgi_stream like a live script's would, so it is
+ * framed for this client's version and connection.
+ **/
+HTTPStatus cgi_replay(Request *r, const void *output, size_t length) {
+    int fd = memfd_create("spidey-cgi", MFD_CLOEXEC);
+    if (fd < 0)
     {
-        fputs(buffer, r->file);
+        fprintf(stderr, "memfd_create failed: %s\n", strerror(errno));
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
 
-    /* Close popen, flush socket, return OK */
-    pclose(pfs);
-    if (fflush(r->file) < 0)
+    const char *data = output;
+    while (length)
     {
-        fprintf(stderr, "fflush failed: %s\n", strerror(errno));
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            close(fd);
+            return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        }
+        data   += n;
+        length -= n;
+    }
+
+    lseek(fd, 0, SEEK_SET);
+    HTTPStatus result = cgi_stream(r, fd, NULL);
+    close(fd);
+    debug("CGI coalesced: %s", r->path);
+    return result;
+}
+
+/**
+ * Read CGI header block from pipe.
+ *
+ * @param   fd          Pipe connected to script output.
+ * @param   buffer      Buffer to read into.
+ * @param   size        Size of buffer.
+ * @param   nread       Pointer to store number of bytes read.
+ * @return  Length of header block including blank line (or 0 on error).
+ *
+ * Any bytes read past the header block are the start of the body.
+ **/
+size_t cgi_read_headers(int fd, char *buffer, size_t size, size_t *nread) {
+    *nread = 0;
+    while (*nread < size - 1) {
+        ssize_t n = read(fd, buffer + *nread, size - 1 - *nread);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+        *nread += n;
+        buffer[*nread] = '\0';
+
+        char *crlf = strstr(buffer, "\r\n\r\n");
+        char *lf   = strstr(buffer, "\n\n");
+        if (crlf && (!lf || crlf < lf)) {
+            return crlf - buffer + 4;
+        }
+        if (lf) {
+            return lf - buffer + 2;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Translate CGI output into HTTP response and stream it to client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   fd          Pipe connected to script output.
+ * @param   flight      Flight to copy raw script output into (or NULL).
+ * @return  Status of the HTTP CGI request.
+ *
+ * The script's header block may start with an NPH style status line
+ * (HTTP/1.0 200 OK) and may contain Status:, Content-Type:, and any other
+ * headers, which are passed through.  If the script does not send a
+ * Content-Length, the body is sent with chunked encoding to HTTP/1.1 clients
+ * (so the connection can be reused) or until EOF to HTTP/1.0 clients.
+ *
+ * Output is copied in large binary chunks with blocking writes, so a slow
+ * client stops the copy loop, which fills the pipe and blocks the script
+ * instead of buffering its output.  Only those writes run under
+ * WriteTimeout; while waiting on the pipe, the script may pause for as long
+ * as the host's CGI timeout allows (ie. server-sent events).
+ **/
+HTTPStatus cgi_stream(Request *r, int fd, Flight *flight) {
+    char    buffer[CGI_CHUNK_SIZE];
+    char    headers[CGI_HEADERS_MAX];
+    char    status[128] = "200 OK";
+    size_t  hused  = 0;
+    size_t  nread;
+    bool    length = false;
+    bool    location = false;
+
+    timer_cancel(&r->timer);
+    size_t hlength = cgi_read_headers(fd, buffer, CGI_HEADERS_MAX, &nread);
+    if (!hlength)
+    {
+        fprintf(stderr, "cgi_read_headers failed: no header block\n");
+        return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    flight_append(flight, buffer, nread);
+
+    /* Parse header lines */
+    buffer[hlength - 1] = '\0';
+    char *line = buffer;
+    for (char *next; line && *line && *line != '\r' && *line != '\n'; line = next) {
+        next = strchr(line, '\n');
+        if (next) {
+            *next++ = '\0';
+        }
+        if (*line && line[strlen(line) - 1] == '\r') {
+            line[strlen(line) - 1] = '\0';
+        }
+
+        if (line == buffer && strncmp(line, "HTTP/", 5) == 0) {
+            char *code = skip_whitespace(skip_nonwhitespace(line));
+            snprintf(status, sizeof(status), "%s", code);
+            continue;
+        }
+
+        char *colon = strchr(line, ':');
+        if (!colon) {
+            continue;
+        }
+        *colon = '\0';
+        char *value = skip_whitespace(colon + 1);
+
+        if (strcasecmp(line, "Status") == 0) {
+            snprintf(status, sizeof(status), "%s", value);
+            continue;
+        }
+        if (strcasecmp(line, "Connection") == 0 || strcasecmp(line, "Transfer-Encoding") == 0) {
+            continue;
+        }
+        if (strcasecmp(line, "Content-Length") == 0) {
+            length = true;
+        }
+        if (strcasecmp(line, "Location") == 0) {
+            location = true;
+        }
+        hused += snprintf(headers + hused, sizeof(headers) - hused, "%s: %s\r\n", line, value);
+        if (hused >= sizeof(headers)) {
+            return handle_error(r, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        }
+    }
+    if (location && streq(status, "200 OK")) {
+        snprintf(status, sizeof(status), "302 Found");
+    }
+
+    /* Frame body with Content-Length, chunks, or connection close */
+    bool chunked = !length && r->version >= 11;
+    if (!length && !chunked) {
+        r->keep_alive = false;
+    }
+
+    Response resp;
+    response_init_status(&resp, status);
+    response_headers(&resp, headers, hused);
+    if (chunked) {
+        response_chunked(&resp);
+    }
+    response_body(&resp, NULL, 0);
+    if (response_send(r, &resp) < 0) {
+        return 418;
+    }
+
+    /* Stream body: leftover bytes from header read first (HEAD only drains
+     * the script, whose output other HEAD requests may share) */
+    size_t  pending = nread - hlength;
+    char   *data    = buffer + hlength;
+    while (true) {
+        if (pending && !r->head) {
+            int sent = chunked ? response_chunk(r, data, pending) : response_write(r, data, pending);
+            if (sent < 0) {
+                return 418;
+            }
+        }
+
+        timer_cancel(&r->timer);
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            pending = 0;
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        flight_append(flight, buffer, n);
+        pending = n;
+        data    = buffer;
+    }
+
+    if (chunked && !r->head && response_chunk(r, NULL, 0) < 0) {
         return 418;
     }
     return HTTP_STATUS_OK;
 }
 
+/**
+ * Start CGI script with its input and output connected to pipes.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   pid         Pointer to store process id of script.
+ * @param   feeder      Pointer to store process id of body feeder (or 0).
+ * @return  Pipe for reading script output (or -1 on error).
+ *
+ * The script runs in its own process group so that it (and anything it
+ * starts) can be killed when it exceeds the host's CGI timeout.
+ *
+ * If the request has a body, a feeder process joins the script's process
+ * group and streams the body into the script's stdin.  This way the script
+ * can consume its input and produce output in any order without the two
+ * pipes deadlocking.  Otherwise the script sees end of file on stdin.
+ *
+ * The feeder runs its own timer wheel, so a client that stalls for
+ * ReadTimeout while sending the body ends it (and the script sees end of
+ * file) even when the CGI timeout is off.
+ **/
+int cgi_open(Request *r, pid_t *pid, pid_t *feeder) {
+    int fds[2];
+    int ifds[2];
+
+    *feeder = 0;
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pipe2(ifds, O_CLOEXEC) < 0) {
+        fprintf(stderr, "pipe failed: %s\n", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    /* Interim response must go out before feeder and script can write */
+    if (request_continue(r) < 0) {
+        goto fail;
+    }
+
+    *pid = fork();
+    if (*pid < 0) {             /* Error */
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        goto fail;
+    } else if (*pid == 0) {     /* Child */
+        setpgid(0, 0);
+        close(fds[0]);
+        close(ifds[1]);
+        close(r->fd);
+        if (dup2(fds[1], STDOUT_FILENO) < 0 || dup2(ifds[0], STDIN_FILENO) < 0) {
+            _exit(EXIT_FAILURE);
+        }
+        close(fds[1]);
+        close(ifds[0]);
+        execl("/bin/sh", "sh", "-c", r->path, NULL);
+        _exit(EXIT_FAILURE);
+    }
+
+    /* Parent */
+    setpgid(*pid, *pid);
+    close(fds[1]);
+    close(ifds[0]);
+
+    /* Stream body to script */
+    if (r->body != REQUEST_BODY_NONE) {
+        *feeder = fork();
+        if (*feeder < 0) {
+            fprintf(stderr, "fork failed: %s\n", strerror(errno));
+            *feeder = 0;
+        } else if (*feeder == 0) {
+            setpgid(0, *pid);
+            close(fds[0]);
+            timers_init();
+            int status = request_send_body(r, ifds[1]);
+            capture_flush();
+            _exit(status < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+        } else {
+            setpgid(*feeder, *pid);
+        }
+    }
+    close(ifds[1]);
+    return fds[0];
+
+fail:
+    close(fds[0]);
+    close(fds[1]);
+    close(ifds[0]);
+    close(ifds[1]);
+    return -1;
+}
+
+/**
+ * Close CGI pipe and reap script.
+ *
+ * @param   fd          Pipe returned by cgi_open.
+ * @param   pid         Process id of script.
+ * @return  Exit status of script (or -1 on error).
+ **/
+int cgi_close(int fd, pid_t pid) {
+    int status;
+
+    close(fd);
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return status;
+}
+
+/**
+ * Reap body feeder and account for the body it consumed.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   feeder      Process id of feeder (or 0 if there is none).
+ *
+ * A feeder that is still running (ie. the script exited without reading its
+ * input) is killed, and the connection is closed since the rest of the body
+ * was never read.
+ **/
+void cgi_feed_close(Request *r, pid_t feeder) {
+    int   status;
+    pid_t done;
+
+    if (!feeder) {
+        r->keep_alive = r->keep_alive && r->body == REQUEST_BODY_NONE;
+        return;
+    }
+
+    while ((done = waitpid(feeder, &status, WNOHANG)) < 0 && errno == EINTR);
+    if (done == 0) {
+        kill(feeder, SIGKILL);
+        while (waitpid(feeder, &status, 0) < 0 && errno == EINTR);
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS || !request_skip_body(r)) {
+        r->keep_alive = false;
+    }
+}
+
+/**
+ * Expire CGI deadline.
+ *
+ * @param   timer       Timer whose argument points to the script's pid.
+ *
+ * This runs from the timer wheel signal handler and kills the script's entire
+ * process group, which closes the pipe and ends the response.
+ **/
+void cgi_timeout(Timer *timer) {
+    pid_t *pid = timer->arg;
+    kill(-*pid, SIGKILL);
+}
+
 /**
  * Handle displaying error page
  *
@@ -300,21 +1045,27 @@ HTTPStatus handle_cgi_request(Request *r) {
  **/
 HTTPStatus  handle_error(Request *r, HTTPStatus status) {
     debug("got into handle_error");
+    account_type(ACCOUNT_ERROR);
     const char *status_string = http_status_string(status);
     // 200
     // 400 - bad request
     // 404 - not found
     // 500 - internal server error
 
-    /* Write HTTP Header */
-    fprintf(r->file, "HTTP/1.0 %s\r\n",status_string);
-    fprintf(r->file, "Content-Type: text/html\r\n");
-    fprintf(r->file, "\r\n");
+    /* Close connection after errors */
+    r->keep_alive = false;
+
+    /* Write HTTP Header and HTML Description of Error */
+    char body[128];
+    int  length = snprintf(body, sizeof(body), "<li> %s</li>\n", status_string);
 
-    /* Write HTML Description of Error*/
-    fprintf(r->file, "<li> %s</li>\n",status_string);
+    Response resp;
+    response_init(&resp, status);
+    response_header(&resp, RESPONSE_CONTENT_TYPE, "text/html");
+    response_length(&resp, length);
+    response_body(&resp, body, length);
+    response_send(r, &resp);
 
-    fflush(r->file);
     /* Return specified status */
     return status;
 }
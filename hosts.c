@@ -0,0 +1,469 @@
+/* hosts.c: Name-Based Virtual Hosts */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "account.h"
+
+/* Constants */
+
+#define HOSTS_NAME_MAX      256         /* Longest normalized host name */
+
+/* Structures */
+
+typedef struct {
+    uint64_t    hash;                   /* Hash of normalized name (0 if slot is empty) */
+    char       *name;                   /* Normalized name */
+    Host       *host;
+} HostSlot;
+
+struct hosts {
+    Host       *hosts;                  /* Default host, then hosts from file */
+    size_t      count;
+    HostSlot   *slots;                  /* Open addressing table of names */
+    size_t      nslots;                 /* Power of two */
+};
+
+/* Global Variables */
+
+static Hosts   *Current = NULL;         /* Hosts requests are routed to */
+static bool     Sharing = false;        /* Whether hosts get shared segments */
+
+/* Internal Functions */
+
+/**
+ * Compute FNV-1a hash of string (never 0, which marks empty slots).
+ **/
+static uint64_t host_hash(const char *s) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * Normalize host name: lowercase, without port or trailing dot.
+ *
+ * @return  Length of normalized name (0 if it is empty or too long).
+ *
+ * Bracketed IPv6 literals (ie. [::1]:8080) keep their brackets.
+ **/
+static size_t host_normalize(const char *name, char *buffer, size_t size) {
+    size_t n = 0;
+
+    for (const char *c = name; *c && !isspace((unsigned char)*c); c++) {
+        if (*c == ':' && name[0] != '[') {
+            break;
+        }
+        if (n + 1 >= size) {
+            return 0;
+        }
+        buffer[n++] = tolower((unsigned char)*c);
+        if (*c == ']') {
+            break;
+        }
+    }
+    while (n && buffer[n - 1] == '.') {
+        n--;
+    }
+    buffer[n] = '\0';
+    return n;
+}
+
+/**
+ * Find slot of normalized name (or the empty slot where it belongs).
+ **/
+static HostSlot * hosts_slot(Hosts *hosts, const char *name, uint64_t hash) {
+    for (size_t i = hash & (hosts->nslots - 1); ; i = (i + 1) & (hosts->nslots - 1)) {
+        HostSlot *slot = &hosts->slots[i];
+        if (!slot->hash || (slot->hash == hash && streq(slot->name, name))) {
+            return slot;
+        }
+    }
+}
+
+/**
+ * Resolve root of host, mapping it if it is a bundle.
+ **/
+static bool host_root(Host *h, const char *root) {
+    char        rpath[PATH_MAX];
+    struct stat s;
+
+    if (!realpath(root, rpath) || stat(rpath, &s) < 0) {
+        fprintf(stderr, "realpath failed: %s: %s\n", root, strerror(errno));
+        return false;
+    }
+    if (S_ISREG(s.st_mode) && !(h->bundle = bundle_open(rpath))) {
+        return false;
+    }
+    h->root = strdup(h->bundle ? bundle_root(h->bundle) : rpath);
+    return h->root != NULL;
+}
+
+/**
+ * Parse settings of host entry.
+ *
+ * @param   h           Host to fill in (defaults already set).
+ * @param   spec        Comma separated list of name=value pairs.
+ * @return  true if parsing was successful, false if there was an error.
+ *
+ * Recognized names are root, mimetypes, mimetype, cgi (seconds, or off),
+ * coalesce (on or off, whether identical CGI requests share output), and the
+ * cache budgets bytes, entries, and shared.
+ **/
+static bool host_parse(Host *h, char *spec) {
+    char *root = NULL;
+    char *save = NULL;
+
+    for (char *pair = strtok_r(spec, ",", &save); pair; pair = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(pair, '=');
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+
+        if (streq(pair, "root")) {
+            root = value;
+        } else if (streq(pair, "mimetypes")) {
+            free(h->mimetypes);
+            h->mimetypes = strdup(value);
+        } else if (streq(pair, "mimetype")) {
+            free(h->mimetype);
+            h->mimetype = strdup(value);
+        } else if (streq(pair, "cgi") && streq(value, "off")) {
+            h->cgi = false;
+        } else if (streq(pair, "cgi")) {
+            char *end;
+            h->cgi_timeout = strtod(value, &end);
+            if (*end || !*value || h->cgi_timeout < 0) {
+                return false;
+            }
+        } else if (streq(pair, "coalesce") && (streq(value, "on") || streq(value, "off"))) {
+            h->cgi_coalesce = streq(value, "on");
+        } else if (streq(pair, "bytes")) {
+            if (!parse_size(value, &h->cache_bytes)) {
+                return false;
+            }
+        } else if (streq(pair, "entries")) {
+            if (!parse_size(value, &h->cache_entries)) {
+                return false;
+            }
+        } else if (streq(pair, "shared")) {
+            if (!parse_size(value, &h->shared_bytes)) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+
+    if (!root) {
+        fprintf(stderr, "Host %s has no root\n", h->names);
+        return false;
+    }
+    return h->mimetypes && h->mimetype && host_root(h, root);
+}
+
+/**
+ * Add names of host (comma separated) to table.
+ **/
+static bool hosts_index(Hosts *hosts, Host *h) {
+    char names[BUFSIZ];
+    char name[HOSTS_NAME_MAX];
+    char *save = NULL;
+
+    strncpy(names, h->names, sizeof(names) - 1);
+    names[sizeof(names) - 1] = '\0';
+    for (char *n = strtok_r(names, ",", &save); n; n = strtok_r(NULL, ",", &save)) {
+        if (!host_normalize(n, name, sizeof(name))) {
+            fprintf(stderr, "Bad host name %s\n", n);
+            return false;
+        }
+
+        uint64_t  hash = host_hash(name);
+        HostSlot *slot = hosts_slot(hosts, name, hash);
+        if (slot->hash) {
+            fprintf(stderr, "Host %s listed twice\n", name);
+            return false;
+        }
+        if (!(slot->name = strdup(name))) {
+            return false;
+        }
+        slot->hash = hash;
+        slot->host = h;
+    }
+    return true;
+}
+
+/**
+ * Release caches of host.
+ **/
+static void host_drop_caches(Host *h) {
+    cache_destroy(h->cache);
+    shmcache_destroy(h->shared);
+    h->cache  = NULL;
+    h->shared = NULL;
+}
+
+/* Functions */
+
+/**
+ * Load virtual hosts file.
+ *
+ * @param   path        Hosts file (NULL for none).
+ * @return  Newly allocated hosts (or NULL on error).
+ *
+ * Each line names a host (and its aliases, comma separated) followed by its
+ * settings, ie:
+ *
+ *  example.com,www.example.com    root=/srv/example,bytes=8M,cgi=10
+ *  static.example.com             root=/srv/static.spk,cgi=off
+ *
+ * Settings that are left out come from the command line (-m, -M, -t cgi,
+ * and -C), so every host has its own cache budget of that size.  Requests
+ * for names that are not listed (or without Host) go to the default host,
+ * which hosts_use builds from RootPath and the other global settings.
+ **/
+Hosts * hosts_load(const char *path) {
+    Hosts *hosts = calloc(1, sizeof(Hosts));
+    size_t capacity = 1;
+    if (!hosts || !(hosts->hosts = calloc(capacity, sizeof(Host)))) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        free(hosts);
+        return NULL;
+    }
+    hosts->count = 1;
+
+    /* Read host entries */
+    FILE *fs = path ? fopen(path, "r") : NULL;
+    if (path && !fs) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+
+    char line[BUFSIZ];
+    int  number = 0;
+    while (fs && fgets(line, sizeof(line), fs)) {
+        number++;
+        line[strcspn(line, "#")] = '\0';
+
+        char *save  = NULL;
+        char *names = strtok_r(line, " \t\r\n", &save);
+        char *spec  = strtok_r(NULL, " \t\r\n", &save);
+        if (!names) {
+            continue;
+        }
+
+        if (hosts->count == capacity) {
+            Host *grown = realloc(hosts->hosts, 2 * capacity * sizeof(Host));
+            if (!grown) {
+                fprintf(stderr, "realloc failed: %s\n", strerror(errno));
+                goto fail;
+            }
+            hosts->hosts = grown;
+            capacity    *= 2;
+        }
+
+        Host *h = &hosts->hosts[hosts->count++];
+        *h = (Host) {
+            .names         = strdup(names),
+            .mimetypes     = strdup(MimeTypesPath),
+            .mimetype      = strdup(DefaultMimeType),
+            .cgi           = true,
+            .cgi_timeout   = CGITimeout,
+            .cache_bytes   = CacheMaxBytes,
+            .cache_entries = CacheMaxEntries,
+            .shared_bytes  = CacheSharedBytes,
+        };
+        if (!h->names || !spec || strtok_r(NULL, " \t\r\n", &save) || !host_parse(h, spec)) {
+            fprintf(stderr, "Bad host entry at %s:%d\n", path, number);
+            goto fail;
+        }
+    }
+    if (fs) {
+        fclose(fs);
+        fs = NULL;
+    }
+
+    /* Index every name (table at most half full) */
+    for (hosts->nslots = 16; hosts->nslots < 4 * hosts->count; hosts->nslots *= 2);
+    if (!(hosts->slots = calloc(hosts->nslots, sizeof(HostSlot)))) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        goto fail;
+    }
+    for (size_t i = 1; i < hosts->count; i++) {
+        if (!hosts_index(hosts, &hosts->hosts[i])) {
+            goto fail;
+        }
+    }
+    return hosts;
+
+fail:
+    if (fs) {
+        fclose(fs);
+    }
+    hosts_free(hosts);
+    return NULL;
+}
+
+/**
+ * Route requests to hosts (freeing the ones used before).
+ *
+ * @param   hosts       Hosts returned by hosts_load.
+ *
+ * The default host is filled in here from RootPath, SiteBundle, and the
+ * other global settings, so call this after they are resolved.  Caches are
+ * not carried over; build them again with hosts_caches.
+ **/
+void hosts_use(Hosts *hosts) {
+    hosts->hosts[0] = (Host) {
+        .names         = "default",
+        .root          = RootPath,
+        .bundle        = SiteBundle,
+        .mimetypes     = MimeTypesPath,
+        .mimetype      = DefaultMimeType,
+        .cgi           = true,
+        .cgi_timeout   = CGITimeout,
+        .cgi_coalesce  = FlightCGI,
+        .cache_bytes   = CacheMaxBytes,
+        .cache_entries = CacheMaxEntries,
+        .shared_bytes  = CacheSharedBytes,
+    };
+
+    hosts_free(Current);
+    Current = hosts;
+    if (hosts->count > 1) {
+        log("Serving %zu virtual hosts", hosts->count - 1);
+    }
+}
+
+/**
+ * Deallocate hosts along with their caches.
+ *
+ * @param   hosts       Hosts (may be NULL).
+ *
+ * The default host only borrows the global settings and SiteBundle.
+ **/
+void hosts_free(Hosts *hosts) {
+    if (!hosts) {
+        return;
+    }
+
+    for (size_t i = 0; i < hosts->count; i++) {
+        Host *h = &hosts->hosts[i];
+        host_drop_caches(h);
+        if (i > 0) {
+            bundle_close(h->bundle);
+            free(h->names);
+            free(h->root);
+            free(h->mimetypes);
+            free(h->mimetype);
+        }
+    }
+    for (size_t i = 0; hosts->slots && i < hosts->nslots; i++) {
+        free(hosts->slots[i].name);
+    }
+    free(hosts->slots);
+    free(hosts->hosts);
+    free(hosts);
+}
+
+/**
+ * Lookup host by name (ie. the Host header).
+ *
+ * @param   name        Host name, with or without port (may be NULL).
+ * @return  Host serving name (the default host if none is listed).
+ *
+ * This is one hash and (usually) one comparison, however many hosts there
+ * are.
+ **/
+Host * host_lookup(const char *name) {
+    char normalized[HOSTS_NAME_MAX];
+
+    if (name && Current->count > 1 && host_normalize(name, normalized, sizeof(normalized))) {
+        HostSlot *slot = hosts_slot(Current, normalized, host_hash(normalized));
+        if (slot->hash) {
+            return slot->host;
+        }
+    }
+    return &Current->hosts[0];
+}
+
+/**
+ * Return host by position.
+ *
+ * @param   index       Position (0 is the default host).
+ * @return  Host (or NULL past the last one).
+ **/
+Host * host_at(size_t index) {
+    return Current && index < Current->count ? &Current->hosts[index] : NULL;
+}
+
+/**
+ * Find host whose document root holds path.
+ *
+ * @param   path        Real path of file.
+ * @return  Host with the longest root that is a prefix of path (or NULL).
+ **/
+Host * host_owning(const char *path) {
+    Host  *owner  = NULL;
+    size_t length = 0;
+
+    for (size_t i = 0; Current && i < Current->count; i++) {
+        Host  *h = &Current->hosts[i];
+        size_t n = strlen(h->root);
+        if ((!owner || n > length) && strncmp(path, h->root, n) == 0 && (n == 1 || path[n] == '/')) {
+            owner  = h;
+            length = n;
+        }
+    }
+    return owner;
+}
+
+/**
+ * Build small file cache of every host and preload CachePreloadPath.
+ *
+ * Each host gets a cache of its own budget, so one busy host cannot evict
+ * another's files.  CachePreloadPath goes to the host whose root holds it
+ * (or the default host).
+ * Once hosts_share has been called, hosts also get new shared segments.
+ **/
+void hosts_caches(void) {
+    for (size_t i = 0; i < Current->count; i++) {
+        Host *h = &Current->hosts[i];
+        host_drop_caches(h);
+        h->cache = cache_create(h->cache_bytes, h->cache_entries, CacheMaxFile);
+        if (Sharing) {
+            h->shared = shmcache_create(h->shared_bytes, CacheSharedFile);
+        }
+    }
+
+    if (CachePreloadPath) {
+        Host *owner = host_owning(CachePreloadPath);
+        cache_preload(owner ? owner : host_at(0), CachePreloadPath);
+    }
+}
+
+/**
+ * Give every host a shared cache segment (forking mode).
+ *
+ * Call before forking so that every child maps the same segments.
+ **/
+void hosts_share(void) {
+    Sharing = true;
+    for (size_t i = 0; i < Current->count; i++) {
+        Host *h = &Current->hosts[i];
+        shmcache_destroy(h->shared);
+        h->shared = shmcache_create(h->shared_bytes, CacheSharedFile);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
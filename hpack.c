@@ -0,0 +1,562 @@
+/* hpack.c: HPACK Header Compression (RFC 7541) */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Constants */
+
+#define HPACK_ENTRY_OVERHEAD    32      /* Size charged per dynamic entry */
+#define HPACK_STATIC_COUNT      61
+#define HPACK_EOS               256
+
+/**
+ * Static table (Appendix A), indexed from 1.
+ **/
+static const char *StaticTable[HPACK_STATIC_COUNT + 1][2] = {
+    { NULL, NULL },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/**
+ * Huffman code length of every symbol (Appendix B).  The code is canonical:
+ * codes are assigned in order of length and then symbol, so the lengths are
+ * all that is needed to rebuild it.
+ **/
+static const uint8_t HuffmanLengths[HPACK_EOS + 1] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+     6, 10, 10, 12, 13,  6,  8, 11, 10, 10,  8, 11,  8,  6,  6,  6,
+     5,  5,  5,  6,  6,  6,  6,  6,  6,  6,  7,  8, 15,  6, 12, 10,
+    13,  6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+     7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  8, 13, 19, 13, 14,  6,
+    15,  5,  6,  5,  6,  5,  6,  6,  6,  5,  7,  7,  6,  6,  6,  5,
+     6,  7,  6,  5,  5,  6,  7,  7,  7,  7,  7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+#define HUFFMAN_MAX_LENGTH  30
+
+/* Structures */
+
+struct hpack_entry {
+    char       *name;
+    char       *value;
+    size_t      size;                   /* Length of name and value plus overhead */
+};
+
+/* Global Variables */
+
+static uint32_t HuffmanCodes[HPACK_EOS + 1];            /* Code of each symbol */
+static uint16_t HuffmanSymbols[HPACK_EOS + 1];          /* Symbols in code order */
+static uint32_t HuffmanFirst[HUFFMAN_MAX_LENGTH + 1];   /* First code of each length */
+static uint16_t HuffmanCount[HUFFMAN_MAX_LENGTH + 1];   /* Codes of each length */
+static uint16_t HuffmanOffset[HUFFMAN_MAX_LENGTH + 1];  /* Index of first code in HuffmanSymbols */
+static bool     HuffmanReady = false;
+
+/* Internal Functions */
+
+/**
+ * Build canonical Huffman code from code lengths.
+ **/
+static void hpack_huffman_init(void) {
+    uint32_t code = 0;
+    uint16_t n    = 0;
+
+    for (int length = 1; length <= HUFFMAN_MAX_LENGTH; length++) {
+        HuffmanFirst[length]  = code;
+        HuffmanOffset[length] = n;
+        for (int symbol = 0; symbol <= HPACK_EOS; symbol++) {
+            if (HuffmanLengths[symbol] == length) {
+                HuffmanCodes[symbol] = code++;
+                HuffmanSymbols[n++]  = symbol;
+                HuffmanCount[length]++;
+            }
+        }
+        code <<= 1;
+    }
+    HuffmanReady = true;
+}
+
+/**
+ * Decode Huffman string into allocated NUL-terminated string.
+ **/
+static char * hpack_huffman_decode(const uint8_t *s, size_t n, size_t *length) {
+    char    *out    = malloc(n * 8 / 5 + 1);
+    size_t   used   = 0;
+    uint32_t code   = 0;
+    int      bits   = 0;
+
+    if (!out) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code = (code << 1) | ((s[i] >> bit) & 1);
+            bits++;
+            if (code - HuffmanFirst[bits] < HuffmanCount[bits]) {
+                uint16_t symbol = HuffmanSymbols[HuffmanOffset[bits] + code - HuffmanFirst[bits]];
+                if (symbol == HPACK_EOS || symbol == 0) {
+                    goto fail;
+                }
+                out[used++] = symbol;
+                code = 0;
+                bits = 0;
+            } else if (bits == HUFFMAN_MAX_LENGTH) {
+                goto fail;
+            }
+        }
+    }
+
+    /* Padding is the most significant bits of EOS (all ones), under a byte */
+    if (bits > 7 || code != (1u << bits) - 1) {
+        goto fail;
+    }
+    out[used] = '\0';
+    *length   = used;
+    return out;
+
+fail:
+    free(out);
+    return NULL;
+}
+
+/**
+ * Decode integer with prefix of the given number of bits.
+ *
+ * @return  Bytes consumed (or 0 on error).
+ **/
+static size_t hpack_integer(const uint8_t *s, size_t n, int prefix, size_t *value) {
+    size_t max = (1u << prefix) - 1;
+
+    if (n == 0) {
+        return 0;
+    }
+    *value = s[0] & max;
+    if (*value < max) {
+        return 1;
+    }
+
+    for (size_t i = 1, shift = 0; i < n && shift < 28; i++, shift += 7) {
+        *value += (size_t)(s[i] & 0x7f) << shift;
+        if (!(s[i] & 0x80)) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Decode string literal into allocated NUL-terminated string.
+ *
+ * @return  Bytes consumed (or 0 on error).
+ **/
+static size_t hpack_string(const uint8_t *s, size_t n, char **string) {
+    size_t length;
+    size_t decoded;
+    size_t used = hpack_integer(s, n, 7, &length);
+
+    if (!used || length > n - used) {
+        return 0;
+    }
+
+    decoded = length;
+    if (s[0] & 0x80) {
+        *string = hpack_huffman_decode(s + used, length, &decoded);
+    } else if ((*string = malloc(length + 1))) {
+        memcpy(*string, s + used, length);
+        (*string)[length] = '\0';
+    }
+
+    /* Names and values are handled as C strings */
+    if (!*string || strlen(*string) != decoded) {
+        free(*string);
+        *string = NULL;
+        return 0;
+    }
+    return used + length;
+}
+
+/**
+ * Return dynamic table entry (1 is the newest).
+ **/
+static struct hpack_entry * hpack_dynamic(Hpack *h, size_t index) {
+    return &h->entries[(h->head + h->capacity + 1 - index) % h->capacity];
+}
+
+/**
+ * Evict oldest entries until table fits in size.
+ **/
+static void hpack_evict(Hpack *h, size_t size) {
+    while (h->count && h->size > size) {
+        struct hpack_entry *e = hpack_dynamic(h, h->count);
+        h->size -= e->size;
+        free(e->name);
+        free(e->value);
+        h->count--;
+    }
+}
+
+/**
+ * Add entry to dynamic table (taking ownership of name and value).
+ **/
+static bool hpack_insert(Hpack *h, char *name, char *value) {
+    size_t size = strlen(name) + strlen(value) + HPACK_ENTRY_OVERHEAD;
+
+    /* Entries larger than the table just empty it */
+    hpack_evict(h, size > h->max_size ? 0 : h->max_size - size);
+    if (size > h->max_size) {
+        free(name);
+        free(value);
+        return true;
+    }
+
+    if (h->count == h->capacity) {
+        size_t capacity = h->capacity ? h->capacity * 2 : 16;
+        struct hpack_entry *entries = calloc(capacity, sizeof(struct hpack_entry));
+        if (!entries) {
+            free(name);
+            free(value);
+            return false;
+        }
+        for (size_t i = 1; i <= h->count; i++) {
+            entries[h->count - i] = *hpack_dynamic(h, i);
+        }
+        free(h->entries);
+        h->entries  = entries;
+        h->capacity = capacity;
+        h->head     = h->count ? h->count - 1 : capacity - 1;
+    }
+
+    h->head = (h->head + 1) % h->capacity;
+    h->entries[h->head] = (struct hpack_entry){ name, value, size };
+    h->count++;
+    h->size += size;
+    return true;
+}
+
+/**
+ * Lookup name and value of table index.
+ **/
+static bool hpack_lookup(Hpack *h, size_t index, const char **name, const char **value) {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= HPACK_STATIC_COUNT) {
+        *name  = StaticTable[index][0];
+        *value = StaticTable[index][1];
+        return true;
+    }
+    if (index - HPACK_STATIC_COUNT > h->count) {
+        return false;
+    }
+    struct hpack_entry *e = hpack_dynamic(h, index - HPACK_STATIC_COUNT);
+    *name  = e->name;
+    *value = e->value;
+    return true;
+}
+
+/**
+ * Encode integer with prefix of the given number of bits.
+ *
+ * @return  Bytes written (or 0 if there is no room).
+ **/
+static size_t hpack_put_integer(uint8_t *out, size_t size, uint8_t flags, int prefix, size_t value) {
+    size_t max  = (1u << prefix) - 1;
+    size_t used = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+    if (value < max) {
+        out[used++] = flags | value;
+        return used;
+    }
+
+    out[used++] = flags | max;
+    for (value -= max; value >= 0x80; value >>= 7) {
+        if (used == size) {
+            return 0;
+        }
+        out[used++] = (value & 0x7f) | 0x80;
+    }
+    if (used == size) {
+        return 0;
+    }
+    out[used++] = value;
+    return used;
+}
+
+/**
+ * Encode string literal, with Huffman coding if that is shorter.
+ *
+ * @return  Bytes written (or 0 if there is no room).
+ **/
+static size_t hpack_put_string(uint8_t *out, size_t size, const char *s) {
+    size_t length = strlen(s);
+    size_t bits   = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        bits += HuffmanLengths[(uint8_t)s[i]];
+    }
+
+    size_t hlength = (bits + 7) / 8;
+    if (hlength >= length) {
+        size_t used = hpack_put_integer(out, size, 0x00, 7, length);
+        if (!used || size - used < length) {
+            return 0;
+        }
+        memcpy(out + used, s, length);
+        return used + length;
+    }
+
+    size_t used = hpack_put_integer(out, size, 0x80, 7, hlength);
+    if (!used || size - used < hlength) {
+        return 0;
+    }
+
+    uint64_t buffer = 0;
+    int      nbits  = 0;
+    uint8_t *o      = out + used;
+    for (size_t i = 0; i < length; i++) {
+        uint8_t c = s[i];
+        buffer = (buffer << HuffmanLengths[c]) | HuffmanCodes[c];
+        nbits += HuffmanLengths[c];
+        while (nbits >= 8) {
+            nbits -= 8;
+            *o++   = buffer >> nbits;
+        }
+    }
+    if (nbits) {
+        *o++ = (buffer << (8 - nbits)) | (0xff >> nbits);
+    }
+    return used + hlength;
+}
+
+/* Functions */
+
+/**
+ * Initialize decoder state.
+ *
+ * @param   h           HPACK decoder.
+ * @param   max_size    Largest dynamic table the peer may use
+ *                      (SETTINGS_HEADER_TABLE_SIZE).
+ **/
+void hpack_init(Hpack *h, size_t max_size) {
+    if (!HuffmanReady) {
+        hpack_huffman_init();
+    }
+    memset(h, 0, sizeof(Hpack));
+    h->max_size = max_size;
+    h->limit    = max_size;
+}
+
+/**
+ * Release dynamic table.
+ *
+ * @param   h           HPACK decoder.
+ **/
+void hpack_free(Hpack *h) {
+    hpack_evict(h, 0);
+    free(h->entries);
+    h->entries  = NULL;
+    h->capacity = 0;
+}
+
+/**
+ * Decode header block.
+ *
+ * @param   h           HPACK decoder (dynamic table is updated).
+ * @param   block       Header block fragment(s), concatenated.
+ * @param   length      Length of block.
+ * @param   emit        Function called with each header in order.
+ * @param   arg         Argument passed to emit.
+ * @return  -1 on a compression error (the connection cannot continue) and 0
+ *          on success.
+ **/
+int hpack_decode(Hpack *h, const uint8_t *block, size_t length, HpackEmit emit, void *arg) {
+    const uint8_t *s   = block;
+    const uint8_t *end = block + length;
+    size_t         index;
+    size_t         used;
+
+    while (s < end) {
+        const char *name;
+        const char *value;
+        char       *nalloc = NULL;
+        char       *valloc = NULL;
+
+        if (s[0] & 0x80) {
+            /* Indexed header field */
+            if (!(used = hpack_integer(s, end - s, 7, &index)) || !hpack_lookup(h, index, &name, &value)) {
+                return -1;
+            }
+            s += used;
+            emit(arg, name, value);
+            continue;
+        }
+
+        if ((s[0] & 0xe0) == 0x20) {
+            /* Dynamic table size update */
+            if (!(used = hpack_integer(s, end - s, 5, &index)) || index > h->limit) {
+                return -1;
+            }
+            s += used;
+            h->max_size = index;
+            hpack_evict(h, h->max_size);
+            continue;
+        }
+
+        /* Literal with incremental indexing, without indexing, or never
+         * indexed */
+        bool indexing = (s[0] & 0xc0) == 0x40;
+        if (!(used = hpack_integer(s, end - s, indexing ? 6 : 4, &index))) {
+            return -1;
+        }
+        s += used;
+        if (index) {
+            if (!hpack_lookup(h, index, &name, &value) || !(nalloc = strdup(name))) {
+                return -1;
+            }
+        } else {
+            if (!(used = hpack_string(s, end - s, &nalloc))) {
+                return -1;
+            }
+            s += used;
+        }
+        if (!(used = hpack_string(s, end - s, &valloc))) {
+            free(nalloc);
+            return -1;
+        }
+        s += used;
+
+        emit(arg, nalloc, valloc);
+        if (indexing) {
+            if (!hpack_insert(h, nalloc, valloc)) {
+                return -1;
+            }
+        } else {
+            free(nalloc);
+            free(valloc);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Encode header as a literal that is never added to the peer's table.
+ *
+ * @param   out         Buffer to store encoded header.
+ * @param   size        Size of buffer.
+ * @param   name        Header name (lower case).
+ * @param   value       Header value.
+ * @return  Bytes written (or 0 if there is no room).
+ *
+ * Names in the static table are sent by index; a name and value that are
+ * both in the static table (ie. :status 200) are sent as a single index.
+ **/
+size_t hpack_encode(uint8_t *out, size_t size, const char *name, const char *value) {
+    size_t index = 0;
+
+    if (!HuffmanReady) {
+        hpack_huffman_init();
+    }
+
+    for (size_t i = 1; i <= HPACK_STATIC_COUNT; i++) {
+        if (streq(StaticTable[i][0], name)) {
+            if (streq(StaticTable[i][1], value)) {
+                return hpack_put_integer(out, size, 0x80, 7, i);
+            }
+            if (!index) {
+                index = i;
+            }
+        }
+    }
+
+    size_t used = hpack_put_integer(out, size, 0x00, 4, index);
+    if (!used) {
+        return 0;
+    }
+    if (!index) {
+        size_t n = hpack_put_string(out + used, size - used, name);
+        if (!n) {
+            return 0;
+        }
+        used += n;
+    }
+
+    size_t n = hpack_put_string(out + used, size - used, value);
+    return n ? used + n : 0;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
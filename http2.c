@@ -0,0 +1,1482 @@
+/* http2.c: HTTP/2 over Cleartext TCP (RFC 9113) */
+
+#include "spidey.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define H2_PREFACE          "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_REST     "SM\r\n\r\n"    /* Preface after the HTTP/1 parser */
+#define H2_FRAME_HEADER     9
+#define H2_FRAME_MAX        16384           /* Largest frame sent or accepted */
+#define H2_WINDOW           65535           /* Initial flow control window */
+#define H2_WINDOW_MAX       0x7fffffff
+#define H2_TABLE_SIZE       4096            /* Peer's HPACK dynamic table */
+#define H2_STREAMS_MAX      32              /* Concurrent streams per connection */
+#define H2_BLOCK_MAX        (64 * 1024)     /* Largest request header block */
+#define H2_HEAD_MAX         (16 * 1024)     /* Largest response head from handler */
+#define H2_SETTINGS_MAX     512             /* Largest HTTP2-Settings payload */
+#define H2_WEIGHT           16              /* Default stream weight */
+#define H2_STRIDE           (1 << 16)       /* Virtual time of one byte at weight 1 */
+
+/* Frame types */
+enum {
+    H2_DATA = 0,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION,
+};
+
+/* Frame flags */
+#define H2_FLAG_END_STREAM  0x01
+#define H2_FLAG_ACK         0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED      0x08
+#define H2_FLAG_PRIORITY    0x20
+
+/* Error codes */
+enum {
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR,
+    H2_ENHANCE_YOUR_CALM,
+};
+
+/* Settings */
+enum {
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    H2_SETTINGS_ENABLE_PUSH,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE,
+    H2_SETTINGS_MAX_FRAME_SIZE,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE,
+};
+
+/* Structures */
+
+typedef struct {
+    char       *data;
+    size_t      length;
+    size_t      capacity;
+} H2Buffer;
+
+typedef struct {
+    uint32_t    depends;                /* Stream this one depends on (0 if none) */
+    int         weight;                 /* 1 to 256 */
+    bool        set;                    /* Whether frame carried priority */
+} H2Priority;
+
+typedef struct {
+    uint32_t    id;                     /* Stream identifier (0 if slot is free) */
+    pid_t       pid;                    /* Stream process running the handler */
+    int         fd;                     /* Socket to stream process */
+
+    /* Request */
+    H2Buffer    request;                /* HTTP/1 request bytes for handler */
+    size_t      delivered;              /* Bytes of request written to handler */
+    size_t      unacked;                /* DATA bytes not yet returned to window */
+    int64_t     recv_window;            /* DATA bytes client may still send */
+    bool        ended;                  /* Whether client finished request */
+    bool        chunked;                /* Whether body is relayed chunked */
+    bool        head;                   /* Whether response has no body */
+
+    /* Response */
+    char        header[H2_HEAD_MAX + 1];/* Status line and headers from handler */
+    size_t      header_length;
+    bool        responding;             /* Whether HEADERS was sent */
+    bool        eof;                    /* Whether handler finished response */
+    char        data[H2_FRAME_MAX];     /* Body bytes waiting to be framed */
+    size_t      start;
+    size_t      end;
+    int64_t     send_window;            /* DATA bytes we may still send */
+
+    /* Priority */
+    uint32_t    depends;
+    int         weight;
+    uint64_t    pass;                   /* Virtual time of next frame */
+} H2Stream;
+
+typedef struct {
+    Request    *r;                      /* Request that began the connection */
+    Hpack       decoder;                /* Client's header compression state */
+    H2Stream    streams[H2_STREAMS_MAX];
+    size_t      active;                 /* Streams in use */
+    uint32_t    last;                   /* Highest stream id opened by client */
+    int64_t     send_window;            /* Connection flow control window */
+    int64_t     initial_window;         /* Client's SETTINGS_INITIAL_WINDOW_SIZE */
+    uint64_t    vtime;                  /* Virtual time of scheduler */
+    bool        goaway;                 /* Whether client is done opening streams */
+
+    uint8_t     input[H2_FRAME_HEADER + H2_FRAME_MAX];
+    size_t      input_length;
+
+    H2Buffer    block;                  /* Header block awaiting CONTINUATION */
+    uint32_t    block_stream;           /* Stream of block (0 if none) */
+    uint8_t     block_flags;            /* Flags of HEADERS that began block */
+    H2Priority  block_priority;
+} H2Connection;
+
+typedef struct {
+    char       *method;
+    char       *path;
+    char       *authority;
+    H2Buffer    fields;                 /* Regular fields as HTTP/1 header lines */
+    H2Buffer    cookie;                 /* Cookie fields joined with "; " */
+    bool        length;                 /* Whether content-length was given */
+    bool        host;                   /* Whether host was given */
+    bool        regular;                /* Whether a regular field was seen */
+    bool        error;                  /* Whether the header list is malformed */
+} H2Headers;
+
+/* Internal Functions: Buffers */
+
+/**
+ * Append bytes to buffer, growing it as needed.
+ **/
+static bool h2_append(H2Buffer *b, const void *data, size_t length) {
+    if (b->length + length > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : BUFSIZ;
+        while (capacity < b->length + length) {
+            capacity *= 2;
+        }
+        char *grown = realloc(b->data, capacity);
+        if (!grown) {
+            fprintf(stderr, "realloc failed: %s\n", strerror(errno));
+            return false;
+        }
+        b->data     = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->length, data, length);
+    b->length += length;
+    return true;
+}
+
+/**
+ * Append string to buffer.
+ **/
+static bool h2_puts(H2Buffer *b, const char *s) {
+    return h2_append(b, s, strlen(s));
+}
+
+/**
+ * Read big-endian 32-bit integer.
+ **/
+static uint32_t h2_u32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/**
+ * Write big-endian 32-bit integer.
+ **/
+static void h2_put_u32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+/* Internal Functions: Frames */
+
+/**
+ * Send frame to client.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   type        Frame type.
+ * @param   flags       Frame flags.
+ * @param   id          Stream identifier.
+ * @param   payload     Frame payload.
+ * @param   length      Length of payload.
+ * @return  -1 on error and 0 on success.
+ **/
+static int h2_frame(H2Connection *c, int type, int flags, uint32_t id, const void *payload, size_t length) {
+    uint8_t  header[H2_FRAME_HEADER];
+    Response resp = { .iovcnt = length ? 2 : 1, .body = true };
+
+    header[0] = length >> 16;
+    header[1] = length >> 8;
+    header[2] = length;
+    header[3] = type;
+    header[4] = flags;
+    h2_put_u32(header + 5, id & H2_WINDOW_MAX);
+
+    resp.iov[0] = (struct iovec){ header, sizeof(header) };
+    resp.iov[1] = (struct iovec){ (void *)payload, length };
+    return response_send(c->r, &resp);
+}
+
+/**
+ * Send GOAWAY with connection error.
+ *
+ * @return  -1 (the connection is finished).
+ **/
+static int h2_goaway(H2Connection *c, uint32_t error) {
+    uint8_t payload[8];
+
+    h2_put_u32(payload, c->last);
+    h2_put_u32(payload + 4, error);
+    h2_frame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    debug("HTTP/2 GOAWAY: %u", error);
+    return -1;
+}
+
+/**
+ * Send WINDOW_UPDATE for connection (id 0) or stream.
+ **/
+static int h2_window_update(H2Connection *c, uint32_t id, uint32_t increment) {
+    uint8_t payload[4];
+
+    h2_put_u32(payload, increment);
+    return h2_frame(c, H2_WINDOW_UPDATE, 0, id, payload, sizeof(payload));
+}
+
+/**
+ * Send header block, continuing it in CONTINUATION frames as needed.
+ **/
+static int h2_send_headers(H2Connection *c, uint32_t id, int flags, const uint8_t *block, size_t length) {
+    int type = H2_HEADERS;
+
+    do {
+        size_t n = length < H2_FRAME_MAX ? length : H2_FRAME_MAX;
+        int    f = (type == H2_HEADERS ? flags : 0) | (n == length ? H2_FLAG_END_HEADERS : 0);
+        if (h2_frame(c, type, f, id, block, n) < 0) {
+            return -1;
+        }
+        block  += n;
+        length -= n;
+        type    = H2_CONTINUATION;
+    } while (length);
+    return 0;
+}
+
+/* Internal Functions: Streams */
+
+/**
+ * Find open stream by identifier.
+ **/
+static H2Stream * h2_stream(H2Connection *c, uint32_t id) {
+    for (size_t i = 0; id && i < H2_STREAMS_MAX; i++) {
+        if (c->streams[i].id == id) {
+            return &c->streams[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Close stream, stopping its process if the response is unfinished.
+ **/
+static void h2_close(H2Connection *c, H2Stream *s) {
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    if (s->pid > 0) {
+        if (!s->eof) {
+            kill(s->pid, SIGTERM);
+        }
+        while (waitpid(s->pid, NULL, 0) < 0 && errno == EINTR);
+    }
+    free(s->request.data);
+
+    s->id           = 0;
+    s->pid          = 0;
+    s->fd           = -1;
+    s->request      = (H2Buffer){ 0 };
+    c->active--;
+}
+
+/**
+ * Send RST_STREAM and close stream.
+ *
+ * @return  -1 if the connection failed and 0 on success.
+ **/
+static int h2_reset(H2Connection *c, H2Stream *s, uint32_t error) {
+    uint8_t  payload[4];
+    uint32_t id = s->id;
+
+    h2_close(c, s);
+    h2_put_u32(payload, error);
+    return h2_frame(c, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+}
+
+/**
+ * Apply priority to stream.
+ **/
+static void h2_prioritize(H2Stream *s, H2Priority priority) {
+    if (priority.set && priority.depends != s->id) {
+        s->depends = priority.depends;
+        s->weight  = priority.weight;
+    }
+}
+
+/**
+ * Parse priority fields (exclusive bit and dependency, then weight).
+ **/
+static H2Priority h2_priority(const uint8_t *p) {
+    return (H2Priority){ .depends = h2_u32(p) & H2_WINDOW_MAX, .weight = p[4] + 1, .set = true };
+}
+
+/**
+ * Give back lane slot and exit when stream process is terminated.
+ *
+ * The connection terminates stream processes it no longer needs (ie. once
+ * the client is gone), which may be before they leave their lane.
+ **/
+static void h2_terminate(int signum) {
+    lane_abandon();
+    _exit(EXIT_FAILURE);
+}
+
+/**
+ * Start stream process to run the HTTP/1 handlers for stream.
+ *
+ * @return  -1 on error and 0 on success.
+ *
+ * The stream process reads the synthesized HTTP/1.0 request from its end of
+ * a socket pair and writes its response there, exactly as it would to a
+ * client, so every handler (and the lanes and coalescing around them) works
+ * unchanged.
+ **/
+static int h2_spawn(H2Connection *c, H2Stream *s) {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        fprintf(stderr, "socketpair failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        signal(SIGTERM, h2_terminate);
+        control_ignore();
+        timers_init();
+        accept_discard();
+
+        close(sv[0]);
+        close(c->r->fd);
+        for (size_t i = 0; i < H2_STREAMS_MAX; i++) {
+            if (c->streams[i].fd >= 0) {
+                close(c->streams[i].fd);
+            }
+        }
+
+        Request *r = calloc(1, sizeof(Request));
+        if (!r) {
+            _exit(EXIT_FAILURE);
+        }
+        r->fd      = sv[1];
+        r->id      = c->r->id;
+        r->addr    = c->r->addr;
+        r->addrlen = c->r->addrlen;
+        r->port    = c->r->port;
+        r->secure  = c->r->secure;
+
+        handle_request(r);
+        free_request(r);
+        _exit(EXIT_SUCCESS);
+    }
+
+    close(sv[1]);
+    if (fcntl(sv[0], F_SETFL, O_NONBLOCK) < 0) {
+        fprintf(stderr, "fcntl failed: %s\n", strerror(errno));
+    }
+    s->fd  = sv[0];
+    s->pid = pid;
+    return 0;
+}
+
+/**
+ * Take free stream slot for new stream.
+ **/
+static H2Stream * h2_open(H2Connection *c, uint32_t id, H2Priority priority) {
+    for (size_t i = 0; i < H2_STREAMS_MAX; i++) {
+        H2Stream *s = &c->streams[i];
+        if (s->id) {
+            continue;
+        }
+
+        s->id            = id;
+        s->delivered     = 0;
+        s->unacked       = 0;
+        s->recv_window   = H2_WINDOW;
+        s->ended         = false;
+        s->chunked       = false;
+        s->head          = false;
+        s->header_length = 0;
+        s->responding    = false;
+        s->eof           = false;
+        s->start         = 0;
+        s->end           = 0;
+        s->send_window   = c->initial_window;
+        s->depends       = 0;
+        s->weight        = H2_WEIGHT;
+        s->pass          = c->vtime;
+        h2_prioritize(s, priority);
+        c->active++;
+        return s;
+    }
+    return NULL;
+}
+
+/**
+ * Write buffered request bytes to stream process.
+ *
+ * @return  -1 if the connection failed and 0 on success.
+ *
+ * Once everything received so far is delivered, the client's DATA is
+ * returned to the stream window, so a stream never buffers more than one
+ * window of body.  After the whole request, the socket is shut down for
+ * writing so the handler sees the end of the body.
+ **/
+static int h2_deliver(H2Connection *c, H2Stream *s) {
+    while (s->delivered < s->request.length) {
+        ssize_t n = write(s->fd, s->request.data + s->delivered, s->request.length - s->delivered);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            /* Handler finished without reading the whole body */
+            s->delivered = s->request.length;
+            break;
+        }
+        s->delivered += n;
+    }
+
+    s->request.length = 0;
+    s->delivered      = 0;
+    if (s->ended) {
+        shutdown(s->fd, SHUT_WR);
+    } else if (s->unacked) {
+        s->recv_window += s->unacked;
+        if (h2_window_update(c, s->id, s->unacked) < 0) {
+            return -1;
+        }
+        s->unacked = 0;
+    }
+    return 0;
+}
+
+/**
+ * Finish client's half of stream.
+ **/
+static int h2_end_request(H2Connection *c, H2Stream *s) {
+    s->ended = true;
+    if (s->chunked && !h2_puts(&s->request, "0\r\n\r\n")) {
+        return h2_reset(c, s, H2_INTERNAL_ERROR);
+    }
+    return h2_deliver(c, s);
+}
+
+/**
+ * Collect one decoded request header (HpackEmit callback).
+ **/
+static void h2_header(void *arg, const char *name, const char *value) {
+    static const char *Dropped[] = { "te", "expect", "http2-settings", NULL };
+    static const char *Forbidden[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", NULL };
+    H2Headers *h = arg;
+
+    if (strpbrk(value, "\r\n")) {
+        h->error = true;
+        return;
+    }
+
+    /* Pseudo-header fields come first */
+    if (name[0] == ':') {
+        char **field = NULL;
+        if (streq(name, ":method")) {
+            field = &h->method;
+        } else if (streq(name, ":path")) {
+            field = &h->path;
+        } else if (streq(name, ":authority")) {
+            field = &h->authority;
+        } else if (streq(name, ":scheme")) {
+            return;
+        }
+        if (!field || *field || h->regular || !(*field = strdup(value))) {
+            h->error = true;
+        }
+        return;
+    }
+    h->regular = true;
+
+    for (const char *c = name; *c; c++) {
+        if (isupper((unsigned char)*c) || *c == ':' || isspace((unsigned char)*c)) {
+            h->error = true;
+            return;
+        }
+    }
+    for (const char **f = Forbidden; *f; f++) {
+        if (streq(name, *f)) {
+            h->error = true;
+            return;
+        }
+    }
+    for (const char **d = Dropped; *d; d++) {
+        if (streq(name, *d)) {
+            return;
+        }
+    }
+
+    /* Cookie may be split into several fields */
+    if (streq(name, "cookie")) {
+        if ((h->cookie.length && !h2_puts(&h->cookie, "; ")) || !h2_puts(&h->cookie, value)) {
+            h->error = true;
+        }
+        return;
+    }
+    h->length = h->length || streq(name, "content-length");
+    h->host   = h->host   || streq(name, "host");
+
+    /* Restore conventional capitalization (ie. Content-Type) */
+    size_t offset = h->fields.length;
+    if (!h2_puts(&h->fields, name) || !h2_puts(&h->fields, ": ") ||
+        !h2_puts(&h->fields, value) || !h2_puts(&h->fields, "\r\n")) {
+        h->error = true;
+        return;
+    }
+    for (char *c = h->fields.data + offset; *c != ':'; c++) {
+        if (c == h->fields.data + offset || c[-1] == '-') {
+            *c = toupper((unsigned char)*c);
+        }
+    }
+}
+
+/**
+ * Release decoded request headers.
+ **/
+static void h2_headers_free(H2Headers *h) {
+    free(h->method);
+    free(h->path);
+    free(h->authority);
+    free(h->fields.data);
+    free(h->cookie.data);
+}
+
+/**
+ * Write HTTP/1.0 request for stream from decoded headers.
+ **/
+static bool h2_compose(H2Stream *s, H2Headers *h, bool ended) {
+    H2Buffer *b = &s->request;
+    bool      ok;
+
+    ok = h2_puts(b, h->method) && h2_puts(b, " ") && h2_puts(b, h->path) && h2_puts(b, " HTTP/1.0\r\n");
+    if (ok && h->authority && !h->host) {
+        ok = h2_puts(b, "Host: ") && h2_puts(b, h->authority) && h2_puts(b, "\r\n");
+    }
+    if (ok && h->fields.length) {
+        ok = h2_append(b, h->fields.data, h->fields.length);
+    }
+    if (ok && h->cookie.length) {
+        ok = h2_puts(b, "Cookie: ") && h2_append(b, h->cookie.data, h->cookie.length) && h2_puts(b, "\r\n");
+    }
+
+    /* Body without a declared length is relayed chunked */
+    if (ok && !ended && !h->length) {
+        ok = h2_puts(b, "Transfer-Encoding: chunked\r\n");
+        s->chunked = true;
+    }
+    s->head = streq(h->method, "HEAD");
+    return ok && h2_puts(b, "\r\n");
+}
+
+/**
+ * Handle complete header block of stream.
+ *
+ * @return  -1 if the connection failed and 0 on success.
+ **/
+static int h2_request(H2Connection *c, uint32_t id, int flags, const uint8_t *block, size_t length, H2Priority priority) {
+    H2Headers h = { 0 };
+    H2Stream *s;
+    int       status = 0;
+
+    /* Every block updates the decoder, even if the stream is refused */
+    if (hpack_decode(&c->decoder, block, length, h2_header, &h) < 0) {
+        h2_headers_free(&h);
+        return h2_goaway(c, H2_COMPRESSION_ERROR);
+    }
+
+    if ((s = h2_stream(c, id))) {
+        /* Trailers (ignored) must end the request */
+        if (s->ended) {
+            status = h2_reset(c, s, H2_STREAM_CLOSED);
+        } else if (!(flags & H2_FLAG_END_STREAM)) {
+            status = h2_reset(c, s, H2_PROTOCOL_ERROR);
+        } else {
+            status = h2_end_request(c, s);
+        }
+    } else if (id <= c->last) {
+        status = h2_goaway(c, H2_STREAM_CLOSED);
+    } else {
+        c->last = id;
+        if (c->goaway) {
+            /* Client will not wait for it */
+        } else if (c->active >= H2_STREAMS_MAX || !(s = h2_open(c, id, priority))) {
+            uint8_t payload[4];
+            h2_put_u32(payload, H2_REFUSED_STREAM);
+            status = h2_frame(c, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+        } else if (h.error || !h.method || !h.path) {
+            status = h2_reset(c, s, H2_PROTOCOL_ERROR);
+        } else if (!h2_compose(s, &h, flags & H2_FLAG_END_STREAM) || h2_spawn(c, s) < 0) {
+            status = h2_reset(c, s, H2_INTERNAL_ERROR);
+        } else {
+            debug("HTTP/2 STREAM %u: %s %s", id, h.method, h.path);
+            s->ended = flags & H2_FLAG_END_STREAM;
+            status = h2_deliver(c, s);
+        }
+    }
+
+    h2_headers_free(&h);
+    return status;
+}
+
+/**
+ * Relay response head from stream process as HEADERS.
+ *
+ * @param   c           HTTP/2 connection.
+ * @param   s           Stream.
+ * @param   size        Length of head (through the blank line).
+ * @return  -1 if the connection failed and 0 on success.
+ **/
+static int h2_respond(H2Connection *c, H2Stream *s, size_t size) {
+    static const char *Dropped[] = { "connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", NULL };
+    uint8_t block[H2_HEAD_MAX];
+    size_t  used = 0;
+    char    status[4];
+
+    /* Status line becomes :status */
+    if (size < 14 || strncmp(s->header, "HTTP/1.", 7) != 0 || s->header[8] != ' ' ||
+        !isdigit((unsigned char)s->header[9]) || !isdigit((unsigned char)s->header[10]) ||
+        !isdigit((unsigned char)s->header[11])) {
+        return h2_reset(c, s, H2_INTERNAL_ERROR);
+    }
+    memcpy(status, s->header + 9, 3);
+    status[3] = '\0';
+    used = hpack_encode(block, sizeof(block), ":status", status);
+
+    /* Header fields are lower case and hop-by-hop fields are dropped */
+    char *line = strstr(s->header, "\r\n") + 2;
+    char *end  = s->header + size - 2;
+    while (line < end) {
+        char *eol   = strstr(line, "\r\n");
+        char *colon = memchr(line, ':', eol - line);
+        char *name  = line;
+
+        line = eol + 2;
+        if (!colon) {
+            continue;
+        }
+        *eol   = '\0';
+        *colon = '\0';
+
+        char *value = colon + 1;
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+        for (char *c = name; *c; c++) {
+            *c = tolower((unsigned char)*c);
+        }
+
+        bool dropped = false;
+        for (const char **d = Dropped; *d && !dropped; d++) {
+            dropped = streq(name, *d);
+        }
+        if (dropped) {
+            continue;
+        }
+
+        size_t n = hpack_encode(block + used, sizeof(block) - used, name, value);
+        if (!n) {
+            return h2_reset(c, s, H2_INTERNAL_ERROR);
+        }
+        used += n;
+    }
+
+    if (h2_send_headers(c, s->id, 0, block, used) < 0) {
+        return -1;
+    }
+    s->responding = true;
+
+    /* Body bytes that arrived with the head */
+    if (!s->head) {
+        s->end = s->header_length - size;
+        memcpy(s->data, s->header + size, s->end);
+    }
+    return 0;
+}
+
+/**
+ * Read response bytes from stream process.
+ *
+ * @return  -1 if the connection failed and 0 on success.
+ **/
+static int h2_pump(H2Connection *c, H2Stream *s) {
+    if (!s->responding) {
+        ssize_t n = read(s->fd, s->header + s->header_length, H2_HEAD_MAX - s->header_length);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n <= 0) {
+            s->eof = true;
+            return h2_reset(c, s, H2_INTERNAL_ERROR);
+        }
+        s->header_length += n;
+        s->header[s->header_length] = '\0';
+
+        char *blank = strstr(s->header, "\r\n\r\n");
+        if (blank) {
+            return h2_respond(c, s, blank + 4 - s->header);
+        }
+        if (s->header_length == H2_HEAD_MAX) {
+            return h2_reset(c, s, H2_INTERNAL_ERROR);
+        }
+        return 0;
+    }
+
+    ssize_t n = read(s->fd, s->data, sizeof(s->data));
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        fprintf(stderr, "read failed: %s\n", strerror(errno));
+        n = 0;
+    }
+    if (n == 0) {
+        s->eof = true;
+    }
+    s->start = 0;
+    s->end   = s->head ? 0 : n;
+    return 0;
+}
+
+/**
+ * Determine if stream has a frame it may send now.
+ **/
+static bool h2_ready(H2Connection *c, H2Stream *s) {
+    if (!s->id || !s->responding) {
+        return false;
+    }
+    if (s->start < s->end) {
+        return s->send_window > 0 && c->send_window > 0;
+    }
+    return s->eof;
+}
+
+/**
+ * Determine if stream must wait for a stream it depends on.
+ *
+ * A stream waits while any stream it (transitively) depends on can send;
+ * parents that are waiting on their handler or on flow control do not hold
+ * up their dependents.  Dependency cycles are ignored.
+ **/
+static bool h2_blocked(H2Connection *c, H2Stream *s) {
+    bool     blocked = false;
+    uint32_t id      = s->depends;
+
+    for (int hops = 0; id && hops < H2_STREAMS_MAX; hops++) {
+        H2Stream *parent = h2_stream(c, id);
+        if (id == s->id) {
+            return false;
+        }
+        if (!parent) {
+            break;
+        }
+        blocked = blocked || h2_ready(c, parent);
+        id      = parent->depends;
+    }
+    return blocked;
+}
+
+/**
+ * Send ready frames, choosing among streams by priority.
+ *
+ * @return  -1 if the connection failed and 0 on success.
+ *
+ * Streams whose dependencies are done share the connection by stride
+ * scheduling: each DATA frame advances its stream's pass by its length over
+ * the stream's weight, and the stream with the lowest pass goes next, so
+ * siblings get bandwidth in proportion to their weights.  New streams start
+ * at the current virtual time.
+ **/
+static int h2_flush(H2Connection *c) {
+    while (true) {
+        H2Stream *next = NULL;
+        for (size_t i = 0; i < H2_STREAMS_MAX; i++) {
+            H2Stream *s = &c->streams[i];
+            if (h2_ready(c, s) && !h2_blocked(c, s) && (!next || s->pass < next->pass)) {
+                next = s;
+            }
+        }
+        if (!next) {
+            return 0;
+        }
+
+        /* End of response */
+        if (next->start == next->end) {
+            bool     ended = next->ended;
+            uint32_t id    = next->id;
+            h2_close(c, next);
+            if (h2_frame(c, H2_DATA, H2_FLAG_END_STREAM, id, NULL, 0) < 0) {
+                return -1;
+            }
+            if (!ended) {
+                /* Client need not send the rest of its request */
+                uint8_t payload[4];
+                h2_put_u32(payload, H2_NO_ERROR);
+                if (h2_frame(c, H2_RST_STREAM, 0, id, payload, sizeof(payload)) < 0) {
+                    return -1;
+                }
+            }
+            continue;
+        }
+
+        size_t n = next->end - next->start;
+        if ((int64_t)n > next->send_window) {
+            n = next->send_window;
+        }
+        if ((int64_t)n > c->send_window) {
+            n = c->send_window;
+        }
+        if (h2_frame(c, H2_DATA, 0, next->id, next->data + next->start, n) < 0) {
+            return -1;
+        }
+
+        next->start       += n;
+        next->send_window -= n;
+        c->send_window    -= n;
+        c->vtime           = next->pass;
+        next->pass        += (uint64_t)n * H2_STRIDE / next->weight;
+        if (next->start == next->end) {
+            next->start = next->end = 0;
+        }
+    }
+}
+
+/* Internal Functions: Frame Handling */
+
+/**
+ * Apply client's SETTINGS.
+ *
+ * @return  Error code (H2_NO_ERROR on success).
+ **/
+static uint32_t h2_settings(H2Connection *c, const uint8_t *p, size_t length) {
+    for (size_t i = 0; i + 6 <= length; i += 6) {
+        int      id    = p[i] << 8 | p[i + 1];
+        uint32_t value = h2_u32(p + i + 2);
+
+        switch (id) {
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if (value > H2_WINDOW_MAX) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                for (size_t j = 0; j < H2_STREAMS_MAX; j++) {
+                    H2Stream *s = &c->streams[j];
+                    if (s->id && (s->send_window += (int64_t)value - c->initial_window) > H2_WINDOW_MAX) {
+                        return H2_FLOW_CONTROL_ERROR;
+                    }
+                }
+                c->initial_window = value;
+                break;
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                /* We never send more than the minimum anyway */
+                if (value < H2_FRAME_MAX || value > 0xffffff) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                break;
+            default:
+                /* Our encoder never uses the dynamic table, and we never push */
+                break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+/**
+ * Handle DATA frame.
+ **/
+static int h2_data(H2Connection *c, uint32_t id, int flags, const uint8_t *p, size_t length) {
+    size_t size = length;
+
+    if (!id || id > c->last) {
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+    }
+
+    /* Bodies are buffered per stream, so the connection window is returned
+     * at once */
+    if (length && h2_window_update(c, 0, length) < 0) {
+        return -1;
+    }
+
+    if (flags & H2_FLAG_PADDED) {
+        if (!length || p[0] >= length) {
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+        }
+        size = length - 1 - p[0];
+        p++;
+    }
+
+    H2Stream *s = h2_stream(c, id);
+    if (!s || s->ended) {
+        uint8_t payload[4];
+        h2_put_u32(payload, H2_STREAM_CLOSED);
+        if (s) {
+            return h2_reset(c, s, H2_STREAM_CLOSED);
+        }
+        return h2_frame(c, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+    }
+
+    s->recv_window -= length;
+    s->unacked     += length;
+    if (s->recv_window < 0) {
+        return h2_reset(c, s, H2_FLOW_CONTROL_ERROR);
+    }
+
+    if (size) {
+        char chunk[32];
+        bool ok = true;
+        if (s->chunked) {
+            snprintf(chunk, sizeof(chunk), "%zx\r\n", size);
+            ok = h2_puts(&s->request, chunk);
+        }
+        ok = ok && h2_append(&s->request, p, size);
+        if (ok && s->chunked) {
+            ok = h2_puts(&s->request, "\r\n");
+        }
+        if (!ok) {
+            return h2_reset(c, s, H2_INTERNAL_ERROR);
+        }
+    }
+
+    if (flags & H2_FLAG_END_STREAM) {
+        return h2_end_request(c, s);
+    }
+    return h2_deliver(c, s);
+}
+
+/**
+ * Handle HEADERS frame.
+ **/
+static int h2_headers(H2Connection *c, uint32_t id, int flags, const uint8_t *p, size_t length) {
+    H2Priority priority = { 0 };
+
+    if (!id || !(id & 1)) {
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+    }
+
+    if (flags & H2_FLAG_PADDED) {
+        if (!length || p[0] >= length) {
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+        }
+        length -= 1 + p[0];
+        p++;
+    }
+    if (flags & H2_FLAG_PRIORITY) {
+        if (length < 5) {
+            return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+        }
+        priority = h2_priority(p);
+        p      += 5;
+        length -= 5;
+    }
+
+    if (!(flags & H2_FLAG_END_HEADERS)) {
+        c->block.length   = 0;
+        c->block_stream   = id;
+        c->block_flags    = flags;
+        c->block_priority = priority;
+        return h2_append(&c->block, p, length) ? 0 : h2_goaway(c, H2_INTERNAL_ERROR);
+    }
+    return h2_request(c, id, flags, p, length, priority);
+}
+
+/**
+ * Handle one frame from client.
+ *
+ * @return  -1 if the connection is finished and 0 otherwise.
+ **/
+static int h2_dispatch(H2Connection *c, int type, int flags, uint32_t id, const uint8_t *p, size_t length) {
+    H2Stream *s;
+    uint32_t  error;
+    uint32_t  increment;
+
+    /* Header blocks may only be interrupted by their own CONTINUATION */
+    if (c->block_stream && (type != H2_CONTINUATION || id != c->block_stream)) {
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+        case H2_DATA:
+            return h2_data(c, id, flags, p, length);
+
+        case H2_HEADERS:
+            return h2_headers(c, id, flags, p, length);
+
+        case H2_CONTINUATION:
+            if (!c->block_stream) {
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            }
+            if (c->block.length + length > H2_BLOCK_MAX) {
+                return h2_goaway(c, H2_ENHANCE_YOUR_CALM);
+            }
+            if (!h2_append(&c->block, p, length)) {
+                return h2_goaway(c, H2_INTERNAL_ERROR);
+            }
+            if (flags & H2_FLAG_END_HEADERS) {
+                c->block_stream = 0;
+                return h2_request(c, id, c->block_flags, (uint8_t *)c->block.data, c->block.length, c->block_priority);
+            }
+            return 0;
+
+        case H2_PRIORITY:
+            if (!id) {
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            }
+            if (length != 5) {
+                return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+            }
+            if ((s = h2_stream(c, id))) {
+                h2_prioritize(s, h2_priority(p));
+            }
+            return 0;
+
+        case H2_RST_STREAM:
+            if (!id || id > c->last) {
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            }
+            if (length != 4) {
+                return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+            }
+            if ((s = h2_stream(c, id))) {
+                h2_close(c, s);
+            }
+            return 0;
+
+        case H2_SETTINGS:
+            if (id) {
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            }
+            if (flags & H2_FLAG_ACK) {
+                return length ? h2_goaway(c, H2_FRAME_SIZE_ERROR) : 0;
+            }
+            if (length % 6) {
+                return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+            }
+            if ((error = h2_settings(c, p, length)) != H2_NO_ERROR) {
+                return h2_goaway(c, error);
+            }
+            return h2_frame(c, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0);
+
+        case H2_PING:
+            if (id) {
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            }
+            if (length != 8) {
+                return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+            }
+            return (flags & H2_FLAG_ACK) ? 0 : h2_frame(c, H2_PING, H2_FLAG_ACK, 0, p, length);
+
+        case H2_GOAWAY:
+            if (id) {
+                return h2_goaway(c, H2_PROTOCOL_ERROR);
+            }
+            c->goaway = true;
+            return 0;
+
+        case H2_WINDOW_UPDATE:
+            if (length != 4) {
+                return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+            }
+            increment = h2_u32(p) & H2_WINDOW_MAX;
+            if (!id) {
+                if (!increment || (c->send_window += increment) > H2_WINDOW_MAX) {
+                    return h2_goaway(c, increment ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+                }
+                return 0;
+            }
+            if (!(s = h2_stream(c, id))) {
+                return id > c->last ? h2_goaway(c, H2_PROTOCOL_ERROR) : 0;
+            }
+            if (!increment) {
+                return h2_reset(c, s, H2_PROTOCOL_ERROR);
+            }
+            if ((s->send_window += increment) > H2_WINDOW_MAX) {
+                return h2_reset(c, s, H2_FLOW_CONTROL_ERROR);
+            }
+            return 0;
+
+        case H2_PUSH_PROMISE:
+            return h2_goaway(c, H2_PROTOCOL_ERROR);
+
+        default:
+            /* Unknown frame types are ignored */
+            return 0;
+    }
+}
+
+/**
+ * Handle every complete frame in input buffer.
+ *
+ * @return  -1 if the connection is finished and 0 otherwise.
+ **/
+static int h2_input(H2Connection *c) {
+    size_t offset = 0;
+
+    while (c->input_length - offset >= H2_FRAME_HEADER) {
+        const uint8_t *h      = c->input + offset;
+        size_t         length = (size_t)h[0] << 16 | h[1] << 8 | h[2];
+
+        if (length > H2_FRAME_MAX) {
+            return h2_goaway(c, H2_FRAME_SIZE_ERROR);
+        }
+        if (c->input_length - offset < H2_FRAME_HEADER + length) {
+            break;
+        }
+        if (h2_dispatch(c, h[3], h[4], h2_u32(h + 5) & H2_WINDOW_MAX, h + H2_FRAME_HEADER, length) < 0) {
+            return -1;
+        }
+        offset += H2_FRAME_HEADER + length;
+    }
+
+    memmove(c->input, c->input + offset, c->input_length - offset);
+    c->input_length -= offset;
+    return 0;
+}
+
+/**
+ * Read and remove connection preface from input.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int h2_preface(H2Connection *c, const char *preface) {
+    size_t length = strlen(preface);
+
+    while (c->input_length < length) {
+        ssize_t n = c->r->tls ? tls_read(c->r, c->input + c->input_length, sizeof(c->input) - c->input_length)
+                              : read(c->r->fd, c->input + c->input_length, sizeof(c->input) - c->input_length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        c->input_length += n;
+    }
+
+    if (memcmp(c->input, preface, length) != 0) {
+        return h2_goaway(c, H2_PROTOCOL_ERROR);
+    }
+    c->input_length -= length;
+    memmove(c->input, c->input + length, c->input_length);
+    return 0;
+}
+
+/**
+ * Decode base64url (RFC 4648, padding optional).
+ *
+ * @return  Number of bytes decoded (or -1 on error).
+ **/
+static ssize_t h2_base64url(const char *s, uint8_t *out, size_t size) {
+    uint32_t bits  = 0;
+    int      nbits = 0;
+    size_t   n     = 0;
+
+    for (; *s && *s != '='; s++) {
+        int value;
+        if (isupper((unsigned char)*s)) {
+            value = *s - 'A';
+        } else if (islower((unsigned char)*s)) {
+            value = *s - 'a' + 26;
+        } else if (isdigit((unsigned char)*s)) {
+            value = *s - '0' + 52;
+        } else if (*s == '-' || *s == '+') {
+            value = 62;
+        } else if (*s == '_' || *s == '/') {
+            value = 63;
+        } else {
+            return -1;
+        }
+
+        bits   = (bits << 6 | value) & 0xffff;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            if (n == size) {
+                return -1;
+            }
+            out[n++] = bits >> nbits;
+        }
+    }
+    return n;
+}
+
+/**
+ * Switch HTTP/1.1 request that asked for h2c, making it stream 1.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int h2_upgrade(H2Connection *c) {
+    static const char *Dropped[] = { "Connection", "Upgrade", "HTTP2-Settings", "Keep-Alive", "Proxy-Connection", "TE", "Expect", NULL };
+    static const char  Switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    Request *r = c->r;
+    uint8_t  settings[H2_SETTINGS_MAX];
+
+    /* Settings in the request header count as the client's first SETTINGS,
+     * acknowledged by the 101 itself */
+    ssize_t length = h2_base64url(request_header(r, "HTTP2-Settings"), settings, sizeof(settings));
+    if (length < 0 || length % 6 || h2_settings(c, settings, length) != H2_NO_ERROR) {
+        return -1;
+    }
+    if (response_write(r, Switching, sizeof(Switching) - 1) < 0) {
+        return -1;
+    }
+
+    H2Stream *s = h2_open(c, 1, (H2Priority){ 0 });
+    H2Buffer *b = &s->request;
+    bool      ok;
+
+    ok = h2_puts(b, r->method) && h2_puts(b, " ") && h2_puts(b, r->uri);
+    if (ok && r->query) {
+        ok = h2_puts(b, "?") && h2_puts(b, r->query);
+    }
+    ok = ok && h2_puts(b, " HTTP/1.0\r\n");
+    for (Header *header = r->headers; ok && header; header = header->next) {
+        bool dropped = false;
+        for (const char **d = Dropped; *d && !dropped; d++) {
+            dropped = strcasecmp(header->name, *d) == 0;
+        }
+        if (!dropped) {
+            ok = h2_puts(b, header->name) && h2_puts(b, ": ") && h2_puts(b, header->value) && h2_puts(b, "\r\n");
+        }
+    }
+    ok = ok && h2_puts(b, "\r\n");
+
+    c->last  = 1;
+    s->ended = true;
+    s->head  = streq(r->method, "HEAD");
+    if (!ok || h2_spawn(c, s) < 0) {
+        return h2_reset(c, s, H2_INTERNAL_ERROR);
+    }
+    return 0;
+}
+
+/**
+ * Relay traffic until the connection is finished.
+ **/
+static void h2_loop(H2Connection *c) {
+    struct pollfd fds[1 + H2_STREAMS_MAX];
+    H2Stream     *owners[1 + H2_STREAMS_MAX];
+    uint32_t      ids[1 + H2_STREAMS_MAX];
+    Request      *r = c->r;
+
+    while (true) {
+        /* Frames of every ready stream share segments, flushed together */
+        socket_cork(r->fd, true);
+        int flushed = h2_flush(c);
+        socket_cork(r->fd, false);
+        if (flushed < 0) {
+            return;
+        }
+        if (c->goaway && !c->active) {
+            return;
+        }
+
+        /* Connection only times out while it has no streams */
+        if (c->active) {
+            timer_cancel(&r->timer);
+        } else {
+            timer_add(&r->timer, IdleTimeout, request_timeout, r);
+        }
+
+        int nfds = 0;
+        fds[nfds++] = (struct pollfd){ .fd = r->fd, .events = POLLIN };
+        for (size_t i = 0; i < H2_STREAMS_MAX; i++) {
+            H2Stream *s      = &c->streams[i];
+            short     events = 0;
+            if (!s->id || s->fd < 0) {
+                continue;
+            }
+            /* Only read more output once the last of it is framed */
+            if (!s->eof && s->start == s->end) {
+                events |= POLLIN;
+            }
+            if (s->delivered < s->request.length) {
+                events |= POLLOUT;
+            }
+            if (events) {
+                owners[nfds] = s;
+                ids[nfds]    = s->id;
+                fds[nfds++]  = (struct pollfd){ .fd = s->fd, .events = events };
+            }
+        }
+
+        /* Input already decrypted does not make the socket readable */
+        bool buffered = r->tls && tls_pending(r) > 0;
+        if (poll(fds, nfds, buffered ? 0 : -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            return;
+        }
+
+        if (fds[0].revents || buffered) {
+            ssize_t n = r->tls ? tls_read(r, c->input + c->input_length, sizeof(c->input) - c->input_length)
+                               : read(r->fd, c->input + c->input_length, sizeof(c->input) - c->input_length);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0 || (c->input_length += n, h2_input(c) < 0)) {
+                return;
+            }
+        }
+
+        for (int i = 1; i < nfds; i++) {
+            H2Stream *s = owners[i];
+            if (s->id != ids[i] || s->fd != fds[i].fd) {
+                continue;   /* Closed (or reused) while handling input */
+            }
+            if ((fds[i].revents & (POLLOUT | POLLERR)) && h2_deliver(c, s) < 0) {
+                return;
+            }
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && s->id == ids[i] && h2_pump(c, s) < 0) {
+                return;
+            }
+        }
+    }
+}
+
+/* Functions */
+
+/**
+ * Determine if request begins an HTTP/2 connection.
+ *
+ * @param   r           Parsed HTTP Request.
+ * @return  true for the prior knowledge preface (PRI * HTTP/2.0) or an
+ *          HTTP/1.1 request without a body asking to upgrade to h2c.
+ **/
+bool http2_requested(Request *r) {
+    if (streq(r->method, "PRI")) {
+        return streq(r->uri, "*") && r->version == 20;
+    }
+
+    /* h2c is cleartext only; TLS clients negotiate h2 with ALPN instead */
+    const char *upgrade = request_header(r, "Upgrade");
+    if (r->secure || r->version != 11 || !upgrade || !request_header(r, "HTTP2-Settings") ||
+        r->body != REQUEST_BODY_NONE) {
+        return false;
+    }
+
+    /* Upgrade is a list of protocols */
+    for (const char *c = upgrade; (c = strcasestr(c, "h2c")); c += 3) {
+        if ((c == upgrade || c[-1] == ' ' || c[-1] == ',') && (!c[3] || c[3] == ' ' || c[3] == ',')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Serve HTTP/2 connection.
+ *
+ * @param   r           Request that began the connection (see
+ *                      http2_requested).
+ * @return  Status of the HTTP/2 connection.
+ *
+ * Each stream is handed to a stream process of its own, which runs
+ * handle_request on an HTTP/1.0 rendering of the stream's request over a
+ * socket pair.  This process decodes HPACK header blocks, relays request
+ * bodies under flow control, and frames each handler's response into
+ * HEADERS and DATA, interleaving streams by priority (see h2_flush).
+ *
+ * The connection is never persistent as HTTP/1: it ends when the client
+ * closes it, sends GOAWAY and its streams finish, idles for IdleTimeout, or
+ * breaks the protocol.
+ **/
+HTTPStatus http2_serve(Request *r) {
+    H2Connection *c = calloc(1, sizeof(H2Connection));
+
+    r->keep_alive = false;
+    r->head       = false;                /* Frames follow, whatever the method */
+    if (!c) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        return HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    c->r              = r;
+    c->send_window    = H2_WINDOW;
+    c->initial_window = H2_WINDOW;
+    hpack_init(&c->decoder, H2_TABLE_SIZE);
+    for (size_t i = 0; i < H2_STREAMS_MAX; i++) {
+        c->streams[i].fd = -1;
+    }
+
+    /* Take over input the HTTP/1 parser read ahead */
+    c->input_length = r->input_end - r->input_start;
+    memcpy(c->input, r->input + r->input_start, c->input_length);
+    r->input_start  = r->input_end;
+
+    /* Server preface is our SETTINGS */
+    uint8_t settings[6] = { 0, H2_SETTINGS_MAX_CONCURRENT_STREAMS };
+    h2_put_u32(settings + 2, H2_STREAMS_MAX);
+
+    bool upgrade = !streq(r->method, "PRI");
+    int  status  = upgrade ? h2_upgrade(c) : 0;
+    timer_add(&r->timer, ReadTimeout, request_timeout, r);
+    if (status == 0 && h2_frame(c, H2_SETTINGS, 0, 0, settings, sizeof(settings)) == 0 &&
+        h2_preface(c, upgrade ? H2_PREFACE : H2_PREFACE_REST) == 0) {
+        log("HTTP/2 CONNECTION%s", upgrade ? " (upgrade)" : "");
+        h2_loop(c);
+    }
+
+    /* Stop whatever is still running */
+    for (size_t i = 0; i < H2_STREAMS_MAX; i++) {
+        if (c->streams[i].id) {
+            h2_close(c, &c->streams[i]);
+        }
+    }
+    timer_cancel(&r->timer);
+    hpack_free(&c->decoder);
+    free(c->block.data);
+    free(c);
+    return HTTP_STATUS_OK;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
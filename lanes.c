@@ -0,0 +1,199 @@
+/* lanes.c: Per-Class Scheduling Lanes */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+
+/* Constants */
+
+#define LANE_SLICE          100000000   /* Nanoseconds queued between checks for SIGTERM */
+
+/* Structures */
+
+typedef struct {
+    sem_t       slots[LANE_COUNT];      /* Free slots in each limited lane */
+    uint32_t    waiting[LANE_COUNT];    /* Requests queued for each lane */
+} Lanes;
+
+/* Global Variables */
+
+static Lanes *SharedLanes = NULL;       /* NULL until lanes_create */
+static Lane   Held        = LANE_NONE;  /* Lane this process has a slot in */
+
+/* Internal Functions */
+
+/**
+ * Determine if lane has a concurrency limit.
+ **/
+static bool lane_limited(Lane lane) {
+    return SharedLanes && LaneLimits[lane] > 0;
+}
+
+/**
+ * Block SIGTERM, saving the previous signal mask (to be put back with
+ * sigprocmask(SIG_SETMASK, saved, NULL)).
+ **/
+static void lane_shield(sigset_t *saved) {
+    sigset_t terminate;
+    sigemptyset(&terminate);
+    sigaddset(&terminate, SIGTERM);
+    sigprocmask(SIG_BLOCK, &terminate, saved);
+}
+
+/**
+ * Take slot in lane (or borrow one), recording it in Held.
+ *
+ * @return  Lane that was charged (or LANE_NONE if none).
+ **/
+static Lane lane_take(Lane lane, bool wait) {
+    if (sem_trywait(&SharedLanes->slots[lane]) == 0) {
+        return Held = lane;
+    }
+
+    if (!wait) {
+        int free = 0;
+        if (lane == LANE_CGI && !LaneDetach && lane_limited(LANE_STATIC) &&
+            sem_getvalue(&SharedLanes->slots[LANE_STATIC], &free) == 0 &&
+            (size_t)free > LaneLimits[LANE_STATIC] / 2 &&
+            sem_trywait(&SharedLanes->slots[LANE_STATIC]) == 0) {
+            return Held = LANE_STATIC;
+        }
+        return LANE_NONE;
+    }
+
+    /* Queue for own lane */
+    uint32_t *waiting = &SharedLanes->waiting[lane];
+    if (__atomic_add_fetch(waiting, 1, __ATOMIC_RELAXED) > LaneQueue) {
+        __atomic_sub_fetch(waiting, 1, __ATOMIC_RELAXED);
+        return LANE_NONE;
+    }
+
+    /* Without a CGI timeout, the request waits as long as it takes */
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec  += (time_t)CGITimeout;
+    deadline.tv_nsec += (long)((CGITimeout - (time_t)CGITimeout) * 1000000000);
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    /* Wait in slices, giving up early once SIGTERM is pending */
+    int status;
+    while (true) {
+        struct timespec slice;
+        clock_gettime(CLOCK_REALTIME, &slice);
+        slice.tv_nsec += LANE_SLICE;
+        if (slice.tv_nsec >= 1000000000) {
+            slice.tv_sec++;
+            slice.tv_nsec -= 1000000000;
+        }
+        bool last = CGITimeout > 0 && (slice.tv_sec > deadline.tv_sec ||
+                    (slice.tv_sec == deadline.tv_sec && slice.tv_nsec >= deadline.tv_nsec));
+
+        sigset_t pending;
+        status = sem_timedwait(&SharedLanes->slots[lane], last ? &deadline : &slice);
+        if (status == 0 || (errno == ETIMEDOUT && last) || (errno != EINTR && errno != ETIMEDOUT) ||
+            (sigpending(&pending) == 0 && sigismember(&pending, SIGTERM))) {
+            break;
+        }
+    }
+    __atomic_sub_fetch(waiting, 1, __ATOMIC_RELAXED);
+    return status == 0 ? (Held = lane) : LANE_NONE;
+}
+
+/* Functions */
+
+/**
+ * Create lane semaphores shared by all processes.
+ *
+ * @return  true on success, false on error.
+ *
+ * This must be called before forking.  Without it, every lane is unlimited.
+ **/
+bool lanes_create(void) {
+    Lanes *lanes = mmap(NULL, sizeof(Lanes), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (lanes == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        if (sem_init(&lanes->slots[lane], 1, LaneLimits[lane]) < 0) {
+            fprintf(stderr, "sem_init failed: %s\n", strerror(errno));
+            munmap(lanes, sizeof(Lanes));
+            return false;
+        }
+    }
+    SharedLanes = lanes;
+    return true;
+}
+
+/**
+ * Enter lane, taking one of its slots.
+ *
+ * @param   lane        Lane of request.
+ * @param   wait        Whether to queue for a slot if the lane is full.
+ * @return  Lane that was charged for the request (or LANE_NONE if none).
+ *
+ * Without wait, a CGI request that finds its lane full may borrow a slot
+ * from the static lane while fewer than half of the static slots are in
+ * use, unless CGI requests are detached (a borrowed slot would then tie up
+ * a worker).  Static and directory requests never borrow from the CGI lane.
+ *
+ * With wait, the request queues for its own lane for at most CGITimeout
+ * seconds (or until a slot frees up, if there is no CGI timeout), unless
+ * LaneQueue requests are already waiting.
+ *
+ * SIGTERM is held off until the slot is recorded in Held, so lane_abandon
+ * never misses a slot that was just taken; a queued request stops waiting
+ * (within LANE_SLICE) once SIGTERM is pending.
+ **/
+Lane lane_enter(Lane lane, bool wait) {
+    if (!lane_limited(lane)) {
+        return lane;
+    }
+
+    sigset_t saved;
+    lane_shield(&saved);
+    Lane charged = lane_take(lane, wait);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return charged;
+}
+
+/**
+ * Leave lane, returning the slot taken by lane_enter.
+ *
+ * @param   lane        Lane returned by lane_enter.
+ **/
+void lane_leave(Lane lane) {
+    if (lane != LANE_NONE && lane_limited(lane)) {
+        sigset_t saved;
+        lane_shield(&saved);
+        Held = LANE_NONE;
+        sem_post(&SharedLanes->slots[lane]);
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+    }
+}
+
+/**
+ * Return slot held by a process that is being terminated.
+ *
+ * This only calls sem_post(3), so it is safe in a signal handler; a process
+ * killed while in a lane would otherwise take its slot with it.
+ **/
+void lane_abandon(void) {
+    Lane lane = Held;
+    if (lane != LANE_NONE) {
+        Held = LANE_NONE;
+        sem_post(&SharedLanes->slots[lane]);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,330 @@
+/* pack.c: Compile document root into site bundle */
+
+#include "spidey.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Global Variables */
+
+char *MimeTypesPath   = "/etc/mime.types";
+char *DefaultMimeType = "text/plain";
+char *RootPath        = NULL;
+
+static bool Compress  = false;          /* Store gzip variants */
+
+/* Structures */
+
+typedef struct {
+    char       *path;                   /* URI path */
+    char       *source;                 /* Real path on disk */
+    char       *mimetype;
+    char        etag[24];
+    uint32_t    flags;
+    char       *data;                   /* Identity body */
+    size_t      length;
+    char       *gzdata;                 /* Gzip body */
+    size_t      gzlength;
+    BundleEntry entry;                  /* Entry as written to bundle */
+} Item;
+
+static Item    *Items    = NULL;
+static size_t   NItems   = 0;
+static size_t   Capacity = 0;
+
+/* Functions */
+
+/**
+ * Display usage message and exit with specified status code.
+ **/
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [hmMz] root bundle.spk\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -m path       Path to mimetypes file\n");
+    fprintf(stderr, "    -M mimetype   Default mimetype\n");
+    fprintf(stderr, "    -z            Store precompressed gzip variants\n");
+    exit(status);
+}
+
+/**
+ * Compute quoted ETag from FNV-1a hash of data.
+ **/
+void make_etag(const char *data, size_t length, char *etag, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    snprintf(etag, size, "\"%016llx\"", (unsigned long long)hash);
+}
+
+/**
+ * Compress data with gzip.
+ *
+ * @return  Allocated buffer (or NULL if compression did not help).
+ **/
+char * make_gzip(const char *data, size_t length, size_t *zlength) {
+    z_stream z = {0};
+
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    size_t bound = deflateBound(&z, length);
+    char  *zdata = malloc(bound);
+    if (zdata) {
+        z.next_in   = (Bytef *)data;
+        z.avail_in  = length;
+        z.next_out  = (Bytef *)zdata;
+        z.avail_out = bound;
+        if (deflate(&z, Z_FINISH) != Z_STREAM_END || z.total_out >= length) {
+            free(zdata);
+            zdata = NULL;
+        } else {
+            *zlength = z.total_out;
+        }
+    }
+    deflateEnd(&z);
+    return zdata;
+}
+
+/**
+ * Build directory listing identical to handle_browse_request.
+ **/
+char * make_listing(const char *source, const char *uri, size_t *length) {
+    struct dirent **entries;
+    char   *listing = NULL;
+    FILE   *stream;
+    int     n = scandir(source, &entries, NULL, alphasort);
+
+    if (n < 0 || !(stream = open_memstream(&listing, length))) {
+        fprintf(stderr, "Unable to list %s: %s\n", source, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stream, "<ul>");
+    for (int i = 0; i < n; i++) {
+        if (!streq(entries[i]->d_name, ".")) {
+            fprintf(stream, "<li><a href=\"%s%s%s\">%s</a></li>\n", uri,
+                    streq(uri, "/") ? "" : "/", entries[i]->d_name, entries[i]->d_name);
+        }
+        free(entries[i]);
+    }
+    fprintf(stream, "</ul>");
+    fclose(stream);
+    free(entries);
+    return listing;
+}
+
+/**
+ * Read entire file.
+ **/
+char * make_body(const char *source, size_t length) {
+    int   fd   = open(source, O_RDONLY);
+    char *data = malloc(length ? length : 1);
+    size_t nread = 0;
+
+    while (fd >= 0 && data && nread < length) {
+        ssize_t n = read(fd, data + nread, length - nread);
+        if (n <= 0) {
+            break;
+        }
+        nread += n;
+    }
+    if (fd < 0 || !data || nread != length) {
+        fprintf(stderr, "Unable to read %s: %s\n", source, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    return data;
+}
+
+/**
+ * Add directory tree entry to item list (nftw callback).
+ **/
+int add_item(const char *source, const struct stat *s, int type, struct FTW *ftw) {
+    if (type != FTW_F && type != FTW_D) {
+        return 0;
+    }
+    if (type == FTW_F && !S_ISREG(s->st_mode)) {
+        return 0;
+    }
+
+    if (NItems == Capacity) {
+        Capacity = Capacity ? Capacity * 2 : 64;
+        Items    = realloc(Items, Capacity * sizeof(Item));
+        if (!Items) {
+            fprintf(stderr, "realloc failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Item *item   = &Items[NItems++];
+    memset(item, 0, sizeof(Item));
+    item->source = strdup(source);
+    item->path   = strdup(source[strlen(RootPath)] ? source + strlen(RootPath) : "/");
+
+    if (type == FTW_D) {
+        item->flags    = BUNDLE_DIRECTORY;
+        item->mimetype = strdup("text/html");
+        item->data     = make_listing(source, item->path, &item->length);
+    } else if (access(source, X_OK) == 0) {
+        item->flags    = BUNDLE_CGI;
+        item->mimetype = strdup("");
+    } else {
+        item->mimetype = determine_mimetype(source, MimeTypesPath, DefaultMimeType);
+        item->length   = s->st_size;
+        item->data     = make_body(source, s->st_size);
+    }
+
+    if (item->data) {
+        make_etag(item->data, item->length, item->etag, sizeof(item->etag));
+        if (Compress) {
+            item->gzdata = make_gzip(item->data, item->length, &item->gzlength);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Order items by path (matches strcmp in bundle_lookup).
+ **/
+int compare_items(const void *a, const void *b) {
+    return strcmp(((const Item *)a)->path, ((const Item *)b)->path);
+}
+
+/**
+ * Append string to string table.
+ **/
+uint32_t add_string(FILE *strings, const char *s) {
+    long offset = ftell(strings);
+    fwrite(s, 1, strlen(s) + 1, strings);
+    return offset;
+}
+
+/**
+ * Write bytes at offset, exiting on failure.
+ **/
+void write_at(int fd, const void *data, size_t length, off_t offset) {
+    while (length) {
+        ssize_t n = pwrite(fd, data, length, offset);
+        if (n <= 0) {
+            fprintf(stderr, "pwrite failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        data    = (const char *)data + n;
+        length -= n;
+        offset += n;
+    }
+}
+
+/**
+ * Compile document root into bundle.
+ *
+ * Layout: header, sorted index, string table, then page-aligned bodies.
+ **/
+int main(int argc, char *argv[]) {
+    char *progname = argv[0];
+    int argind = 1;
+    while(argind < argc && argv[argind][0] == '-' && strlen(argv[argind]) > 1){
+        char *arg = argv[argind++];
+        switch(arg[1]){
+            case 'h': usage(progname, 0); break;
+            case 'm': MimeTypesPath = argv[argind++]; break;
+            case 'M': DefaultMimeType = argv[argind++]; break;
+            case 'z': Compress = true; break;
+            default:  usage(progname, 1); break;
+        }
+    }
+    if (argc - argind != 2) {
+        usage(progname, 1);
+    }
+
+    RootPath = realpath(argv[argind], NULL);
+    if (!RootPath) {
+        fprintf(stderr, "realpath failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Collect and sort entries */
+    if (nftw(RootPath, add_item, 16, FTW_PHYS) < 0) {
+        fprintf(stderr, "nftw failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    qsort(Items, NItems, sizeof(Item), compare_items);
+
+    /* Build string table */
+    char  *strings = NULL;
+    size_t slength = 0;
+    FILE  *sstream = open_memstream(&strings, &slength);
+    BundleHeader header = {
+        .magic = BUNDLE_MAGIC,
+        .count = NItems,
+        .index = sizeof(BundleHeader),
+    };
+    header.root = add_string(sstream, RootPath);
+    for (size_t i = 0; i < NItems; i++) {
+        Items[i].entry.path     = add_string(sstream, Items[i].path);
+        Items[i].entry.mimetype = add_string(sstream, Items[i].mimetype);
+        Items[i].entry.etag     = add_string(sstream, Items[i].etag);
+        Items[i].entry.flags    = Items[i].flags;
+    }
+    fclose(sstream);
+    header.strings = header.index + NItems * sizeof(BundleEntry);
+
+    /* Assign page-aligned body offsets */
+    uint64_t offset = header.strings + slength;
+    for (size_t i = 0; i < NItems; i++) {
+        Item *item = &Items[i];
+        if (item->data) {
+            offset = (offset + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+            item->entry.body   = offset;
+            item->entry.length = item->length;
+            offset += item->length;
+        }
+        if (item->gzdata) {
+            offset = (offset + BUNDLE_ALIGN - 1) & ~(uint64_t)(BUNDLE_ALIGN - 1);
+            item->entry.gzbody   = offset;
+            item->entry.gzlength = item->gzlength;
+            offset += item->gzlength;
+        }
+    }
+
+    /* Write bundle */
+    int fd = open(argv[argind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", argv[argind + 1], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    write_at(fd, &header, sizeof(header), 0);
+    for (size_t i = 0; i < NItems; i++) {
+        Item *item = &Items[i];
+        write_at(fd, &item->entry, sizeof(BundleEntry), header.index + i * sizeof(BundleEntry));
+        if (item->data) {
+            write_at(fd, item->data, item->length, item->entry.body);
+        }
+        if (item->gzdata) {
+            write_at(fd, item->gzdata, item->gzlength, item->entry.gzbody);
+        }
+    }
+    write_at(fd, strings, slength, header.strings);
+    if (ftruncate(fd, offset) < 0 || close(fd) < 0) {
+        fprintf(stderr, "Unable to write %s: %s\n", argv[argind + 1], strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    printf("Packed %zu entries from %s into %s (%llu bytes)\n", NItems, RootPath,
+           argv[argind + 1], (unsigned long long)offset);
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,634 @@
+/* replay.c: Replay captured requests and compare latencies */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Structures */
+
+typedef struct {
+    uint64_t    timestamp;              /* Arrival time in capture */
+    uint64_t    connection;
+    uint32_t    type;
+    size_t      order;                  /* Position in capture log */
+    const char *data;
+    size_t      length;
+} Record;
+
+typedef struct {
+    size_t      first;                  /* Index of first record */
+    size_t      count;                  /* Number of records */
+    uint64_t    timestamp;              /* Arrival of first request */
+} Connection;
+
+typedef struct {
+    int         fd;
+    char        buffer[BUFSIZ];
+    size_t      start;
+    size_t      end;
+} Reader;
+
+typedef struct {
+    size_t      count;
+    size_t      errors;
+    double      mean;
+    double      p50, p90, p99, max;     /* Microseconds */
+    double      elapsed;                /* Seconds from first to last request */
+} Summary;
+
+/* Global Variables */
+
+static char       *ServerHost  = NULL;
+static char       *ServerPort  = NULL;
+static double      Speed       = 1.0;   /* 0 replays as fast as possible */
+static size_t      MaxChildren = 256;
+
+static Record     *Records     = NULL;
+static size_t      NRecords    = 0;
+static Connection *Connections = NULL;
+static size_t      NConnections = 0;
+
+static struct timespec Start;           /* Monotonic time replay began */
+static uint64_t    Origin      = 0;     /* Timestamp of first captured request */
+
+/* Functions */
+
+/**
+ * Display usage message and exit with specified status code.
+ **/
+void usage(const char *progname, int status) {
+    fprintf(stderr, "Usage: %s [hnos] host port capture.log\n", progname);
+    fprintf(stderr, "       %s -c baseline.txt candidate.txt\n", progname);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -h            Display help message\n");
+    fprintf(stderr, "    -c            Compare latencies of two replay results\n");
+    fprintf(stderr, "    -n children   Most connections replayed at once (default 256)\n");
+    fprintf(stderr, "    -o path       Write per-request results to path\n");
+    fprintf(stderr, "    -s speed      Speed relative to capture (ie. 1, 2.5, or 0 for as fast as possible)\n");
+    exit(status);
+}
+
+/**
+ * Return microseconds elapsed since replay began.
+ **/
+double elapsed_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - Start.tv_sec) * 1e6 + (now.tv_nsec - Start.tv_nsec) / 1e3;
+}
+
+/**
+ * Sleep until the replay time of a captured timestamp.
+ **/
+void wait_until(uint64_t timestamp) {
+    if (Speed <= 0) {
+        return;
+    }
+
+    double          offset = (timestamp - Origin) / Speed;     /* Nanoseconds */
+    struct timespec when   = Start;
+    when.tv_sec  += (time_t)(offset / 1e9);
+    when.tv_nsec += (long)(offset - (time_t)(offset / 1e9) * 1e9);
+    if (when.tv_nsec >= 1000000000L) {
+        when.tv_sec  += 1;
+        when.tv_nsec -= 1000000000L;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR);
+}
+
+/**
+ * Order records by connection, then by position in log.
+ **/
+int compare_records(const void *a, const void *b) {
+    const Record *ra = a;
+    const Record *rb = b;
+    if (ra->connection != rb->connection) {
+        return ra->connection < rb->connection ? -1 : 1;
+    }
+    return ra->order < rb->order ? -1 : ra->order > rb->order;
+}
+
+/**
+ * Order connections by arrival of their first request.
+ **/
+int compare_connections(const void *a, const void *b) {
+    const Connection *ca = a;
+    const Connection *cb = b;
+    return ca->timestamp < cb->timestamp ? -1 : ca->timestamp > cb->timestamp;
+}
+
+/**
+ * Map capture log and group its records by connection.
+ **/
+bool load_capture(const char *path) {
+    struct stat s;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &s) < 0) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    const char *base = s.st_size ? mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    CaptureHeader header;
+    if (base == MAP_FAILED || (size_t)s.st_size < sizeof(header) ||
+        (memcpy(&header, base, sizeof(header)), header.magic != CAPTURE_MAGIC) ||
+        header.version != CAPTURE_VERSION) {
+        fprintf(stderr, "Invalid capture log: %s\n", path);
+        return false;
+    }
+
+    /* Collect records */
+    size_t capacity = 0;
+    size_t offset   = sizeof(header);
+    while (offset + sizeof(CaptureRecord) <= (size_t)s.st_size) {
+        CaptureRecord record;
+        memcpy(&record, base + offset, sizeof(record));
+        offset += sizeof(record);
+        if (offset + record.length > (size_t)s.st_size) {
+            fprintf(stderr, "Truncated capture log: %s\n", path);
+            break;
+        }
+
+        if (NRecords == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            Records  = realloc(Records, capacity * sizeof(Record));
+            if (!Records) {
+                fprintf(stderr, "realloc failed: %s\n", strerror(errno));
+                return false;
+            }
+        }
+        Records[NRecords] = (Record){
+            .timestamp  = record.timestamp,
+            .connection = record.connection,
+            .type       = record.type,
+            .order      = NRecords,
+            .data       = base + offset,
+            .length     = record.length,
+        };
+        NRecords++;
+        offset += record.length;
+    }
+
+    /* Group by connection */
+    qsort(Records, NRecords, sizeof(Record), compare_records);
+    Connections = calloc(NRecords ? NRecords : 1, sizeof(Connection));
+    if (!Connections) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        return false;
+    }
+    for (size_t i = 0; i < NRecords; i++) {
+        if (i == 0 || Records[i].connection != Records[i - 1].connection) {
+            Connections[NConnections++] = (Connection){ .first = i, .timestamp = UINT64_MAX };
+        }
+        Connection *c = &Connections[NConnections - 1];
+        c->count++;
+        if (Records[i].type == CAPTURE_REQUEST && Records[i].timestamp < c->timestamp) {
+            c->timestamp = Records[i].timestamp;
+        }
+    }
+    qsort(Connections, NConnections, sizeof(Connection), compare_connections);
+
+    Origin = NConnections ? Connections[0].timestamp : 0;
+    return true;
+}
+
+/**
+ * Connect to server.
+ **/
+int replay_connect(void) {
+    struct addrinfo  hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *results;
+    int status;
+    if ((status = getaddrinfo(ServerHost, ServerPort, &hints, &results)) != 0) {
+        fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(status));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *p = results; p != NULL && fd < 0; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
+            continue;
+        }
+        if (connect(fd, p->ai_addr, p->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Unable to connect to %s:%s: %s\n", ServerHost, ServerPort, strerror(errno));
+    }
+    freeaddrinfo(results);
+    return fd;
+}
+
+/**
+ * Write all bytes to socket.
+ **/
+bool send_all(int fd, const char *data, size_t length) {
+    while (length) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data   += n;
+        length -= n;
+    }
+    return true;
+}
+
+/**
+ * Read more bytes into reader.
+ **/
+bool reader_fill(Reader *r) {
+    if (r->start == r->end) {
+        r->start = r->end = 0;
+    } else if (r->end == sizeof(r->buffer)) {
+        memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+        r->end  -= r->start;
+        r->start = 0;
+    }
+
+    ssize_t n;
+    while ((n = read(r->fd, r->buffer + r->end, sizeof(r->buffer) - r->end)) < 0 && errno == EINTR);
+    if (n <= 0) {
+        return false;
+    }
+    r->end += n;
+    return true;
+}
+
+/**
+ * Read line from reader (without CRLF).
+ **/
+bool reader_line(Reader *r, char *line, size_t size) {
+    while (true) {
+        char *newline = memchr(r->buffer + r->start, '\n', r->end - r->start);
+        if (newline) {
+            size_t length = newline - (r->buffer + r->start);
+            if (length >= size) {
+                return false;
+            }
+            memcpy(line, r->buffer + r->start, length);
+            line[length] = '\0';
+            if (length && line[length - 1] == '\r') {
+                line[length - 1] = '\0';
+            }
+            r->start += length + 1;
+            return true;
+        }
+        if (r->end - r->start == sizeof(r->buffer) || !reader_fill(r)) {
+            return false;
+        }
+    }
+}
+
+/**
+ * Skip bytes from reader (or until end of file if length is SIZE_MAX).
+ **/
+bool reader_skip(Reader *r, size_t length) {
+    while (length) {
+        if (r->start == r->end && !reader_fill(r)) {
+            return length == SIZE_MAX;
+        }
+        size_t n = r->end - r->start;
+        n = n < length ? n : length;
+        r->start += n;
+        if (length != SIZE_MAX) {
+            length -= n;
+        }
+    }
+    return true;
+}
+
+/**
+ * Read complete response.
+ *
+ * @param   r           Reader for connection.
+ * @param   head        Whether request was HEAD (response has no body).
+ * @param   closed      Set if server closes connection after response.
+ * @return  Status code (or 0 on error).
+ **/
+int read_response(Reader *r, bool head, bool *closed) {
+    char line[BUFSIZ];
+    int  status;
+
+    do {
+        bool    chunked = false;
+        ssize_t length  = -1;
+
+        if (!reader_line(r, line, sizeof(line)) || sscanf(line, "HTTP/1.%*d %d", &status) != 1) {
+            return 0;
+        }
+        *closed = strncmp(line, "HTTP/1.0", 8) == 0;
+        while (reader_line(r, line, sizeof(line)) && line[0]) {
+            char *value = strchr(line, ':');
+            if (!value) {
+                continue;
+            }
+            *value++ = '\0';
+            while (*value == ' ') {
+                value++;
+            }
+            if (strcasecmp(line, "Content-Length") == 0) {
+                length = strtol(value, NULL, 10);
+            } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+                chunked = strcasecmp(value, "chunked") == 0;
+            } else if (strcasecmp(line, "Connection") == 0) {
+                *closed = strcasecmp(value, "close") == 0;
+            }
+        }
+
+        /* Skip body */
+        if (head || status == 204 || status == 304 || (status >= 100 && status < 200)) {
+            continue;
+        }
+        if (chunked) {
+            size_t size;
+            do {
+                if (!reader_line(r, line, sizeof(line))) {
+                    return 0;
+                }
+                size = strtoul(line, NULL, 16);
+                if (!reader_skip(r, size)) {
+                    return 0;
+                }
+                if (size && !reader_line(r, line, sizeof(line))) {
+                    return 0;
+                }
+            } while (size);
+            while (reader_line(r, line, sizeof(line)) && line[0]);
+        } else if (length >= 0) {
+            if (!reader_skip(r, length)) {
+                return 0;
+            }
+        } else {
+            reader_skip(r, SIZE_MAX);
+            *closed = true;
+        }
+    } while (status >= 100 && status < 200);
+
+    return status;
+}
+
+/**
+ * Replay requests of one connection in order, writing one result line per
+ * request.
+ **/
+void replay_connection(const Connection *c, int results) {
+    Reader reader = { .fd = -1 };
+    size_t request = 0;
+
+    for (size_t i = c->first; i < c->first + c->count; i++) {
+        const Record *record = &Records[i];
+        if (record->type != CAPTURE_REQUEST) {
+            continue;
+        }
+
+        wait_until(record->timestamp);
+        if (reader.fd < 0) {
+            reader = (Reader){ .fd = replay_connect() };
+        }
+
+        /* Send request head and any body records that follow it */
+        double start  = elapsed_us();
+        bool   ok     = reader.fd >= 0 && send_all(reader.fd, record->data, record->length);
+        for (size_t j = i + 1; ok && j < c->first + c->count && Records[j].type == CAPTURE_BODY; j++) {
+            ok = send_all(reader.fd, Records[j].data, Records[j].length);
+        }
+
+        /* Wait for complete response */
+        bool closed = true;
+        bool head   = record->length >= 5 && strncmp(record->data, "HEAD ", 5) == 0;
+        int  status = ok ? read_response(&reader, head, &closed) : 0;
+        double end  = elapsed_us();
+
+        dprintf(results, "%llu\t%zu\t%.0f\t%.0f\t%d\n", (unsigned long long)record->connection,
+                request++, start, end - start, status);
+
+        /* Reconnect for the next request if the server closed */
+        if ((closed || !status) && reader.fd >= 0) {
+            close(reader.fd);
+            reader.fd = -1;
+        }
+    }
+
+    if (reader.fd >= 0) {
+        close(reader.fd);
+    }
+}
+
+/**
+ * Compare doubles for qsort.
+ **/
+int compare_doubles(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return da < db ? -1 : da > db;
+}
+
+/**
+ * Summarize latencies in results file.
+ *
+ * Each line is: connection, request index, start (us), latency (us), status.
+ **/
+bool summarize(const char *path, Summary *summary) {
+    FILE *stream = fopen(path, "r");
+    if (!stream) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    double *latencies = NULL;
+    size_t  capacity  = 0;
+    double  first     = -1;
+    double  last      = 0;
+    char    line[BUFSIZ];
+
+    memset(summary, 0, sizeof(Summary));
+    while (fgets(line, sizeof(line), stream)) {
+        double start, latency;
+        int    status;
+        if (line[0] == '#' || sscanf(line, "%*u %*u %lf %lf %d", &start, &latency, &status) != 3) {
+            continue;
+        }
+        if (!status || status >= 500) {
+            summary->errors++;
+            continue;
+        }
+        if (summary->count == capacity) {
+            capacity  = capacity ? capacity * 2 : 1024;
+            latencies = realloc(latencies, capacity * sizeof(double));
+            if (!latencies) {
+                fprintf(stderr, "realloc failed: %s\n", strerror(errno));
+                fclose(stream);
+                return false;
+            }
+        }
+        latencies[summary->count++] = latency;
+        summary->mean += latency;
+        first = first < 0 || start < first ? start : first;
+        last  = start + latency > last ? start + latency : last;
+    }
+    fclose(stream);
+
+    if (summary->count) {
+        qsort(latencies, summary->count, sizeof(double), compare_doubles);
+        summary->mean   /= summary->count;
+        summary->p50     = latencies[(summary->count - 1) * 50 / 100];
+        summary->p90     = latencies[(summary->count - 1) * 90 / 100];
+        summary->p99     = latencies[(summary->count - 1) * 99 / 100];
+        summary->max     = latencies[summary->count - 1];
+        summary->elapsed = (last - first) / 1e6;
+    }
+    free(latencies);
+    return true;
+}
+
+/**
+ * Print summary (and change from baseline if there is one).
+ **/
+void report(const char *name, const Summary *s, const Summary *baseline) {
+    const double values[] = { s->mean, s->p50, s->p90, s->p99, s->max };
+    const double bases[]  = { baseline ? baseline->mean : 0, baseline ? baseline->p50 : 0,
+                              baseline ? baseline->p90 : 0, baseline ? baseline->p99 : 0,
+                              baseline ? baseline->max : 0 };
+
+    printf("%-12s %8zu %7zu %9.2f", name, s->count, s->errors,
+           s->elapsed > 0 ? s->count / s->elapsed : 0.0);
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        printf(" %10.0f", values[i]);
+    }
+    printf("\n");
+
+    if (baseline) {
+        printf("%-12s %8s %7s %9s", "change", "", "", "");
+        for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+            printf(" %9.1f%%", bases[i] ? 100 * (values[i] - bases[i]) / bases[i] : 0.0);
+        }
+        printf("\n");
+    }
+}
+
+/**
+ * Print table heading.
+ **/
+void report_heading(void) {
+    printf("%-12s %8s %7s %9s %10s %10s %10s %10s %10s\n", "run", "requests", "errors",
+           "req/s", "mean(us)", "p50(us)", "p90(us)", "p99(us)", "max(us)");
+}
+
+/**
+ * Replay capture log (or compare two results files).
+ **/
+int main(int argc, char *argv[]) {
+    char *progname = argv[0];
+    char *output   = NULL;
+    bool  compare  = false;
+    int   argind   = 1;
+
+    while (argind < argc && argv[argind][0] == '-' && strlen(argv[argind]) > 1) {
+        char *arg = argv[argind++];
+        switch (arg[1]) {
+            case 'h': usage(progname, 0); break;
+            case 'c': compare = true; break;
+            case 'n': MaxChildren = argind < argc ? strtoul(argv[argind++], NULL, 10) : 0; break;
+            case 'o': output = argind < argc ? argv[argind++] : NULL; break;
+            case 's': Speed = argind < argc ? strtod(argv[argind++], NULL) : -1; break;
+            default:  usage(progname, 1); break;
+        }
+    }
+
+    /* Compare two earlier runs */
+    if (compare) {
+        Summary baseline, candidate;
+        if (argc - argind != 2 || !summarize(argv[argind], &baseline) ||
+            !summarize(argv[argind + 1], &candidate)) {
+            usage(progname, 1);
+        }
+        report_heading();
+        report("baseline", &baseline, NULL);
+        report("candidate", &candidate, &baseline);
+        return EXIT_SUCCESS;
+    }
+
+    if (argc - argind != 3 || !MaxChildren || Speed < 0) {
+        usage(progname, 1);
+    }
+    ServerHost = argv[argind];
+    ServerPort = argv[argind + 1];
+    if (!load_capture(argv[argind + 2])) {
+        return EXIT_FAILURE;
+    }
+
+    /* Results are appended by every child, one line per write */
+    char temporary[] = "/tmp/spidey-replay.XXXXXX";
+    int  results     = output ? open(output, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)
+                              : mkstemp(temporary);
+    if (results < 0) {
+        fprintf(stderr, "Unable to open results: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (!output) {
+        fcntl(results, F_SETFL, O_APPEND);
+        output = temporary;
+    }
+    dprintf(results, "# connection\trequest\tstart_us\tlatency_us\tstatus\n");
+
+    /* Start each connection at its captured time, preserving order within
+     * connections by replaying each one sequentially in its own process */
+    signal(SIGPIPE, SIG_IGN);
+    clock_gettime(CLOCK_MONOTONIC, &Start);
+    size_t running = 0;
+    for (size_t i = 0; i < NConnections; i++) {
+        if (Connections[i].timestamp == UINT64_MAX) {
+            continue;
+        }
+        while (running >= MaxChildren && wait(NULL) > 0) {
+            running--;
+        }
+        wait_until(Connections[i].timestamp);
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+            break;
+        } else if (pid == 0) {
+            replay_connection(&Connections[i], results);
+            _exit(EXIT_SUCCESS);
+        }
+        running++;
+    }
+    while (wait(NULL) > 0);
+    close(results);
+
+    /* Report */
+    Summary summary;
+    if (!summarize(output, &summary)) {
+        return EXIT_FAILURE;
+    }
+    printf("Replayed %zu connections at %s speed\n", NConnections, Speed > 0 ? "scaled" : "full");
+    report_heading();
+    report("replay", &summary, NULL);
+    if (output == temporary) {
+        unlink(temporary);
+    }
+    return EXIT_SUCCESS;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -2,73 +2,322 @@
 
 #include "spidey.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+#include "account.h"
+
 int parse_request_method(Request *r);
 int parse_request_headers(Request *r);
+int parse_request_body(Request *r);
+
+
+/* Constants */
+
+#define ACCEPT_BATCH    64              /* Maximum connections accepted per wakeup */
+#define SPLICE_SIZE     (64 * 1024)     /* Maximum body bytes moved per splice */
+#define DRAIN_MAX       (64 * 1024)     /* Largest unread body discarded to reuse connection */
+#define ACCEPT_COST_QUANTA 64           /* Most quanta one connection is expected to cost */
+
+/* Accept Queue */
+
+typedef struct {
+    int                     fd;         /* Client socket file descriptor (-1 once taken) */
+    struct sockaddr_storage addr;       /* Client address */
+    socklen_t               addrlen;    /* Length of client address */
+    uint16_t                port;       /* Local port of listener */
+    bool                    tls;        /* Whether listener speaks TLS */
+    int                     client;     /* Client charged for connection (0 if untracked) */
+    size_t                  flow;       /* Flow of client in queue */
+} Pending;
+
+typedef struct {
+    int                     client;     /* Client of flow (0 if untracked) */
+    uint64_t                cost;       /* Expected busy time of each connection */
+    uint64_t                deficit;    /* Busy time flow may still hand out */
+    size_t                  queued;     /* Connections waiting in flow */
+} Flow;
+
+static Pending  AcceptQueue[ACCEPT_BATCH];
+static size_t   AcceptCount = 0;        /* Connections left in queue */
+static size_t   AcceptTotal = 0;        /* Entries in use (including those taken) */
+static Flow     AcceptFlows[ACCEPT_BATCH];
+static size_t   AcceptFlowCount = 0;
+static size_t   AcceptTurn  = 0;        /* Flow whose turn it is */
+static bool     AcceptTurnFilled = false; /* Whether flow got its quantum this turn */
+static uint32_t Connections = 0;        /* Connections accepted by this process */
+
+/**
+ * Queue connection in the flow of its client.
+ *
+ * Untracked clients each get a flow of their own, and a flow whose
+ * connections have all been handed out may be taken over.  A client's cost
+ * is capped at ACCEPT_COST_QUANTA quanta, so that one turn never waits on
+ * more than that many rounds.
+ **/
+static void accept_flow(Pending *p) {
+    size_t flow  = AcceptFlowCount;
+    size_t empty = AcceptFlowCount;
+    for (size_t i = 0; i < AcceptFlowCount; i++) {
+        if (p->client && AcceptFlows[i].client == p->client) {
+            flow = i;
+            break;
+        }
+        if (!AcceptFlows[i].queued && empty == AcceptFlowCount) {
+            empty = i;
+        }
+    }
+
+    if (flow == AcceptFlowCount) {
+        uint64_t quantum = (uint64_t)ClientQuantum * 1000;
+        uint64_t cost    = client_cost(p->client);
+        flow = empty;
+        AcceptFlows[flow] = (Flow) {
+            .client = p->client,
+            .cost   = cost > quantum * ACCEPT_COST_QUANTA ? quantum * ACCEPT_COST_QUANTA : cost,
+        };
+        if (flow == AcceptFlowCount) {
+            AcceptFlowCount++;
+        }
+    }
+    AcceptFlows[flow].queued++;
+    p->flow = flow;
+}
+
+/**
+ * Move connections left in accept queue to its front (in order).
+ **/
+static void accept_compact(void) {
+    size_t count = 0;
+    for (size_t i = 0; i < AcceptTotal; i++) {
+        if (AcceptQueue[i].fd >= 0) {
+            AcceptQueue[count++] = AcceptQueue[i];
+        }
+    }
+    AcceptTotal = count;
+}
+
+/**
+ * Fill accept queue with all connections waiting on the server sockets.
+ *
+ * @param   listeners   Server sockets (non-blocking).
+ * @param   wait        Whether to wait for a connection (or a control
+ *                      signal) instead of only taking those already waiting.
+ * @return  Number of connections queued (or -1 on error).
+ *
+ * This polls the server sockets and then calls accept4(2) on each readable
+ * one until its backlog is drained or the queue is full.  The first socket
+ * drained rotates between wakeups, so a busy listener cannot starve the
+ * others.  A control signal (see control_fd) ends the wait with nothing
+ * queued.
+ *
+ * Each connection is charged to its client (see client_admit); one over
+ * the client's connection cap is closed at once, which also keeps a client
+ * from filling the listen backlog ahead of everyone else.
+ **/
+static int accept_batch(const Listeners *listeners, bool wait) {
+    static size_t first = 0;
+    struct pollfd pfds[LISTEN_MAX + 1];
+    size_t        count = listeners->count;
+
+    if (!count) {
+        return AcceptCount;
+    }
+    for (size_t i = 0; i < count; i++) {
+        pfds[i] = (struct pollfd){ .fd = listeners->fds[i], .events = POLLIN };
+    }
+    pfds[count] = (struct pollfd){ .fd = control_fd(), .events = POLLIN };
+    while (poll(pfds, wait ? count + 1 : count, wait ? -1 : 0) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    /* Start over once the queue is empty; otherwise make room at its end */
+    if (AcceptCount == 0) {
+        AcceptTotal      = 0;
+        AcceptFlowCount  = 0;
+        AcceptTurn       = 0;
+        AcceptTurnFilled = false;
+    } else if (AcceptTotal == ACCEPT_BATCH) {
+        accept_compact();
+    }
 
+    first = (first + 1) % count;
+    for (size_t n = 0; n < count && AcceptTotal < ACCEPT_BATCH; n++) {
+        size_t         index = (first + n) % count;
+        struct pollfd *pfd   = &pfds[index];
+        if (!(pfd->revents & POLLIN)) {
+            continue;
+        }
+
+        while (AcceptTotal < ACCEPT_BATCH) {
+            Pending *p = &AcceptQueue[AcceptTotal];
+
+            p->addrlen = sizeof(p->addr);
+            p->fd      = accept4(pfd->fd, (struct sockaddr *)&p->addr, &p->addrlen, SOCK_CLOEXEC);
+            if (p->fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    fprintf(stderr, "accept failed: %s\n", strerror(errno));
+                }
+                break;
+            }
+            if ((p->client = client_admit(&p->addr)) < 0) {
+                debug("Refused connection over client's cap of %zu", ClientConnections);
+                close(p->fd);
+                continue;
+            }
+            p->port = listeners->ports[index];
+            p->tls  = listeners->tls[index];
+            socket_client(p->fd);
+            accept_flow(p);
+            AcceptTotal++;
+            AcceptCount++;
+        }
+    }
+
+    return AcceptCount;
+}
+
+/**
+ * Take next connection from accept queue.
+ *
+ * Connections are handed out by deficit round robin across the flows of
+ * their clients: on its turn each flow gets ClientQuantum of busy time and
+ * hands out connections while they fit (each is expected to cost what the
+ * client's connections have cost so far).  So a client with many (or
+ * costly) connections queued cannot push everyone else's behind them;
+ * every other client waits at most about one quantum per client ahead of
+ * it.  Without a quantum, connections are taken in the order they arrived.
+ **/
+static Pending * accept_next(void) {
+    uint64_t quantum = (uint64_t)ClientQuantum * 1000;
+    Pending *p       = AcceptQueue;
+
+    if (!quantum) {
+        while (p->fd < 0) {
+            p++;
+        }
+        AcceptFlows[p->flow].queued--;
+        AcceptCount--;
+        return p;
+    }
+
+    /* Find flow whose deficit covers its next connection */
+    Flow *f;
+    while (true) {
+        f = &AcceptFlows[AcceptTurn];
+        if (f->queued && !AcceptTurnFilled) {
+            f->deficit      += quantum;
+            AcceptTurnFilled = true;
+        }
+        if (f->queued && f->deficit >= f->cost) {
+            break;
+        }
+        AcceptTurn       = (AcceptTurn + 1) % AcceptFlowCount;
+        AcceptTurnFilled = false;
+    }
+
+    /* Hand out its oldest connection (an emptied flow keeps no deficit) */
+    while (p->fd < 0 || p->flow != AcceptTurn) {
+        p++;
+    }
+    f->deficit = --f->queued ? f->deficit - f->cost : 0;
+    AcceptCount--;
+    return p;
+}
+
+/**
+ * Close any connections left in the accept queue.
+ *
+ * Forked children call this so that they do not hold open copies of
+ * connections that the parent will hand to other children (the parent
+ * still holds their clients' charges).
+ **/
+void accept_discard(void) {
+    for (size_t i = 0; i < AcceptTotal; i++) {
+        if (AcceptQueue[i].fd >= 0) {
+            close(AcceptQueue[i].fd);
+            AcceptQueue[i].fd = -1;
+        }
+    }
+    AcceptCount = 0;
+}
 
 /**
- * Accept request from server socket.
+ * Accept request from any server socket.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   listeners   Server sockets.
  * @return  Newly allocated Request structure.
  *
  * This function does the following:
  *
- *  1. Allocates a request struct initialized to 0.
- *  2. Initializes the headers list in the request struct.
- *  3. Accepts a client connection from the server socket.
- *  4. Looks up the client information and stores it in the request struct.
- *  5. Opens the client socket stream for the request struct.
- *  6. Returns the request struct.
+ *  1. Refills the accept queue from the server sockets if it is empty (or
+ *     tops it up with connections already waiting).
+ *  2. Allocates a request struct initialized to 0.
+ *  3. Stores the next queued client socket (see accept_next), raw address,
+ *     and client in the struct.
+ *  4. Prepares a TLS session if the socket came from a TLS listener.
+ *  5. Returns the request struct.
+ *
+ * The client address is only formatted on demand by request_address.
  *
  * The returned request struct must be deallocated using free_request.
  **/
-Request * accept_request(int sfd) {
+Request * accept_request(const Listeners *listeners) {
     Request *r;
-    struct sockaddr raddr;
-    socklen_t rlen = sizeof(struct sockaddr);
+
+    /* Accept clients (while connections are queued, let any that arrived
+     * since join their flows, so they are not served after the whole queue) */
+    if (AcceptCount == 0 ? accept_batch(listeners, true) <= 0 :
+        ClientSlots && ClientQuantum && accept_batch(listeners, false) <= 0) {
+        return NULL;
+    }
+    Pending *p = accept_next();
+    int      fd = p->fd;
+    p->fd = -1;
 
     /* Allocate request struct (zeroed) */
     r = calloc(1, sizeof(Request));
     if (r == NULL)
     {
         fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        client_release(p->client, &p->addr, 0);
+        close(fd);
         goto fail;
     }
-    
-    /* Accept a client */
-    int client_fd;
+    r->fd = fd;
+    r->id = ((uint64_t)getpid() << 32) | ++Connections;
 
-    if ((client_fd = accept(sfd, &raddr, &rlen)) < 0) {
-        fprintf(stderr, "accept failed: %s\n", strerror(errno));
-        goto fail;
-    }
-    r->fd = client_fd;
-
-    /* Lookup client information */
-    int  flags = NI_NUMERICHOST | NI_NUMERICSERV;
-    int  status;
-    if ((status = getnameinfo(&raddr, rlen, r->host, sizeof(r->host), r->port, sizeof(r->port), flags)) != 0) {
-        fprintf(stderr, "Unable to lookup request : %s\n", gai_strerror(status));
-        goto fail;
-    }
+    /* Record client information */
+    memcpy(&r->addr, &p->addr, p->addrlen);
+    r->addrlen = p->addrlen;
+    r->port    = p->port;
+    r->client  = p->client;
 
     r->headers = NULL;
 
-    /* Open socket stream */
-    FILE *client_file = fdopen(client_fd, "w+");
-    if (!client_file) {
-        fprintf(stderr, "fdopen failed: %s\n", strerror(errno));
+    /* Handshake happens later, in the process serving the connection */
+    if (p->tls && !tls_session(r)) {
         goto fail;
     }
-    r->file = client_file;
 
-    log("Accepted request from %s:%s", r->host, r->port);
+#ifndef NDEBUG
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    request_address(r, host, sizeof(host), port, sizeof(port));
+    debug("Accepted request from %s:%s", host, port);
+#endif
     return r;
 
 fail:
@@ -78,34 +327,54 @@ fail:
 }
 
 /**
- * Deallocate request struct.
+ * Format client address of request.
  *
  * @param   r           Request structure.
- *
- * This function does the following:
- *
- *  1. Closes the request socket stream or file descriptor.
- *  2. Frees all allocated strings in request struct.
- *  3. Frees all of the headers (including any allocated fields).
- *  4. Frees request struct.
+ * @param   host        Buffer to store numeric host of client.
+ * @param   hostlen     Size of host buffer.
+ * @param   port        Buffer to store numeric port of client.
+ * @param   portlen     Size of port buffer.
+ * @return  -1 on error and 0 on success.
  **/
-void free_request(Request *r) {
-    if (!r) {
-    	return;
+int request_address(Request *r, char *host, size_t hostlen, char *port, size_t portlen) {
+    int  flags = NI_NUMERICHOST | NI_NUMERICSERV;
+    int  status;
+
+    if ((status = getnameinfo((struct sockaddr *)&r->addr, r->addrlen, host, hostlen, port, portlen, flags)) != 0) {
+        fprintf(stderr, "Unable to lookup request : %s\n", gai_strerror(status));
+        snprintf(host, hostlen, "unknown");
+        snprintf(port, portlen, "0");
+        return -1;
     }
+    return 0;
+}
 
-    /* Close socket or fd */
-    if(r->file){
-        fclose(r->file);
-    } else {
-        close(r->fd);
+/**
+ * Lookup value of request header.
+ *
+ * @param   r           Request structure.
+ * @param   name        Header name (case insensitive).
+ * @return  Header value (or NULL if header was not sent).
+ **/
+const char * request_header(Request *r, const char *name) {
+    for (Header *h = r->headers; h; h = h->next) {
+        if (strcasecmp(h->name, name) == 0) {
+            return h->value;
+        }
     }
+    return NULL;
+}
 
+/**
+ * Free per-request strings and headers, leaving the connection intact.
+ **/
+static void request_clear(Request *r) {
     /* Free allocated strings */
     free(r->method);
     free(r->uri);
     free(r->path);
     free(r->query);
+    r->method = r->uri = r->path = r->query = NULL;
 
     /* Free headers */
     Header * h = r->headers;
@@ -120,10 +389,222 @@ void free_request(Request *r) {
     }
     r->headers = NULL;
 
+    /* Forget body framing (input buffer may hold the next request) */
+    r->body           = REQUEST_BODY_NONE;
+    r->body_remaining = 0;
+    r->continued      = false;
+    r->head           = false;
+
+    /* Charge time spent on request to connection */
+    client_end(r);
+
+    /* Whatever the request allocated is now either freed or leaked */
+    account_end();
+}
+
+/**
+ * Read more input from client socket into request buffer.
+ *
+ * @param   r           Request structure.
+ * @return  Number of bytes read, 0 on end of file, or -1 on error.
+ **/
+static ssize_t request_fill(Request *r) {
+    /* Reclaim consumed space */
+    if (r->input_start == r->input_end) {
+        r->input_start = r->input_end = 0;
+    } else if (r->input_end == sizeof(r->input)) {
+        memmove(r->input, r->input + r->input_start, r->input_end - r->input_start);
+        r->input_end  -= r->input_start;
+        r->input_start = 0;
+    }
+
+    ssize_t nread;
+    do {
+        nread = r->tls ? tls_read(r, r->input + r->input_end, sizeof(r->input) - r->input_end)
+                       : read(r->fd, r->input + r->input_end, sizeof(r->input) - r->input_end);
+    } while (nread < 0 && errno == EINTR);
+
+    if (nread < 0) {
+        fprintf(stderr, "read failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (nread == 0) {
+        r->eof = true;
+    }
+    r->input_end += nread;
+    return nread;
+}
+
+/**
+ * Read one line of input from client.
+ *
+ * @param   r           Request structure.
+ * @param   line        Buffer to store line (including newline).
+ * @param   size        Size of line buffer (at most REQUEST_INPUT_SIZE).
+ * @return  Length of line (or -1 on end of file, error, or if the line is
+ * too long).
+ **/
+static ssize_t request_getline(Request *r, char *line, size_t size) {
+    while (true) {
+        char  *start    = r->input + r->input_start;
+        size_t buffered = r->input_end - r->input_start;
+        char  *newline  = memchr(start, '\n', buffered);
+
+        if (newline) {
+            size_t length = newline - start + 1;
+            if (length >= size) {
+                break;
+            }
+            memcpy(line, start, length);
+            line[length] = '\0';
+            r->input_start += length;
+            capture_bytes(r, line, length);
+            return length;
+        }
+        if (buffered >= size - 1) {
+            break;
+        }
+        if (request_fill(r) <= 0) {
+            return -1;
+        }
+    }
+
+    fprintf(stderr, "request_getline: line too long\n");
+    return -1;
+}
+
+/**
+ * Read next chunk size line (and trailers after the last chunk).
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ **/
+static int request_chunk(Request *r) {
+    char line[BUFSIZ];
+
+    /* Data of previous chunk is followed by CRLF */
+    if (r->body_remaining == 0) {
+        if (request_getline(r, line, sizeof(line)) < 0 || (!streq(line, "\r\n") && !streq(line, "\n"))) {
+            return -1;
+        }
+    }
+
+    /* Chunk size is hexadecimal and may be followed by extensions */
+    if (request_getline(r, line, sizeof(line)) < 0 || !isxdigit((unsigned char)line[0])) {
+        return -1;
+    }
+    errno = 0;
+    char *end;
+    unsigned long long size = strtoull(line, &end, 16);
+    if (errno || size > INT64_MAX) {
+        return -1;
+    }
+
+    /* Last chunk is followed by optional trailers and a blank line */
+    if (size == 0) {
+        do {
+            if (request_getline(r, line, sizeof(line)) < 0) {
+                return -1;
+            }
+        } while (!streq(line, "\r\n") && !streq(line, "\n"));
+        r->body = REQUEST_BODY_NONE;
+    }
+    r->body_remaining = size;
+    return 0;
+}
+
+/**
+ * Consume body bytes that were moved without going through request_read.
+ **/
+static void request_consumed(Request *r, size_t length) {
+    r->body_remaining -= length;
+    if (r->body == REQUEST_BODY_LENGTH && r->body_remaining == 0) {
+        r->body = REQUEST_BODY_NONE;
+    }
+}
+
+/**
+ * Deallocate request struct.
+ *
+ * @param   r           Request structure.
+ *
+ * This function does the following:
+ *
+ *  1. Closes the request socket stream or file descriptor.
+ *  2. Frees all allocated strings in request struct.
+ *  3. Frees all of the headers (including any allocated fields).
+ *  4. Frees request struct.
+ **/
+void free_request(Request *r) {
+    if (!r) {
+    	return;
+    }
+
+    /* Cancel any pending deadline and write out any captured body */
+    timer_cancel(&r->timer);
+    capture_flush();
+
+    /* Close TLS session and socket */
+    tls_close(r);
+    close(r->fd);
+
+    /* Free allocated strings and headers */
+    request_clear(r);
+
+    /* Return connection's charge to its client */
+    client_release(r->client, &r->addr, r->busy);
+
     /* Free request */
     free(r);
     r = NULL;
 }
+
+/**
+ * Prepare request struct for the next request on a persistent connection.
+ *
+ * @param   r           Request structure.
+ * @return  true if the connection persists and another request should be
+ * handled, false if the request struct should be freed.
+ **/
+bool request_reset(Request *r) {
+    char   buffer[BUFSIZ];
+    size_t drained = 0;
+
+    if (!r->keep_alive) {
+        return false;
+    }
+
+    /* Discard small bodies the handler ignored (unless the client is still
+     * waiting for 100 Continue before sending it) */
+    const char *expect = request_header(r, "Expect");
+    if (r->body != REQUEST_BODY_NONE && expect && !r->continued) {
+        return false;
+    }
+    while (r->body != REQUEST_BODY_NONE) {
+        ssize_t nread = request_read(r, buffer, sizeof(buffer));
+        if (nread < 0 || (drained += nread) > DRAIN_MAX) {
+            return false;
+        }
+    }
+
+    request_clear(r);
+    r->keep_alive = false;
+    return true;
+}
+
+/**
+ * Expire connection deadline.
+ *
+ * @param   timer       Timer embedded in Request structure.
+ *
+ * This runs from the timer wheel signal handler, so it only shuts down the
+ * client socket, which causes any blocked read or write on it to fail.
+ **/
+void request_timeout(Timer *timer) {
+    Request *r = timer->arg;
+    shutdown(r->fd, SHUT_RDWR);
+}
+
 /**
  * Parse HTTP Request.
  *
@@ -132,22 +613,53 @@ void free_request(Request *r) {
  *
  * This function first parses the request method, any query, and then the
  * headers, returning 0 on success, and -1 on error.
+ *
+ * The client has IdleTimeout seconds to begin the request and then
+ * ReadTimeout seconds to finish sending the headers.  Any body is left
+ * unread for the handler (see request_read and request_send_body).
+ *
+ * When capturing, the raw request line and headers are logged as one record
+ * stamped when the request line arrived.  On a persistent
+ * connection, IdleTimeout is how long the connection may sit idle between
+ * requests.
  **/
 int parse_request(Request *r) {
     /* Parse HTTP Request Method */
+    account_begin();
+    capture_flush();
+    timer_add(&r->timer, IdleTimeout, request_timeout, r);
     int prm = parse_request_method(r);
     if (prm == -1)
     {
         return -1;
     }
+    capture_stamp(r);
 
     /* Parse HTTP Requet Headers*/
+    timer_add(&r->timer, ReadTimeout, request_timeout, r);
     int prh = parse_request_headers(r); 
     if (prh == -1)
     {
         return -1;
     }
 
+    timer_cancel(&r->timer);
+    capture_flush();
+
+    /* Parse HTTP Request Body framing */
+    if (parse_request_body(r) == -1)
+    {
+        return -1;
+    }
+
+    /* Determine if connection persists after this request */
+    const char *connection = request_header(r, "Connection");
+    if (r->version >= 11) {
+        r->keep_alive = !connection || strcasecmp(connection, "close") != 0;
+    } else {
+        r->keep_alive = connection && strcasecmp(connection, "keep-alive") == 0;
+    }
+    r->keep_alive = r->keep_alive && KeepAlive;
     return 0;
 }
 
@@ -172,41 +684,55 @@ int parse_request_method(Request *r) {
     char buffer[BUFSIZ];
     char *method;
     char *uri;
-    char *query;
-    char *replace;
+    char *query = NULL;
+    char *version;
+    char *end;
+    char *c;
+    ssize_t length;
+    size_t n;
 
     /* Read line from socket */
-    if ((fgets(buffer, BUFSIZ, r->file)) < 0) 
+    if ((length = request_getline(r, buffer, BUFSIZ)) < 0) 
     {
-        fprintf(stderr, "fgets failed: %s\n", strerror(errno));
         goto fail;
     }
+    end = buffer + length;
 
-    /* Parse method and uri */
-    method = strtok(buffer, " ");
-    if (method == NULL)
+    /* Parse method (a token followed by a space) */
+    method = buffer;
+    n = scan_token(method, length);
+    if (n == 0 || method[n] != ' ')
     {
-        fprintf(stderr, "strtok failed: %s\n", strerror(errno));
+        fprintf(stderr, "parse_request_method: invalid method\n");
         goto fail;
     }
+    method[n] = '\0';
 
-    uri = strtok(NULL, " ");
-    debug("uri: %s",uri);
-    if (uri == NULL)
+    /* Parse uri and query from uri */
+    uri = method + n + 1;
+    c = uri + scan_until(uri, end - uri, " ?\r\n");
+    if (c == uri)
     {
-        fprintf(stderr, "strtok failed: %s\n", strerror(errno));
+        fprintf(stderr, "parse_request_method: missing uri\n");
         goto fail;
     }
-    
-    /* Parse query from uri */
-    replace = strchr(uri,'?');
-    query = strchr(uri, '?');
-    if(query){
-        *replace = '\0';
-        query++;
+    if (*c == '?') {
+        *c++ = '\0';
+        query = c;
+        c += scan_until(c, end - c, " \r\n");
     }
+    version = *c == ' ' ? c + 1 : NULL;
+    *c = '\0';
+    debug("uri: %s",uri);
     debug("query: %s:", query);
 
+    /* Parse version (requests without one are HTTP/1.0) */
+    r->version = 10;
+    if (version && strncmp(version, "HTTP/", 5) == 0 && isdigit(version[5]) &&
+        version[6] == '.' && isdigit(version[7])) {
+        r->version = (version[5] - '0') * 10 + (version[7] - '0');
+    }
+
     /* Record method, uri, and query in request struct */
     r->method = strdup(method);
     if (r->method == NULL)
@@ -215,6 +741,7 @@ int parse_request_method(Request *r) {
         free(r->method);
         goto fail;
     }
+    r->head = streq(r->method, "HEAD");
     r->uri = strdup(uri);
     if (r->uri == NULL)
     {
@@ -227,7 +754,6 @@ int parse_request_method(Request *r) {
         if (r->query == NULL)
         {
             fprintf(stderr, "strdup failed: %s\n", strerror(errno));
-            free(r);
             goto fail;
         }
     } else {
@@ -263,6 +789,9 @@ fail:
  *  Accept-Encoding: gzip, deflate
  *  Connection: keep-alive
  *
+ * Names must be tokens and are found, like the end of each value, with the
+ * vectorized scan_token and scan_until kernels.
+ *
  * This function parses the stream from the request socket using the following
  * pseudo-code:
  *
@@ -276,26 +805,50 @@ int parse_request_headers(Request *r) {
     char buffer[BUFSIZ];
     char *name;
     char *value;
+    char *end;
+    ssize_t length;
+    size_t n;
     struct header *header;
 
     /* Parse headers from socket */
-    while ((fgets(buffer, BUFSIZ, r->file)) != NULL && !streq(buffer,"\r\n"))
+    while (true)
     {
+        if ((length = request_getline(r, buffer, BUFSIZ)) < 0) {
+            goto fail;
+        }
+        if (streq(buffer, "\r\n") || streq(buffer, "\n")) {
+            break;
+        }
         debug("buffer: %s",buffer);
+        end = buffer + length;
+
+        /* Parse name (a token followed by a colon) */
         name = buffer;
-        name = skip_whitespace(name);
-        name = strtok(name,":");
-        if(!name){
+        n = scan_token(name, length);
+        if (n == 0 || name[n] != ':') {
+            fprintf(stderr, "parse_request_headers: invalid header name\n");
             goto fail;
         }
+        name[n] = '\0';
         debug("Name: %s",name);
-        value = strtok(NULL,"\r");
-        if(!value){
-            goto fail;
+
+        /* Parse value (without surrounding whitespace) */
+        value = name + n + 1;
+        while (*value == ' ' || *value == '\t') {
+            value++;
         }
-        value = skip_whitespace(value);
+        end = value + scan_until(value, end - value, "\r\n");
+        while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+            end--;
+        }
+        *end = '\0';
         debug("value: %s",value);
+
         header = malloc(sizeof(Header));
+        if (!header) {
+            fprintf(stderr, "malloc failed: %s\n", strerror(errno));
+            goto fail;
+        }
         header->name = strdup(name);        
         header->value = strdup(value);
         header->next = r->headers;
@@ -315,4 +868,207 @@ fail:
     return -1;
 }
 
+/**
+ * Parse HTTP Request Body framing.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * Transfer-Encoding: chunked takes precedence over Content-Length; other
+ * transfer codings cannot be framed and are rejected.
+ **/
+int parse_request_body(Request *r) {
+    const char *encoding = request_header(r, "Transfer-Encoding");
+    const char *length   = request_header(r, "Content-Length");
+
+    if (encoding) {
+        if (strcasecmp(encoding, "chunked") != 0) {
+            fprintf(stderr, "parse_request_body: unsupported Transfer-Encoding: %s\n", encoding);
+            return -1;
+        }
+        r->body           = REQUEST_BODY_CHUNKED;
+        r->body_remaining = -1;
+    } else if (length) {
+        char *end;
+        errno = 0;
+        long long n = strtoll(length, &end, 10);
+        if (errno || end == length || *skip_whitespace(end) || n < 0) {
+            fprintf(stderr, "parse_request_body: invalid Content-Length: %s\n", length);
+            return -1;
+        }
+        r->body           = n ? REQUEST_BODY_LENGTH : REQUEST_BODY_NONE;
+        r->body_remaining = n;
+    }
+    return 0;
+}
+
+/**
+ * Tell client to send body if it is waiting for permission.
+ *
+ * @param   r           Request structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * Clients that send Expect: 100-continue wait for this interim response
+ * before sending the body, so it is only sent once a handler wants the body.
+ **/
+int request_continue(Request *r) {
+    const char *expect = request_header(r, "Expect");
+
+    if (r->continued || r->body == REQUEST_BODY_NONE || r->version < 11 ||
+        !expect || strcasecmp(expect, "100-continue") != 0) {
+        return 0;
+    }
+    r->continued = true;
+    return response_write(r, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+}
+
+/**
+ * Read decoded request body while the read deadline is armed (see
+ * request_read).
+ **/
+static ssize_t request_read_body(Request *r, void *data, size_t length) {
+    if (r->body == REQUEST_BODY_CHUNKED && r->body_remaining <= 0) {
+        if (request_chunk(r) < 0) {
+            fprintf(stderr, "request_read: invalid chunk\n");
+            return -1;
+        }
+        if (r->body == REQUEST_BODY_NONE) {
+            return 0;
+        }
+    }
+
+    /* Serve buffered input first, then read socket directly */
+    size_t  buffered = r->input_end - r->input_start;
+    ssize_t nread    = length < (uint64_t)r->body_remaining ? length : r->body_remaining;
+    if (buffered) {
+        nread = (size_t)nread < buffered ? nread : (ssize_t)buffered;
+        memcpy(data, r->input + r->input_start, nread);
+        r->input_start += nread;
+        capture_bytes(r, data, nread);
+    } else {
+        do {
+            nread = r->tls ? tls_read(r, data, nread) : read(r->fd, data, nread);
+        } while (nread < 0 && errno == EINTR);
+        if (nread <= 0) {
+            fprintf(stderr, "request_read: body truncated: %s\n", nread ? strerror(errno) : "end of file");
+            return -1;
+        }
+        capture_bytes(r, data, nread);
+    }
+
+    request_consumed(r, nread);
+    return nread;
+}
+
+/**
+ * Read decoded request body.
+ *
+ * @param   r           Request structure.
+ * @param   data        Buffer to store body bytes.
+ * @param   length      Size of buffer.
+ * @return  Number of bytes read, 0 at end of body, or -1 on error.
+ *
+ * Chunked bodies are decoded transparently.  The client has ReadTimeout
+ * seconds to make progress on each read (the deadline is cancelled once the
+ * read returns).
+ **/
+ssize_t request_read(Request *r, void *data, size_t length) {
+    if (r->body == REQUEST_BODY_NONE) {
+        return 0;
+    }
+    if (request_continue(r) < 0) {
+        return -1;
+    }
+
+    timer_add(&r->timer, ReadTimeout, request_timeout, r);
+    ssize_t nread = request_read_body(r, data, length);
+    timer_cancel(&r->timer);
+    return nread;
+}
+
+/**
+ * Stream entire request body to file descriptor.
+ *
+ * @param   r           Request structure.
+ * @param   fd          Destination (ie. pipe to CGI script).
+ * @return  -1 on error and 0 on success.
+ *
+ * Once buffered input is exhausted, Content-Length bodies are moved from the
+ * socket to fd with splice(2), so uploads never pass through user space.
+ * Chunked bodies (or destinations splice does not support, or bodies being
+ * captured or decrypted here) are decoded and copied through a small buffer.
+ **/
+int request_send_body(Request *r, int fd) {
+    char buffer[BUFSIZ];
+    bool zerocopy = !capture_enabled() && !r->tls;
+
+    if (request_continue(r) < 0) {
+        return -1;
+    }
+
+    while (r->body != REQUEST_BODY_NONE) {
+        /* Splice straight from socket */
+        if (zerocopy && r->body == REQUEST_BODY_LENGTH && r->input_start == r->input_end) {
+            size_t  length = r->body_remaining < SPLICE_SIZE ? r->body_remaining : SPLICE_SIZE;
+
+            timer_add(&r->timer, ReadTimeout, request_timeout, r);
+            ssize_t nmoved = splice(r->fd, NULL, fd, NULL, length, SPLICE_F_MOVE | SPLICE_F_MORE);
+            timer_cancel(&r->timer);
+            if (nmoved < 0 && errno == EINTR) {
+                continue;
+            }
+            if (nmoved < 0 && errno == EINVAL) {
+                zerocopy = false;
+                continue;
+            }
+            if (nmoved <= 0) {
+                fprintf(stderr, "splice failed: %s\n", nmoved ? strerror(errno) : "end of file");
+                return -1;
+            }
+            request_consumed(r, nmoved);
+            continue;
+        }
+
+        /* Copy decoded bytes */
+        ssize_t nread = request_read(r, buffer, sizeof(buffer));
+        if (nread < 0) {
+            return -1;
+        }
+        for (ssize_t nwritten = 0, n; nwritten < nread; nwritten += n) {
+            n = write(fd, buffer + nwritten, nread - nwritten);
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+            } else if (n < 0) {
+                fprintf(stderr, "write failed: %s\n", strerror(errno));
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Account for body that another process sent with request_send_body.
+ *
+ * @param   r           Request structure.
+ * @return  true if the connection is positioned at the next request, false
+ * if it is not (and so must be closed).
+ *
+ * Content-Length bodies are spliced exactly, so only the part that was
+ * already buffered here needs to be skipped.  Chunked decoding may read
+ * ahead, so the position after a chunked body is unknown.
+ **/
+bool request_skip_body(Request *r) {
+    if (r->body != REQUEST_BODY_LENGTH) {
+        return r->body == REQUEST_BODY_NONE;
+    }
+
+    size_t buffered = r->input_end - r->input_start;
+    size_t skip     = (uint64_t)r->body_remaining < buffered ? (size_t)r->body_remaining : buffered;
+    r->input_start += skip;
+    request_consumed(r, r->body_remaining);
+    return true;
+}
+
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,330 @@
+/* response.c: HTTP Response Functions */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "account.h"
+
+/* Constants */
+
+/**
+ * Preformatted status lines indexed by HTTPStatus.
+ **/
+static const struct iovec StatusLines[] = {
+    [HTTP_STATUS_OK]                    = { "HTTP/1.1 200 OK\r\n", 17 },
+    [HTTP_STATUS_BAD_REQUEST]           = { "HTTP/1.1 400 Bad Request\r\n", 26 },
+    [HTTP_STATUS_NOT_FOUND]             = { "HTTP/1.1 404 Not Found\r\n", 24 },
+    [HTTP_STATUS_INTERNAL_SERVER_ERROR] = { "HTTP/1.1 500 Internal Server Error\r\n", 36 },
+    [HTTP_STATUS_NOT_MODIFIED]          = { "HTTP/1.1 304 Not Modified\r\n", 27 },
+    [HTTP_STATUS_SERVICE_UNAVAILABLE]   = { "HTTP/1.1 503 Service Unavailable\r\n", 34 },
+};
+
+/**
+ * Preformatted header names indexed by ResponseHeader.
+ **/
+static const struct iovec HeaderNames[] = {
+    [RESPONSE_CONTENT_TYPE]     = { "Content-Type: ", 14 },
+    [RESPONSE_CONTENT_LENGTH]   = { "Content-Length: ", 16 },
+    [RESPONSE_CONTENT_ENCODING] = { "Content-Encoding: ", 18 },
+    [RESPONSE_ETAG]             = { "ETag: ", 6 },
+    [RESPONSE_VARY]             = { "Vary: ", 6 },
+};
+
+static const struct iovec ServerHeader    = { "Server: spidey\r\n", 16 };
+static const struct iovec KeepAliveHeader = { "Connection: keep-alive\r\n", 24 };
+static const struct iovec CloseHeader     = { "Connection: close\r\n", 19 };
+static const struct iovec Chunked         = { "Transfer-Encoding: chunked\r\n", 28 };
+static const struct iovec Version         = { "HTTP/1.1 ", 9 };
+static const struct iovec LastChunk       = { "0\r\n\r\n", 5 };
+static const struct iovec CRLF            = { "\r\n", 2 };
+
+/* Global Variables */
+
+static char   DateHeader[64];   /* Cached "Date: ...\r\n" header line */
+static size_t DateLength = 0;
+static time_t DateTime   = 0;   /* Time DateHeader was formatted */
+
+/* Internal Functions */
+
+/**
+ * Return cached Date header, reformatting it if a second has passed.
+ **/
+static struct iovec response_date(void) {
+    time_t now = time(NULL);
+
+    if (now != DateTime) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        DateLength = strftime(DateHeader, sizeof(DateHeader), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        DateTime   = now;
+    }
+    return (struct iovec){ DateHeader, DateLength };
+}
+
+/**
+ * Append segment to response.
+ **/
+static void response_append(Response *resp, const void *data, size_t length) {
+    if (resp->iovcnt >= RESPONSE_IOV_MAX) {
+        fprintf(stderr, "response_append: too many segments\n");
+        return;
+    }
+    resp->iov[resp->iovcnt].iov_base = (void *)data;
+    resp->iov[resp->iovcnt].iov_len  = length;
+    resp->iovcnt++;
+}
+
+/**
+ * Terminate headers if they have not been terminated yet.
+ **/
+static void response_end_headers(Response *resp) {
+    if (!resp->body) {
+        response_append(resp, CRLF.iov_base, CRLF.iov_len);
+        resp->body  = true;
+        resp->start = resp->iovcnt;
+    }
+}
+
+/**
+ * Append standard headers and reserve slot for Connection header.
+ **/
+static void response_standard(Response *resp) {
+    struct iovec date = response_date();
+    response_append(resp, ServerHeader.iov_base, ServerHeader.iov_len);
+    response_append(resp, date.iov_base, date.iov_len);
+    resp->connection = resp->iovcnt;
+    response_append(resp, NULL, 0);
+}
+
+/* Functions */
+
+/**
+ * Initialize response with status line and standard headers.
+ *
+ * @param   resp        Response structure.
+ * @param   status      HTTP status of response.
+ **/
+void response_init(Response *resp, HTTPStatus status) {
+    if (status >= sizeof(StatusLines) / sizeof(StatusLines[0])) {
+        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+    }
+
+    resp->iovcnt  = 0;
+    resp->used    = 0;
+    resp->body    = false;
+    resp->start   = 0;
+    resp->chunked = false;
+
+    response_append(resp, StatusLines[status].iov_base, StatusLines[status].iov_len);
+    response_standard(resp);
+}
+
+/**
+ * Initialize response with arbitrary status and standard headers.
+ *
+ * @param   resp        Response structure.
+ * @param   status      Status code and reason (ie. "302 Found"; must remain
+ *                      valid until response_send).
+ **/
+void response_init_status(Response *resp, const char *status) {
+    resp->iovcnt  = 0;
+    resp->used    = 0;
+    resp->body    = false;
+    resp->start   = 0;
+    resp->chunked = false;
+
+    response_append(resp, Version.iov_base, Version.iov_len);
+    response_append(resp, status, strlen(status));
+    response_append(resp, CRLF.iov_base, CRLF.iov_len);
+    response_standard(resp);
+}
+
+/**
+ * Use chunked transfer encoding for the response body.
+ *
+ * @param   resp        Response structure.
+ *
+ * The body is then sent with response_chunk after response_send.
+ **/
+void response_chunked(Response *resp) {
+    response_append(resp, Chunked.iov_base, Chunked.iov_len);
+    resp->chunked = true;
+}
+
+/**
+ * Add header to response.
+ *
+ * @param   resp        Response structure.
+ * @param   header      Which header to add.
+ * @param   value       Header value (must remain valid until response_send).
+ **/
+void response_header(Response *resp, ResponseHeader header, const char *value) {
+    response_append(resp, HeaderNames[header].iov_base, HeaderNames[header].iov_len);
+    response_append(resp, value, strlen(value));
+    response_append(resp, CRLF.iov_base, CRLF.iov_len);
+}
+
+/**
+ * Add Content-Length header to response.
+ *
+ * @param   resp        Response structure.
+ * @param   length      Length of body in bytes.
+ **/
+void response_length(Response *resp, size_t length) {
+    char *value = resp->scratch + resp->used;
+    int   n     = snprintf(value, sizeof(resp->scratch) - resp->used, "%zu\r\n", length);
+
+    resp->used += n + 1;
+    response_append(resp, HeaderNames[RESPONSE_CONTENT_LENGTH].iov_base, HeaderNames[RESPONSE_CONTENT_LENGTH].iov_len);
+    response_append(resp, value, n);
+}
+
+/**
+ * Add body segment to response.
+ *
+ * @param   resp        Response structure.
+ * @param   data        Body data (must remain valid until response_send).
+ * @param   length      Length of body data.
+ *
+ * The first body segment terminates the headers.
+ **/
+void response_body(Response *resp, const void *data, size_t length) {
+    response_end_headers(resp);
+    if (length) {
+        response_append(resp, data, length);
+    }
+}
+
+/**
+ * Add preformatted header lines to response.
+ *
+ * @param   resp        Response structure.
+ * @param   data        Header lines each terminated by CRLF (must remain valid
+ *                      until response_send).
+ * @param   length      Length of data.
+ **/
+void response_headers(Response *resp, const void *data, size_t length) {
+    if (length) {
+        response_append(resp, data, length);
+    }
+}
+
+/**
+ * Add preformatted segment to response.
+ *
+ * @param   resp        Response structure.
+ * @param   data        Remaining header lines, blank line, and body (must
+ *                      remain valid until response_send).
+ * @param   length      Length of data (only through the blank line for
+ *                      HEAD requests, since all of it is sent).
+ **/
+void response_raw(Response *resp, const void *data, size_t length) {
+    response_append(resp, data, length);
+    resp->body  = true;
+    resp->start = resp->iovcnt;
+}
+
+/**
+ * Send response to client with a single writev(2).
+ *
+ * @param   r           HTTP Request structure.
+ * @param   resp        Response structure.
+ * @return  -1 on error and 0 on success.
+ *
+ * Partial writes are resumed until the whole response is sent, extending the
+ * write deadline each time the client makes progress.  The deadline is
+ * cancelled once the call returns, so it only covers a stalled write.  For HEAD requests only
+ * the status line and headers are sent (so body segments passed to
+ * response_write and response_chunk are dropped).
+ **/
+int response_send(Request *r, Response *resp) {
+    struct iovec *iov    = resp->iov;
+    int           iovcnt = resp->iovcnt;
+
+    /* Tell client whether the connection persists */
+    if (resp->connection) {
+        const struct iovec *connection = r->keep_alive ? &KeepAliveHeader : &CloseHeader;
+        resp->iov[resp->connection] = *connection;
+    }
+
+    response_end_headers(resp);
+    iovcnt = r->head ? resp->start : resp->iovcnt;
+
+    timer_add(&r->timer, WriteTimeout, request_timeout, r);
+    while (iovcnt > 0) {
+        ssize_t nwritten = r->tls ? tls_writev(r, iov, iovcnt) : writev(r->fd, iov, iovcnt);
+        if (nwritten < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "writev failed: %s\n", strerror(errno));
+            timer_cancel(&r->timer);
+            return -1;
+        }
+
+        /* Skip fully written segments and adjust partially written one */
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base  = (char *)iov->iov_base + nwritten;
+            iov->iov_len  -= nwritten;
+        }
+        timer_add(&r->timer, WriteTimeout, request_timeout, r);
+    }
+
+    timer_cancel(&r->timer);
+    return 0;
+}
+
+/**
+ * Write raw data to client.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   data        Data to write.
+ * @param   length      Length of data.
+ * @return  -1 on error and 0 on success.
+ **/
+int response_write(Request *r, const void *data, size_t length) {
+    Response resp = {
+        .iov    = {{ (void *)data, length }},
+        .iovcnt = 1,
+        .body   = true,
+    };
+    return response_send(r, &resp);
+}
+
+/**
+ * Write body data to client as one chunk of a chunked response.
+ *
+ * @param   r           HTTP Request structure.
+ * @param   data        Data to write.
+ * @param   length      Length of data (0 writes the terminating chunk).
+ * @return  -1 on error and 0 on success.
+ **/
+int response_chunk(Request *r, const void *data, size_t length) {
+    char     size[32];
+    Response resp = {
+        .iovcnt = 0,
+        .body   = true,
+    };
+
+    if (length == 0) {
+        response_append(&resp, LastChunk.iov_base, LastChunk.iov_len);
+    } else {
+        response_append(&resp, size, snprintf(size, sizeof(size), "%zx\r\n", length));
+        response_append(&resp, data, length);
+        response_append(&resp, CRLF.iov_base, CRLF.iov_len);
+    }
+    return response_send(r, &resp);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,206 @@
+/* scan.c: Vectorized Delimiter and Token Scanning */
+
+#include "spidey.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86
+#endif
+
+/* Constants */
+
+/**
+ * Token characters (RFC 7230 tchar) as a bitmap indexed by byte value.
+ **/
+static const uint8_t TokenBitmap[32] = {
+    0x00, 0x00, 0x00, 0x00,             /* 0x00 - 0x1f: controls */
+    0xfa, 0x6c, 0xff, 0x03,             /* 0x20 - 0x3f: ! #$%&' *+ -. 0-9 */
+    0xfe, 0xff, 0xff, 0xc7,             /* 0x40 - 0x5f: A-Z ^_ */
+    0xff, 0xff, 0xff, 0x57,             /* 0x60 - 0x7f: ` a-z | ~ */
+};
+
+/* Global Variables */
+
+static size_t (*ScanUntil)(const char *s, size_t n, const char *set);
+static size_t (*ScanToken)(const char *s, size_t n);
+
+/* Scalar Kernels */
+
+static size_t scan_until_scalar(const char *s, size_t n, const char *set) {
+    for (size_t i = 0; i < n; i++) {
+        if (s[i] && strchr(set, s[i])) {
+            return i;
+        }
+    }
+    return n;
+}
+
+static size_t scan_token_scalar(const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint8_t c = s[i];
+        if (!(TokenBitmap[c >> 3] & (1 << (c & 7)))) {
+            return i;
+        }
+    }
+    return n;
+}
+
+#ifdef SCAN_X86
+
+/**
+ * Token characters split by nibble for pshufb lookups: TokenLow[lo] has bit
+ * hi set if the byte (hi << 4 | lo) is a token character.  TokenHigh[hi] is
+ * that bit (0 for bytes >= 0x80, which are never token characters).
+ **/
+static const uint8_t TokenLow[16] = {
+    0xe8, 0xfc, 0xf8, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc,
+    0xf8, 0xf8, 0xf4, 0x54, 0xd0, 0x54, 0xf4, 0x70,
+};
+static const uint8_t TokenHigh[16] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+/* SSE4.2 Kernels: 16 bytes at a time */
+
+__attribute__((target("sse4.2")))
+static size_t scan_until_sse42(const char *s, size_t n, const char *set) {
+    char    padded[SCAN_SET_MAX] = {0};
+    size_t  setlen = strlen(set);
+    size_t  i      = 0;
+
+    memcpy(padded, set, setlen);
+    __m128i needle = _mm_loadu_si128((const __m128i *)padded);
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(s + i));
+        int     index = _mm_cmpestri(needle, setlen, chunk, 16,
+                                     _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16) {
+            return i + index;
+        }
+    }
+    return i + scan_until_scalar(s + i, n - i, set);
+}
+
+__attribute__((target("sse4.2")))
+static size_t scan_token_sse42(const char *s, size_t n) {
+    const __m128i low   = _mm_loadu_si128((const __m128i *)TokenLow);
+    const __m128i high  = _mm_loadu_si128((const __m128i *)TokenHigh);
+    const __m128i mask  = _mm_set1_epi8(0x0f);
+    size_t        i     = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i lo    = _mm_shuffle_epi8(low, _mm_and_si128(chunk, mask));
+        __m128i hi    = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(chunk, 4), mask));
+        __m128i bad   = _mm_cmpeq_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128());
+        int     bits  = _mm_movemask_epi8(bad);
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+    return i + scan_token_scalar(s + i, n - i);
+}
+
+/* AVX2 Kernels: 32 bytes at a time */
+
+__attribute__((target("avx2")))
+static size_t scan_until_avx2(const char *s, size_t n, const char *set) {
+    size_t  setlen = strlen(set);
+    __m256i needles[SCAN_SET_MAX];
+    size_t  i      = 0;
+
+    for (size_t j = 0; j < setlen; j++) {
+        needles[j] = _mm256_set1_epi8(set[j]);
+    }
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i found = _mm256_setzero_si256();
+        for (size_t j = 0; j < setlen; j++) {
+            found = _mm256_or_si256(found, _mm256_cmpeq_epi8(chunk, needles[j]));
+        }
+        unsigned bits = _mm256_movemask_epi8(found);
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+    return i + scan_until_scalar(s + i, n - i, set);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_token_avx2(const char *s, size_t n) {
+    const __m256i low   = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)TokenLow));
+    const __m256i high  = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)TokenHigh));
+    const __m256i mask  = _mm256_set1_epi8(0x0f);
+    size_t        i     = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        __m256i  chunk = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i  lo    = _mm256_shuffle_epi8(low, _mm256_and_si256(chunk, mask));
+        __m256i  hi    = _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), mask));
+        __m256i  bad   = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), _mm256_setzero_si256());
+        unsigned bits  = _mm256_movemask_epi8(bad);
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+    return i + scan_token_scalar(s + i, n - i);
+}
+
+#endif
+
+/* Functions */
+
+/**
+ * Select fastest scanning kernels supported by this CPU.
+ *
+ * Until this is called, the scalar kernels are used.
+ **/
+void scan_init(void) {
+    const char *kernel = "scalar";
+
+    ScanUntil = scan_until_scalar;
+    ScanToken = scan_token_scalar;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ScanUntil = scan_until_avx2;
+        ScanToken = scan_token_avx2;
+        kernel    = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        ScanUntil = scan_until_sse42;
+        ScanToken = scan_token_sse42;
+        kernel    = "sse4.2";
+    }
+#endif
+    debug("Scanning kernels = %s", kernel);
+}
+
+/**
+ * Find first byte that is in set.
+ *
+ * @param   s           Bytes to scan.
+ * @param   n           Number of bytes.
+ * @param   set         Delimiters (at most SCAN_SET_MAX, no NUL).
+ * @return  Index of first delimiter (or n if there is none).
+ **/
+size_t scan_until(const char *s, size_t n, const char *set) {
+    return ScanUntil ? ScanUntil(s, n, set) : scan_until_scalar(s, n, set);
+}
+
+/**
+ * Find length of token (RFC 7230 tchar) prefix.
+ *
+ * @param   s           Bytes to scan.
+ * @param   n           Number of bytes.
+ * @return  Index of first byte that is not a token character (or n).
+ **/
+size_t scan_token(const char *s, size_t n) {
+    return ScanToken ? ScanToken(s, n) : scan_token_scalar(s, n);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
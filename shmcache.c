@@ -0,0 +1,364 @@
+/* shmcache.c: Shared Memory Cache Segment */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define SHM_PROBE           8           /* Slots examined per lookup */
+#define SHM_PATH_MAX        512         /* Longest path that can be shared */
+#define SHM_MIME_MAX        128         /* Longest mimetype that can be shared */
+#define SHM_HEADERS_MAX     512         /* Room reserved for each header block */
+#define SHM_PAGE_SIZE       4096
+
+#define SHM_HAS_BODY        0x1         /* Slot holds response blocks */
+
+#define SHM_SEQ(claim)      ((uint32_t)(claim))
+#define SHM_OWNER(claim)    ((pid_t)((claim) >> 32))
+#define SHM_CLAIM(seq, pid) ((uint64_t)(uint32_t)(pid) << 32 | (uint32_t)(seq))
+
+/* Structures */
+
+typedef struct {
+    uint64_t        claim;              /* Seqlock sequence (odd while written) and its owner */
+    uint32_t        stamp;              /* Clock value of last use */
+    uint64_t        hash;               /* Hash of path (0 if slot is empty) */
+    uint32_t        flags;
+
+    dev_t           dev;                /* Identity of file version */
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtime;
+
+    char            path[SHM_PATH_MAX];
+    char            mimetype[SHM_MIME_MAX];
+
+    uint32_t        hlen;               /* Identity headers and body */
+    uint32_t        blen;
+    uint32_t        gzhlen;             /* Gzip headers and body */
+    uint32_t        gzblen;
+    char            data[];             /* Identity block then gzip block */
+} ShmSlot;
+
+struct shm_cache {
+    uint32_t        clock;              /* Shared use counter */
+    uint32_t        nslots;
+    size_t          slot_size;
+    size_t          capacity;           /* Bytes of data per slot */
+    size_t          length;             /* Size of mapping */
+    char            slots[] __attribute__((aligned(SHM_PAGE_SIZE)));
+};
+
+/* Internal Functions */
+
+/**
+ * Compute FNV-1a hash of string (never 0, which marks empty slots).
+ **/
+static uint64_t shmcache_hash(const char *s) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*s) {
+        hash ^= (unsigned char)*s++;
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+/**
+ * Return slot at index.
+ **/
+static ShmSlot * shmcache_slot(ShmCache *c, uint64_t index) {
+    return (ShmSlot *)(c->slots + (index % c->nslots) * c->slot_size);
+}
+
+/**
+ * Determine if slot describes the specified version of the file.
+ **/
+static bool shmcache_matches(ShmSlot *slot, uint64_t hash, const char *path, const struct stat *s) {
+    return slot->hash == hash && slot->dev == s->st_dev && slot->ino == s->st_ino &&
+           slot->size == s->st_size && slot->mtime.tv_sec == s->st_mtim.tv_sec &&
+           slot->mtime.tv_nsec == s->st_mtim.tv_nsec &&
+           strncmp(slot->path, path, SHM_PATH_MAX) == 0;
+}
+
+/**
+ * Claim slot for writing.
+ *
+ * @return  Odd sequence the slot was claimed with (or 0 if another writer
+ * holds it).
+ *
+ * The sequence and the claiming process change in one atomic swap.  A slot
+ * left odd is only taken over once its owner no longer exists (ie. a stream
+ * process terminated by its connection), so a live writer, however slow,
+ * is never overwritten while it copies.
+ **/
+static uint32_t shmcache_claim(ShmSlot *slot) {
+    uint64_t held = __atomic_load_n(&slot->claim, __ATOMIC_RELAXED);
+    uint32_t seq  = SHM_SEQ(held);
+
+    if (seq & 1 && !(kill(SHM_OWNER(held), 0) < 0 && errno == ESRCH)) {
+        return 0;
+    }
+    seq += seq & 1 ? 2 : 1;
+    if (!__atomic_compare_exchange_n(&slot->claim, &held, SHM_CLAIM(seq, getpid()), false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return seq;
+}
+
+/* Functions */
+
+/**
+ * Create shared memory cache segment.
+ *
+ * @param   bytes       Size of segment.
+ * @param   max_file    Largest file body that can be shared.
+ * @return  Newly mapped cache (or NULL if disabled or on error).
+ *
+ * This must be called before forking so that every child maps the same
+ * segment.  Pages are only allocated as slots are written, so unused
+ * capacity costs nothing.
+ **/
+ShmCache * shmcache_create(size_t bytes, size_t max_file) {
+    if (!bytes) {
+        return NULL;
+    }
+
+    size_t capacity  = 2 * (max_file + SHM_HEADERS_MAX);
+    size_t slot_size = (sizeof(ShmSlot) + capacity + SHM_PAGE_SIZE - 1) & ~(size_t)(SHM_PAGE_SIZE - 1);
+    size_t nslots    = bytes / slot_size;
+    if (!nslots) {
+        fprintf(stderr, "shmcache_create: segment too small\n");
+        return NULL;
+    }
+    size_t length    = sizeof(ShmCache) + nslots * slot_size;
+
+    int fd = memfd_create("spidey-cache", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, length) < 0) {
+        fprintf(stderr, "memfd_create failed: %s\n", strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    ShmCache *c = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (c == MAP_FAILED) {
+        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    c->nslots    = nslots;
+    c->slot_size = slot_size;
+    c->capacity  = capacity;
+    c->length    = length;
+    log("Shared cache: %zu slots of %zu bytes", nslots, slot_size);
+    return c;
+}
+
+/**
+ * Lookup file in shared cache.
+ *
+ * @param   c           Shared cache (may be NULL).
+ * @param   path        Real path of file.
+ * @param   s           Current stat of file.
+ * @param   e           Entry to fill with private copies of the slot contents.
+ * @param   body        Whether the response blocks are required.
+ * @return  true if a consistent copy was made, false otherwise.
+ *
+ * Readers never block: a slot that is being written or that changes while it
+ * is copied is treated as a miss.  On success with body, e->data and
+ * e->gzdata (if there is a gzip variant) are allocated copies of the
+ * response blocks.
+ **/
+bool shmcache_get(ShmCache *c, const char *path, const struct stat *s, ShmEntry *e, bool body) {
+    if (!c) {
+        return false;
+    }
+
+    uint64_t hash = shmcache_hash(path);
+    for (int i = 0; i < SHM_PROBE; i++) {
+        ShmSlot *slot = shmcache_slot(c, hash + i);
+        uint32_t seq  = SHM_SEQ(__atomic_load_n(&slot->claim, __ATOMIC_ACQUIRE));
+
+        if (seq & 1 || !shmcache_matches(slot, hash, path, s)) {
+            continue;
+        }
+        if (body && !(slot->flags & SHM_HAS_BODY)) {
+            return false;
+        }
+
+        /* Copy out slot contents */
+        memcpy(e->mimetype, slot->mimetype, sizeof(e->mimetype));
+        e->mimetype[sizeof(e->mimetype) - 1] = '\0';
+        e->data = e->gzdata = NULL;
+        if (body) {
+            e->hlen   = slot->hlen;
+            e->blen   = slot->blen;
+            e->gzhlen = slot->gzhlen;
+            e->gzblen = slot->gzblen;
+
+            size_t length   = e->hlen + e->blen;
+            size_t gzlength = e->gzhlen + e->gzblen;
+            if (length + gzlength > c->capacity ||
+                !(e->data = malloc(length)) ||
+                (gzlength && !(e->gzdata = malloc(gzlength)))) {
+                free(e->data);
+                e->data = NULL;
+                return false;
+            }
+            memcpy(e->data, slot->data, length);
+            if (gzlength) {
+                memcpy(e->gzdata, slot->data + length, gzlength);
+            }
+        }
+
+        /* Validate that no writer touched the slot while copying */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (SHM_SEQ(__atomic_load_n(&slot->claim, __ATOMIC_RELAXED)) != seq ||
+            !shmcache_matches(slot, hash, path, s)) {
+            free(e->data);
+            free(e->gzdata);
+            e->data = e->gzdata = NULL;
+            return false;
+        }
+
+        __atomic_store_n(&slot->stamp, __atomic_add_fetch(&c->clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Publish file metadata, mimetype, and optionally response blocks.
+ *
+ * @param   c           Shared cache (may be NULL).
+ * @param   path        Real path of file.
+ * @param   s           Stat of file the blocks were built from.
+ * @param   e           Entry to publish (e->data may be NULL for metadata
+ *                      only, e->gzdata may be NULL if there is no gzip
+ *                      variant).
+ *
+ * The slot is chosen from the probe window: the slot already holding the
+ * path, else an empty slot, else the least recently used one.  Writers claim
+ * the slot by making its sequence odd; if another writer holds it, the
+ * publish is simply skipped.  Publishing only metadata keeps the response
+ * blocks already in the slot if they were built from the same version of
+ * the file (ie. by another process since this one missed).
+ **/
+void shmcache_put(ShmCache *c, const char *path, const struct stat *s, const ShmEntry *e) {
+    size_t length   = e->data ? e->hlen + e->blen : 0;
+    size_t gzlength = e->gzdata ? e->gzhlen + e->gzblen : 0;
+
+    if (!c || strlen(path) >= SHM_PATH_MAX || length + gzlength > c->capacity) {
+        return;
+    }
+
+    /* Select victim slot */
+    uint64_t hash   = shmcache_hash(path);
+    ShmSlot *victim = NULL;
+    for (int i = 0; i < SHM_PROBE; i++) {
+        ShmSlot *slot = shmcache_slot(c, hash + i);
+        uint64_t other = __atomic_load_n(&slot->hash, __ATOMIC_RELAXED);
+
+        if (other == hash && strncmp(slot->path, path, SHM_PATH_MAX) == 0) {
+            victim = slot;
+            break;
+        }
+        if (!victim || (victim->hash && (!other || (int32_t)(slot->stamp - victim->stamp) < 0))) {
+            victim = slot;
+        }
+    }
+
+    /* Claim slot */
+    uint32_t seq = shmcache_claim(victim);
+    if (!seq) {
+        return;
+    }
+    bool keep = !e->data && (victim->flags & SHM_HAS_BODY) && shmcache_matches(victim, hash, path, s);
+
+    /* Write slot contents */
+    victim->hash  = hash;
+    victim->dev   = s->st_dev;
+    victim->ino   = s->st_ino;
+    victim->size  = s->st_size;
+    victim->mtime = s->st_mtim;
+    strncpy(victim->path, path, SHM_PATH_MAX);
+    strncpy(victim->mimetype, e->mimetype, SHM_MIME_MAX - 1);
+    victim->mimetype[SHM_MIME_MAX - 1] = '\0';
+    victim->flags = keep ? SHM_HAS_BODY : 0;
+    if (e->data) {
+        victim->hlen   = e->hlen;
+        victim->blen   = e->blen;
+        victim->gzhlen = e->gzdata ? e->gzhlen : 0;
+        victim->gzblen = e->gzdata ? e->gzblen : 0;
+        memcpy(victim->data, e->data, length);
+        if (e->gzdata) {
+            memcpy(victim->data + length, e->gzdata, gzlength);
+        }
+        victim->flags  = SHM_HAS_BODY;
+    }
+    victim->stamp = __atomic_add_fetch(&c->clock, 1, __ATOMIC_RELAXED);
+
+    /* Release slot */
+    __atomic_store_n(&victim->claim, SHM_CLAIM(seq + 1, getpid()), __ATOMIC_RELEASE);
+}
+
+/**
+ * Write paths of files whose response blocks are in shared cache.
+ *
+ * @param   c           Shared cache (may be NULL).
+ * @param   stream      Stream to write one path per line to.
+ * @return  Number of paths written.
+ *
+ * Slots that are being written, or change while their path is copied, are
+ * skipped.
+ **/
+size_t shmcache_snapshot(ShmCache *c, FILE *stream) {
+    char   path[SHM_PATH_MAX];
+    size_t count = 0;
+
+    for (uint32_t i = 0; c && i < c->nslots; i++) {
+        ShmSlot *slot = shmcache_slot(c, i);
+        uint32_t seq  = SHM_SEQ(__atomic_load_n(&slot->claim, __ATOMIC_ACQUIRE));
+
+        if (seq & 1 || !slot->hash || !(slot->flags & SHM_HAS_BODY)) {
+            continue;
+        }
+        memcpy(path, slot->path, sizeof(path));
+        path[sizeof(path) - 1] = '\0';
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (SHM_SEQ(__atomic_load_n(&slot->claim, __ATOMIC_RELAXED)) == seq) {
+            fprintf(stream, "%s\n", path);
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Unmap shared cache segment.
+ *
+ * @param   c           Shared cache (may be NULL).
+ *
+ * Processes that mapped the segment before keep using it; only this
+ * process lets go of it.
+ **/
+void shmcache_destroy(ShmCache *c) {
+    if (c) {
+        munmap(c, c->length);
+    }
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
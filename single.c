@@ -10,17 +10,37 @@
 /**
  * Handle one HTTP request at a time.
  *
- * @param   sfd         Server socket file descriptor.
+ * @param   listeners   Server sockets.
  * @return  Exit status of server (EXIT_SUCCESS).
+ *
+ * Control signals (see control_init) are acted on between connections; once
+ * draining, the connections already accepted are served before returning.
  **/
-int single_server(int sfd) {
+int single_server(Listeners *listeners) {
     Request *request;
+    /* Start connection deadline timers */
+    timers_init();
+
+    /* A persistent connection would block every other client */
+    KeepAlive = false;
+
+    /* Track clients (workers already share a table) */
+    if (!clients_create(ClientSlots)) {
+        return EXIT_FAILURE;
+    }
+
     /* Accept and handle HTTP request */
     while (true) {
+        /* Reload, snapshot, upgrade, or drain */
+        control_apply(listeners);
+
     	/* Accept request */
-        request = accept_request(sfd); 
+        request = accept_request(listeners); 
 	/* Handle request */
         if(!request){
+            if (!listeners->count) {
+                break;
+            }
             continue;
         }
         handle_request(request);
@@ -28,8 +48,8 @@ int single_server(int sfd) {
         free_request(request);
     }
 
-    /* Close server socket */
-    close(sfd);
+    /* Close server sockets */
+    listeners_close(listeners);
     return EXIT_SUCCESS;
 }
 
@@ -9,16 +9,159 @@
 
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+/* Internal Functions */
+
+/**
+ * Set integer socket option, reporting (but otherwise ignoring) failure.
+ *
+ * @return  -1 on error and 0 on success.
+ **/
+static int socket_option(int fd, int level, int option, const char *name, int value) {
+    if (setsockopt(fd, level, option, &value, sizeof(value)) < 0) {
+        fprintf(stderr, "Unable to set %s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
 /**
- * Allocate socket, bind it, and listen to specified port.
+ * Allocate socket and bind it to address.
  *
- * @param   port        Port number to bind to and listen on.
- * @return  Allocated server socket file descriptor.
+ * @param   p           Address to bind.
+ * @param   reuseport   Whether to share the port (SO_REUSEPORT).
+ * @return  Bound socket file descriptor (or -1 on error).
  **/
-int socket_listen(const char *port) {
+static int socket_bind(struct addrinfo *p, bool reuseport) {
+    /* Allocate socket */
+    int socket_fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+    if (socket_fd < 0) {
+        fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Rebind promptly after restart; share port with other worker sockets */
+    socket_option(socket_fd, SOL_SOCKET, SO_REUSEADDR, "SO_REUSEADDR", 1);
+    if (reuseport && socket_option(socket_fd, SOL_SOCKET, SO_REUSEPORT, "SO_REUSEPORT", 1) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+
+    /* Let the IPv4 socket for the same port bind alongside this one */
+    if (p->ai_family == AF_INET6) {
+        socket_option(socket_fd, IPPROTO_IPV6, IPV6_V6ONLY, "IPV6_V6ONLY", 1);
+    }
+
+    /* Bind socket */
+    if (bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0) {
+        fprintf(stderr, "Unable to bind: %s\n", strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+/**
+ * Apply TCP profile to bound socket and listen to it.
+ *
+ * @param   fd          Bound (or already listening) socket.
+ * @return  -1 on error and 0 on success.
+ *
+ * Calling this again on a listening socket (ie. after a reload) applies the
+ * current profile; the backlog is updated by listening again.
+ **/
+static int socket_tune(int fd) {
+    /* Accepted sockets inherit buffer sizes from the listener */
+    if (TCPSendBuffer) {
+        socket_option(fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", TCPSendBuffer);
+    }
+    if (TCPReceiveBuffer) {
+        socket_option(fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", TCPReceiveBuffer);
+    }
+
+    /* Only wake accept once the request has arrived, and let clients send it
+     * in the SYN */
+    socket_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT", TCPDeferAccept);
+    if (TCPFastOpen) {
+        socket_option(fd, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", TCPFastOpen);
+    }
+
+    /* Listen to socket */
+    if (listen(fd, TCPBacklog) < 0) {
+        fprintf(stderr, "Unable to listen: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Split listen address into host and port.
+ *
+ * @param   address     Port, host:port, or [IPv6]:port (modified in place).
+ * @param   host        Pointer to store host (NULL for all interfaces).
+ * @param   port        Pointer to store port.
+ * @return  true if address is well formed.
+ **/
+static bool socket_split(char *address, char **host, char **port) {
+    char *colon;
+
+    if (*address == '[') {
+        char *close = strchr(address, ']');
+        if (!close || close[1] != ':') {
+            return false;
+        }
+        *close = '\0';
+        *host  = address + 1;
+        *port  = close + 2;
+    } else if ((colon = strrchr(address, ':'))) {
+        *colon = '\0';
+        *host  = *address ? address : NULL;
+        *port  = colon + 1;
+    } else {
+        *host  = NULL;
+        *port  = address;
+    }
+    return **port != '\0';
+}
+
+/* Functions */
+
+/**
+ * Allocate sockets, bind them, and listen to specified address.
+ *
+ * @param   address     Port, host:port, or [IPv6]:port to listen on (a bare
+ *                      port means every interface of every family).
+ * @param   reuseport   Whether other sockets may bind the same port (with
+ *                      SO_REUSEPORT) to share incoming connections.
+ * @param   listeners   Listeners to append sockets to.
+ * @return  Number of sockets bound (or -1 on error).
+ *
+ * Every getaddrinfo result is bound, so a bare port listens on IPv4 and
+ * IPv6 at once; IPv6 sockets are marked IPV6_V6ONLY so the two do not
+ * collide.  Sockets handed over by an upgrade (see control_adopt) are used
+ * instead of binding new ones.  The server sockets are non-blocking so that accept_request can
+ * drain the entire backlog each time it wakes up, and are tuned with the
+ * TCP profile (see parse_tcp_profile).
+ **/
+int socket_listen(const char *address, bool reuseport, Listeners *listeners) {
+    char  buffer[NI_MAXHOST + NI_MAXSERV + 4];
+    char *host;
+    char *port;
+
+    /* Split address */
+    if (strlen(address) >= sizeof(buffer)) {
+        fprintf(stderr, "Invalid listen address: %s\n", address);
+        return -1;
+    }
+    strcpy(buffer, address);
+    if (!socket_split(buffer, &host, &port)) {
+        fprintf(stderr, "Invalid listen address: %s\n", address);
+        return -1;
+    }
+
     /* Lookup server address information */
     struct addrinfo  hints = {
         .ai_family   = AF_UNSPEC,   /* Return IPv4 and IPv6 choices */
@@ -27,41 +170,160 @@ int socket_listen(const char *port) {
     };
     struct addrinfo *results;
     int status;
-    if ((status = getaddrinfo(NULL, port, &hints, &results)) != 0) {
+    if ((status = getaddrinfo(host, port, &hints, &results)) != 0) {
         fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(status));
         return -1;
     }
 
-
-    /* For each server entry, allocate socket and try to connect */
-    int socket_fd = -1;
-    for (struct addrinfo *p = results; p != NULL && socket_fd < 0; p = p->ai_next) {
-	/* Allocate socket */
-        if ((socket_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) {
-            fprintf(stderr, "Unable to make socket: %s\n", strerror(errno));
-            continue;
+    /* For each server entry, allocate socket and try to bind */
+    int bound = 0;
+    for (struct addrinfo *p = results; p != NULL; p = p->ai_next) {
+        if (listeners->count >= LISTEN_MAX) {
+            fprintf(stderr, "Too many listen addresses (at most %d)\n", LISTEN_MAX);
+            break;
         }
 
-	/* Bind socket */
-        if (bind(socket_fd, p->ai_addr, p->ai_addrlen) < 0) {
-            fprintf(stderr, "Unable to bind: %s\n", strerror(errno));
-            close(socket_fd);
-            socket_fd = -1;
+	/* Take over socket from the process being upgraded, or make one */
+        int socket_fd = control_adopt(p->ai_addr, p->ai_addrlen, reuseport);
+        if (socket_fd < 0 && (socket_fd = socket_bind(p, reuseport)) < 0) {
             continue;
         }
 
-    	/* Listen to socket */
-        if (listen(socket_fd, SOMAXCONN) < 0) {
-            fprintf(stderr, "Unable to listen: %s\n", strerror(errno));
+    	/* Tune and listen to socket */
+        if (socket_tune(socket_fd) < 0) {
             close(socket_fd);
-            socket_fd = -1;
             continue;
         }
 
+        /* Remember port actually bound (ie. for SERVER_PORT) */
+        struct sockaddr_storage local;
+        socklen_t               locallen = sizeof(local);
+        uint16_t                number   = 0;
+        if (getsockname(socket_fd, (struct sockaddr *)&local, &locallen) == 0) {
+            number = ntohs(local.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&local)->sin6_port
+                                                       : ((struct sockaddr_in *)&local)->sin_port);
+        }
+        listeners->ports[listeners->count] = number;
+        listeners->fds[listeners->count++] = socket_fd;
+        bound++;
     }
 
     freeaddrinfo(results);
-    return socket_fd;
+    if (!bound) {
+        fprintf(stderr, "Unable to listen on %s\n", address);
+        return -1;
+    }
+    return bound;
+}
+
+/**
+ * Listen to every address in list.
+ *
+ * @param   spec        Comma separated list of addresses (see socket_listen).
+ * @param   tls         Whether connections to these addresses speak TLS.
+ * @param   reuseport   Whether sockets may share their ports (SO_REUSEPORT).
+ * @param   listeners   Listeners to add sockets to.
+ * @return  true if every address is being listened to.
+ **/
+static bool listeners_add(const char *spec, bool tls, bool reuseport, Listeners *listeners) {
+    char buffer[BUFSIZ];
+
+    if (strlen(spec) >= sizeof(buffer)) {
+        fprintf(stderr, "Listen address list too long\n");
+        return false;
+    }
+    strcpy(buffer, spec);
+
+    char *next = NULL;
+    for (char *address = strtok_r(buffer, ",", &next); address; address = strtok_r(NULL, ",", &next)) {
+        size_t first = listeners->count;
+        if (socket_listen(address, reuseport, listeners) < 0) {
+            return false;
+        }
+        for (size_t i = first; i < listeners->count; i++) {
+            listeners->tls[i] = tls;
+        }
+    }
+    return true;
+}
+
+/**
+ * Listen to every cleartext and TLS address.
+ *
+ * @param   spec        Comma separated list of addresses (see socket_listen).
+ * @param   secure      Comma separated list of TLS addresses (or NULL).
+ * @param   reuseport   Whether sockets may share their ports (SO_REUSEPORT).
+ * @param   listeners   Listeners to fill.
+ * @return  true if every address is being listened to.
+ *
+ * Sockets are always bound in the same order, so workers that each call
+ * this get matching indices in every reuseport group.
+ **/
+bool listeners_open(const char *spec, const char *secure, bool reuseport, Listeners *listeners) {
+    listeners->count = 0;
+    if (!listeners_add(spec, false, reuseport, listeners) ||
+        (secure && !listeners_add(secure, true, reuseport, listeners))) {
+        listeners_close(listeners);
+        return false;
+    }
+    if (!listeners->count) {
+        fprintf(stderr, "No listen addresses\n");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Apply current TCP profile to every listening socket.
+ *
+ * @param   listeners   Listeners to tune.
+ **/
+void listeners_tune(Listeners *listeners) {
+    for (size_t i = 0; i < listeners->count; i++) {
+        socket_tune(listeners->fds[i]);
+    }
+}
+
+/**
+ * Close every listening socket.
+ *
+ * @param   listeners   Listeners to close.
+ **/
+void listeners_close(Listeners *listeners) {
+    for (size_t i = 0; i < listeners->count; i++) {
+        close(listeners->fds[i]);
+    }
+    listeners->count = 0;
+}
+
+/**
+ * Prepare accepted client socket according to the TCP profile.
+ *
+ * @param   fd          Client socket file descriptor.
+ *
+ * With TCPNoDelay, small writes (ie. the last segment of a response on a
+ * persistent connection) go out at once instead of waiting for an ACK.
+ **/
+void socket_client(int fd) {
+    if (TCPNoDelay) {
+        socket_option(fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+    }
+}
+
+/**
+ * Hold back partial segments while a response is written in several calls.
+ *
+ * @param   fd          Client socket file descriptor.
+ * @param   on          true before the first write, false after the last.
+ *
+ * Corking lets headers and the start of a body (ie. a writev followed by
+ * sendfile) share full segments; uncorking flushes whatever is left
+ * immediately.  This does nothing unless TCPCork is set.
+ **/
+void socket_cork(int fd, bool on) {
+    if (TCPCork) {
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &(int){ on }, sizeof(int));
+    }
 }
 
 /* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
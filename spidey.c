@@ -3,6 +3,8 @@
 #include "spidey.h"
 
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <string.h>
 
@@ -13,6 +15,50 @@ char *Port	      = "9898";
 char *MimeTypesPath   = "/etc/mime.types";
 char *DefaultMimeType = "text/plain";
 char *RootPath	      = "www";
+char *OptionsPath     = NULL;
+char *SnapshotPath    = NULL;
+char *TLSPort         = NULL;
+char *TLSCertPath     = NULL;
+char *TLSKeyPath      = NULL;
+char *HostsPath       = NULL;
+
+size_t CacheMaxBytes  = 32 << 20;
+size_t CacheMaxEntries= 4096;
+size_t CacheMaxFile   = 256 << 10;
+size_t CacheSharedBytes = 64 << 20;
+size_t CacheSharedFile  = 64 << 10;
+char *CachePreloadPath= NULL;
+Bundle *SiteBundle    = NULL;
+
+bool   KeepAlive      = true;
+size_t Workers        = 0;
+char  *WorkerCPUs     = NULL;
+char  *CapturePath    = NULL;
+size_t LaneLimits[LANE_COUNT] = { [LANE_CGI] = 16 };
+size_t LaneQueue      = 64;
+bool   LaneDetach     = false;
+size_t FlightSlots    = 64;
+bool   FlightCGI      = false;
+size_t ClientSlots    = 4096;
+size_t ClientConnections = 0;
+double ClientRate     = 0;
+size_t ClientBurst    = 64;
+size_t ClientQuantum  = 10;
+size_t TCPBacklog     = SOMAXCONN;
+size_t TCPDeferAccept = 5;
+size_t TCPFastOpen    = 256;
+size_t TCPSendBuffer  = 0;
+size_t TCPReceiveBuffer = 0;
+bool   TCPNoDelay     = true;
+bool   TCPCork        = true;
+double ReadTimeout    = 10.0;
+double WriteTimeout   = 30.0;
+double IdleTimeout    = 15.0;
+double CGITimeout     = 30.0;
+
+static ServerMode Mode      = SINGLE;   /* Mode the server was started in */
+static char *RootOption     = NULL;     /* RootPath as given (ie. a symlink) */
+static char *PreloadOption  = NULL;     /* CachePreloadPath as given */
 
 /**
  * Display usage message and exit with specified status code.
@@ -21,17 +67,260 @@ char *RootPath	      = "www";
  * @param   status      Exit status.
  */
 void usage(const char *progname, int status) {
-    fprintf(stderr, "Usage: %s [hcmMpr]\n", progname);
+    fprintf(stderr, "Usage: %s [hacCfFHkKlLmMpPqrsStTw]\n", progname);
     fprintf(stderr, "Options:\n");
     fprintf(stderr, "    -h            Display help message\n");
-    fprintf(stderr, "    -c mode       Single or Forking mode\n");
+    fprintf(stderr, "    -a cpus       Pin workers to CPUs (ie. auto or 0-3,8)\n");
+    fprintf(stderr, "    -c mode       Single, Forking, or Workers mode\n");
+    fprintf(stderr, "    -C limits     Small file cache limits (ie. bytes=32M,entries=4096,file=256K,shared=64M,sharedfile=64K)\n");
+    fprintf(stderr, "    -f path       Options file, read after the command line and again on SIGHUP\n");
+    fprintf(stderr, "    -F flights    Coalesce identical concurrent misses (ie. 64, 0 to disable, or 64,cgi to share CGI output too)\n");
+    fprintf(stderr, "    -H path       Virtual hosts file (ie. example.com,www.example.com root=/srv/example,bytes=8M)\n");
+    fprintf(stderr, "    -k path       TLS certificate chain (PEM, may also hold the key)\n");
+    fprintf(stderr, "    -K path       TLS private key (PEM)\n");
+    fprintf(stderr, "    -l lanes      Concurrent requests per lane (ie. static=0,directory=0,cgi=16,queue=64)\n");
+    fprintf(stderr, "    -L path       Capture raw requests to log (for spidey-replay)\n");
     fprintf(stderr, "    -m path       Path to mimetypes file\n");
     fprintf(stderr, "    -M mimetype   Default mimetype\n");
-    fprintf(stderr, "    -p port       Port to listen on\n");
-    fprintf(stderr, "    -r path       Root directory\n");
+    fprintf(stderr, "    -p addresses  Ports or addresses to listen on (ie. 9898,127.0.0.1:8080,[::1]:8080)\n");
+    fprintf(stderr, "    -P path       Directory to preload into small file cache\n");
+    fprintf(stderr, "    -q limits     Per-client fairness (ie. conns=0,rate=0,burst=64,quantum=10,clients=4096)\n");
+    fprintf(stderr, "    -r path       Root directory (or bundle built by spidey-pack)\n");
+    fprintf(stderr, "    -s addresses  Addresses to listen on with TLS (ie. 8443,[::]:443)\n");
+    fprintf(stderr, "    -S path       Cache index snapshot (saved on SIGUSR1 and SIGUSR2, restored at startup)\n");
+    fprintf(stderr, "    -t timeouts   Timeouts in seconds (ie. read=10,write=30,idle=15,cgi=30)\n");
+    fprintf(stderr, "    -T profile    TCP tuning (ie. backlog=4096,defer=5,fastopen=256,nodelay=1,cork=1,sndbuf=0,rcvbuf=0)\n");
+    fprintf(stderr, "    -w workers    Number of workers (default: one per CPU)\n");
     exit(status);
 }
 
+/**
+ * Parse timeout specification.
+ *
+ * @param   spec        Comma separated list of name=seconds pairs.
+ * @return  true if parsing was successful, false if there was an error.
+ *
+ * Recognized names are read, write, idle, and cgi.  A timeout of 0 disables
+ * the corresponding deadline.
+ */
+bool parse_timeouts(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *value = strchr(pair, '=');
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+
+        char  *end;
+        double seconds = strtod(value, &end);
+        if (*end || seconds < 0) {
+            return false;
+        }
+
+        if (streq(pair, "read")) {
+            ReadTimeout = seconds;
+        } else if (streq(pair, "write")) {
+            WriteTimeout = seconds;
+        } else if (streq(pair, "idle")) {
+            IdleTimeout = seconds;
+        } else if (streq(pair, "cgi")) {
+            CGITimeout = seconds;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Parse request coalescing specification.
+ *
+ * @param   spec        Number of flight slots, optionally followed by ,cgi.
+ * @return  true if parsing was successful, false if there was an error.
+ *
+ * Only file cache fills are coalesced unless cgi is given, since a script's
+ * output may depend on anything in its environment (the default host then
+ * shares it between requests whose CGI variables are all the same; virtual
+ * hosts opt in with coalesce=on).
+ */
+bool parse_flights(char *spec) {
+    char *cgi = strchr(spec, ',');
+    if (cgi) {
+        *cgi++ = '\0';
+        if (!streq(cgi, "cgi")) {
+            return false;
+        }
+    }
+    FlightCGI = cgi != NULL;
+    return parse_size(spec, &FlightSlots);
+}
+
+/**
+ * Parse small file cache limits.
+ *
+ * @param   spec        Comma separated list of name=size pairs.
+ * @return  true if parsing was successful, false if there was an error.
+ *
+ * Recognized names are bytes, entries, file, shared, and sharedfile.  Setting
+ * bytes or entries to 0 disables the cache; setting shared to 0 disables the
+ * shared memory segment used by forking mode.
+ */
+bool parse_cache_limits(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char  *value = strchr(pair, '=');
+        size_t size;
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+
+        if (!parse_size(value, &size)) {
+            return false;
+        }
+
+        if (streq(pair, "bytes")) {
+            CacheMaxBytes = size;
+        } else if (streq(pair, "entries")) {
+            CacheMaxEntries = size;
+        } else if (streq(pair, "file")) {
+            CacheMaxFile = size;
+        } else if (streq(pair, "shared")) {
+            CacheSharedBytes = size;
+        } else if (streq(pair, "sharedfile")) {
+            CacheSharedFile = size;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Parse scheduling lane limits.
+ *
+ * @param   spec        Comma separated list of name=count pairs.
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_lane_limits(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *value = strchr(pair, '=');
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+
+        char  *end;
+        size_t count = strtoul(value, &end, 10);
+        if (*end || !*value) {
+            return false;
+        }
+
+        if (streq(pair, "static")) {
+            LaneLimits[LANE_STATIC] = count;
+        } else if (streq(pair, "directory")) {
+            LaneLimits[LANE_DIRECTORY] = count;
+        } else if (streq(pair, "cgi")) {
+            LaneLimits[LANE_CGI] = count;
+        } else if (streq(pair, "queue")) {
+            LaneQueue = count;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Parse per-client fairness limits.
+ *
+ * @param   spec        Comma separated list of name=value pairs.
+ * @return  true if parsing was successful, false if there was an error.
+ *
+ * Recognized names are conns (open connections per client), rate (requests
+ * per second per client), burst (requests a client may make at once),
+ * quantum (milliseconds of work each client is handed per turn), and
+ * clients (addresses tracked).  Setting conns or rate to 0 lifts that
+ * limit, quantum to 0 hands out connections in the order they arrived, and
+ * clients to 0 disables all of it.
+ *
+ * Neither cap is on by default, since clients behind one address (ie. a
+ * proxy or NAT) would share it; enable them with, ie. -q conns=128,rate=50.
+ **/
+bool parse_client_limits(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char *value = strchr(pair, '=');
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+
+        char  *end;
+        double number = strtod(value, &end);
+        if (*end || !*value || number < 0) {
+            return false;
+        }
+
+        if (streq(pair, "conns")) {
+            ClientConnections = number;
+        } else if (streq(pair, "rate")) {
+            ClientRate = number;
+        } else if (streq(pair, "burst")) {
+            ClientBurst = number;
+        } else if (streq(pair, "quantum")) {
+            ClientQuantum = number;
+        } else if (streq(pair, "clients")) {
+            ClientSlots = number;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Parse TCP tuning profile.
+ *
+ * @param   spec        Comma separated list of name=value pairs.
+ * @return  true if parsing was successful, false if there was an error.
+ *
+ * Recognized names are backlog, defer (seconds), fastopen (queue length),
+ * nodelay and cork (0 or 1), and sndbuf and rcvbuf (sizes).  Setting defer,
+ * fastopen, sndbuf, or rcvbuf to 0 leaves the kernel default in place.
+ **/
+bool parse_tcp_profile(char *spec) {
+    for (char *pair = strtok(spec, ","); pair; pair = strtok(NULL, ",")) {
+        char  *value = strchr(pair, '=');
+        size_t size;
+        if (!value) {
+            return false;
+        }
+        *value++ = '\0';
+
+        if (!parse_size(value, &size) || size > INT_MAX) {
+            return false;
+        }
+
+        if (streq(pair, "backlog")) {
+            TCPBacklog = size;
+        } else if (streq(pair, "defer")) {
+            TCPDeferAccept = size;
+        } else if (streq(pair, "fastopen")) {
+            TCPFastOpen = size;
+        } else if (streq(pair, "nodelay") && size <= 1) {
+            TCPNoDelay = size;
+        } else if (streq(pair, "cork") && size <= 1) {
+            TCPCork = size;
+        } else if (streq(pair, "sndbuf")) {
+            TCPSendBuffer = size;
+        } else if (streq(pair, "rcvbuf")) {
+            TCPReceiveBuffer = size;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
 /**
  * Parse command-line options.
  *
@@ -40,8 +329,10 @@ void usage(const char *progname, int status) {
  * @param   mode        Pointer to ServerMode variable.
  * @return  true if parsing was successful, false if there was an error.
  *
- * This should set the mode, MimeTypesPath, DefaultMimeType, Port, and RootPath
- * if specified.
+ * This should set the mode, MimeTypesPath, DefaultMimeType, Port, RootPath,
+ * HostsPath, timeouts, TCP profile, cache limits, lane limits, client limits,
+ * coalescing slots, and worker placement if specified.  Strings are used in place, so argv must
+ * outlive them.
  */
 bool parse_options(int argc, char *argv[], ServerMode *mode) {
     char *progname = argv[0];
@@ -52,17 +343,53 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
             case 'h':
                 usage(progname,0);
                 break;
+            case 'a':
+                WorkerCPUs = argv[argind++];
+                break;
             case 'c':
                 if(streq(argv[argind],"single")){
                     *mode = SINGLE;
                 } 
                 else if(streq(argv[argind],"forking")){
                     *mode = FORKING;
+                }
+                else if(streq(argv[argind],"workers")){
+                    *mode = WORKERS;
                 } else {
-                    usage(progname,1);
+                    return false;
                 }
                 argind++;
                 break;
+            case 'C':
+                if(argind >= argc || !parse_cache_limits(argv[argind++])){
+                    return false;
+                }
+                break;
+            case 'f':
+                OptionsPath = argv[argind++];
+                break;
+            case 'F':
+                if(argind >= argc || !parse_flights(argv[argind++])){
+                    return false;
+                }
+                break;
+            case 'H':
+                HostsPath = argv[argind++];
+                break;
+            case 'k':
+                TLSCertPath = argv[argind++];
+                break;
+            case 'K':
+                TLSKeyPath = argv[argind++];
+                break;
+            case 'l':
+                if(argind >= argc || !parse_lane_limits(argv[argind++])){
+                    return false;
+                }
+                break;
+            case 'L':
+                CapturePath = argv[argind++];
+                break;
             case 'm':
                 MimeTypesPath = argv[argind++];
                 break;
@@ -72,54 +399,393 @@ bool parse_options(int argc, char *argv[], ServerMode *mode) {
             case 'p':
                 Port = argv[argind++];
                 break;
+            case 'P':
+                CachePreloadPath = argv[argind++];
+                break;
+            case 'q':
+                if(argind >= argc || !parse_client_limits(argv[argind++])){
+                    return false;
+                }
+                break;
             case 'r':
                 RootPath = argv[argind++];
                 break;
+            case 's':
+                TLSPort = argv[argind++];
+                break;
+            case 'S':
+                SnapshotPath = argv[argind++];
+                break;
+            case 't':
+                if(argind >= argc || !parse_timeouts(argv[argind++])){
+                    return false;
+                }
+                break;
+            case 'T':
+                if(argind >= argc || !parse_tcp_profile(argv[argind++])){
+                    return false;
+                }
+                break;
+            case 'w':
+                if(argind >= argc || (Workers = strtoul(argv[argind++], NULL, 10)) == 0){
+                    return false;
+                }
+                break;
             default:
-                usage(progname,1);
+                return false;
                 break;
         }
     }
     return true;
 }
 
+/**
+ * Parse options file.
+ *
+ * @param   path        File of options written as on the command line (one
+ *                      or more per line; # starts a comment).
+ * @param   mode        Pointer to ServerMode variable.
+ * @return  true if parsing was successful, false if there was an error.
+ *
+ * The contents stay allocated, since the globals set from them point into
+ * them.
+ **/
+bool parse_options_file(const char *path, ServerMode *mode) {
+    FILE *fs = fopen(path, "r");
+    if (!fs) {
+        fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char  *contents = NULL;
+    size_t length   = 0;
+    char   line[BUFSIZ];
+    while (fgets(line, sizeof(line), fs)) {
+        line[strcspn(line, "#")] = '\0';
+        size_t n = strlen(line);
+        char  *grown = realloc(contents, length + n + 2);
+        if (!grown) {
+            fprintf(stderr, "realloc failed: %s\n", strerror(errno));
+            free(contents);
+            fclose(fs);
+            return false;
+        }
+        contents = grown;
+        memcpy(contents + length, line, n);
+        length += n;
+        contents[length++] = ' ';
+        contents[length]   = '\0';
+    }
+    fclose(fs);
+
+    char *argv[256] = { (char *)path };
+    int   argc      = 1;
+    for (char *word = contents ? strtok(contents, " \t\r\n") : NULL; word; word = strtok(NULL, " \t\r\n")) {
+        if (argc + 1 >= (int)(sizeof(argv) / sizeof(argv[0]))) {
+            fprintf(stderr, "Too many options in %s\n", path);
+            return false;
+        }
+        argv[argc++] = word;
+    }
+    argv[argc] = NULL;
+    return parse_options(argc, argv, mode);
+}
+
+/* Settings an options file can change (see server_reload) */
+typedef struct {
+    char   *port, *mimetypes, *mimetype, *root, *rootoption, *preload, *preloadoption;
+    char   *options, *snapshot, *cpus, *capture, *tlsport, *tlscert, *tlskey, *hosts;
+    size_t  bytes, entries, file, shared, sharedfile;
+    size_t  workers, queue, flights, lanes[LANE_COUNT];
+    bool    flightcgi;
+    size_t  clients, conns, burst, quantum;
+    double  rate;
+    size_t  backlog, defer, fastopen, sndbuf, rcvbuf;
+    bool    nodelay, cork;
+    double  timeouts[4];
+} Options;
+
+/**
+ * Copy current settings.
+ **/
+static void options_save(Options *o) {
+    *o = (Options) {
+        .port       = Port,         .mimetypes     = MimeTypesPath,   .mimetype = DefaultMimeType,
+        .root       = RootPath,     .rootoption    = RootOption,
+        .preload    = CachePreloadPath, .preloadoption = PreloadOption,
+        .options    = OptionsPath,  .snapshot      = SnapshotPath,
+        .cpus       = WorkerCPUs,   .capture       = CapturePath,
+        .tlsport    = TLSPort,      .tlscert       = TLSCertPath,     .tlskey   = TLSKeyPath,
+        .hosts      = HostsPath,
+        .bytes      = CacheMaxBytes, .entries      = CacheMaxEntries, .file     = CacheMaxFile,
+        .shared     = CacheSharedBytes, .sharedfile = CacheSharedFile,
+        .workers    = Workers,      .queue         = LaneQueue,       .flights  = FlightSlots,
+        .flightcgi  = FlightCGI,
+        .clients    = ClientSlots,  .conns         = ClientConnections, .burst  = ClientBurst,
+        .quantum    = ClientQuantum, .rate         = ClientRate,
+        .backlog    = TCPBacklog,   .defer         = TCPDeferAccept,  .fastopen = TCPFastOpen,
+        .sndbuf     = TCPSendBuffer, .rcvbuf       = TCPReceiveBuffer,
+        .nodelay    = TCPNoDelay,   .cork          = TCPCork,
+        .timeouts   = { ReadTimeout, WriteTimeout, IdleTimeout, CGITimeout },
+    };
+    memcpy(o->lanes, LaneLimits, sizeof(o->lanes));
+}
+
+/**
+ * Put back settings copied by options_save.
+ **/
+static void options_restore(const Options *o) {
+    Port             = o->port;
+    MimeTypesPath    = o->mimetypes;
+    DefaultMimeType  = o->mimetype;
+    RootPath         = o->root;
+    RootOption       = o->rootoption;
+    CachePreloadPath = o->preload;
+    PreloadOption    = o->preloadoption;
+    OptionsPath      = o->options;
+    SnapshotPath     = o->snapshot;
+    WorkerCPUs       = o->cpus;
+    CapturePath      = o->capture;
+    TLSPort          = o->tlsport;
+    TLSCertPath      = o->tlscert;
+    TLSKeyPath       = o->tlskey;
+    HostsPath        = o->hosts;
+    CacheMaxBytes    = o->bytes;
+    CacheMaxEntries  = o->entries;
+    CacheMaxFile     = o->file;
+    CacheSharedBytes = o->shared;
+    CacheSharedFile  = o->sharedfile;
+    Workers          = o->workers;
+    LaneQueue        = o->queue;
+    FlightSlots      = o->flights;
+    FlightCGI        = o->flightcgi;
+    ClientSlots      = o->clients;
+    ClientConnections = o->conns;
+    ClientBurst      = o->burst;
+    ClientQuantum    = o->quantum;
+    ClientRate       = o->rate;
+    TCPBacklog       = o->backlog;
+    TCPDeferAccept   = o->defer;
+    TCPFastOpen      = o->fastopen;
+    TCPSendBuffer    = o->sndbuf;
+    TCPReceiveBuffer = o->rcvbuf;
+    TCPNoDelay       = o->nodelay;
+    TCPCork          = o->cork;
+    ReadTimeout      = o->timeouts[0];
+    WriteTimeout     = o->timeouts[1];
+    IdleTimeout      = o->timeouts[2];
+    CGITimeout       = o->timeouts[3];
+    memcpy(LaneLimits, o->lanes, sizeof(o->lanes));
+}
+
+/**
+ * Compare optional strings.
+ **/
+static bool same_string(const char *a, const char *b) {
+    return a == b || (a && b && streq(a, b));
+}
+
+/**
+ * Resolve RootPath (mapping it if it is a bundle) and CachePreloadPath.
+ *
+ * @return  true on success, false on error (leaving both unchanged).
+ *
+ * The paths as given are remembered, so that resolving again (ie. on
+ * SIGHUP) follows a symlink that now points at a new release.
+ **/
+static bool resolve_paths(void) {
+    static char root[PATH_MAX];
+    static char preload[PATH_MAX];
+    char        rpath[PATH_MAX];
+    char        ppath[PATH_MAX];
+
+    /* Pick up paths set since last time */
+    if (RootPath != root && (!SiteBundle || RootPath != bundle_root(SiteBundle))) {
+        RootOption = RootPath;
+    }
+    if (CachePreloadPath != preload) {
+        PreloadOption = CachePreloadPath;
+    }
+
+    /* Determine real paths */
+    if (!realpath(RootOption, rpath) || (PreloadOption && !realpath(PreloadOption, ppath))) {
+        fprintf(stderr,"realpath failed: %s\n",strerror(errno));
+        return false;
+    }
+
+    /* Map site bundle if RootPath is a file; CGI scripts still run from the
+     * directory the bundle was built from */
+    Bundle     *bundle = NULL;
+    struct stat s;
+    if (stat(rpath, &s) == 0 && S_ISREG(s.st_mode) && !(bundle = bundle_open(rpath))) {
+        return false;
+    }
+
+    bundle_close(SiteBundle);
+    SiteBundle       = bundle;
+    RootPath         = bundle ? (char *)bundle_root(bundle) : strcpy(root, rpath);
+    CachePreloadPath = PreloadOption ? strcpy(preload, ppath) : NULL;
+    return true;
+}
+
+/**
+ * Reload options, root, and caches (on SIGHUP).
+ *
+ * @param   listeners   Server sockets to apply the TCP profile to (NULL in
+ *                      a supervisor, which neither accepts nor caches).
+ * @return  true on success, false if the old settings were kept.
+ *
+ * OptionsPath is read again on top of the current settings, and HostsPath is
+ * read again from scratch.  Options that
+ * shape processes, sockets, or shared segments (-a, -c, -F, -l, -L, -p,
+ * -s, -w, the number of clients tracked, and the shared cache sizes) keep
+ * their values; a binary upgrade
+ * (SIGUSR2) is the way to change those.  Connections being served finish
+ * with the settings they started with.  If either file or a new root is bad,
+ * every setting (and every host) stays as it was.
+ **/
+bool server_reload(Listeners *listeners) {
+    /* Remember every setting, so a failed reload changes nothing */
+    Options saved;
+    options_save(&saved);
+
+    /* Read options file again, load TLS certificate again (ie. renewed),
+     * read hosts file again, then re-resolve root (ie. a symlink switched to
+     * a new release) */
+    ServerMode mode  = Mode;
+    Hosts     *hosts = NULL;
+    if ((OptionsPath && !parse_options_file(OptionsPath, &mode)) ||
+        (listeners && !tls_reload()) || !(hosts = hosts_load(HostsPath)) || !resolve_paths()) {
+        log("Reload failed; keeping RootPath %s", saved.root);
+        hosts_free(hosts);
+        options_restore(&saved);
+        return false;
+    }
+
+    /* Put back what a reload cannot change */
+    if (mode != Mode || !same_string(Port, saved.port) || !same_string(TLSPort, saved.tlsport) ||
+        !same_string(WorkerCPUs, saved.cpus) ||
+        !same_string(CapturePath, saved.capture) || Workers != saved.workers ||
+        FlightSlots != saved.flights || CacheSharedBytes != saved.shared ||
+        CacheSharedFile != saved.sharedfile || LaneQueue != saved.queue ||
+        ClientSlots != saved.clients || memcmp(LaneLimits, saved.lanes, sizeof(saved.lanes)) != 0) {
+        log("Reload kept -a, -c, -F, -l, -L, -p, -s, -w, -q clients, and shared cache sizes (upgrade to change them)");
+    }
+    Port             = saved.port;
+    TLSPort          = saved.tlsport;
+    WorkerCPUs       = saved.cpus;
+    CapturePath      = saved.capture;
+    Workers          = saved.workers;
+    FlightSlots      = saved.flights;
+    ClientSlots      = saved.clients;
+    CacheSharedBytes = saved.shared;
+    CacheSharedFile  = saved.sharedfile;
+    LaneQueue        = saved.queue;
+    memcpy(LaneLimits, saved.lanes, sizeof(saved.lanes));
+    hosts_use(hosts);
+
+    /* Cached responses carry mimetypes and paths from before */
+    if (listeners) {
+        hosts_caches();
+        listeners_tune(listeners);
+    }
+
+    log("Reloaded: RootPath = %s", RootPath);
+    return true;
+}
+
 /**
  * Parses command line options and starts appropriate server
  **/
 int main(int argc, char *argv[]) {
-    ServerMode mode;
+    ServerMode mode = SINGLE;
 
     bool parseResult;
-    /* Parse command line options */
-    parseResult = parse_options(argc, argv, &mode);
+    /* Parse command line options, then options file */
+    parseResult = parse_options(argc, argv, &mode) &&
+                  (!OptionsPath || parse_options_file(OptionsPath, &mode));
     if(!parseResult){
+        usage(argv[0], EXIT_FAILURE);
+    }
+    Mode = mode;
+
+    /* Select request scanning kernels for this CPU */
+    scan_init();
+
+    /* Share accounting totals with every process (ACCOUNTING builds only) */
+    if (!account_create()) {
+        return EXIT_FAILURE;
+    }
+
+    /* Ignore SIGPIPE so that writes to dead clients fail with EPIPE */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Handle reload, upgrade, and drain signals; take over sockets from an
+     * upgraded process */
+    if (!control_init(argv)) {
         return EXIT_FAILURE;
     }
-    /* Listen to server socket */
-    int sfd = socket_listen(Port);
-    if(sfd < 0){
+
+    /* Listen to server sockets */
+    Listeners listeners;
+    if(!listeners_open(Port, TLSPort, mode == WORKERS, &listeners)){
         return EXIT_FAILURE;
     }
-    /* Determine real RootPath */
-    char buffer[BUFSIZ];
-    RootPath = realpath(RootPath,buffer);
-    if(!RootPath){
-        fprintf(stderr,"realpath failed: %s\n",strerror(errno)); 
+
+    /* Load TLS certificate (before workers start, so they share ticket keys) */
+    if (TLSPort && !tls_init()) {
         return EXIT_FAILURE;
     }
 
-    log("Listening on port %s", Port);
+    /* Determine real RootPath and CachePreloadPath */
+    if(!resolve_paths()){
+        return EXIT_FAILURE;
+    }
+
+    /* Load virtual hosts (the default host serves RootPath) */
+    Hosts *hosts = hosts_load(HostsPath);
+    if (!hosts) {
+        return EXIT_FAILURE;
+    }
+    hosts_use(hosts);
+
+    /* Create small file cache of each host and optionally warm them up
+     * (workers build their own after they are placed) */
+    if (mode != WORKERS) {
+        hosts_caches();
+        cache_restore(SnapshotPath);
+    }
+
+    /* Open capture log shared by all processes */
+    if (CapturePath && !capture_open(CapturePath)) {
+        return EXIT_FAILURE;
+    }
+
+    log("Listening on %s%s%s (%zu sockets)", Port, TLSPort ? " and with TLS on " : "", TLSPort ? TLSPort : "", listeners.count);
     debug("RootPath        = %s", RootPath);
+    debug("HostsPath       = %s", HostsPath ? HostsPath : "(none)");
     debug("MimeTypesPath   = %s", MimeTypesPath);
     debug("DefaultMimeType = %s", DefaultMimeType);
-    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : "Forking");
+    debug("ConcurrencyMode = %s", mode == SINGLE ? "Single" : mode == FORKING ? "Forking" : "Workers");
+    debug("TCPProfile      = backlog=%zu defer=%zu fastopen=%zu nodelay=%d cork=%d sndbuf=%zu rcvbuf=%zu",
+          TCPBacklog, TCPDeferAccept, TCPFastOpen, TCPNoDelay, TCPCork, TCPSendBuffer, TCPReceiveBuffer);
+    debug("Timeouts        = read=%.1f write=%.1f idle=%.1f cgi=%.1f",
+          ReadTimeout, WriteTimeout, IdleTimeout, CGITimeout);
+    debug("ClientLimits    = conns=%zu rate=%.1f burst=%zu quantum=%zu clients=%zu",
+          ClientConnections, ClientRate, ClientBurst, ClientQuantum, ClientSlots);
 
-    /* Start either forking or single HTTP server */
+    /* Start single, forking, or workers HTTP server (workers take over
+     * from an upgraded process once their sockets are open) */
+    if (mode != WORKERS) {
+        control_ready();
+    }
     int status;
-    if(mode == 0){
-        status = single_server(sfd);
+    if(mode == SINGLE){
+        status = single_server(&listeners);
+    } else if(mode == FORKING){
+        status = forking_server(&listeners);
     } else {
-        status = forking_server(sfd);
+        status = workers_server(&listeners);
     }
     return status;
 }
@@ -2,10 +2,14 @@
 #define SPIDEY_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /* Constants */
@@ -18,15 +22,47 @@
 typedef enum {
     SINGLE,                             /**< Single connection */
     FORKING,                            /**< Process per connection */
+    WORKERS,                            /**< Pre-forked pool of worker processes */
     UNKNOWN
 } ServerMode;
 
 /* Global Variables */
 
-extern char *Port;                      /**< Port number */
+extern char *Port;                      /**< Addresses to listen on (ie. 9898,[::1]:8080) */
 extern char *MimeTypesPath;             /**< Path to mime.types file */
 extern char *DefaultMimeType;           /**< Default file mimetype */
 extern char *RootPath;                  /**< Path to root directory */
+extern char *OptionsPath;               /**< Options file re-read on SIGHUP (NULL for none) */
+extern char *SnapshotPath;              /**< Cache index snapshot (NULL to disable) */
+extern char *TLSPort;                   /**< Addresses to listen on with TLS (NULL for none) */
+extern char *TLSCertPath;               /**< PEM certificate chain for TLS listeners */
+extern char *TLSKeyPath;                /**< PEM private key (NULL if in certificate file) */
+extern char *HostsPath;                 /**< Virtual hosts file (NULL for none) */
+
+extern size_t CacheMaxBytes;            /**< Budget for small file cache */
+extern size_t CacheMaxEntries;          /**< Maximum number of cached files */
+extern size_t CacheMaxFile;             /**< Largest file size to cache */
+extern size_t CacheSharedBytes;         /**< Size of shared cache segment */
+extern size_t CacheSharedFile;          /**< Largest file body in shared cache */
+extern char *CachePreloadPath;          /**< Directory to preload into cache */
+
+extern bool KeepAlive;                  /**< Allow persistent connections */
+
+extern size_t Workers;                  /**< Number of workers (0 for one per CPU) */
+extern char *WorkerCPUs;                /**< CPUs to pin workers to (NULL to not pin) */
+
+extern size_t TCPBacklog;               /**< Length of each listen queue */
+extern size_t TCPDeferAccept;           /**< Seconds accept waits for data (0 to disable) */
+extern size_t TCPFastOpen;              /**< Pending TCP Fast Open requests (0 to disable) */
+extern size_t TCPSendBuffer;            /**< SO_SNDBUF of connections (0 for kernel autotuning) */
+extern size_t TCPReceiveBuffer;         /**< SO_RCVBUF of connections (0 for kernel autotuning) */
+extern bool TCPNoDelay;                 /**< Disable Nagle on connections */
+extern bool TCPCork;                    /**< Cork responses written in several calls */
+
+extern double ReadTimeout;              /**< Seconds allowed to read request headers */
+extern double WriteTimeout;             /**< Seconds allowed between response writes */
+extern double IdleTimeout;              /**< Seconds allowed before request begins */
+extern double CGITimeout;               /**< Seconds allowed for CGI script to run */
 
 /* Logging Macros */
 
@@ -39,6 +75,34 @@ extern char *RootPath;                  /**< Path to root directory */
 #define fatal(M, ...)   fprintf(stderr, "[%5d] FATAL %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE)
 #define log(M, ...)     fprintf(stderr, "[%5d] LOG   %10s:%-4d " M "\n", getpid(), __FILE__, __LINE__, ##__VA_ARGS__)
 
+/* Timers */
+
+typedef struct timer Timer;
+typedef void (*TimerCallback)(Timer *timer);
+
+struct timer {
+    Timer          *next;               /*< Next timer in wheel slot */
+    Timer          *prev;               /*< Previous timer in wheel slot */
+    unsigned long   expires;            /*< Expiration time in ticks */
+    TimerCallback   callback;           /*< Function called on expiration */
+    void           *arg;                /*< Argument for callback */
+};
+
+void            timers_init(void);
+void            timer_add(Timer *timer, double seconds, TimerCallback callback, void *arg);
+void            timer_cancel(Timer *timer);
+
+/* Listening Sockets */
+
+#define LISTEN_MAX      16              /* Most sockets listened to at once */
+
+typedef struct {
+    int     fds[LISTEN_MAX];            /*< Listening sockets (non-blocking) */
+    uint16_t ports[LISTEN_MAX];         /*< Local port of each socket */
+    bool    tls[LISTEN_MAX];            /*< Whether each socket speaks TLS */
+    size_t  count;                      /*< Number of listening sockets */
+} Listeners;
+
 /* HTTP Request */
 
 typedef struct header Header;
@@ -48,23 +112,64 @@ struct header {
     Header  *next;                      /*< Next header entry */
 };
 
+#define REQUEST_INPUT_SIZE  BUFSIZ         /* Bytes buffered from client socket */
+
+typedef enum {
+    REQUEST_BODY_NONE = 0,              /* No body (or body fully read) */
+    REQUEST_BODY_LENGTH,                /* Body framed by Content-Length */
+    REQUEST_BODY_CHUNKED,               /* Body framed by chunked encoding */
+} RequestBody;
+
+typedef struct host Host;
+
 typedef struct {
     int     fd;                         /*< Client socket file descripter */
-    FILE    *file;                      /*< Client socket file stream */
+    uint64_t id;                        /*< Connection id (unique across processes) */
+    char    input[REQUEST_INPUT_SIZE];  /*< Bytes read from client socket */
+    size_t  input_start;                /*< Offset of first unconsumed input byte */
+    size_t  input_end;                  /*< Offset past last input byte */
+    bool    eof;                        /*< Whether client closed its end */
     char    *method;                    /*< HTTP method */
     char    *uri;                       /*< HTTP uniform resource identifier */
-    char    *path;                      /*< Real path corrsponding to URI and RootPath */
+    char    *path;                      /*< Real path corrsponding to URI and host root */
     char    *query;                     /*< HTTP query string */
 
-    char host[NI_MAXHOST];              /*< Host name of client */
-    char port[NI_MAXSERV];              /*< Port number of client */
+    struct sockaddr_storage addr;       /*< Address of client */
+    socklen_t addrlen;                  /*< Length of client address */
+    uint16_t port;                      /*< Local port connection arrived on */
+    bool    secure;                     /*< Whether connection arrived over TLS */
+    struct ssl_st *tls;                 /*< TLS session (NULL if cleartext or relayed) */
 
     Header  *headers;                   /*< List of name, value Header pairs */
+    Host    *host;                      /*< Virtual host named by Host header */
+
+    int     version;                    /*< HTTP version (ie. 11 for HTTP/1.1) */
+    bool    keep_alive;                 /*< Whether connection persists after response */
+    bool    head;                       /*< Whether response is sent without body (HEAD) */
+
+    RequestBody body;                   /*< How request body is framed */
+    int64_t body_remaining;             /*< Body bytes left (in current chunk) */
+    bool    continued;                  /*< Whether 100 Continue was sent */
+
+    Timer   timer;                      /*< Connection deadline timer */
+
+    int     client;                     /*< Client slot plus one (0 if untracked) */
+    uint64_t started;                   /*< When current request began (0 if none) */
+    uint64_t busy;                      /*< Microseconds spent handling requests */
 } Request;
 
-Request *       accept_request(int sfd);
+Request *       accept_request(const Listeners *listeners);
+void            accept_discard(void);
+const char *    request_header(Request *request, const char *name);
+int             request_address(Request *request, char *host, size_t hostlen, char *port, size_t portlen);
 void	        free_request(Request *request);
+bool            request_reset(Request *request);
 int	        parse_request(Request *request);
+void            request_timeout(Timer *timer);
+int             request_continue(Request *request);
+ssize_t         request_read(Request *request, void *data, size_t length);
+int             request_send_body(Request *request, int fd);
+bool            request_skip_body(Request *request);
 
 /* HTTP Request Handlers */
 
@@ -73,26 +178,375 @@ typedef enum {
     HTTP_STATUS_BAD_REQUEST,		/* 400 Bad Request */
     HTTP_STATUS_NOT_FOUND,		/* 404 Not Found */
     HTTP_STATUS_INTERNAL_SERVER_ERROR,	/* 500 Internal Server Error */
+    HTTP_STATUS_NOT_MODIFIED,		/* 304 Not Modified */
+    HTTP_STATUS_SERVICE_UNAVAILABLE,	/* 503 Service Unavailable */
 } HTTPStatus;
 
 HTTPStatus      handle_request(Request *request);
 
+/* HTTP Responses */
+
+#define RESPONSE_IOV_MAX    32
+
+typedef enum {
+    RESPONSE_CONTENT_TYPE = 0,          /* Content-Type */
+    RESPONSE_CONTENT_LENGTH,            /* Content-Length */
+    RESPONSE_CONTENT_ENCODING,          /* Content-Encoding */
+    RESPONSE_ETAG,                      /* ETag */
+    RESPONSE_VARY,                      /* Vary */
+} ResponseHeader;
+
+typedef struct {
+    struct iovec iov[RESPONSE_IOV_MAX]; /*< Status line, header, and body segments */
+    int     iovcnt;                     /*< Number of segments in use */
+    bool    body;                       /*< Whether headers have been terminated */
+    int     start;                      /*< Segments before body (all that HEAD sends) */
+    bool    chunked;                    /*< Whether body uses chunked encoding */
+    int     connection;                 /*< Index of Connection header slot (0 if none) */
+    char    scratch[64];                /*< Storage for formatted header values */
+    size_t  used;                       /*< Bytes of scratch in use */
+} Response;
+
+void            response_init(Response *resp, HTTPStatus status);
+void            response_init_status(Response *resp, const char *status);
+void            response_chunked(Response *resp);
+void            response_headers(Response *resp, const void *data, size_t length);
+void            response_header(Response *resp, ResponseHeader header, const char *value);
+void            response_length(Response *resp, size_t length);
+void            response_body(Response *resp, const void *data, size_t length);
+void            response_raw(Response *resp, const void *data, size_t length);
+int             response_send(Request *request, Response *resp);
+int             response_write(Request *request, const void *data, size_t length);
+int             response_chunk(Request *request, const void *data, size_t length);
+
+/* Small File Cache */
+
+typedef struct cache Cache;
+typedef struct cache_entry CacheEntry;
+
+Cache *         cache_create(size_t max_bytes, size_t max_entries, size_t max_file);
+CacheEntry *    cache_lookup(Host *host, const char *path, const struct stat *s);
+CacheEntry *    cache_fill(Host *host, const char *path, const struct stat *s);
+int             cache_send(Request *request, CacheEntry *e, bool gzip);
+void            cache_preload(Host *host, const char *root);
+void            cache_destroy(Cache *c);
+bool            cache_snapshot(const char *path);
+void            cache_restore(const char *path);
+char *          cache_mimetype(Host *host, const char *path, const struct stat *s);
+
+/* Shared Memory Cache */
+
+typedef struct shm_cache ShmCache;
+
+typedef struct {
+    char    mimetype[128];              /*< Mimetype of file */
+    char   *data;                       /*< Identity headers and body */
+    size_t  hlen;
+    size_t  blen;
+    char   *gzdata;                     /*< Gzip headers and body */
+    size_t  gzhlen;
+    size_t  gzblen;
+} ShmEntry;
+
+ShmCache *      shmcache_create(size_t bytes, size_t max_file);
+bool            shmcache_get(ShmCache *c, const char *path, const struct stat *s, ShmEntry *e, bool body);
+void            shmcache_put(ShmCache *c, const char *path, const struct stat *s, const ShmEntry *e);
+size_t          shmcache_snapshot(ShmCache *c, FILE *stream);
+void            shmcache_destroy(ShmCache *c);
+
+/* Site Bundles */
+
+#define BUNDLE_MAGIC        0x314b5053  /* "SPK1" */
+#define BUNDLE_ALIGN        4096        /* Alignment of bodies in bundle */
+
+#define BUNDLE_DIRECTORY    0x1         /* Body is a prebuilt listing */
+#define BUNDLE_CGI          0x2         /* Script that runs from disk */
+
+typedef struct {
+    uint32_t    magic;                  /*< BUNDLE_MAGIC */
+    uint32_t    count;                  /*< Number of index entries */
+    uint64_t    index;                  /*< Offset of sorted BundleEntry array */
+    uint64_t    strings;                /*< Offset of string table */
+    uint32_t    root;                   /*< Source document root (string) */
+    uint32_t    reserved;
+} BundleHeader;
+
+typedef struct {
+    uint32_t    path;                   /*< URI path, ie. /text/lyrics.txt (string) */
+    uint32_t    mimetype;               /*< Content-Type (string) */
+    uint32_t    etag;                   /*< Quoted ETag (string) */
+    uint32_t    flags;                  /*< BUNDLE_DIRECTORY, BUNDLE_CGI */
+    uint64_t    body;                   /*< Offset of identity body */
+    uint64_t    length;
+    uint64_t    gzbody;                 /*< Offset of gzip body (0 if none) */
+    uint64_t    gzlength;
+} BundleEntry;
+
+typedef struct bundle Bundle;
+
+extern Bundle *SiteBundle;              /**< Bundle used instead of RootPath */
+
+Bundle *        bundle_open(const char *path);
+void            bundle_close(Bundle *b);
+const char *    bundle_root(Bundle *b);
+const BundleEntry * bundle_lookup(Bundle *b, const char *uri);
+int             bundle_send(Request *request, Bundle *b, const BundleEntry *e);
+
+/* Virtual Hosts */
+
+typedef struct hosts Hosts;
+
+struct host {
+    char       *names;                  /*< Names as listed (ie. example.com,www.example.com) */
+    char       *root;                   /*< Real path of document root (or bundle source) */
+    Bundle     *bundle;                 /*< Bundle served instead of root (NULL for none) */
+    char       *mimetypes;              /*< Path to mime.types file */
+    char       *mimetype;               /*< Default mimetype */
+    bool        cgi;                    /*< Whether executables run as CGI scripts */
+    double      cgi_timeout;            /*< Seconds allowed for CGI script to run */
+    bool        cgi_coalesce;           /*< Whether identical CGI requests share output */
+    size_t      cache_bytes;            /*< Budget for small file cache */
+    size_t      cache_entries;          /*< Maximum number of cached files */
+    size_t      shared_bytes;           /*< Size of shared cache segment */
+    Cache      *cache;                  /*< Small file cache (NULL if disabled) */
+    ShmCache   *shared;                 /*< Shared cache segment (forking mode only) */
+};
+
+Hosts *         hosts_load(const char *path);
+void            hosts_use(Hosts *hosts);
+void            hosts_free(Hosts *hosts);
+void            hosts_caches(void);
+void            hosts_share(void);
+Host *          host_lookup(const char *name);
+Host *          host_at(size_t index);
+Host *          host_owning(const char *path);
+
+/* Scheduling Lanes */
+
+typedef enum {
+    LANE_NONE = -1,                     /* No slot was taken */
+    LANE_STATIC = 0,                    /* Regular files */
+    LANE_DIRECTORY,                     /* Directory listings */
+    LANE_CGI,                           /* CGI scripts */
+    LANE_COUNT
+} Lane;
+
+extern size_t LaneLimits[LANE_COUNT];   /**< Concurrent requests per lane (0 for unlimited) */
+extern size_t LaneQueue;                /**< Requests that may wait for each lane */
+extern bool LaneDetach;                 /**< Run CGI requests apart from the worker */
+
+bool            lanes_create(void);
+Lane            lane_enter(Lane lane, bool wait);
+void            lane_leave(Lane lane);
+void            lane_abandon(void);
+
+/* Client Fairness */
+
+extern size_t ClientSlots;              /**< Client addresses tracked (0 to disable) */
+extern size_t ClientConnections;        /**< Open connections per client (0 for unlimited) */
+extern double ClientRate;               /**< Requests per second per client (0 for unlimited) */
+extern size_t ClientBurst;              /**< Requests a client may make at once */
+extern size_t ClientQuantum;            /**< Milliseconds of work per client turn (0 for arrival order) */
+
+bool            clients_create(size_t slots);
+int             client_admit(const struct sockaddr_storage *addr);
+void            client_release(int client, const struct sockaddr_storage *addr, uint64_t busy);
+uint64_t        client_cost(int client);
+bool            client_begin(Request *request);
+void            client_end(Request *request);
+void            client_detach(Request *request);
+
+/* Request Coalescing */
+
+#define FLIGHT_RESULT_MAX   (1 << 20)   /* Smallest result each slot can share */
+
+typedef enum {
+    FLIGHT_SOLO = 0,                    /* Work is done alone */
+    FLIGHT_LEADER,                      /* Work is done and shared */
+    FLIGHT_WAITER,                      /* Work is done by another process */
+} FlightRole;
+
+typedef struct {
+    FlightRole  role;                   /*< Part played in flight */
+    void       *slot;                   /*< Shared slot (NULL if solo) */
+    size_t      length;                 /*< Bytes appended by leader */
+    bool        overflow;               /*< Whether result outgrew slot */
+} Flight;
+
+extern size_t FlightSlots;              /**< Keys that can be in flight (0 to disable) */
+extern bool   FlightCGI;                /**< Whether default host shares CGI output */
+
+bool            flights_create(size_t slots);
+FlightRole      flight_begin(Flight *flight, const char *key);
+void            flight_append(Flight *flight, const void *data, size_t length);
+const void *    flight_wait(Flight *flight, size_t *length);
+void            flight_end(Flight *flight, bool ok);
+
+/* HPACK */
+
+typedef struct hpack_entry HpackEntry;
+
+typedef struct {
+    HpackEntry *entries;                /*< Ring of dynamic table entries */
+    size_t      capacity;               /*< Slots in ring */
+    size_t      count;                  /*< Entries in dynamic table */
+    size_t      head;                   /*< Slot of newest entry */
+    size_t      size;                   /*< Size of dynamic table */
+    size_t      max_size;               /*< Size set by peer's last update */
+    size_t      limit;                  /*< Largest size peer may set */
+} Hpack;
+
+typedef void (*HpackEmit)(void *arg, const char *name, const char *value);
+
+void            hpack_init(Hpack *hpack, size_t max_size);
+void            hpack_free(Hpack *hpack);
+int             hpack_decode(Hpack *hpack, const uint8_t *block, size_t length, HpackEmit emit, void *arg);
+size_t          hpack_encode(uint8_t *out, size_t size, const char *name, const char *value);
+
+/* Allocation and System Call Accounting */
+
+typedef enum {
+    ACCOUNT_OTHER = 0,                  /* Closed or malformed before dispatch */
+    ACCOUNT_FILE,
+    ACCOUNT_DIRECTORY,
+    ACCOUNT_CGI,
+    ACCOUNT_BUNDLE,
+    ACCOUNT_HTTP2,
+    ACCOUNT_ERROR,
+    ACCOUNT_TYPES,
+} AccountType;
+
+#ifdef ACCOUNTING
+#define ACCOUNT_INTERVAL    10          /* Seconds between dumps */
+
+typedef struct {
+    const char *file;                   /*< Source file of call site */
+    int         line;                   /*< Source line of call site */
+    const char *call;                   /*< Function called (ie. malloc) */
+    bool        keep;                   /*< Whether allocations outlive requests */
+    int         index;                  /*< Shared slot plus one (0 if unknown) */
+} AccountSite;
+
+bool            account_create(void);
+void            account_begin(void);
+void            account_type(AccountType type);
+void            account_end(void);
+
+void            account_syscall(AccountSite *site);
+pid_t           account_fork(AccountSite *site);
+void *          account_malloc(AccountSite *site, size_t size);
+void *          account_calloc(AccountSite *site, size_t count, size_t size);
+void *          account_realloc(AccountSite *site, void *ptr, size_t size);
+char *          account_strdup(AccountSite *site, const char *s);
+char *          account_strndup(AccountSite *site, const char *s, size_t n);
+char *          account_realpath(AccountSite *site, const char *path, char *resolved);
+void            account_free(void *ptr);
+FILE *          account_fopen(AccountSite *site, const char *path, const char *mode);
+int             account_fclose(AccountSite *site, FILE *stream);
+#else
+#define account_create()    true
+#define account_begin()
+#define account_type(type)
+#define account_end()
+#endif
+
+/* HTTP/2 */
+
+bool            http2_requested(Request *request);
+HTTPStatus      http2_serve(Request *request);
+
+/* TLS */
+
+bool            tls_init(void);
+bool            tls_reload(void);
+bool            tls_session(Request *request);
+bool            tls_handshake(Request *request);
+ssize_t         tls_read(Request *request, void *data, size_t length);
+size_t          tls_pending(Request *request);
+ssize_t         tls_writev(Request *request, const struct iovec *iov, int iovcnt);
+ssize_t         tls_sendfile(Request *request, int fd, off_t *offset, size_t count);
+void            tls_detach(Request *request);
+void            tls_close(Request *request);
+
+/* Reload and Upgrade */
+
+#define CONTROL_RELOAD      0x1         /* SIGHUP: re-read options, root, and caches */
+#define CONTROL_SNAPSHOT    0x2         /* SIGUSR1: save cache index */
+#define CONTROL_UPGRADE     0x4         /* SIGUSR2: start new binary on same sockets */
+#define CONTROL_DRAIN       0x8         /* SIGQUIT: finish connections and exit */
+
+bool            control_init(char *argv[]);
+void            control_worker(void);
+void            control_ignore(void);
+int             control_fd(void);
+unsigned        control_signals(void);
+void            control_apply(Listeners *listeners);
+int             control_adopt(const struct sockaddr *addr, socklen_t addrlen, bool reuseport);
+bool            control_upgrade(const int *fds, size_t count);
+void            control_ready(void);
+bool            server_reload(Listeners *listeners);
+
 /* HTTP Server */
 
-int             single_server(int sfd);
-int             forking_server(int sfd);
+int             single_server(Listeners *listeners);
+int             forking_server(Listeners *listeners);
+int             workers_server(Listeners *listeners);
+
+/* Capture */
+
+#define CAPTURE_MAGIC       0x50414353  /* "SCAP" */
+#define CAPTURE_VERSION     1
+
+#define CAPTURE_REQUEST     1           /* Request line and headers */
+#define CAPTURE_BODY        2           /* Request body bytes (follows request) */
+
+typedef struct {
+    uint32_t    magic;                  /*< CAPTURE_MAGIC */
+    uint32_t    version;                /*< CAPTURE_VERSION */
+} CaptureHeader;
+
+typedef struct {
+    uint64_t    timestamp;              /*< Arrival time (ns since epoch) */
+    uint64_t    connection;             /*< Connection id */
+    uint32_t    length;                 /*< Number of raw bytes that follow */
+    uint16_t    type;                   /*< CAPTURE_REQUEST or CAPTURE_BODY */
+    uint16_t    reserved;
+} CaptureRecord;
+
+extern char *CapturePath;               /**< Path to capture log (NULL to disable) */
+
+bool            capture_open(const char *path);
+bool            capture_enabled(void);
+void            capture_stamp(Request *request);
+void            capture_bytes(Request *request, const void *data, size_t length);
+void            capture_flush(void);
+
+/* Scanning */
+
+#define SCAN_SET_MAX    16              /* Most delimiters scan_until accepts */
+
+void            scan_init(void);
+size_t          scan_until(const char *s, size_t n, const char *set);
+size_t          scan_token(const char *s, size_t n);
 
 /* Socket */
 
-int	        socket_listen(const char *port);
+int	        socket_listen(const char *address, bool reuseport, Listeners *listeners);
+bool            listeners_open(const char *spec, const char *secure, bool reuseport, Listeners *listeners);
+void            listeners_tune(Listeners *listeners);
+void            listeners_close(Listeners *listeners);
+void            socket_client(int fd);
+void            socket_cork(int fd, bool on);
 
 /* Utilities */
 
 #define chomp(s)    (s)[strlen(s) - 1] = '\0'
 #define streq(a, b) (strcmp((a), (b)) == 0)
 
-char *	        determine_mimetype(const char *path);
-char *	        determine_request_path(const char *uri);
+char *	        determine_mimetype(const char *path, const char *mimetypes, const char *fallback);
+char *	        determine_request_path(const char *root, const char *uri);
+bool            parse_size(const char *s, size_t *size);
+bool            accepts_encoding(const char *header, const char *coding);
 const char *    http_status_string(HTTPStatus status);
 char *	        skip_nonwhitespace(char *s);
 char *	        skip_whitespace(char *s);
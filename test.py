@@ -0,0 +1,276 @@
+#!/usr/bin/env python3
+
+import os
+import shutil
+import socket
+import struct
+import subprocess
+import threading
+import sys
+import time
+
+# Globals
+
+SPIDEY      = './spidey'
+PACK        = './spidey-pack'
+ROOT        = '/tmp/spidey-test'
+LOG         = 'test.log'
+VERBOSE     = False
+
+# Functions
+
+def usage(status=0):
+    print('''Usage: {} [options] [TESTS]
+    -h              Display help message
+    -v              Display server output
+
+    -r  PATH        Directory for generated document roots ({})
+
+Tests: {}
+    '''.format(os.path.basename(sys.argv[0]), ROOT, ','.join(TESTS)))
+    sys.exit(status)
+
+def write_file(path, data, mode=0o644):
+    ''' Write file (creating its directory), then set its mode. '''
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, 'wb') as fs:
+        fs.write(data.encode() if isinstance(data, str) else data)
+    os.chmod(path, mode)
+
+def free_port():
+    ''' Return loopback port nobody is listening on. '''
+    with socket.socket() as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+def start_server(args, log):
+    ''' Start spidey in forking mode and wait until it accepts connections;
+    return server and port (or None and the exit status if it refused to
+    start). '''
+    port   = free_port()
+    server = subprocess.Popen([SPIDEY, '-c', 'forking', '-p', '127.0.0.1:{}'.format(port)] + args,
+                              stdout=log, stderr=log)
+    deadline = time.time() + 10
+    while time.time() < deadline:
+        try:
+            socket.create_connection(('127.0.0.1', port), timeout=1).close()
+            return server, port
+        except OSError:
+            if server.poll() is not None:
+                return None, server.returncode
+            time.sleep(0.05)
+    stop_server(server)
+    raise RuntimeError('spidey did not start (see {})'.format(LOG))
+
+def stop_server(server):
+    ''' Stop spidey and the processes it started. '''
+    server.terminate()
+    try:
+        server.wait(timeout=10)
+    except subprocess.TimeoutExpired:
+        server.kill()
+        server.wait()
+
+def fetch(port, request, timeout=10):
+    ''' Send raw request and return everything the server sent back until it
+    closed the connection. '''
+    with socket.create_connection(('127.0.0.1', port), timeout=timeout) as s:
+        s.sendall(request.encode())
+        response = b''
+        for data in iter(lambda: s.recv(1 << 16), b''):
+            response += data
+        return response
+
+def test_slow_cgi(root, log):
+    ''' Script pausing longer than the write timeout between outputs is
+    streamed whole (deadlines cover stalled reads and writes, not the
+    script). '''
+    write_file(os.path.join(root, 'pause.cgi'), '''#!/bin/sh
+printf 'Content-Type: text/plain\\r\\n\\r\\nfirst\\n'
+sleep 2.5
+printf 'second\\n'
+''', 0o755)
+
+    server, port = start_server(['-r', root, '-t', 'read=2,write=2,idle=2,cgi=0'], log)
+    try:
+        request  = 'GET /pause.cgi HTTP/1.0\r\n\r\n'
+        response = fetch(port, request)
+        assert response.split(b'\r\n')[0].endswith(b' 200 OK'), response[:64]
+        assert response.endswith(b'first\nsecond\n'), response[-64:]
+
+        request  = 'POST /pause.cgi HTTP/1.1\r\nHost: test\r\nConnection: close\r\n' \
+                   'Expect: 100-continue\r\nContent-Length: 5\r\n\r\nhello'
+        response = fetch(port, request)
+        assert response.endswith(b'6\r\nfirst\n\r\n7\r\nsecond\n\r\n0\r\n\r\n'), response[-64:]
+    finally:
+        stop_server(server)
+
+def test_cgi_stream(root, log):
+    ''' Script output reaches the client as it is written, even with pauses
+    longer than the write timeout between events. '''
+    write_file(os.path.join(root, 'events.cgi'), '''#!/bin/sh
+printf 'Content-Type: text/event-stream\\r\\n\\r\\n'
+for event in 1 2 3; do
+    printf 'data: %s\\n\\n' $event
+    sleep 1.5
+done
+''', 0o755)
+
+    server, port = start_server(['-r', root, '-t', 'read=1,write=1,idle=1,cgi=0'], log)
+    try:
+        with socket.create_connection(('127.0.0.1', port), timeout=10) as s:
+            s.sendall(b'GET /events.cgi HTTP/1.0\r\n\r\n')
+            start    = time.time()
+            response = b''
+            while b'data: 1' not in response:
+                data = s.recv(1 << 16)
+                assert data, response
+                response += data
+            assert time.time() - start < 1, 'first event took {:.1f}s'.format(time.time() - start)
+            for data in iter(lambda: s.recv(1 << 16), b''):
+                response += data
+        assert response.endswith(b'data: 1\n\ndata: 2\n\ndata: 3\n\n'), response[-64:]
+    finally:
+        stop_server(server)
+
+def test_slow_body(root, log):
+    ''' Client that stops sending its body is cut off after the read timeout,
+    even with no CGI timeout. '''
+    write_file(os.path.join(root, 'cat.cgi'), '''#!/bin/sh
+printf 'Content-Type: text/plain\\r\\n\\r\\n'
+cat
+''', 0o755)
+
+    server, port = start_server(['-r', root, '-t', 'read=1,write=1,idle=1,cgi=0'], log)
+    try:
+        start    = time.time()
+        request  = 'POST /cat.cgi HTTP/1.1\r\nHost: test\r\nContent-Length: 100\r\n\r\nabc'
+        response = fetch(port, request, timeout=5)
+        assert b'abc' in response, response[-64:]
+        assert time.time() - start < 3, 'connection held {:.1f}s'.format(time.time() - start)
+    finally:
+        stop_server(server)
+
+def test_cgi_lane(root, log):
+    ''' Scripts served from a bundle queue in the CGI lane, and queued
+    requests wait for a slot when there is no CGI timeout. '''
+    write_file(os.path.join(root, 'www', 'sleep.cgi'), '''#!/bin/sh
+sleep 1
+printf 'Content-Type: text/plain\\r\\n\\r\\nslept\\n'
+''', 0o755)
+    bundle = os.path.join(root, 'site.spk')
+    subprocess.check_call([PACK, os.path.join(root, 'www'), bundle], stdout=log, stderr=log)
+
+    server, port = start_server(['-r', bundle, '-l', 'cgi=1', '-t', 'cgi=0'], log)
+    try:
+        start     = time.time()
+        responses = []
+        threads   = [threading.Thread(target=lambda: responses.append(fetch(port, 'GET /sleep.cgi HTTP/1.0\r\n\r\n')))
+                     for _ in range(3)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        assert all(r.endswith(b'slept\n') for r in responses), responses
+        assert time.time() - start >= 2.9, 'scripts overlapped ({:.1f}s)'.format(time.time() - start)
+    finally:
+        stop_server(server)
+
+def test_gzip_negotiation(root, log):
+    ''' Compressed bodies only go to clients whose Accept-Encoding gives gzip
+    (or x-gzip, or *) a weight above 0. '''
+    write_file(os.path.join(root, 'text.txt'), 'All work and no play makes Jack a dull boy.\n' * 100)
+
+    server, port = start_server(['-r', root], log)
+    try:
+        for encoding, gzip in (('gzip', True), ('deflate, gzip;q=0.5', True), ('x-gzip', True),
+                               ('*', True), ('gzip;q=0', False), ('gzip ; q=0.0, *', False),
+                               ('x-gzip-foo', False), ('*;q=0', False), ('identity', False)):
+            request  = 'GET /text.txt HTTP/1.0\r\nAccept-Encoding: {}\r\n\r\n'.format(encoding)
+            headers  = fetch(port, request).split(b'\r\n\r\n')[0].lower()
+            assert (b'content-encoding: gzip' in headers) == gzip, '{}: {}'.format(encoding, headers)
+    finally:
+        stop_server(server)
+
+def test_bundle_refused(root, log):
+    ''' Truncated or corrupt bundles are refused at startup instead of
+    serving bytes from outside the mapping. '''
+    bundle = os.path.join(root, 'site.spk')
+    subprocess.check_call([PACK, 'www', bundle], stdout=log, stderr=log)
+    with open(bundle, 'rb') as fs:
+        data = fs.read()
+
+    server, port = start_server(['-r', bundle], log)
+    assert server, 'valid bundle refused'
+    stop_server(server)
+
+    # Header is magic, count, index, strings, root; entries are path,
+    # mimetype, etag, flags, body, length, gzbody, gzlength
+    count, index, strings = struct.unpack_from('<IQQ', data, 4)
+    entry        = index + (count - 1) * 48       # Last entry
+    assert not data.endswith(b'\0'), 'bundle ends with string table'
+    corrupt      = {
+        'truncated':    data[:5000],
+        'body':         data[:entry + 16] + struct.pack('<Q', 1 << 40) + data[entry + 24:],
+        'length':       data[:entry + 24] + struct.pack('<Q', len(data) + 1) + data[entry + 32:],
+        'gzip':         data[:entry + 32] + struct.pack('<QQ', len(data) - 1, 2) + data[entry + 48:],
+        'path':         data[:entry] + struct.pack('<I', len(data)) + data[entry + 4:],
+        'unterminated': data[:entry + 8] + struct.pack('<I', len(data) - strings - 1) + data[entry + 12:],
+        'index':        data[:8] + struct.pack('<Q', (1 << 64) - 48) + data[16:],
+    }
+    for name, contents in corrupt.items():
+        path = os.path.join(root, name + '.spk')
+        write_file(path, contents)
+        server, status = start_server(['-r', path], log)
+        if server:
+            stop_server(server)
+        assert not server, '{} bundle served'.format(name)
+
+# Tests in the order they run
+
+TESTS = {
+    'slow-cgi':         test_slow_cgi,
+    'cgi-stream':       test_cgi_stream,
+    'slow-body':        test_slow_body,
+    'cgi-lane':         test_cgi_lane,
+    'gzip':             test_gzip_negotiation,
+    'bundle-refused':   test_bundle_refused,
+}
+
+# Main execution
+
+if __name__ == '__main__':
+    # Parse command line arguments
+    args = sys.argv[1:]
+    while args and args[0].startswith('-') and len(args[0]) > 1:
+        arg = args.pop(0)
+        if arg == '-h':
+            usage(0)
+        elif arg == '-v':
+            VERBOSE = True
+        elif arg == '-r':
+            ROOT = args.pop(0)
+        else:
+            usage(1)
+
+    selected = args[0].split(',') if args else list(TESTS)
+    if len(args) > 1 or any(name not in TESTS for name in selected):
+        usage(1)
+
+    # Run each test against a fresh document root and server
+    failures = 0
+    with open(os.devnull if VERBOSE else LOG, 'w') as log:
+        for name in selected:
+            root = os.path.join(ROOT, name)
+            shutil.rmtree(root, ignore_errors=True)
+            os.makedirs(root)
+            try:
+                TESTS[name](root, None if VERBOSE else log)
+                print('{:24} ok'.format(name))
+            except (AssertionError, OSError, RuntimeError) as e:
+                print('{:24} FAILED {}'.format(name, e))
+                failures += 1
+
+    sys.exit(1 if failures else 0)
+
+# vim: set sts=4 sw=4 ts=8 expandtab ft=python:
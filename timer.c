@@ -0,0 +1,239 @@
+/* timer.c: Hierarchical Timer Wheel */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/time.h>
+
+/* Constants */
+
+#define TIMER_TICK_MSEC     100                         /* Resolution of wheel */
+#define TIMER_LEVELS        4                           /* Number of wheels */
+#define TIMER_BITS          6                           /* Slots per wheel (log2) */
+#define TIMER_SLOTS         (1 << TIMER_BITS)
+#define TIMER_MASK          (TIMER_SLOTS - 1)
+#define TIMER_MAX_TICKS     ((1UL << (TIMER_LEVELS * TIMER_BITS)) - 1)
+
+#define TIMER_INDEX(t, n)   (((t) >> ((n) * TIMER_BITS)) & TIMER_MASK)
+
+/* Global Variables */
+
+static Timer                 Wheel[TIMER_LEVELS][TIMER_SLOTS];  /* Slot list heads */
+static volatile unsigned long Ticks = 0;                        /* Current wheel time */
+static struct timespec       Epoch;                             /* Time of tick 0 */
+static bool                  Initialized = false;
+
+/* Internal Functions */
+
+/**
+ * Return number of ticks since Epoch.
+ **/
+static unsigned long timer_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - Epoch.tv_sec) * (1000 / TIMER_TICK_MSEC) +
+           (now.tv_nsec - Epoch.tv_nsec) / (TIMER_TICK_MSEC * 1000000L);
+}
+
+/**
+ * Append timer to the tail of the specified slot list.
+ **/
+static void timer_link(Timer *head, Timer *timer) {
+    timer->next       = head;
+    timer->prev       = head->prev;
+    head->prev->next  = timer;
+    head->prev        = timer;
+}
+
+/**
+ * Remove timer from whatever slot list it is on.
+ **/
+static void timer_unlink(Timer *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next       = NULL;
+    timer->prev       = NULL;
+}
+
+/**
+ * Place timer in the wheel slot that corresponds to its expiration.
+ *
+ * Timers that expire within TIMER_SLOTS ticks go into the innermost wheel;
+ * timers further out go into coarser wheels and are cascaded inwards as time
+ * advances.
+ **/
+static void timer_place(Timer *timer) {
+    unsigned long expires = timer->expires;
+    long          delta   = (long)(expires - Ticks);
+    Timer        *head;
+
+    if (delta < 0) {
+        head = &Wheel[0][TIMER_INDEX(Ticks, 0)];
+    } else if (delta < (1L << TIMER_BITS)) {
+        head = &Wheel[0][TIMER_INDEX(expires, 0)];
+    } else if (delta < (1L << (2 * TIMER_BITS))) {
+        head = &Wheel[1][TIMER_INDEX(expires, 1)];
+    } else if (delta < (1L << (3 * TIMER_BITS))) {
+        head = &Wheel[2][TIMER_INDEX(expires, 2)];
+    } else {
+        if ((unsigned long)delta > TIMER_MAX_TICKS) {
+            expires = timer->expires = Ticks + TIMER_MAX_TICKS;
+        }
+        head = &Wheel[3][TIMER_INDEX(expires, 3)];
+    }
+
+    timer_link(head, timer);
+}
+
+/**
+ * Move all timers in the specified slot of a coarse wheel into finer wheels.
+ *
+ * @return  Index of the slot that was cascaded.
+ **/
+static int timer_cascade(int level, int index) {
+    Timer *head  = &Wheel[level][index];
+    Timer *timer = head->next;
+
+    head->next = head->prev = head;
+    while (timer != head) {
+        Timer *next = timer->next;
+        timer_place(timer);
+        timer = next;
+    }
+    return index;
+}
+
+/**
+ * Advance wheel to the current time and run any expired timers.
+ *
+ * This runs from the SIGALRM handler, so callbacks must only perform
+ * async-signal-safe operations (ie. shutdown(2), kill(2)).
+ **/
+static void timer_advance(int signum) {
+    unsigned long now   = timer_now();
+    int           saved = errno;
+
+    while (Ticks <= now) {
+        int index = TIMER_INDEX(Ticks, 0);
+
+        /* Cascade coarser wheels when the finer wheel wraps around */
+        if (!index &&
+            !timer_cascade(1, TIMER_INDEX(Ticks, 1)) &&
+            !timer_cascade(2, TIMER_INDEX(Ticks, 2))) {
+            timer_cascade(3, TIMER_INDEX(Ticks, 3));
+        }
+        Ticks++;
+
+        /* Run expired timers */
+        Timer *head = &Wheel[0][index];
+        while (head->next != head) {
+            Timer *timer = head->next;
+            timer_unlink(timer);
+            timer->callback(timer);
+        }
+    }
+
+    errno = saved;
+}
+
+/**
+ * Block or unblock SIGALRM so the wheel can be modified safely.
+ **/
+static void timer_block(int how) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(how, &set, NULL);
+}
+
+/* Functions */
+
+/**
+ * Initialize timer wheel for the current process.
+ *
+ * This resets the wheel, installs the SIGALRM handler, and starts the
+ * interval timer that drives the wheel.  Interval timers are not inherited
+ * across fork(2), so each process that handles connections must call this.
+ **/
+void timers_init(void) {
+    timer_block(SIG_BLOCK);
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_SLOTS; slot++) {
+            Wheel[level][slot].next = Wheel[level][slot].prev = &Wheel[level][slot];
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &Epoch);
+    Ticks = 0;
+    Initialized = true;
+    timer_block(SIG_UNBLOCK);
+
+    struct sigaction action = {
+        .sa_handler = timer_advance,
+        .sa_flags   = SA_RESTART,
+    };
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGALRM, &action, NULL) < 0) {
+        fprintf(stderr, "sigaction failed: %s\n", strerror(errno));
+        return;
+    }
+
+    struct itimerval interval = {
+        .it_interval = { .tv_sec = 0, .tv_usec = TIMER_TICK_MSEC * 1000 },
+        .it_value    = { .tv_sec = 0, .tv_usec = TIMER_TICK_MSEC * 1000 },
+    };
+    if (setitimer(ITIMER_REAL, &interval, NULL) < 0) {
+        fprintf(stderr, "setitimer failed: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * Schedule timer to expire after the specified number of seconds.
+ *
+ * @param   timer       Timer structure (usually embedded in another struct).
+ * @param   seconds     Time until expiration (timers with seconds <= 0 are
+ *                      not scheduled).
+ * @param   callback    Function to call on expiration.
+ * @param   arg         Argument stored in timer for callback.
+ *
+ * If the timer is already pending, then it is rescheduled.
+ **/
+void timer_add(Timer *timer, double seconds, TimerCallback callback, void *arg) {
+    if (!Initialized) {
+        return;
+    }
+
+    timer_block(SIG_BLOCK);
+    if (timer->next) {
+        timer_unlink(timer);
+    }
+    if (seconds > 0) {
+        timer->expires  = timer_now() + (unsigned long)(seconds * (1000 / TIMER_TICK_MSEC));
+        timer->callback = callback;
+        timer->arg      = arg;
+        timer_place(timer);
+    }
+    timer_block(SIG_UNBLOCK);
+}
+
+/**
+ * Cancel timer if it is pending.
+ *
+ * @param   timer       Timer structure.
+ **/
+void timer_cancel(Timer *timer) {
+    if (!timer->next) {
+        return;
+    }
+
+    timer_block(SIG_BLOCK);
+    if (timer->next) {
+        timer_unlink(timer);
+    }
+    timer_block(SIG_UNBLOCK);
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -0,0 +1,357 @@
+/* tls.c: TLS Termination with Kernel Offload */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include "account.h"
+
+/* Constants */
+
+#define TLS_RECORD_SIZE     (16 * 1024)     /* Largest TLS record payload */
+#define TLS_TICKET_KEYS     80              /* Name, HMAC, and AES ticket keys */
+
+/* Protocols offered to ALPN, in order of preference (h2 clients then send
+ * the HTTP/2 preface as if they had prior knowledge) */
+static const unsigned char Protocols[] = "\x02h2\x08http/1.1";
+
+/* Global Variables */
+
+static SSL_CTX *Context = NULL;             /* Certificate, ticket keys, and options */
+
+/* Internal Functions */
+
+/**
+ * Report TLS library error.
+ **/
+static void tls_error(const char *call) {
+    unsigned long error = ERR_get_error();
+    char          message[256];
+
+    ERR_error_string_n(error, message, sizeof(message));
+    fprintf(stderr, "%s failed: %s\n", call, error ? message : strerror(errno));
+    ERR_clear_error();
+}
+
+/**
+ * Choose application protocol among those the client offers.
+ **/
+static int tls_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                    const unsigned char *in, unsigned int inlen, void *arg) {
+    unsigned char *selected;
+    if (SSL_select_next_proto(&selected, outlen, Protocols, sizeof(Protocols) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Create context from TLSCertPath and TLSKeyPath.
+ *
+ * @return  New context (or NULL on error).
+ *
+ * Sessions resume from tickets alone (there is no server-side session
+ * cache), so a client may resume in any worker or forked child.
+ **/
+static SSL_CTX *tls_context(void) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) {
+        tls_error("SSL_CTX_new");
+        return NULL;
+    }
+
+    /* Hand record encryption to the kernel whenever it can take it */
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF |
+                             SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"spidey", 6);
+    SSL_CTX_set_alpn_select_cb(ctx, tls_alpn, NULL);
+
+    /* Load certificate chain and key */
+    const char *key = TLSKeyPath ? TLSKeyPath : TLSCertPath;
+    if (SSL_CTX_use_certificate_chain_file(ctx, TLSCertPath) != 1) {
+        tls_error(TLSCertPath);
+        goto fail;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+        tls_error(key);
+        goto fail;
+    }
+    return ctx;
+
+fail:
+    SSL_CTX_free(ctx);
+    return NULL;
+}
+
+/**
+ * Determine if the kernel encrypts what is sent on the connection.
+ **/
+static bool tls_kernel_send(Request *r) {
+    return BIO_get_ktls_send(SSL_get_wbio(r->tls));
+}
+
+/**
+ * Convert result of SSL_read or SSL_write into read(2) or write(2) form.
+ *
+ * @return  n if positive, 0 on close_notify, or -1 with errno set (EINTR
+ * if a signal interrupted the call, which is then simply repeated).
+ **/
+static ssize_t tls_result(Request *r, int n, const char *call) {
+    if (n > 0) {
+        return n;
+    }
+
+    switch (SSL_get_error(r->tls, n)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EINTR;
+            break;
+        case SSL_ERROR_SYSCALL:
+            errno = errno ? errno : ECONNRESET;
+            break;
+        default:
+            tls_error(call);
+            errno = EPROTO;
+            break;
+    }
+    ERR_clear_error();
+    return -1;
+}
+
+/* Functions */
+
+/**
+ * Load certificate for TLS listeners.
+ *
+ * @return  true on success, false on error.
+ *
+ * Call before starting workers, so that every process shares the session
+ * ticket keys generated here and any of them can resume a session.
+ **/
+bool tls_init(void) {
+    if (!TLSCertPath) {
+        fprintf(stderr, "TLS listeners need a certificate (-k)\n");
+        return false;
+    }
+    if (!(Context = tls_context())) {
+        return false;
+    }
+    debug("TLS certificate %s loaded", TLSCertPath);
+    return true;
+}
+
+/**
+ * Load certificate again (ie. after renewal) on SIGHUP.
+ *
+ * @return  true on success (or if there are no TLS listeners), false if
+ * the current certificate was kept.
+ *
+ * Ticket keys carry over, so sessions issued before the reload (and by
+ * processes that have not reloaded yet) still resume.  Connections already
+ * established keep the context they started with.
+ **/
+bool tls_reload(void) {
+    unsigned char keys[TLS_TICKET_KEYS];
+
+    if (!Context) {
+        return true;
+    }
+
+    SSL_CTX *ctx = tls_context();
+    if (!ctx) {
+        return false;
+    }
+    if (SSL_CTX_get_tlsext_ticket_keys(Context, keys, sizeof(keys)) == 1) {
+        SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys));
+    }
+    SSL_CTX_free(Context);
+    Context = ctx;
+    return true;
+}
+
+/**
+ * Prepare TLS session for connection accepted on a TLS listener.
+ *
+ * @param   r           Request structure.
+ * @return  true on success, false on error.
+ *
+ * This is cheap; the handshake is left to tls_handshake, which runs in the
+ * process that serves the connection.
+ **/
+bool tls_session(Request *r) {
+    if (!(r->tls = SSL_new(Context)) || SSL_set_fd(r->tls, r->fd) != 1) {
+        tls_error("SSL_new");
+        return false;
+    }
+    r->secure = true;
+    return true;
+}
+
+/**
+ * Finish TLS handshake with client (if not done already).
+ *
+ * @param   r           Request structure.
+ * @return  true once the connection is established, false on error.
+ *
+ * The client has ReadTimeout seconds to complete the handshake.  When the
+ * kernel accepted the session keys, responses are afterwards written to the
+ * socket directly (and files sent with sendfile(2)); otherwise they are
+ * encrypted here.
+ **/
+bool tls_handshake(Request *r) {
+    if (SSL_is_init_finished(r->tls)) {
+        return true;
+    }
+
+    timer_add(&r->timer, ReadTimeout, request_timeout, r);
+    ssize_t status;
+    do {
+        ERR_clear_error();
+        status = tls_result(r, SSL_accept(r->tls), "SSL_accept");
+    } while (status < 0 && errno == EINTR);
+    timer_cancel(&r->timer);
+
+    if (status <= 0) {
+        fprintf(stderr, "TLS handshake failed: %s\n", status ? strerror(errno) : "connection closed");
+        return false;
+    }
+
+    const unsigned char *protocol = NULL;
+    unsigned int         length   = 0;
+    SSL_get0_alpn_selected(r->tls, &protocol, &length);
+    debug("TLS %s %s%s, ALPN %.*s, kernel send %s, kernel receive %s",
+        SSL_get_version(r->tls), SSL_get_cipher_name(r->tls), SSL_session_reused(r->tls) ? " (resumed)" : "",
+        length ? (int)length : 4, length ? (const char *)protocol : "none",
+        tls_kernel_send(r) ? "on" : "off", BIO_get_ktls_recv(SSL_get_rbio(r->tls)) ? "on" : "off");
+    return true;
+}
+
+/**
+ * Read decrypted data from client.
+ *
+ * @param   r           Request structure.
+ * @param   data        Buffer to store data.
+ * @param   length      Size of buffer.
+ * @return  Number of bytes read, 0 on end of file, or -1 on error (as with
+ * read(2)).
+ **/
+ssize_t tls_read(Request *r, void *data, size_t length) {
+    ERR_clear_error();
+    return tls_result(r, SSL_read(r->tls, data, length > INT32_MAX ? INT32_MAX : length), "SSL_read");
+}
+
+/**
+ * Determine how many decrypted bytes are buffered.
+ *
+ * @param   r           Request structure.
+ * @return  Bytes tls_read returns without waiting on the socket.
+ *
+ * Call before poll(2): data already decrypted does not make the socket
+ * readable.
+ **/
+size_t tls_pending(Request *r) {
+    return SSL_pending(r->tls);
+}
+
+/**
+ * Write data to client (as with writev(2)).
+ *
+ * @param   r           Request structure.
+ * @param   iov         Segments to write.
+ * @param   iovcnt      Number of segments.
+ * @return  Number of bytes written (or -1 on error).
+ *
+ * Without kernel offload, segments are gathered into full records, so a
+ * response's headers and the start of its body share one record.
+ **/
+ssize_t tls_writev(Request *r, const struct iovec *iov, int iovcnt) {
+    char   record[TLS_RECORD_SIZE];
+    size_t length = 0;
+
+    if (tls_kernel_send(r)) {
+        return writev(r->fd, iov, iovcnt);
+    }
+
+    for (int i = 0; i < iovcnt && length < sizeof(record); i++) {
+        size_t n = iov[i].iov_len < sizeof(record) - length ? iov[i].iov_len : sizeof(record) - length;
+        memcpy(record + length, iov[i].iov_base, n);
+        length += n;
+    }
+    ERR_clear_error();
+    return tls_result(r, SSL_write(r->tls, record, length), "SSL_write");
+}
+
+/**
+ * Send part of a file to client (as with sendfile(2)).
+ *
+ * @param   r           Request structure.
+ * @param   fd          File to send.
+ * @param   offset      Offset to send from (advanced by bytes sent).
+ * @param   count       Number of bytes to send.
+ * @return  Number of bytes sent (or -1 on error).
+ *
+ * With kernel offload the file goes straight from the page cache to the
+ * socket; otherwise it is read and encrypted here one record at a time.
+ **/
+ssize_t tls_sendfile(Request *r, int fd, off_t *offset, size_t count) {
+    char record[TLS_RECORD_SIZE];
+
+    if (tls_kernel_send(r)) {
+        return sendfile(r->fd, fd, offset, count);
+    }
+
+    ssize_t nread = pread(fd, record, count < sizeof(record) ? count : sizeof(record), *offset);
+    if (nread <= 0) {
+        return nread;
+    }
+    ERR_clear_error();
+    ssize_t nwritten = tls_result(r, SSL_write(r->tls, record, nread), "SSL_write");
+    if (nwritten > 0) {
+        *offset += nwritten;
+    }
+    return nwritten;
+}
+
+/**
+ * Leave connection to the process that now serves it.
+ *
+ * @param   r           Request structure.
+ *
+ * tls_close then frees the session without telling the client.
+ **/
+void tls_detach(Request *r) {
+    if (r->tls) {
+        SSL_set_quiet_shutdown(r->tls, 1);
+    }
+}
+
+/**
+ * Send close_notify (if the handshake finished) and free TLS session.
+ *
+ * @param   r           Request structure.
+ **/
+void tls_close(Request *r) {
+    if (!r->tls) {
+        return;
+    }
+    if (SSL_is_init_finished(r->tls)) {
+        SSL_shutdown(r->tls);
+    }
+    SSL_free(r->tls);
+    ERR_clear_error();
+    r->tls = NULL;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */
@@ -11,16 +11,20 @@
 
 #include <stdio.h>
 
+#include "account.h"
+
 /**
  * Determine mime-type from file extension.
  *
  * @param   path        Path to file.
+ * @param   mimetypes   Path to mime.types file (ie. MimeTypesPath).
+ * @param   fallback    Mimetype of files that match no rule (ie. DefaultMimeType).
  * @return  An allocated string containing the mime-type of the specified file.
  *
  * This function first finds the file's extension and then scans the contents
- * of the MimeTypesPath file to determine which mimetype the file has.
+ * of the mimetypes file to determine which mimetype the file has.
  *
- * The MimeTypesPath file (typically /etc/mime.types) consists of rules in the
+ * The mimetypes file (typically /etc/mime.types) consists of rules in the
  * following format:
  *
  *  <MIMETYPE>      <EXT1> <EXT2> ...
@@ -29,11 +33,11 @@
  * each mimetype and returns the mimetype on the first match.
  *
  * If no extension exists or no matching mimetype is found, then return
- * DefaultMimeType.
+ * fallback.
  *
  * This function returns an allocated string that must be free'd.
  **/
-char * determine_mimetype(const char *path) {
+char * determine_mimetype(const char *path, const char *mimetypes, const char *fallback) {
     char *ext;
     char *mimetype;
     char *token;
@@ -41,12 +45,16 @@ char * determine_mimetype(const char *path) {
     FILE *fs = NULL;
 
     /* Find file extension */
-    ext = strrchr(path,'.')+1;
-    /* Open MimeTypesPath file */
-    fs = fopen(MimeTypesPath,"r");
+    ext = strrchr(path,'.');
+    if (!ext || strchr(ext, '/')) {
+        return strdup(fallback);
+    }
+    ext++;
+    /* Open mimetypes file */
+    fs = fopen(mimetypes,"r");
     if (!fs){
         debug("Couldn't open mimetypes file");
-        return strdup(DefaultMimeType);
+        return strdup(fallback);
     }
     /* Scan file for matching file extensions */
     while(fgets(buffer,BUFSIZ,fs)){
@@ -57,17 +65,20 @@ char * determine_mimetype(const char *path) {
         token = strtok(token,WHITESPACE);
         while(token != NULL){
             if(streq(token, ext)){
+                fclose(fs);
                 return strdup(mimetype);
             }
             token = strtok(NULL,WHITESPACE);
         }
     }
-    return strdup(DefaultMimeType);
+    fclose(fs);
+    return strdup(fallback);
 }
 
 /**
- * Determine actual filesystem path based on RootPath and URI.
+ * Determine actual filesystem path based on document root and URI.
  *i
+ * @param   root        Real path of document root (ie. RootPath).
  * @param   uri         Resource path of URI.
  * @return  An allocated string containing the full path of the resource on the
  * local filesystem.
@@ -75,20 +86,112 @@ char * determine_mimetype(const char *path) {
  * This function uses realpath(3) to generate the realpath of the
  * file requested in the URI.
  *
- * As a security check, if the real path does not begin with the RootPath, then
- * return NULL.
+ * As a security check, if the real path does not begin with the root, then
+ * return NULL (so that one virtual host cannot reach into another).
  *
  * Otherwise, return a newly allocated string containing the real path.  This
  * string must later be free'd.
  **/
-char * determine_request_path(const char *uri) {
+char * determine_request_path(const char *root, const char *uri) {
     char buffer[BUFSIZ];
-    sprintf(buffer,"%s%s",RootPath,uri);
+    if (snprintf(buffer, sizeof(buffer), "%s%s", root, uri) >= (int)sizeof(buffer)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
     char *path;
     path = realpath(buffer,NULL); 
+
+    size_t length = strlen(root);
+    if (path && (strncmp(path, root, length) != 0 || (length > 1 && path[length] && path[length] != '/'))) {
+        free(path);
+        errno = EACCES;
+        return NULL;
+    }
     return path;
 }
 
+/**
+ * Parse size with optional K, M, or G suffix.
+ *
+ * @param   s           String to parse (ie. 64M).
+ * @param   size        Pointer to store size in bytes.
+ * @return  true if parsing was successful, false if there was an error.
+ **/
+bool parse_size(const char *s, size_t *size) {
+    char *end;
+    unsigned long long value = strtoull(s, &end, 10);
+
+    if (end == s) {
+        return false;
+    }
+    switch (toupper(*end)) {
+        case 'G': value <<= 10; /* Fall through */
+        case 'M': value <<= 10; /* Fall through */
+        case 'K': value <<= 10; end++; break;
+        case '\0': break;
+        default: return false;
+    }
+    if (*end) {
+        return false;
+    }
+    *size = value;
+    return true;
+}
+
+/**
+ * Determine if Accept-Encoding header accepts content coding.
+ *
+ * @param   header      Accept-Encoding value (ie. gzip;q=0.5, br), or NULL.
+ * @param   coding      Content coding (ie. gzip).
+ * @return  true if the coding is listed (or x- prefixed, or matched by *)
+ * with a weight above 0.
+ *
+ * The header is a comma separated list of codings, each with an optional q
+ * parameter; a coding listed by name overrides *.
+ **/
+bool accepts_encoding(const char *header, const char *coding) {
+    size_t length   = strlen(coding);
+    double named    = -1;
+    double wildcard = -1;
+
+    for (const char *c = header; c && *c; ) {
+        /* Coding name */
+        while (*c == ',' || *c == ' ' || *c == '\t') {
+            c++;
+        }
+        const char *name = c;
+        while (*c && *c != ',' && *c != ';' && *c != ' ' && *c != '\t') {
+            c++;
+        }
+        size_t      n   = c - name;
+        const char *end = strchr(c, ',');
+        if (!end) {
+            end = c + strlen(c);
+        }
+
+        /* Weight (1 unless a q parameter says otherwise) */
+        double q = 1;
+        for (const char *p = memchr(c, ';', end - c); p; p = memchr(p + 1, ';', end - p - 1)) {
+            const char *parameter = p + 1;
+            while (*parameter == ' ' || *parameter == '\t') {
+                parameter++;
+            }
+            if (tolower(*parameter) == 'q' && parameter[1] == '=') {
+                q = strtod(parameter + 2, NULL);
+            }
+        }
+
+        if ((n == length && strncasecmp(name, coding, n) == 0) ||
+            (n == length + 2 && strncasecmp(name, "x-", 2) == 0 && strncasecmp(name + 2, coding, length) == 0)) {
+            named = q;
+        } else if (n == 1 && *name == '*') {
+            wildcard = q;
+        }
+        c = end;
+    }
+    return named >= 0 ? named > 0 : wildcard > 0;
+}
+
 /**
  * Return static string corresponding to HTTP Status code.
  *
@@ -104,6 +207,8 @@ const char * http_status_string(HTTPStatus status) {
         "404 Not Found",
         "500 Internal Server Error",
         "418 I'm A Teapot",
+        "304 Not Modified",
+        "503 Service Unavailable",
     };
 
     if (status == HTTP_STATUS_OK) return StatusStrings[0];
@@ -111,6 +216,8 @@ const char * http_status_string(HTTPStatus status) {
     if (status == HTTP_STATUS_NOT_FOUND) return StatusStrings[2];
     if (status == HTTP_STATUS_INTERNAL_SERVER_ERROR) return StatusStrings[3];
     if (status == 418) return StatusStrings[4];
+    if (status == HTTP_STATUS_NOT_MODIFIED) return StatusStrings[5];
+    if (status == HTTP_STATUS_SERVICE_UNAVAILABLE) return StatusStrings[6];
 
     return NULL;
 }
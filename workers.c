@@ -0,0 +1,392 @@
+/* workers.c: Pre-forked Worker HTTP Server */
+
+#include "spidey.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Constants */
+
+#define WORKERS_REAP_MSEC   1000        /* Longest wait between checks for exited workers */
+#define WORKERS_SNAPSHOT_MSEC 1000      /* Longest wait for a worker's cache snapshot */
+
+/* Structures */
+
+typedef struct {
+    pid_t   pid;                        /* Process id (0 if not running) */
+    Listeners listeners;                /* Worker's own listening sockets */
+    int     cpu;                        /* CPU worker is pinned to (or -1) */
+} Worker;
+
+/* Internal Functions */
+
+/**
+ * Parse CPU list into array of CPU numbers.
+ *
+ * @param   spec        "auto" for every CPU this process may run on, or a
+ *                      comma separated list of CPUs and ranges (ie. 0-3,8).
+ * @param   cpus        Array to store CPU numbers.
+ * @return  Number of CPUs (or -1 on error).
+ **/
+static int workers_parse_cpus(const char *spec, int *cpus) {
+    cpu_set_t set;
+    int       ncpus = 0;
+
+    CPU_ZERO(&set);
+    if (streq(spec, "auto")) {
+        if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+            fprintf(stderr, "sched_getaffinity failed: %s\n", strerror(errno));
+            return -1;
+        }
+    } else {
+        const char *c = spec;
+        while (*c) {
+            char *end;
+            long  first = strtol(c, &end, 10);
+            long  last  = first;
+            if (end == c) {
+                return -1;
+            }
+            if (*end == '-') {
+                c    = end + 1;
+                last = strtol(c, &end, 10);
+                if (end == c) {
+                    return -1;
+                }
+            }
+            if (first < 0 || last < first || last >= CPU_SETSIZE) {
+                return -1;
+            }
+            for (long cpu = first; cpu <= last; cpu++) {
+                CPU_SET(cpu, &set);
+            }
+            if (*end == ',') {
+                end++;
+            } else if (*end) {
+                return -1;
+            }
+            c = end;
+        }
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[ncpus++] = cpu;
+        }
+    }
+    return ncpus;
+}
+
+/**
+ * Steer each connection to the listening sockets of the worker pinned to the
+ * CPU that received it.
+ *
+ * @param   workers     Workers (sockets bound in this order).
+ * @param   count       Number of workers.
+ * @return  -1 on error and 0 on success.
+ *
+ * The classic BPF program maps the current CPU to a socket index in the
+ * reuseport group.  CPUs without a worker return an index past the end of
+ * the group, which makes the kernel fall back to its usual hash.  Every
+ * address gets its own reuseport group, so the program is attached to each.
+ **/
+static int workers_steer(const Worker *workers, int count) {
+    struct sock_filter code[2 * CPU_SETSIZE + 2];
+    int                n = 0;
+
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < count; i++) {
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, workers[i].cpu, 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, count);
+
+    struct sock_fprog program = { .len = n, .filter = code };
+    for (size_t i = 0; i < workers[0].listeners.count; i++) {
+        if (setsockopt(workers[0].listeners.fds[i], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) < 0) {
+            fprintf(stderr, "setsockopt SO_ATTACH_REUSEPORT_CBPF failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Pin calling process to CPU and keep its memory on the local node.
+ *
+ * @param   cpu         CPU to run on.
+ **/
+static void workers_place(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        fprintf(stderr, "sched_setaffinity failed: %s\n", strerror(errno));
+    }
+
+    /* Allocate from the node of whichever CPU touches a page first, which is
+     * now always this one */
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) < 0 && errno != ENOSYS) {
+        fprintf(stderr, "set_mempolicy failed: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * Start worker process.
+ *
+ * @param   workers     Workers.
+ * @param   count       Number of workers.
+ * @param   index       Index of worker to start.
+ * @return  Process id of worker (or -1 on error).
+ **/
+static pid_t workers_start(Worker *workers, int count, int index) {
+    Worker *w      = &workers[index];
+    pid_t   parent = getpid();
+    pid_t   pid    = fork();
+
+    if (pid != 0) {
+        if (pid < 0) {
+            fprintf(stderr, "Unable to fork: %s\n", strerror(errno));
+        }
+        return pid;
+    }
+
+    /* Exit along with parent */
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent) {
+        exit(EXIT_FAILURE);
+    }
+    control_worker();
+
+    /* Only listen on own sockets */
+    for (int i = 0; i < count; i++) {
+        if (i != index) {
+            listeners_close(&workers[i].listeners);
+        }
+    }
+
+    /* Place worker before it allocates anything */
+    if (w->cpu >= 0) {
+        workers_place(w->cpu);
+    }
+
+    /* Build private caches (one per host) on the worker's node */
+    hosts_caches();
+    cache_restore(SnapshotPath);
+
+    exit(single_server(&w->listeners));
+}
+
+/**
+ * Send signal to every running worker.
+ **/
+static void workers_signal(const Worker *workers, int count, int signum) {
+    for (int i = 0; i < count; i++) {
+        if (workers[i].pid > 0) {
+            kill(workers[i].pid, signum);
+        }
+    }
+}
+
+/**
+ * Start new binary on the sockets of every worker.
+ *
+ * @param   workers     Workers.
+ * @param   count       Number of workers.
+ *
+ * Caches live in the workers, so with SnapshotPath the first worker is
+ * asked to save its index (SIGUSR1) before the new binary starts, giving
+ * the new workers something to restore.  Every worker's socket is handed
+ * over, so no reuseport group ever loses a member along with its backlog.
+ **/
+static void workers_upgrade(Worker *workers, int count) {
+    struct stat before = {0};
+    struct stat after  = {0};
+
+    if (SnapshotPath && workers[0].pid > 0) {
+        stat(SnapshotPath, &before);
+        kill(workers[0].pid, SIGUSR1);
+        for (int waited = 0; waited < WORKERS_SNAPSHOT_MSEC; waited += 10) {
+            if (stat(SnapshotPath, &after) == 0 && (after.st_ino != before.st_ino ||
+                after.st_mtim.tv_sec != before.st_mtim.tv_sec || after.st_mtim.tv_nsec != before.st_mtim.tv_nsec)) {
+                break;
+            }
+            usleep(10 * 1000);
+        }
+    }
+
+    int *fds = calloc(count * LISTEN_MAX, sizeof(int));
+    if (!fds) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        return;
+    }
+    size_t n = 0;
+    for (int i = 0; i < count; i++) {
+        for (size_t j = 0; j < workers[i].listeners.count; j++) {
+            fds[n++] = workers[i].listeners.fds[j];
+        }
+    }
+    control_upgrade(fds, n);
+    free(fds);
+}
+
+/* Functions */
+
+/**
+ * Handle HTTP requests with a fixed pool of long-lived worker processes.
+ *
+ * @param   listeners   Server sockets (bound with SO_REUSEPORT).
+ * @return  Exit status of server (EXIT_FAILURE if workers cannot start).
+ *
+ * Each worker accepts from its own listening socket for every address, each
+ * in that address's reuseport group, and handles one connection at a time,
+ * like single_server.
+ *
+ * With WorkerCPUs set, worker i is pinned to the i-th CPU in the list (its
+ * caches and buffers are then allocated on that CPU's node), its sockets
+ * are marked with SO_INCOMING_CPU, and if there is exactly one worker per
+ * CPU a reuseport BPF program keeps each connection on the CPU that took its
+ * interrupt.
+ *
+ * CGI requests are handed to processes of their own in the CGI lane (see
+ * lane_enter), so a burst of scripts does not occupy the workers serving
+ * static files.
+ *
+ * The parent only restarts workers that exit, and passes control signals
+ * on: SIGHUP goes to every worker (each reloads between connections),
+ * SIGUSR2 starts a new binary on every worker's sockets, and SIGQUIT drains
+ * every worker before the parent returns.
+ **/
+int workers_server(Listeners *listeners) {
+    static int cpus[CPU_SETSIZE];
+    int        ncpus = 0;
+
+    /* Determine placement */
+    if (WorkerCPUs) {
+        ncpus = workers_parse_cpus(WorkerCPUs, cpus);
+        if (ncpus <= 0) {
+            fprintf(stderr, "Invalid CPU list: %s\n", WorkerCPUs);
+            return EXIT_FAILURE;
+        }
+    }
+
+    int count = Workers;
+    if (!count) {
+        count = ncpus ? ncpus : sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (count <= 0) {
+        count = 1;
+    }
+
+    /* Static requests run inside workers; CGI requests get their own lane */
+    if (!LaneLimits[LANE_STATIC]) {
+        LaneLimits[LANE_STATIC] = count;
+    }
+    LaneDetach = true;
+    if (!lanes_create() || !flights_create(FlightSlots) || !clients_create(ClientSlots)) {
+        return EXIT_FAILURE;
+    }
+
+    Worker *workers = calloc(count, sizeof(Worker));
+    if (!workers) {
+        fprintf(stderr, "calloc failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    /* Bind one socket per worker and address (in order, so that socket i
+     * has index i in each reuseport group) */
+    for (int i = 0; i < count; i++) {
+        if (i == 0) {
+            workers[i].listeners = *listeners;
+        } else if (!listeners_open(Port, TLSPort, true, &workers[i].listeners)) {
+            return EXIT_FAILURE;
+        }
+        workers[i].cpu = ncpus ? cpus[i % ncpus] : -1;
+        for (size_t j = 0; workers[i].cpu >= 0 && j < workers[i].listeners.count; j++) {
+            if (setsockopt(workers[i].listeners.fds[j], SOL_SOCKET, SO_INCOMING_CPU, &workers[i].cpu, sizeof(int)) < 0) {
+                fprintf(stderr, "setsockopt SO_INCOMING_CPU failed: %s\n", strerror(errno));
+            }
+        }
+    }
+    if (ncpus && count == ncpus) {
+        workers_steer(workers, count);
+    }
+
+    /* Start workers */
+    for (int i = 0; i < count; i++) {
+        workers[i].pid = workers_start(workers, count, i);
+        if (workers[i].pid < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+    log("Started %d workers%s", count, ncpus ? " (pinned)" : "");
+    control_ready();
+
+    /* Restart workers that exit and act on control signals */
+    bool draining = false;
+    int  running  = count;
+    while (!draining || running > 0) {
+        struct pollfd pfd = { .fd = control_fd(), .events = POLLIN };
+        if (poll(&pfd, 1, WORKERS_REAP_MSEC) < 0 && errno != EINTR) {
+            fprintf(stderr, "poll failed: %s\n", strerror(errno));
+            break;
+        }
+
+        unsigned signals = control_signals();
+        if (signals & CONTROL_RELOAD) {
+            server_reload(NULL);
+            workers_signal(workers, count, SIGHUP);
+        }
+        if ((signals & CONTROL_SNAPSHOT) && workers[0].pid > 0) {
+            kill(workers[0].pid, SIGUSR1);
+        }
+        if ((signals & CONTROL_UPGRADE) && !draining) {
+            workers_upgrade(workers, count);
+        }
+        if ((signals & CONTROL_DRAIN) && !draining) {
+            draining = true;
+            running  = 0;
+            for (int i = 0; i < count; i++) {
+                listeners_close(&workers[i].listeners);
+                running += workers[i].pid > 0;
+            }
+            log("Draining: waiting for %d workers", running);
+            workers_signal(workers, count, SIGQUIT);
+        }
+
+        int   status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < count; i++) {
+                if (workers[i].pid != pid) {
+                    continue;
+                }
+                if (draining) {
+                    workers[i].pid = 0;
+                    running--;
+                } else {
+                    log("Worker %d exited (status %d); restarting", i, status);
+                    sleep(1);
+                    workers[i].pid = workers_start(workers, count, i);
+                }
+                break;
+            }
+        }
+    }
+
+    return draining ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set expandtab sts=4 sw=4 ts=8 ft=c: */